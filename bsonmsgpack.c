@@ -0,0 +1,185 @@
+#include <string.h>
+
+#include "bsonmsgpack.h"
+
+/*
+ * Both passes share one walker: with s == NULL it only counts bytes, so
+ * msgpack_length() always agrees with what tomsgpack() writes.
+ */
+
+static int put_be(unsigned char * s, int64_t v, int n) {
+  int k;
+
+  if(s) {
+    for(k = n - 1; k >= 0; --k) {
+      s[k] = (unsigned char) (v & 0xff);
+      v >>= 8;
+    }
+  }
+
+  return n;
+}
+
+static int put_header(unsigned char * s, unsigned char tag, int64_t v, int n) {
+  if(s) {
+    s[0] = tag;
+    put_be(s + 1, v, n);
+  }
+
+  return 1 + n;
+}
+
+static int put_int(unsigned char * s, int64_t v) {
+  if(v >= 0 && v <= 0x7f) {
+    if(s) { s[0] = (unsigned char) v; }
+    return 1;
+  }
+  if(v < 0 && v >= -32) {
+    if(s) { s[0] = (unsigned char) (0xe0 | (v + 32)); }
+    return 1;
+  }
+  if(v >= -128 && v <= 127) {
+    return put_header(s, 0xd0, v, 1);
+  }
+  if(v >= -32768 && v <= 32767) {
+    return put_header(s, 0xd1, v, 2);
+  }
+  if(v >= -2147483647LL - 1 && v <= 2147483647LL) {
+    return put_header(s, 0xd2, v, 4);
+  }
+
+  return put_header(s, 0xd3, v, 8);
+}
+
+static int put_raw(unsigned char * s, unsigned char fix, unsigned char tag8, const char * data, int len) {
+  int l;
+
+  if(fix && len < 32) {
+    if(s) { s[0] = (unsigned char) (fix | len); }
+    l = 1;
+  } else if(tag8 && len <= 0xff) {
+    l = put_header(s, tag8, len, 1);
+  } else if(len <= 0xffff) {
+    l = put_header(s, tag8 + 1, len, 2);
+  } else {
+    l = put_header(s, tag8 + 2, len, 4);
+  }
+
+  if(s) {
+    memcpy(s + l, data, len);
+  }
+
+  return l + len;
+}
+
+static int put_container(unsigned char * s, bson_type t, int count) {
+  unsigned char fix = (t == BSON_ARRAY) ? 0x90 : 0x80;
+  unsigned char tag16 = (t == BSON_ARRAY) ? 0xdc : 0xde;
+
+  if(count < 16) {
+    if(s) { s[0] = (unsigned char) (fix | count); }
+    return 1;
+  }
+  if(count <= 0xffff) {
+    return put_header(s, tag16, count, 2);
+  }
+
+  return put_header(s, tag16 + 1, count, 4);
+}
+
+static int walk(bson_iterator * i, bson_type container, unsigned char * s) {
+  bson_iterator sub;
+  bson_iterator count;
+  bson_type t;
+  const char * key;
+  int l = 0;
+  int n = 0;
+
+  count = *i;
+  while(bson_iterator_next(&count)) {
+    ++n;
+  }
+
+  l += put_container(s ? s + l : NULL, container, n);
+
+  while((t = bson_iterator_next(i))) {
+    if(container == BSON_OBJECT) {
+      key = bson_iterator_key(i);
+      l += put_raw(s ? s + l : NULL, 0xa0, 0xd9, key, strlen(key));
+    }
+
+    switch(t) {
+      case BSON_DOUBLE:
+        {
+          union { double d; int64_t i; } u;
+          u.d = bson_iterator_double(i);
+          l += put_header(s ? s + l : NULL, 0xcb, u.i, 8);
+        }
+        break;
+      case BSON_STRING:
+      case BSON_SYMBOL:
+      case BSON_CODE:
+        l += put_raw(s ? s + l : NULL, 0xa0, 0xd9, bson_iterator_string(i), bson_iterator_string_len(i) - 1);
+        break;
+      case BSON_OBJECT:
+      case BSON_ARRAY:
+        bson_iterator_subiterator(i, &sub);
+        l += walk(&sub, t, s ? s + l : NULL);
+        break;
+      case BSON_BINDATA:
+        l += put_raw(s ? s + l : NULL, 0, 0xc4, bson_iterator_bin_data(i), bson_iterator_bin_len(i));
+        break;
+      case BSON_OID:
+        {
+          char id[25];
+          bson_oid_to_string(bson_iterator_oid(i), id);
+          l += put_raw(s ? s + l : NULL, 0xa0, 0xd9, id, 24);
+        }
+        break;
+      case BSON_BOOL:
+        if(s) { s[l] = bson_iterator_bool(i) ? 0xc3 : 0xc2; }
+        ++l;
+        break;
+      case BSON_DATE:
+        l += put_int(s ? s + l : NULL, bson_iterator_date(i));
+        break;
+      case BSON_INT:
+        l += put_int(s ? s + l : NULL, bson_iterator_int(i));
+        break;
+      case BSON_TIMESTAMP:
+        {
+          bson_timestamp_t ts = bson_iterator_timestamp(i);
+          l += put_header(s ? s + l : NULL, 0xcf, ((int64_t) ts.t << 32) | (uint32_t) ts.i, 8);
+        }
+        break;
+      case BSON_LONG:
+        l += put_int(s ? s + l : NULL, bson_iterator_long(i));
+        break;
+      default:
+        /* null, undefined, regex, ... have no MessagePack equivalent. */
+        if(s) { s[l] = 0xc0; }
+        ++l;
+        break;
+    }
+  }
+
+  return l;
+}
+
+int msgpack_length(const bson* b) {
+  bson_iterator i;
+
+  bson_iterator_init(&i, b);
+  return walk(&i, BSON_OBJECT, NULL);
+}
+
+void tomsgpack(const bson* b, char * s) {
+  bson_iterator i;
+
+  bson_iterator_init(&i, b);
+  walk(&i, BSON_OBJECT, (unsigned char *) s);
+}
+
+int msgpack_array_header(int count, char * s) {
+  return put_container((unsigned char *) s, BSON_ARRAY, count);
+}
@@ -0,0 +1,10 @@
+#ifndef BSONMSGPACK_H
+#define BSONMSGPACK_H
+
+#include <mongodb-c/bson.h>
+
+int msgpack_length(const bson* b);
+void tomsgpack(const bson* b, char * s);
+int msgpack_array_header(int count, char * s);
+
+#endif // BSONMSGPACK_H
@@ -1,135 +1,251 @@
 #include "jsonbson.h"
 
-int json_length(const bson* b) {
-  bson_iterator i;
-  bson_type t;
-  const char * key;
-  int l = 2; // "{}"
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
 
-  bson_iterator_init(&i, b);
+/*
+ * json_length and tojson share one walk, which writes to s or, when s is
+ * NULL, only counts; so the length can never disagree with what is written.
+ */
+
+static size_t tojson_walk(char * s, bson_iterator * i, int array);
 
-  while((t = bson_iterator_next(&i))) {
-    key = bson_iterator_key(&i);
-    
-    l += strlen(key) + 3; // "$key":
-    switch(t) {
-      case BSON_OID:
-        l += 26;
-	break;
-      case BSON_BOOL:
-        if(bson_iterator_bool(&i)) {
-	  l += 4;
-	} else {
-	  l += 5;
-	}
-	break;
-      case BSON_INT:
-        {
-          int v = bson_iterator_int(&i);
-	  do {
-            ++l;
-	  } while(v /= 10);
-	}
-	break;
-      case BSON_STRING:
-        l += bson_iterator_string_len(&i) -1 + 2; // ""
-	break;
+static size_t tojson_put(char * s, const char * p, size_t n) {
+  if(s) {
+    memcpy(s, p, n);
+  }
+  return n;
+}
+
+static size_t tojson_string(char * s, const char * p, size_t n) {
+  static const char hex[] = "0123456789abcdef";
+  char esc[6];
+  size_t l = 0, e;
+  unsigned char c;
+
+  l += tojson_put(s ? s + l : NULL, "\"", 1);
+
+  for(; n; --n, ++p) {
+    c = (unsigned char) *p;
+
+    switch(c) {
+      case '"':  e = 2; esc[1] = '"'; break;
+      case '\\': e = 2; esc[1] = '\\'; break;
+      case '\b': e = 2; esc[1] = 'b'; break;
+      case '\f': e = 2; esc[1] = 'f'; break;
+      case '\n': e = 2; esc[1] = 'n'; break;
+      case '\r': e = 2; esc[1] = 'r'; break;
+      case '\t': e = 2; esc[1] = 't'; break;
       default:
-        printf("Unsupported type.\n");
-	break;
+        if(c < 0x20) {
+          e = 6;
+          memcpy(esc + 1, "u00", 3);
+          esc[4] = hex[c >> 4];
+          esc[5] = hex[c & 0xf];
+        } else {
+          e = 0;
+        }
+        break;
+    }
+
+    if(e) {
+      esc[0] = '\\';
+      l += tojson_put(s ? s + l : NULL, esc, e);
+    } else {
+      l += tojson_put(s ? s + l : NULL, p, 1);
+    }
+  }
+
+  l += tojson_put(s ? s + l : NULL, "\"", 1);
+
+  return l;
+}
+
+static size_t tojson_number(char * s, const char * format, ...) {
+  char buf[32];
+  va_list args;
+  int n;
+
+  va_start(args, format);
+  n = vsnprintf(buf, sizeof(buf), format, args);
+  va_end(args);
+
+  return tojson_put(s, buf, n > 0 ? (size_t) n : 0);
+}
+
+/*
+ * Every type json_to_bson produces, and those mongod adds of its own:
+ * dates as milliseconds since the epoch, timestamps as {"t":,"i":},
+ * symbols and code as strings.  Anything JSON cannot hold is null.
+ */
+static size_t tojson_value(char * s, bson_iterator * i, bson_type t) {
+  bson_iterator sub;
+  bson_timestamp_t ts;
+  char oid[25];
+  double d;
+  size_t l = 0;
+
+  switch(t) {
+    case BSON_OID:
+      bson_oid_to_string(bson_iterator_oid(i), oid);
+      return tojson_string(s, oid, 24);
+    case BSON_BOOL:
+      return bson_iterator_bool(i) ? tojson_put(s, "true", 4) : tojson_put(s, "false", 5);
+    case BSON_INT:
+      return tojson_number(s, "%d", bson_iterator_int(i));
+    case BSON_LONG:
+      return tojson_number(s, "%lld", (long long) bson_iterator_long(i));
+    case BSON_DATE:
+      return tojson_number(s, "%lld", (long long) bson_iterator_date(i));
+    case BSON_DOUBLE:
+      d = bson_iterator_double(i);
+      if(isnan(d) || isinf(d)) {
+        return tojson_put(s, "null", 4);
+      }
+      return tojson_number(s, "%.17g", d);
+    case BSON_STRING:
+    case BSON_SYMBOL:
+    case BSON_CODE:
+      return tojson_string(s, bson_iterator_string(i), bson_iterator_string_len(i) - 1);
+    case BSON_TIMESTAMP:
+      ts = bson_iterator_timestamp(i);
+      l += tojson_put(s, "{\"t\":", 5);
+      l += tojson_number(s ? s + l : NULL, "%d", ts.t);
+      l += tojson_put(s ? s + l : NULL, ",\"i\":", 5);
+      l += tojson_number(s ? s + l : NULL, "%d", ts.i);
+      l += tojson_put(s ? s + l : NULL, "}", 1);
+      return l;
+    case BSON_OBJECT:
+    case BSON_ARRAY:
+      bson_iterator_subiterator(i, &sub);
+      return tojson_walk(s, &sub, t == BSON_ARRAY);
+    default:
+      return tojson_put(s, "null", 4);
+  }
+}
+
+static size_t tojson_walk(char * s, bson_iterator * i, int array) {
+  const char * key;
+  bson_type t;
+  size_t l = 0;
+  int first = 1;
+
+  l += tojson_put(s, array ? "[" : "{", 1);
+
+  while((t = bson_iterator_next(i)) != BSON_EOO) {
+    if(!first) {
+      l += tojson_put(s ? s + l : NULL, ",", 1);
+    }
+    first = 0;
+
+    if(!array) {
+      key = bson_iterator_key(i);
+      l += tojson_string(s ? s + l : NULL, key, strlen(key));
+      l += tojson_put(s ? s + l : NULL, ":", 1);
     }
 
-    ++l; // Comma or NULL
+    l += tojson_value(s ? s + l : NULL, i, t);
   }
 
+  l += tojson_put(s ? s + l : NULL, array ? "]" : "}", 1);
+
   return l;
 }
 
+/* Bytes tojson writes for b, its terminating null included. */
+int json_length(const bson* b) {
+  bson_iterator i;
+
+  bson_iterator_init(&i, b);
+  return (int) tojson_walk(NULL, &i, 0) + 1;
+}
+
 void tojson(const bson* b, char * s) {
   bson_iterator i;
-  bson_type t;
-  const char * key;
-  char * pos;
 
   bson_iterator_init(&i, b);
+  s[tojson_walk(s, &i, 0)] = '\0';
+}
 
-  s[0] = '{';
-  pos = s + 1;
-
-  t = bson_iterator_next(&i);
-  if(t) {
-    while(1) {
-      key = bson_iterator_key(&i);
-      
-      *pos = '"';
-      ++pos;
-
-      memcpy(pos, key, strlen(key));
-      pos += strlen(key);
-
-      *pos = '"';
-      ++pos;
-
-      *pos = ':';
-      ++pos;
-      
-      switch(t) {
-        case BSON_OID:
-	  {
-	    bson_oid_t * id;
-	    id = bson_iterator_oid(&i);
-
-	    *pos = '"';
-	    ++pos;
-
-	    bson_oid_to_string(id, pos);
-	    pos += 24;
-
-	    *pos = '"';
-	    ++pos;
-	  }
-	  break;
-	case BSON_BOOL:
-	  if(bson_iterator_bool(&i)) {
-	    memcpy(pos, "true", 4);
-	    pos += 4;
-	  } else {
-	    memcpy(pos, "false", 5);
-	    pos += 5;
-	  }
-	  break;
-        case BSON_INT:
-	  pos += sprintf(pos, "%d", bson_iterator_int(&i));
-	  break;
-	case BSON_STRING:
-	  //l += bson_iterator_string_len(&i) + 2; // ""
-	  *pos = '"';
-	  ++pos;
-
-	  memcpy(pos, bson_iterator_string(&i), bson_iterator_string_len(&i)-1);
-	  pos += bson_iterator_string_len(&i)-1;
-
-	  *pos = '"';
-	  ++pos;
-
-	  break;
-	default:
-	  printf("Unsupported type.\n");
-	  break;
-      }
 
-      if((t = bson_iterator_next(&i))) {
-	*pos = ',';
-	++pos;
-      } else {
-        break;
+int json_append_bson(bson* b, const char * key, json_t * value) {
+  switch(json_typeof(value)) {
+    case JSON_OBJECT:
+      bson_append_start_object(b, key);
+      if(!json_to_bson(value, b, NULL)) {
+        return 0;
       }
-    }
+      bson_append_finish_object(b);
+      break;
+    case JSON_ARRAY:
+      {
+        size_t n;
+        char index[24];
+
+        bson_append_start_array(b, key);
+        for(n = 0; n < json_array_size(value); ++n) {
+          sprintf(index, "%zu", n);
+          if(!json_append_bson(b, index, json_array_get(value, n))) {
+            return 0;
+          }
+        }
+        bson_append_finish_object(b);
+      }
+      break;
+    case JSON_STRING:
+      bson_append_string(b, key, json_string_value(value));
+      break;
+    case JSON_INTEGER:
+      {
+        json_int_t v = json_integer_value(value);
+
+        if(v >= INT32_MIN && v <= INT32_MAX) {
+          bson_append_int(b, key, (int) v);
+        } else {
+          bson_append_long(b, key, (int64_t) v);
+        }
+      }
+      break;
+    case JSON_REAL:
+      bson_append_double(b, key, json_real_value(value));
+      break;
+    case JSON_TRUE:
+      bson_append_bool(b, key, 1);
+      break;
+    case JSON_FALSE:
+      bson_append_bool(b, key, 0);
+      break;
+    case JSON_NULL:
+      bson_append_null(b, key);
+      break;
+    default:
+      return 0;
   }
 
-  *pos = '}';
-  ++pos;
-
-  *pos = '\0';
+  return 1;
 }
 
+/* Append the members of object to b, leaving out skip if given. */
+int json_to_bson(json_t * object, bson* b, const char * skip) {
+  const char * key;
+  void * iter;
+
+  if(!json_is_object(object)) {
+    return 0;
+  }
+
+  for(iter = json_object_iter(object); iter; iter = json_object_iter_next(object, iter)) {
+    key = json_object_iter_key(iter);
+
+    if(skip && strcmp(key, skip) == 0) {
+      continue;
+    }
+
+    if(!json_append_bson(b, key, json_object_iter_value(iter))) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
@@ -2,8 +2,12 @@
 #define JSONBSON_H
 
 #include <mongodb-c/bson.h>
+#include "jansson.h"
 
 int json_length(const bson* b);
 void tojson(const bson* b, char * s);
 
+int json_append_bson(bson* b, const char * key, json_t * value);
+int json_to_bson(json_t * object, bson* b, const char * skip);
+
 #endif // JSONBSON_H
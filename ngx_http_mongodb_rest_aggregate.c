@@ -0,0 +1,754 @@
+/*
+ * Aggregation: named pipelines filled from the request, their results cached in shared memory.
+ */
+
+#include "ngx_http_mongodb_rest_module.h"
+
+static void ngx_http_mongodb_rest_cache_insert(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+
+static ngx_int_t ngx_http_mongodb_rest_cache_init(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_mongodb_rest_cache_t *ocache = data;
+    ngx_http_mongodb_rest_cache_t *cache;
+
+    cache = shm_zone->data;
+    cache->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    /* Results outlive a reload; they are keyed by the pipeline they came from. */
+    if (ocache || shm_zone->shm.exists) {
+        cache->sh = cache->shpool->data;
+        return NGX_OK;
+    }
+
+    cache->sh = ngx_slab_alloc(cache->shpool, sizeof(ngx_http_mongodb_rest_cache_shm_t));
+    if (cache->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&cache->sh->tree, &cache->sh->sentinel, ngx_http_mongodb_rest_cache_insert);
+    ngx_queue_init(&cache->sh->queue);
+    cache->shpool->data = cache->sh;
+
+    /* A full zone makes room by eviction; that is not worth a log line. */
+    cache->shpool->log_nomem = 0;
+
+    return NGX_OK;
+}
+
+/* Parse "cache=name:size"; aggregations may share a zone. */
+static char *ngx_http_mongodb_rest_cache_zone(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf, ngx_str_t *value) {
+    ngx_http_mongodb_rest_cache_t *cache;
+    ngx_shm_zone_t *zone;
+    ngx_str_t name;
+    ssize_t size;
+
+    if (ngx_http_mongodb_rest_zone_param(value, 6, &name, &size) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Invalid Cache Zone: %V", value);
+        return NGX_CONF_ERROR;
+    }
+
+    zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_mongodb_rest_module);
+    if (zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (zone->data) {
+        if (zone->init != ngx_http_mongodb_rest_cache_init) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "Cache Zone \"%V\" is already used", &name);
+            return NGX_CONF_ERROR;
+        }
+        conf->cache = zone->data;
+        return NGX_CONF_OK;
+    }
+
+    cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_mongodb_rest_cache_t));
+    if (cache == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    cache->zone = zone;
+    zone->init = ngx_http_mongodb_rest_cache_init;
+    zone->data = cache;
+    conf->cache = cache;
+
+    return NGX_CONF_OK;
+}
+
+/* The slot a string in the pipeline stands for, if any. */
+static ngx_http_mongodb_rest_param_t *ngx_http_mongodb_rest_param_find(ngx_http_mongodb_rest_loc_conf_t *conf, const char *s, size_t len) {
+    ngx_http_mongodb_rest_param_t *params = conf->params->elts;
+    ngx_uint_t i;
+
+    if (len < 3 || s[0] != '{' || s[len - 1] != '}') {
+        return NULL;
+    }
+
+    for (i = 0; i < conf->params->nelts; i++) {
+        if (params[i].marker.len == len && ngx_strncmp(params[i].marker.data, s, len) == 0) {
+            return &params[i];
+        }
+    }
+
+    return NULL;
+}
+
+/* Parse "{name[:type][=default]}", name being an argument or a path segment from 1. */
+static char *ngx_http_mongodb_rest_param(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf, const char *s, size_t len) {
+    ngx_http_mongodb_rest_param_t *param;
+    u_char *p, *last, *colon, *eq;
+    ngx_int_t n;
+
+    param = ngx_array_push(conf->params);
+    if (param == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_memzero(param, sizeof(ngx_http_mongodb_rest_param_t));
+
+    param->marker.len = len;
+    param->marker.data = ngx_pnalloc(cf->pool, len + 1);
+    if (param->marker.data == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    ngx_cpystrn(param->marker.data, (u_char *) s, len + 1);
+
+    p = param->marker.data + 1;
+    last = param->marker.data + len - 1;
+    param->type = BSON_STRING;
+
+    eq = ngx_strlchr(p, last, '=');
+    if (eq) {
+        param->def.len = last - eq - 1;
+        param->def.data = ngx_pnalloc(cf->pool, param->def.len + 1);
+        if (param->def.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        ngx_cpystrn(param->def.data, eq + 1, param->def.len + 1);
+        last = eq;
+    }
+
+    colon = ngx_strlchr(p, last, ':');
+    if (colon) {
+        param->type = ngx_http_mongodb_rest_type(colon + 1, last - colon - 1);
+        last = colon;
+    }
+
+    if (p == last || param->type == BSON_EOO) {
+        goto invalid;
+    }
+
+    n = ngx_atoi(p, last - p);
+    if (n != NGX_ERROR) {
+        if (n == 0 || n > MONGO_AGGREGATE_MAX_SEGMENTS) {
+            goto invalid;
+        }
+        param->segment = n;
+        conf->nsegments = ngx_max(conf->nsegments, (ngx_uint_t) n);
+    } else {
+        param->name.len = last - p;
+        param->name.data = ngx_pnalloc(cf->pool, param->name.len + 1);
+        if (param->name.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        ngx_cpystrn(param->name.data, p, param->name.len + 1);
+
+        for ( /* void */ ; p < last; p++) {
+            if (!(ngx_isalnum(*p) || *p == '_')) {
+                goto invalid;
+            }
+        }
+    }
+
+    if (param->def.data
+        && ((param->type == BSON_INT && ngx_atoi(param->def.data, param->def.len) == NGX_ERROR)
+            || (param->type == BSON_OID && param->def.len != 24))) {
+        goto invalid;
+    }
+
+    return NGX_CONF_OK;
+
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "Invalid Pipeline Parameter: %s", s);
+    return NGX_CONF_ERROR;
+}
+
+/* Find the slots in the compiled pipeline, to fill without parsing them again. */
+static char *ngx_http_mongodb_rest_params(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf, bson_iterator *it) {
+    bson_iterator sub;
+    bson_type type;
+    const char *s;
+    size_t len;
+
+    while ((type = bson_iterator_next(it)) != BSON_EOO) {
+        if (type == BSON_OBJECT || type == BSON_ARRAY) {
+            bson_iterator_subiterator(it, &sub);
+            if (ngx_http_mongodb_rest_params(cf, conf, &sub) != NGX_CONF_OK) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (type != BSON_STRING) {
+            continue;
+        }
+
+        s = bson_iterator_string(it);
+        len = bson_iterator_string_len(it) - 1;
+        if (len < 3 || s[0] != '{' || s[len - 1] != '}'
+            || ngx_http_mongodb_rest_param_find(conf, s, len)) {
+            continue;
+        }
+
+        if (ngx_http_mongodb_rest_param(cf, conf, s, len) != NGX_CONF_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* Parse the 'mongodb-rest-aggregate' directive. */
+char* ngx_http_mongodb_rest_aggregate(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf = void_conf;
+    ngx_str_t *value, s;
+    bson_iterator it;
+    json_error_t error;
+    json_t *root;
+    ngx_uint_t i;
+    int ok;
+
+    if (mongodb_rest_loc_conf->pipeline != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    // ---------- COMPILE THE PIPELINE ---------- //
+
+    root = json_loadb((char *) value[1].data, value[1].len, 0, &error);
+    if (root == NULL || !json_is_array(root)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Invalid Pipeline: %s", root ? "must be an array" : error.text);
+        if (root) { json_decref(root); }
+        return NGX_CONF_ERROR;
+    }
+
+    mongodb_rest_loc_conf->pipeline = ngx_palloc(cf->pool, sizeof(bson));
+    if (mongodb_rest_loc_conf->pipeline == NULL) {
+        json_decref(root);
+        return NGX_CONF_ERROR;
+    }
+
+    bson_init(mongodb_rest_loc_conf->pipeline);
+    ok = json_append_bson(mongodb_rest_loc_conf->pipeline, "pipeline", root);
+    bson_finish(mongodb_rest_loc_conf->pipeline);
+    json_decref(root);
+
+    if (!ok) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Invalid Pipeline: %V", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    mongodb_rest_loc_conf->params = ngx_array_create(cf->pool, 4, sizeof(ngx_http_mongodb_rest_param_t));
+    if (mongodb_rest_loc_conf->params == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    bson_iterator_init(&it, mongodb_rest_loc_conf->pipeline);
+    if (ngx_http_mongodb_rest_params(cf, mongodb_rest_loc_conf, &it) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    // ---------- CACHE ---------- //
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "cache=", 6) == 0) {
+            if (ngx_http_mongodb_rest_cache_zone(cf, mongodb_rest_loc_conf, &value[i]) != NGX_CONF_OK) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "ttl=", 4) == 0) {
+            s.data = &value[i].data[4];
+            s.len = value[i].len - 4;
+            mongodb_rest_loc_conf->cache_ttl = ngx_parse_time(&s, 1);
+
+            if (mongodb_rest_loc_conf->cache_ttl == (time_t) NGX_ERROR
+                || mongodb_rest_loc_conf->cache_ttl == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Cache TTL: %V", &s);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+// ---------- AGGREGATION ---------- //
+
+/* Entries with the same hash are ordered by their key. */
+static ngx_int_t ngx_http_mongodb_rest_cache_cmp(ngx_http_mongodb_rest_cache_entry_t * e, u_char * p, size_t len) {
+  if(len != e->key_len) {
+    return len < e->key_len ? -1 : 1;
+  }
+  return ngx_memcmp(p, e->data, len);
+}
+
+static void ngx_http_mongodb_rest_cache_insert(ngx_rbtree_node_t * temp, ngx_rbtree_node_t * node, ngx_rbtree_node_t * sentinel) {
+  ngx_http_mongodb_rest_cache_entry_t * e = (ngx_http_mongodb_rest_cache_entry_t *) node;
+  ngx_rbtree_node_t ** p;
+
+  for(;;) {
+    if(node->key != temp->key) {
+      p = (node->key < temp->key) ? &temp->left : &temp->right;
+    } else {
+      p = (ngx_http_mongodb_rest_cache_cmp((ngx_http_mongodb_rest_cache_entry_t *) temp, e->data, e->key_len) < 0)
+          ? &temp->left : &temp->right;
+    }
+
+    if(*p == sentinel) {
+      break;
+    }
+    temp = *p;
+  }
+
+  *p = node;
+  node->parent = temp;
+  node->left = sentinel;
+  node->right = sentinel;
+  ngx_rbt_red(node);
+}
+
+/* The functions below expect the pool mutex to be held. */
+static ngx_http_mongodb_rest_cache_entry_t * ngx_http_mongodb_rest_cache_lookup(ngx_http_mongodb_rest_cache_t * cache, ngx_str_t * key) {
+  ngx_rbtree_node_t * node, * sentinel;
+  ngx_rbtree_key_t hash;
+  ngx_int_t rc;
+
+  hash = ngx_murmur_hash2(key->data, key->len);
+  node = cache->sh->tree.root;
+  sentinel = cache->sh->tree.sentinel;
+
+  while(node != sentinel) {
+    if(hash != node->key) {
+      node = (hash < node->key) ? node->left : node->right;
+      continue;
+    }
+
+    rc = ngx_http_mongodb_rest_cache_cmp((ngx_http_mongodb_rest_cache_entry_t *) node, key->data, key->len);
+    if(rc == 0) {
+      return (ngx_http_mongodb_rest_cache_entry_t *) node;
+    }
+    node = (rc < 0) ? node->left : node->right;
+  }
+
+  return NULL;
+}
+
+static void ngx_http_mongodb_rest_cache_remove(ngx_http_mongodb_rest_cache_t * cache, ngx_http_mongodb_rest_cache_entry_t * e) {
+  ngx_rbtree_delete(&cache->sh->tree, &e->node);
+  ngx_queue_remove(&e->queue);
+  ngx_slab_free_locked(cache->shpool, e);
+}
+
+/* Keep the response body chained from out, making room from the oldest results. */
+static void ngx_http_mongodb_rest_cache_store(ngx_http_mongodb_rest_loc_conf_t * conf, ngx_log_t * log, ngx_str_t * key, ngx_chain_t * out, off_t length) {
+  ngx_http_mongodb_rest_cache_t * cache = conf->cache;
+  ngx_http_mongodb_rest_cache_entry_t * e;
+  ngx_chain_t * cl;
+  u_char * p;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  e = ngx_http_mongodb_rest_cache_lookup(cache, key);
+  if(e) {
+    ngx_http_mongodb_rest_cache_remove(cache, e);
+  }
+
+  while((e = ngx_slab_alloc_locked(cache->shpool, offsetof(ngx_http_mongodb_rest_cache_entry_t, data) + key->len + length)) == NULL) {
+    if(ngx_queue_empty(&cache->sh->queue)) {
+      ngx_shmtx_unlock(&cache->shpool->mutex);
+      ngx_log_error(NGX_LOG_WARN, log, 0,
+                    "Cache zone \"%V\" cannot hold %O bytes of \"%V\"", &cache->zone->shm.name, length, &conf->ns);
+      return;
+    }
+    ngx_http_mongodb_rest_cache_remove(cache, ngx_queue_data(ngx_queue_last(&cache->sh->queue),
+                                                             ngx_http_mongodb_rest_cache_entry_t, queue));
+  }
+
+  e->expires = ngx_time() + conf->cache_ttl;
+  e->key_len = key->len;
+  e->body_len = length;
+  p = ngx_cpymem(e->data, key->data, key->len);
+  for(cl = out; cl; cl = cl->next) {
+    if(ngx_buf_size(cl->buf)) {
+      p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+    }
+  }
+
+  e->node.key = ngx_murmur_hash2(e->data, e->key_len);
+  ngx_rbtree_insert(&cache->sh->tree, &e->node);
+  ngx_queue_insert_head(&cache->sh->queue, &e->queue);
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+}
+
+/* Answer from the cache; NGX_DECLINED if it has nothing fresh. */
+static ngx_int_t ngx_http_mongodb_rest_cache_send(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf, ngx_http_mongodb_rest_format_e format, ngx_str_t * key) {
+  ngx_http_mongodb_rest_cache_t * cache = conf->cache;
+  ngx_http_mongodb_rest_cache_entry_t * e;
+  ngx_chain_t * out;
+  u_char * body = NULL;
+  size_t len = 0;
+
+  ngx_shmtx_lock(&cache->shpool->mutex);
+
+  e = ngx_http_mongodb_rest_cache_lookup(cache, key);
+  if(e && e->expires <= ngx_time()) {
+    ngx_http_mongodb_rest_cache_remove(cache, e);
+    e = NULL;
+  }
+
+  if(e) {
+    len = e->body_len;
+    body = ngx_pnalloc(request->pool, ngx_max(len, 1));
+    if(body) {
+      ngx_memcpy(body, e->data + e->key_len, len);
+    }
+  }
+
+  ngx_shmtx_unlock(&cache->shpool->mutex);
+
+  if(e == NULL) {
+    return NGX_DECLINED;
+  }
+
+  out = body ? ngx_http_mongodb_rest_chain(request->pool, body, len) : NULL;
+  if(out == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if(len == 0) {
+    out->buf->memory = 0;
+  }
+  out->buf->last_buf = 1;
+
+  return ngx_http_mongodb_rest_send(request, format, len, out);
+}
+
+/* The value of a slot from the path or the arguments, else its default. */
+static ngx_int_t ngx_http_mongodb_rest_param_value(ngx_http_request_t * request, ngx_http_mongodb_rest_param_t * param, ngx_str_t * segs, ngx_uint_t nsegs, ngx_str_t * v) {
+  ngx_str_t arg;
+  u_char * dst, * src;
+
+  ngx_str_null(v);
+
+  if(param->segment) {
+    if(param->segment <= nsegs) {
+      *v = segs[param->segment - 1];
+    }
+  } else if(ngx_http_arg(request, param->name.data, param->name.len, &arg) == NGX_OK) {
+    dst = ngx_pnalloc(request->pool, arg.len);
+    if(dst == NULL) {
+      return NGX_ERROR;
+    }
+    src = arg.data;
+    v->data = dst;
+    ngx_unescape_uri(&dst, &src, arg.len, NGX_UNESCAPE_URI);
+    v->len = dst - v->data;
+  }
+
+  if(v->len == 0) {
+    if(param->def.data == NULL) {
+      return NGX_DECLINED;
+    }
+    *v = param->def;
+  }
+
+  if(param->type == BSON_INT && ngx_atoi(v->data, v->len) == NGX_ERROR) {
+    return NGX_DECLINED;
+  }
+
+  return NGX_OK;
+}
+
+/* Copy the compiled pipeline into out, with every slot filled. */
+static ngx_int_t ngx_http_mongodb_rest_aggregate_fill(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf, ngx_str_t * segs, ngx_uint_t nsegs, bson_iterator * it, bson * out) {
+  ngx_http_mongodb_rest_param_t * param;
+  bson_iterator sub;
+  bson_type type;
+  const char * key;
+  ngx_str_t v;
+
+  while((type = bson_iterator_next(it)) != BSON_EOO) {
+    key = bson_iterator_key(it);
+
+    switch(type) {
+      case BSON_OBJECT:
+      case BSON_ARRAY:
+        bson_iterator_subiterator(it, &sub);
+        if(type == BSON_OBJECT) {
+          bson_append_start_object(out, key);
+        } else {
+          bson_append_start_array(out, key);
+        }
+        if(ngx_http_mongodb_rest_aggregate_fill(request, conf, segs, nsegs, &sub, out) != NGX_OK) {
+          return NGX_DECLINED;
+        }
+        bson_append_finish_object(out);
+        break;
+
+      case BSON_STRING:
+        param = ngx_http_mongodb_rest_param_find(conf, bson_iterator_string(it), bson_iterator_string_len(it) - 1);
+        if(param) {
+          if(ngx_http_mongodb_rest_param_value(request, param, segs, nsegs, &v) != NGX_OK
+             || !ngx_http_mongodb_rest_append_value_n(out, param->type, key, (char *) v.data, v.len)) {
+            return NGX_DECLINED;
+          }
+          break;
+        }
+        /* fall through */
+
+      default:
+        bson_append_element(out, NULL, it);
+        break;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/*
+ * Fill the location's pipeline from the request, and answer from the cache
+ * if it holds the results; NGX_OK leaves the aggregation to run once the
+ * request is admitted.
+ */
+ngx_int_t ngx_http_mongodb_rest_aggregate_prepare(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  ngx_http_mongodb_rest_aggregate_t * ag;
+  ngx_http_mongodb_rest_format_e format;
+  ngx_str_t segs[MONGO_AGGREGATE_MAX_SEGMENTS];
+  ngx_uint_t nsegs;
+  bson_iterator it;
+  ngx_pool_t * pool;
+  ngx_int_t rc;
+  char * value, * slash;
+  u_char * p;
+
+  if(!(request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  rc = ngx_http_discard_request_body(request);
+  if(rc != NGX_OK) {
+    return rc;
+  }
+
+  rc = ngx_http_mongodb_rest_path(request, &value);
+  if(rc != NGX_OK) {
+    return rc;
+  }
+
+  /* No more segments than the pipeline has slots for. */
+  for(nsegs = 0; *value != '\0'; nsegs++) {
+    if(nsegs == conf->nsegments) {
+      return NGX_HTTP_NOT_FOUND;
+    }
+    slash = strchr(value, '/');
+    segs[nsegs].data = (u_char *) value;
+    segs[nsegs].len = slash ? (size_t) (slash - value) : ngx_strlen(value);
+    value += segs[nsegs].len + (slash != NULL);
+  }
+
+  ag = ngx_pcalloc(request->pool, sizeof(ngx_http_mongodb_rest_aggregate_t));
+  if(ag == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  pool = ngx_http_mongodb_rest_alloc_from(request->pool);
+  bson_init(&ag->pipeline);
+  bson_iterator_init(&it, conf->pipeline);
+  rc = ngx_http_mongodb_rest_aggregate_fill(request, conf, segs, nsegs, &it, &ag->pipeline);
+  if(rc == NGX_OK) {
+    bson_finish(&ag->pipeline);
+  }
+  ngx_http_mongodb_rest_alloc_from(pool);
+
+  if(rc != NGX_OK) {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  ngx_http_set_ctx(request, ag, ngx_http_mongodb_rest_module);
+
+  if(conf->cache == NULL) {
+    return NGX_OK;
+  }
+
+  // ---------- FROM THE CACHE ---------- //
+  format = ngx_http_mongodb_rest_format(request);
+
+  ag->key.len = 1 + conf->ns.len + 1 + bson_size(&ag->pipeline);
+  ag->key.data = ngx_pnalloc(request->pool, ag->key.len);
+  if(ag->key.data == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  p = ag->key.data;
+  *p++ = (u_char) format;
+  p = ngx_cpymem(p, conf->ns.data, conf->ns.len);
+  *p++ = '\0';
+  ngx_memcpy(p, ag->pipeline.data, bson_size(&ag->pipeline));
+
+  rc = ngx_http_mongodb_rest_cache_send(request, conf, format, &ag->key);
+  return rc == NGX_DECLINED ? NGX_OK : rc;
+}
+
+/* Run the filled pipeline, read every batch of its cursor, and keep the results. */
+ngx_int_t ngx_http_mongodb_rest_aggregate_handler(ngx_http_request_t * request, mongo * conn) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongodb_rest_aggregate_t * ag;
+  ngx_http_mongodb_rest_format_e format;
+  ngx_chain_t * out = NULL, ** ll = &out;
+  ngx_msec_int_t remaining;
+  ngx_uint_t ndocs = 0;
+  ngx_int_t rc = NGX_OK;
+  off_t length = 0;
+  mongo_reply * reply;
+  bson_iterator it, docs;
+  bson cmd, res, cursor, b;
+  int64_t cursor_id = 0;
+  char * ns = NULL;
+  u_char * p;
+  int32_t i;
+
+  conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
+  ag = ngx_http_get_module_ctx(request, ngx_http_mongodb_rest_module);
+  format = ngx_http_mongodb_rest_format(request);
+  remaining = ngx_http_mongodb_rest_remaining(request, conf);
+
+  // ---------- RUN THE PIPELINE ---------- //
+  bson_init(&cmd);
+  bson_append_string(&cmd, "aggregate", (char *) conf->collection.data);
+  bson_iterator_init(&it, &ag->pipeline);
+  bson_iterator_next(&it);
+  bson_append_element(&cmd, NULL, &it);
+  bson_append_start_object(&cmd, "cursor");
+  bson_append_finish_object(&cmd);
+  bson_append_long(&cmd, "maxTimeMS", (int64_t) ngx_max(remaining, 1));
+  bson_finish(&cmd);
+
+  rc = ngx_http_mongodb_rest_op_query(conn, (char *) conf->cmd_ns.data, 0, -1, &cmd, NULL);
+  bson_destroy(&cmd);
+
+  if(rc != NGX_OK || mongo_read_response(conn, &reply) != MONGO_OK) {
+    return NGX_HTTP_GATEWAY_TIME_OUT;
+  }
+
+  if(reply->fields.num != 1) {
+    bson_free(reply);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  ngx_http_mongodb_rest_bson_wrap(&res, (u_char *) &reply->objs);
+
+  if(bson_find(&it, &res, "ok") == BSON_EOO || !bson_iterator_bool(&it)) {
+    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if(bson_find(&it, &res, "code") == BSON_INT && bson_iterator_int(&it) == MONGO_EXCEEDED_TIME_LIMIT) {
+      rc = NGX_HTTP_GATEWAY_TIME_OUT;
+    } else if(bson_find(&it, &res, "errmsg") == BSON_STRING) {
+      ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                    "Aggregation on \"%V\" failed: %s", &conf->ns, bson_iterator_string(&it));
+    }
+    bson_free(reply);
+    return rc;
+  }
+
+  // ---------- THE FIRST BATCH ---------- //
+  if(bson_find(&it, &res, "cursor") == BSON_OBJECT) {
+    bson_iterator_subobject(&it, &cursor);
+
+    if(bson_find(&it, &cursor, "id") == BSON_LONG) {
+      cursor_id = bson_iterator_long(&it);
+    }
+
+    if(cursor_id && bson_find(&it, &cursor, "ns") == BSON_STRING) {
+      ns = ngx_pnalloc(request->pool, bson_iterator_string_len(&it));
+      if(ns) {
+        ngx_memcpy(ns, bson_iterator_string(&it), bson_iterator_string_len(&it));
+      }
+    }
+
+    if(bson_find(&it, &cursor, "firstBatch") == BSON_ARRAY) {
+      bson_iterator_subiterator(&it, &docs);
+      while(ll && bson_iterator_next(&docs) == BSON_OBJECT) {
+        bson_iterator_subobject(&docs, &b);
+        ll = ngx_http_mongodb_rest_append_doc(request, format, &b, ll, &length, ndocs++);
+      }
+    }
+  }
+  bson_free(reply);
+
+  if(ll == NULL || (cursor_id && ns == NULL)) {
+    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  // ---------- THE REST ---------- //
+  while(rc == NGX_OK && cursor_id) {
+    ngx_time_update();
+    if(ngx_http_mongodb_rest_remaining(request, conf) <= 0) {
+      rc = NGX_HTTP_GATEWAY_TIME_OUT;
+      break;
+    }
+
+    if(ngx_http_mongodb_rest_op_get_more(conn, ns, cursor_id) != NGX_OK
+       || mongo_read_response(conn, &reply) != MONGO_OK) {
+      rc = NGX_HTTP_GATEWAY_TIME_OUT;
+      break;
+    }
+
+    if(reply->fields.flag & (MONGO_REPLY_CURSOR_NOT_FOUND | MONGO_REPLY_QUERY_FAILURE)) {
+      bson_free(reply);
+      rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+      break;
+    }
+
+    cursor_id = reply->fields.cursorID;
+
+    p = (u_char *) &reply->objs;
+    for(i = 0; ll && i < reply->fields.num; i++) {
+      ngx_http_mongodb_rest_bson_wrap(&b, p);
+      p += bson_size(&b);
+      ll = ngx_http_mongodb_rest_append_doc(request, format, &b, ll, &length, ndocs++);
+    }
+    bson_free(reply);
+
+    if(ll == NULL) {
+      rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+  }
+
+  /* Whatever went wrong, mongod need not keep the cursor until it times out. */
+  if(rc != NGX_OK) {
+    if(cursor_id) {
+      ngx_http_mongodb_rest_op_kill_cursors(conn, cursor_id);
+    }
+    return rc;
+  }
+
+  // ---------- KEEP AND SEND ---------- //
+  if(ngx_http_mongodb_rest_frame_array(request, format, ndocs, &length, &out, ll) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if(conf->cache) {
+    ngx_http_mongodb_rest_cache_store(conf, request->connection->log, &ag->key, out, length);
+  }
+
+  return ngx_http_mongodb_rest_send(request, format, length, out);
+}
@@ -0,0 +1,653 @@
+/*
+ * Export: a collection streamed as NDJSON over parallel range partitions.
+ */
+
+#include "ngx_http_mongodb_rest_module.h"
+
+/* Parse the 'mongodb-rest-export' directive. */
+char* ngx_http_mongodb_rest_export(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf = void_conf;
+    ngx_str_t *value;
+    ngx_int_t n;
+
+    if (mongodb_rest_loc_conf->export_partitions != NGX_CONF_UNSET_UINT) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0 || n > MONGO_EXPORT_MAX_PARTITIONS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Invalid Export: %V, must be 1 to %d partitions", &value[1],
+                           MONGO_EXPORT_MAX_PARTITIONS);
+        return NGX_CONF_ERROR;
+    }
+    mongodb_rest_loc_conf->export_partitions = n;
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Ask mongod for up to n - 1 values of the key's first field that split
+ * the collection into ranges of about equal size.  NGX_DECLINED when it
+ * cannot say, e.g. for a collection too small to split.
+ */
+static ngx_int_t ngx_http_mongodb_rest_export_bounds(mongo * conn, ngx_http_mongodb_rest_loc_conf_t * conf, ngx_uint_t n, bson * out) {
+  bson cmd, stats;
+  bson_iterator it;
+  double size = 0;
+  int rc;
+
+  bson_init(&cmd);
+  bson_append_string_n(&cmd, "collStats", (char *) conf->collection.data, conf->collection.len);
+  bson_finish(&cmd);
+  rc = mongo_run_command(conn, (char *) conf->db.data, &cmd, &stats);
+  bson_destroy(&cmd);
+
+  if(rc != MONGO_OK) {
+    return NGX_DECLINED;
+  }
+  if(bson_find(&it, &stats, "size") != BSON_EOO) {
+    size = bson_iterator_double(&it);
+  }
+  bson_destroy(&stats);
+
+  if(size < n) {
+    return NGX_DECLINED;
+  }
+
+  /* splitVector aims for half the chunk size it is given. */
+  bson_init(&cmd);
+  bson_append_string(&cmd, "splitVector", (char *) conf->ns.data);
+  bson_append_start_object(&cmd, "keyPattern");
+  bson_append_int(&cmd, (char *) conf->field.data, 1);
+  bson_append_finish_object(&cmd);
+  bson_append_long(&cmd, "maxChunkSizeBytes", (int64_t) (2 * size / n) + 1);
+  bson_append_int(&cmd, "maxSplitPoints", (int) n - 1);
+  bson_finish(&cmd);
+  rc = mongo_run_command(conn, (char *) conf->db.data, &cmd, out);
+  bson_destroy(&cmd);
+
+  return rc == MONGO_OK ? NGX_OK : NGX_DECLINED;
+}
+
+/* A partition with a reply waiting, NULL if none has one yet. */
+static ngx_http_mongodb_rest_partition_t * ngx_http_mongodb_rest_export_ready(ngx_http_mongodb_rest_export_t * ex) {
+  struct pollfd pfd[MONGO_EXPORT_MAX_PARTS];
+  ngx_uint_t idx[MONGO_EXPORT_MAX_PARTS];
+  ngx_uint_t i, j, n;
+
+  /* In order, only the partition being sent will do. */
+  if(!ex->unordered) {
+    while(ex->parts[ex->next].done) {
+      ex->next++;
+    }
+
+    pfd[0].fd = ex->parts[ex->next].conn.sock;
+    pfd[0].events = POLLIN;
+    pfd[0].revents = 0;
+
+    return poll(pfd, 1, 0) > 0 ? &ex->parts[ex->next] : NULL;
+  }
+
+  n = 0;
+  for(i = 0; i < ex->nparts; i++) {
+    j = (ex->next + i) % ex->nparts;
+    if(ex->parts[j].done) {
+      continue;
+    }
+    pfd[n].fd = ex->parts[j].conn.sock;
+    pfd[n].events = POLLIN;
+    pfd[n].revents = 0;
+    idx[n++] = j;
+  }
+
+  if(poll(pfd, n, 0) <= 0) {
+    return NULL;
+  }
+
+  for(i = 0; !pfd[i].revents; i++) { /* void */ }
+
+  /* Take turns, so no partition falls behind while others are busy. */
+  ex->next = (idx[i] + 1) % ex->nparts;
+  return &ex->parts[idx[i]];
+}
+
+/*
+ * Read a partition's reply, ask for its next batch straight away so that
+ * mongod reads ahead while this one is sent, and write the documents into
+ * the buffer as NDJSON.
+ */
+static ngx_int_t ngx_http_mongodb_rest_export_read(ngx_http_mongodb_rest_export_t * ex, ngx_http_mongodb_rest_partition_t * part) {
+  ngx_http_request_t * r = ex->request;
+  mongo_reply * reply;
+  bson_iterator it;
+  bson b, query;
+  size_t len;
+  int32_t i;
+  int code;
+  u_char * p;
+  unsigned hinted = 0;
+
+  if(mongo_read_response(&part->conn, &reply) != MONGO_OK) {
+    return NGX_ERROR;
+  }
+
+  if(reply->fields.flag & MONGO_REPLY_QUERY_FAILURE) {
+    if(reply->fields.num && bson_find(&it, &part->query, "$hint") != BSON_EOO) {
+      ngx_http_mongodb_rest_bson_wrap(&b, (u_char *) &reply->objs);
+      code = bson_find(&it, &b, "code") == BSON_INT ? bson_iterator_int(&it) : 0;
+      if(bson_find(&it, &b, "$err") == BSON_STRING
+         && ngx_http_mongodb_rest_hint_error(code, bson_iterator_string(&it))) {
+        (void) ngx_http_mongodb_rest_hint_lost(r->connection->log, ex->conf, code, bson_iterator_string(&it));
+        hinted = 1;
+      }
+    }
+    bson_free(reply);
+    if(!hinted) {
+      return NGX_ERROR;
+    }
+
+    /* Nothing of the partition is sent yet; once more without the index. */
+    ngx_http_mongodb_rest_unhint(&query, &part->query);
+    bson_destroy(&part->query);
+    part->query = query;
+    return ngx_http_mongodb_rest_op_query(&part->conn, (char *) ex->conf->ns.data, 0, 0, &part->query, ex->projection);
+  }
+
+  part->cursor_id = reply->fields.cursorID;
+  if(part->cursor_id == 0) {
+    part->done = 1;
+    ex->active--;
+  } else if(ngx_http_mongodb_rest_op_get_more(&part->conn, (char *) ex->conf->ns.data, part->cursor_id) != NGX_OK) {
+    bson_free(reply);
+    return NGX_ERROR;
+  }
+
+  len = 0;
+  p = (u_char *) &reply->objs;
+  for(i = 0; i < reply->fields.num; i++) {
+    ngx_http_mongodb_rest_bson_wrap(&b, p);
+    len += json_length(&b); /* The null becomes the newline. */
+    p += bson_size(&b);
+  }
+
+  if(ex->buf == NULL || (size_t) (ex->buf->end - ex->buf->start) < len) {
+    if(ex->buf) {
+      ngx_pfree(r->pool, ex->buf->start);
+    }
+    ex->buf = ngx_create_temp_buf(r->pool, ngx_max(len, (size_t) ngx_pagesize));
+    if(ex->buf == NULL) {
+      bson_free(reply);
+      return NGX_ERROR;
+    }
+    ex->out.buf = ex->buf;
+    ex->out.next = NULL;
+  }
+
+  ex->buf->pos = ex->buf->start;
+  ex->buf->last = ex->buf->start;
+  ex->buf->flush = 1;
+
+  p = (u_char *) &reply->objs;
+  for(i = 0; i < reply->fields.num; i++) {
+    ngx_http_mongodb_rest_bson_wrap(&b, p);
+    tojson(&b, (char *) ex->buf->last);
+    ex->buf->last += json_length(&b) - 1;
+    *ex->buf->last++ = '\n';
+    p += bson_size(&b);
+  }
+
+  bson_free(reply);
+  return NGX_OK;
+}
+
+static void ngx_http_mongodb_rest_export_finish(ngx_http_mongodb_rest_export_t * ex, ngx_int_t rc) {
+  ngx_http_request_t * r = ex->request;
+  ngx_connection_t * c = r->connection;
+
+  if(ex->timer.timer_set) {
+    ngx_del_timer(&ex->timer);
+  }
+
+  if(rc == NGX_OK) {
+    rc = ngx_http_send_special(r, NGX_HTTP_LAST);
+  } else {
+    /* Cut the response short, so the client cannot take it for the whole collection. */
+    ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                  "Export of \"%V\" failed with %ui partitions left", &ex->conf->ns, ex->active);
+    rc = NGX_ERROR;
+  }
+
+  ngx_http_finalize_request(r, rc);
+  ngx_http_run_posted_requests(c);
+}
+
+static void ngx_http_mongodb_rest_export_write(ngx_http_request_t * r);
+
+/* Carry on once the client has taken what is buffered. */
+static ngx_int_t ngx_http_mongodb_rest_export_wait(ngx_http_request_t * r) {
+  ngx_http_core_loc_conf_t * clcf;
+  ngx_event_t * wev = r->connection->write;
+
+  clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+  r->write_event_handler = ngx_http_mongodb_rest_export_write;
+
+  if(!wev->delayed) {
+    ngx_add_timer(wev, clcf->send_timeout);
+  }
+
+  return ngx_handle_write_event(wev, clcf->send_lowat);
+}
+
+static void ngx_http_mongodb_rest_export_pump(ngx_http_mongodb_rest_export_t * ex) {
+  ngx_http_request_t * r = ex->request;
+  ngx_connection_t * c = r->connection;
+  ngx_http_mongodb_rest_partition_t * part;
+  ngx_pool_t * pool;
+  ngx_uint_t n;
+  ngx_int_t rc;
+
+  /* Replies are freed as soon as they are serialized. */
+  pool = ngx_http_mongodb_rest_alloc_from(NULL);
+
+  for(n = 0; ; n++) {
+    if(ex->active == 0) {
+      rc = NGX_OK;
+      break;
+    }
+
+    /* The buffer is only reused once the client has all of it. */
+    if(r->out || c->buffered) {
+      rc = NGX_AGAIN;
+      break;
+    }
+
+    /* Let other requests in. */
+    if(n == MONGO_EXPORT_BATCH) {
+      rc = NGX_BUSY;
+      break;
+    }
+
+    part = ngx_http_mongodb_rest_export_ready(ex);
+    if(part == NULL) {
+      ngx_time_update();
+      if(ngx_current_msec - ex->progress >= ex->conf->read_timeout) {
+        ngx_log_error(NGX_LOG_ERR, c->log, 0,
+                      "Export of \"%V\" timed out waiting for mongod", &ex->conf->ns);
+        rc = NGX_ERROR;
+      } else if(ngx_http_mongodb_rest_client_gone(r)) {
+        rc = NGX_ERROR;
+      } else {
+        rc = NGX_BUSY;
+      }
+      break;
+    }
+
+    if(ngx_http_mongodb_rest_export_read(ex, part) != NGX_OK) {
+      rc = NGX_ERROR;
+      break;
+    }
+    ex->progress = ngx_current_msec;
+
+    if(ngx_buf_size(ex->buf) && ngx_http_output_filter(r, &ex->out) == NGX_ERROR) {
+      rc = NGX_ERROR;
+      break;
+    }
+  }
+
+  ngx_http_mongodb_rest_alloc_from(pool);
+
+  switch(rc) {
+    case NGX_BUSY:
+      ngx_add_timer(&ex->timer, MONGO_EXPORT_POLL);
+      return;
+    case NGX_AGAIN:
+      if(ngx_http_mongodb_rest_export_wait(r) == NGX_OK) {
+        return;
+      }
+      rc = NGX_ERROR;
+      /* fall through */
+    default:
+      ngx_http_mongodb_rest_export_finish(ex, rc);
+  }
+}
+
+static void ngx_http_mongodb_rest_export_timer(ngx_event_t * ev) {
+  ngx_http_mongodb_rest_export_pump(ev->data);
+}
+
+static void ngx_http_mongodb_rest_export_write(ngx_http_request_t * r) {
+  ngx_http_mongodb_rest_export_t * ex;
+  ngx_event_t * wev = r->connection->write;
+
+  ex = ngx_http_get_module_ctx(r, ngx_http_mongodb_rest_module);
+
+  if(wev->timedout) {
+    if(!wev->delayed) {
+      ngx_log_error(NGX_LOG_INFO, r->connection->log, NGX_ETIMEDOUT, "client timed out");
+      r->connection->timedout = 1;
+      ngx_http_mongodb_rest_export_finish(ex, NGX_ERROR);
+      return;
+    }
+    /* Held back by limit_rate. */
+    wev->timedout = 0;
+    wev->delayed = 0;
+  }
+
+  if(ngx_http_output_filter(r, NULL) == NGX_ERROR) {
+    ngx_http_mongodb_rest_export_finish(ex, NGX_ERROR);
+    return;
+  }
+
+  if(r->out || r->connection->buffered) {
+    if(ngx_http_mongodb_rest_export_wait(r) != NGX_OK) {
+      ngx_http_mongodb_rest_export_finish(ex, NGX_ERROR);
+    }
+    return;
+  }
+
+  if(wev->timer_set) {
+    ngx_del_timer(wev);
+  }
+  r->write_event_handler = ngx_http_request_empty_handler;
+
+  ngx_http_mongodb_rest_export_pump(ex);
+}
+
+static void ngx_http_mongodb_rest_export_cleanup(void * data) {
+  ngx_http_mongodb_rest_export_t * ex = data;
+  ngx_http_mongodb_rest_partition_t * part;
+  ngx_pool_t * pool;
+  ngx_uint_t i;
+
+  if(ex->timer.timer_set) {
+    ngx_del_timer(&ex->timer);
+  }
+  if(ex->timer.posted) {
+    ngx_delete_posted_event(&ex->timer);
+  }
+
+  pool = ngx_http_mongodb_rest_alloc_from(NULL);
+  for(i = 0; i < ex->nparts; i++) {
+    part = &ex->parts[i];
+    /* mongod keeps a cursor until it times out, not until its connection closes. */
+    if(part->conn.connected && !part->done && part->cursor_id) {
+      ngx_http_mongodb_rest_op_kill_cursors(&part->conn, part->cursor_id);
+    }
+    if(part->conn.primary) {
+      mongo_destroy(&part->conn);
+    }
+    bson_destroy(&part->query);
+  }
+  if(ex->projection == &ex->fields) {
+    bson_destroy(&ex->fields);
+  }
+  ngx_http_mongodb_rest_alloc_from(pool);
+}
+
+/* Where mongod sorts values of a $type among the others; numbers sort together. */
+static ngx_int_t ngx_http_mongodb_rest_type_rank(int type) {
+  switch(type) {
+    case -1: return 0; /* MinKey */
+    case 6: case 10: return 1; /* undefined, null */
+    case 1: case 16: case 18: case 19: return 2;
+    case 2: case 14: return 3; /* string, symbol */
+    case 3: return 4;
+    case 4: return 5;
+    case 5: return 6;
+    case 7: return 7;
+    case 8: return 8;
+    case 9: return 9;
+    case 17: return 10;
+    case 11: return 11;
+    case 12: return 12;
+    case 13: return 13;
+    case 15: return 14;
+    case 127: return 15; /* MaxKey */
+    default: return -1;
+  }
+}
+
+/*
+ * {$or: [...]} matching the documents whose field sorts before values of
+ * rank (or is missing), or after them.  Ranges of values only match their
+ * own type, so these take the rest of the collection.
+ */
+static void ngx_http_mongodb_rest_export_types(bson * query, const char * field, ngx_int_t rank, unsigned before) {
+  static const int types[] = { -1, 6, 10, 1, 16, 18, 19, 2, 14, 3, 4, 5, 7, 8, 9, 17, 11, 12, 13, 15, 127 };
+
+  ngx_uint_t i, j = 0;
+  ngx_int_t r;
+  u_char num[NGX_INT_T_LEN + 1];
+
+  bson_append_start_array(query, "$or");
+  if(before) {
+    bson_append_start_object(query, "0");
+    bson_append_start_object(query, field);
+    bson_append_bool(query, "$exists", 0);
+    bson_append_finish_object(query);
+    bson_append_finish_object(query);
+    j++;
+  }
+  for(i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+    r = ngx_http_mongodb_rest_type_rank(types[i]);
+    if(before ? r >= rank : r <= rank) {
+      continue;
+    }
+    *ngx_sprintf(num, "%ui", j++) = '\0';
+    bson_append_start_object(query, (char *) num);
+    bson_append_start_object(query, field);
+    bson_append_int(query, "$type", types[i]);
+    bson_append_finish_object(query);
+    bson_append_finish_object(query);
+  }
+  bson_append_finish_array(query);
+}
+
+/*
+ * The query for partition i: the first and last take the documents whose
+ * field is missing or of a type sorting before or after the split points,
+ * and those between, the range between the split points either side.
+ */
+static void ngx_http_mongodb_rest_export_query(bson * query, ngx_http_mongodb_rest_export_t * ex, bson_iterator * splits, ngx_uint_t i) {
+  char * field = (char *) ex->conf->field.data;
+  ngx_uint_t nsplits;
+  ngx_int_t rank;
+
+  bson_init(query);
+  bson_append_start_object(query, "$query");
+  if(ex->nparts > 1) {
+    nsplits = ex->nparts - 3;
+    rank = ngx_http_mongodb_rest_type_rank(bson_iterator_type(&splits[0]));
+    if(i == 0 || i == ex->nparts - 1) {
+      ngx_http_mongodb_rest_export_types(query, field, rank, i == 0);
+    } else {
+      i--;
+      bson_append_start_object(query, field);
+      if(i > 0) {
+        bson_append_element(query, "$gte", &splits[i - 1]);
+      }
+      if(i < nsplits) {
+        bson_append_element(query, "$lt", &splits[i]);
+      }
+      bson_append_finish_object(query);
+    }
+  }
+  bson_append_finish_object(query);
+  if(!ex->unordered) {
+    bson_append_start_object(query, "$orderby");
+    bson_append_int(query, field, 1);
+    bson_append_finish_object(query);
+  }
+  if(ex->conf->hint) {
+    bson_append_string(query, "$hint", ex->conf->hint);
+  }
+  bson_finish(query);
+}
+
+/*
+ * Stream the whole collection as NDJSON, split into up to mongodb-rest-export
+ * partitions by ranges of the key's first field.  Each partition is
+ * scanned over its own connection to the primary; in order, partitions
+ * are sent one after another while the rest read ahead, otherwise each
+ * reply is sent as it arrives.
+ */
+ngx_int_t ngx_http_mongodb_rest_export_handler(ngx_http_request_t * request, mongo * conn, ngx_str_t * mode) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongo_connection_t * mongo_conn;
+  ngx_http_mongodb_rest_partition_t * part;
+  ngx_http_mongodb_rest_export_t * ex;
+  bson_iterator splits[MONGO_EXPORT_MAX_PARTITIONS - 1];
+  bson_iterator it, sub;
+  ngx_pool_cleanup_t * cln;
+  ngx_str_t arg;
+  ngx_uint_t i, n, nparts, nsplits = 0;
+  ngx_int_t rc;
+  ngx_pool_t * pool;
+  bson split;
+  unsigned has_split = 0;
+
+  conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
+  if(conf->export_partitions == 0) {
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  ex = ngx_pcalloc(request->pool, sizeof(ngx_http_mongodb_rest_export_t));
+  if(ex == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if(mode->len == 9 && ngx_strncmp(mode->data, "unordered", 9) == 0) {
+    ex->unordered = 1;
+  } else if(!(mode->len == 7 && ngx_strncmp(mode->data, "ordered", 7) == 0)) {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  n = conf->export_partitions;
+  if(ngx_http_arg(request, (u_char *) "partitions", 10, &arg) == NGX_OK) {
+    rc = ngx_atoi(arg.data, arg.len);
+    if(rc == NGX_ERROR || rc == 0) {
+      return NGX_HTTP_BAD_REQUEST;
+    }
+    n = ngx_min((ngx_uint_t) rc, n);
+  }
+
+  rc = ngx_http_mongodb_rest_projection(request, &ex->fields, &ex->projection);
+  if(rc != NGX_OK) {
+    return rc == NGX_DECLINED ? NGX_HTTP_BAD_REQUEST : NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  // ---------- SPLIT THE RANGE ---------- //
+  if(n > 1 && ngx_http_mongodb_rest_export_bounds(conn, conf, n, &split) == NGX_OK) {
+    has_split = 1;
+    if(bson_find(&it, &split, "splitKeys") == BSON_ARRAY) {
+      bson_iterator_subiterator(&it, &sub);
+      while(nsplits < n - 1 && bson_iterator_next(&sub) == BSON_OBJECT) {
+        bson_iterator_subiterator(&sub, &splits[nsplits]);
+        if(bson_iterator_next(&splits[nsplits]) != BSON_EOO) {
+          nsplits++;
+        }
+      }
+    }
+  }
+
+  /* Ranges between points of different types match nothing: one scan then. */
+  for(i = 0; i < nsplits; i++) {
+    if(ngx_http_mongodb_rest_type_rank(bson_iterator_type(&splits[i]))
+       != ngx_http_mongodb_rest_type_rank(bson_iterator_type(&splits[0]))
+       || ngx_http_mongodb_rest_type_rank(bson_iterator_type(&splits[0])) == -1) {
+      nsplits = 0;
+      break;
+    }
+  }
+  /* The ranges, and the rest before and after them. */
+  nparts = nsplits ? nsplits + 3 : 1;
+  /* A failed command is no reason to fail the export; it is just not split. */
+  mongo_clear_errors(conn);
+
+  ex->parts = ngx_pcalloc(request->pool, nparts * sizeof(ngx_http_mongodb_rest_partition_t));
+  cln = ngx_pool_cleanup_add(request->pool, 0);
+  if(ex->parts == NULL || cln == NULL) {
+    rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+    goto done;
+  }
+  ex->request = request;
+  ex->conf = conf;
+  cln->handler = ngx_http_mongodb_rest_export_cleanup;
+  cln->data = ex;
+
+  // ---------- OPEN THE PARTITIONS ---------- //
+  mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+
+  for(i = 0; i < nparts; i++) {
+    part = &ex->parts[i];
+    ex->nparts = i + 1;
+
+    /* Freed with the request, but by mongo_destroy like any connection. */
+    pool = ngx_http_mongodb_rest_alloc_from(NULL);
+    mongo_connect(&part->conn, conn->primary->host, conn->primary->port);
+    ngx_http_mongodb_rest_alloc_from(pool);
+
+    if(!part->conn.connected) {
+      ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                    "Could not connect to mongo for export: \"%V\"", &conf->mongo);
+      rc = ngx_http_mongodb_rest_retry_after(request, MONGO_RETRY_AFTER);
+      goto done;
+    }
+
+    ngx_http_mongo_set_timeouts(request->connection->log, mongo_conn, &part->conn);
+    if(ngx_http_mongo_reauth(request->connection->log, mongo_conn, &part->conn) != NGX_OK) {
+      rc = NGX_HTTP_SERVICE_UNAVAILABLE;
+      goto done;
+    }
+  }
+
+  for(i = 0; i < ex->nparts; i++) {
+    ngx_http_mongodb_rest_export_query(&ex->parts[i].query, ex, splits, i);
+    rc = ngx_http_mongodb_rest_op_query(&ex->parts[i].conn, (char *) conf->ns.data, 0, 0, &ex->parts[i].query, ex->projection);
+    if(rc != NGX_OK) {
+      rc = NGX_HTTP_GATEWAY_TIME_OUT;
+      goto done;
+    }
+  }
+  ex->active = ex->nparts;
+
+  ngx_log_error(NGX_LOG_INFO, request->connection->log, 0,
+                "Exporting \"%V\" in %ui partitions", &conf->ns, ex->nparts);
+
+  // ---------- STREAM ---------- //
+  ngx_str_set(&request->headers_out.content_type, "application/x-ndjson");
+  request->headers_out.status = NGX_HTTP_OK;
+  request->headers_out.content_length_n = -1;
+
+  rc = ngx_http_send_header(request);
+  if(rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
+    goto done;
+  }
+
+  ngx_http_set_ctx(request, ex, ngx_http_mongodb_rest_module);
+  request->write_event_handler = ngx_http_request_empty_handler;
+
+  ngx_time_update();
+  ex->progress = ngx_current_msec;
+  ex->timer.handler = ngx_http_mongodb_rest_export_timer;
+  ex->timer.data = ex;
+  ex->timer.log = request->connection->log;
+
+  /* The first replies are not in yet; start once the handler has returned. */
+  ngx_post_event(&ex->timer, &ngx_posted_events);
+  request->main->count++;
+  rc = NGX_DONE;
+
+done:
+  if(has_split) {
+    bson_destroy(&split);
+  }
+  /* Otherwise they go with the export, in case a partition is queried again. */
+  if((cln == NULL || cln->handler == NULL) && ex->projection == &ex->fields) {
+    bson_destroy(&ex->fields);
+  }
+  return rc;
+}
@@ -0,0 +1,554 @@
+/*
+ * GridFS: PUT bodies streamed into chunks as they arrive.
+ */
+
+#include "ngx_http_mongodb_rest_module.h"
+
+/* Parse the 'mongodb-rest-gridfs' directive. */
+char* ngx_http_mongodb_rest_gridfs(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf = void_conf;
+    ngx_str_t *value, size;
+    ngx_int_t n;
+    ngx_uint_t i;
+
+    if (mongodb_rest_loc_conf->gridfs != NGX_CONF_UNSET) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "on") == 0) {
+        mongodb_rest_loc_conf->gridfs = 1;
+    } else if (ngx_strcmp(value[1].data, "off") == 0) {
+        mongodb_rest_loc_conf->gridfs = 0;
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\", it must be \"on\" or \"off\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "root_collection=", 16) == 0) {
+            mongodb_rest_loc_conf->root_collection.data = &value[i].data[16];
+            mongodb_rest_loc_conf->root_collection.len = value[i].len - 16;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "chunk_size=", 11) == 0) {
+            size.data = &value[i].data[11];
+            size.len = value[i].len - 11;
+            mongodb_rest_loc_conf->chunk_size = ngx_parse_size(&size);
+
+            if (mongodb_rest_loc_conf->chunk_size == (size_t) NGX_ERROR
+                || mongodb_rest_loc_conf->chunk_size == 0
+                || mongodb_rest_loc_conf->chunk_size > MONGO_GRIDFS_MAX_CHUNK_SIZE) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Chunk Size: %V", &size);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "chunk_batch=", 12) == 0) {
+            n = ngx_atoi(&value[i].data[12], value[i].len - 12);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Chunk Batch: %s", &value[i].data[12]);
+                return NGX_CONF_ERROR;
+            }
+            mongodb_rest_loc_conf->chunk_batch = n;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* The _id of the file once stored: the key itself, if that is the field. */
+static unsigned char ngx_http_mongodb_rest_gridfs_files_id(bson * b, ngx_http_mongodb_rest_gridfs_ctx_t * ctx, const char * name) {
+  if(ngx_strcmp(ctx->field, "_id") == 0) {
+    return ngx_http_mongodb_rest_append_value(b, ctx->type, name, ctx->value);
+  }
+
+  bson_append_oid(b, name, &ctx->oid);
+  return 1;
+}
+
+/* Take the reply to the last batch's getLastError: NGX_ERROR if it failed. */
+static ngx_int_t ngx_http_mongodb_rest_gridfs_confirm(ngx_http_mongodb_rest_gridfs_ctx_t * ctx) {
+  u_char err[NGX_MAX_ERROR_STR];
+  int code;
+
+  if(!ctx->pending) {
+    return NGX_OK;
+  }
+  ctx->pending = 0;
+
+  if(ngx_http_mongodb_rest_gle_read(ctx->conn, &code, err, sizeof(err), NULL) != NGX_OK) {
+    /* The reply may still arrive, and be taken for another's. */
+    mongo_disconnect(ctx->conn);
+    ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+		  "No reply for GridFS chunks of: %s", ctx->value);
+    return NGX_ERROR;
+  }
+
+  if(code) {
+    ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+		  "Failed to write GridFS chunks: %s", err);
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+/*
+ * Send the queued chunks as a single insert, followed by a getLastError
+ * whose reply is only read when the next batch is sent, or at the end. An
+ * insert of many documents stops at the first that fails, so one reply
+ * per batch accounts for all of it.
+ */
+static ngx_int_t ngx_http_mongodb_rest_gridfs_flush_batch(ngx_http_mongodb_rest_gridfs_ctx_t * ctx, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  ngx_uint_t i;
+  int status;
+
+  if(ctx->nbatch == 0) {
+    return NGX_OK;
+  }
+
+  if(ngx_http_mongodb_rest_gridfs_confirm(ctx) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  ctx->sent = 1;
+  status = mongo_insert_batch(ctx->conn, (char *) conf->gridfs_chunks.data, ctx->batch_ptrs, ctx->nbatch);
+
+  for(i = 0; i < ctx->nbatch; i++) {
+    bson_destroy(&ctx->batch[i]);
+  }
+  ctx->nbatch = 0;
+
+  if(status != MONGO_OK || ngx_http_mongodb_rest_gle_send(ctx->conn, conf) != NGX_OK) {
+    return NGX_ERROR;
+  }
+  ctx->pending = 1;
+
+  return NGX_OK;
+}
+
+static ngx_int_t ngx_http_mongodb_rest_gridfs_flush_chunk(ngx_http_mongodb_rest_gridfs_ctx_t * ctx, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  bson * b;
+
+  b = &ctx->batch[ctx->nbatch];
+  ctx->batch_ptrs[ctx->nbatch] = b;
+  ctx->nbatch++;
+
+  bson_init(b);
+  bson_append_new_oid(b, "_id");
+  bson_append_oid(b, "files_id", &ctx->oid);
+  bson_append_int(b, "n", (int) ctx->n);
+  bson_append_binary(b, "data", BSON_BIN_BINARY, (const char *) ctx->chunk, (int) ctx->chunk_len);
+  bson_finish(b);
+
+  ctx->n++;
+  ctx->chunk_len = 0;
+
+  if(ctx->nbatch == conf->chunk_batch) {
+    return ngx_http_mongodb_rest_gridfs_flush_batch(ctx, conf);
+  }
+
+  return NGX_OK;
+}
+
+/* Cut the buffered body into chunks as it arrives. */
+static ngx_int_t ngx_http_mongodb_rest_gridfs_consume(ngx_http_request_t * r, ngx_http_mongodb_rest_gridfs_ctx_t * ctx, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  ngx_chain_t * cl;
+  ngx_buf_t * buf;
+  size_t n;
+
+  for(cl = r->request_body->bufs; cl; cl = cl->next) {
+    buf = cl->buf;
+
+    if(buf->in_file) {
+      ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+		    "GridFS upload buffered to a temporary file");
+      return NGX_ERROR;
+    }
+
+    while(buf->pos < buf->last) {
+      n = ngx_min((size_t) (buf->last - buf->pos), conf->chunk_size - ctx->chunk_len);
+
+      ngx_memcpy(ctx->chunk + ctx->chunk_len, buf->pos, n);
+      ngx_md5_update(&ctx->md5, buf->pos, n);
+      ctx->chunk_len += n;
+      ctx->length += n;
+      buf->pos += n;
+
+      if(ctx->chunk_len == conf->chunk_size
+	 && ngx_http_mongodb_rest_gridfs_flush_chunk(ctx, conf) != NGX_OK) {
+	return NGX_ERROR;
+      }
+    }
+  }
+
+  r->request_body->bufs = NULL;
+
+  return NGX_OK;
+}
+
+/* Whether the last write on conn went through. */
+static ngx_int_t ngx_http_mongodb_rest_gridfs_check(ngx_http_mongodb_rest_gridfs_ctx_t * ctx, ngx_http_mongodb_rest_loc_conf_t * conf, int sent, const char * what) {
+  u_char err[NGX_MAX_ERROR_STR];
+  int code;
+
+  if(sent != MONGO_OK || ngx_http_mongodb_rest_gle_send(ctx->conn, conf) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+		  "Failed to send %s for GridFS file: %s", what, ctx->value);
+    return NGX_ERROR;
+  }
+
+  if(ngx_http_mongodb_rest_gle_read(ctx->conn, &code, err, sizeof(err), NULL) != NGX_OK) {
+    mongo_disconnect(ctx->conn);
+    ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+		  "No reply to %s for GridFS file: %s", what, ctx->value);
+    return NGX_ERROR;
+  }
+
+  if(code) {
+    ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+		  "Failed %s for GridFS file: %s: %s", what, ctx->value, err);
+    return NGX_ERROR;
+  }
+
+  return NGX_OK;
+}
+
+/* Remove any file (and its chunks) already stored under the key. */
+static ngx_int_t ngx_http_mongodb_rest_gridfs_remove(ngx_http_mongodb_rest_gridfs_ctx_t * ctx, ngx_http_mongodb_rest_loc_conf_t * conf, bson * query) {
+  mongo_cursor cursor;
+  bson_iterator it;
+  bson chunks;
+  ngx_int_t rc = NGX_OK;
+  int status;
+
+  mongo_cursor_init(&cursor, ctx->conn, (char *) conf->gridfs_files.data);
+  mongo_cursor_set_query(&cursor, query);
+
+  while(rc == NGX_OK && mongo_cursor_next(&cursor) == MONGO_OK) {
+    if(bson_find(&it, mongo_cursor_bson(&cursor), "_id") == BSON_EOO) {
+      continue;
+    }
+
+    bson_init(&chunks);
+    bson_append_element(&chunks, "files_id", &it);
+    bson_finish(&chunks);
+    status = mongo_remove(ctx->conn, (char *) conf->gridfs_chunks.data, &chunks);
+    bson_destroy(&chunks);
+
+    rc = ngx_http_mongodb_rest_gridfs_check(ctx, conf, status, "chunk removal");
+  }
+
+  mongo_cursor_destroy(&cursor);
+
+  if(rc != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  status = mongo_remove(ctx->conn, (char *) conf->gridfs_files.data, query);
+
+  return ngx_http_mongodb_rest_gridfs_check(ctx, conf, status, "removal");
+}
+
+/* A files_id: the given one, or the key when NULL. */
+static void ngx_http_mongodb_rest_gridfs_append_id(bson * b, ngx_http_mongodb_rest_gridfs_ctx_t * ctx, const char * name, bson_oid_t * oid) {
+  if(oid) {
+    bson_append_oid(b, name, oid);
+  } else {
+    (void) ngx_http_mongodb_rest_append_value(b, ctx->type, name, ctx->value);
+  }
+}
+
+/* Move every chunk under one files_id to another. */
+static ngx_int_t ngx_http_mongodb_rest_gridfs_move(ngx_http_mongodb_rest_gridfs_ctx_t * ctx, ngx_http_mongodb_rest_loc_conf_t * conf, bson_oid_t * from, bson_oid_t * to) {
+  bson query, set;
+  int status;
+
+  bson_init(&query);
+  ngx_http_mongodb_rest_gridfs_append_id(&query, ctx, "files_id", from);
+  bson_finish(&query);
+  bson_init(&set);
+  bson_append_start_object(&set, "$set");
+  ngx_http_mongodb_rest_gridfs_append_id(&set, ctx, "files_id", to);
+  bson_append_finish_object(&set);
+  bson_finish(&set);
+
+  status = mongo_update(ctx->conn, (char *) conf->gridfs_chunks.data, &query, &set, MONGO_UPDATE_MULTI);
+  bson_destroy(&query);
+  bson_destroy(&set);
+
+  return ngx_http_mongodb_rest_gridfs_check(ctx, conf, status, "chunk move");
+}
+
+/*
+ * Write the trailing chunk and the fs.files document, then retire any file
+ * already stored under the key.  The chunks went out under a files_id of
+ * their own, so until this point the old file is untouched.
+ */
+static ngx_int_t ngx_http_mongodb_rest_gridfs_finish(ngx_http_request_t * r, ngx_http_mongodb_rest_gridfs_ctx_t * ctx, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  u_char digest[16];
+  u_char md5[33];
+  ngx_time_t * tp;
+  bson_oid_t retired;
+  bson file, query;
+  ngx_int_t rc;
+  int status;
+
+  if(ctx->chunk_len > 0
+     && ngx_http_mongodb_rest_gridfs_flush_chunk(ctx, conf) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  if(ngx_http_mongodb_rest_gridfs_flush_batch(ctx, conf) != NGX_OK
+     || ngx_http_mongodb_rest_gridfs_confirm(ctx) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  ngx_md5_final(digest, &ctx->md5);
+  *ngx_hex_dump(md5, digest, 16) = '\0';
+  tp = ngx_timeofday();
+
+  bson_init(&file);
+  ngx_http_mongodb_rest_gridfs_files_id(&file, ctx, "_id");
+  if(ngx_strcmp(ctx->field, "_id") != 0) {
+    ngx_http_mongodb_rest_append_value(&file, ctx->type, ctx->field, ctx->value);
+  }
+  bson_append_long(&file, "length", (int64_t) ctx->length);
+  bson_append_int(&file, "chunkSize", (int) conf->chunk_size);
+  bson_append_date(&file, "uploadDate", (bson_date_t) tp->sec * 1000 + tp->msec);
+  bson_append_string(&file, "md5", (char *) md5);
+  if(r->headers_in.content_type) {
+    bson_append_string_n(&file, "contentType", (char *) r->headers_in.content_type->value.data, r->headers_in.content_type->value.len);
+  }
+  bson_finish(&file);
+
+  if(ngx_strcmp(ctx->field, "_id") != 0) {
+    // ---------- ADD THE NEW FILE, THEN DROP THE OLD ---------- //
+    status = mongo_insert(ctx->conn, (char *) conf->gridfs_files.data, &file);
+    bson_destroy(&file);
+
+    if(ngx_http_mongodb_rest_gridfs_check(ctx, conf, status, "insert") != NGX_OK) {
+      return NGX_ERROR;
+    }
+    ctx->stored = 1;
+
+    bson_init(&query);
+    ngx_http_mongodb_rest_append_value(&query, ctx->type, ctx->field, ctx->value);
+    bson_append_start_object(&query, "_id");
+    bson_append_oid(&query, "$ne", &ctx->oid);
+    bson_append_finish_object(&query);
+    bson_finish(&query);
+
+    rc = ngx_http_mongodb_rest_gridfs_remove(ctx, conf, &query);
+    bson_destroy(&query);
+
+    if(rc != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, ctx->log, 0,
+		    "Failed to remove replaced GridFS file: %s", ctx->value);
+    }
+    return rc;
+  }
+
+  /*
+   * The file's _id is the key, and the chunks of the old file hold it as
+   * their files_id until they go; so they are set aside under an id of their
+   * own, the new chunks moved under the key and the file document replaced.
+   * Only then are the old chunks removed.  A step that fails moves back
+   * what the ones before it moved, leaving the old file as it was.
+   */
+  if(!ngx_http_mongodb_rest_query_init(&query, conf, ctx->value)) {
+    bson_destroy(&file);
+    return NGX_ERROR;
+  }
+  bson_oid_gen(&retired);
+
+  if(ngx_http_mongodb_rest_gridfs_move(ctx, conf, NULL, &retired) != NGX_OK) {
+    (void) ngx_http_mongodb_rest_gridfs_move(ctx, conf, &retired, NULL);
+    rc = NGX_ERROR;
+  } else if(ngx_http_mongodb_rest_gridfs_move(ctx, conf, &ctx->oid, NULL) != NGX_OK) {
+    (void) ngx_http_mongodb_rest_gridfs_move(ctx, conf, NULL, &ctx->oid);
+    (void) ngx_http_mongodb_rest_gridfs_move(ctx, conf, &retired, NULL);
+    rc = NGX_ERROR;
+  } else {
+    status = mongo_update(ctx->conn, (char *) conf->gridfs_files.data, &query, &file, MONGO_UPDATE_UPSERT);
+    rc = ngx_http_mongodb_rest_gridfs_check(ctx, conf, status, "replace");
+    if(rc != NGX_OK) {
+      (void) ngx_http_mongodb_rest_gridfs_move(ctx, conf, NULL, &ctx->oid);
+      (void) ngx_http_mongodb_rest_gridfs_move(ctx, conf, &retired, NULL);
+    }
+  }
+  bson_destroy(&query);
+  bson_destroy(&file);
+
+  if(rc != NGX_OK) {
+    return NGX_ERROR;
+  }
+  ctx->stored = 1;
+
+  // ---------- DROP THE OLD CHUNKS ---------- //
+  bson_init(&query);
+  bson_append_oid(&query, "files_id", &retired);
+  bson_finish(&query);
+  status = mongo_remove(ctx->conn, (char *) conf->gridfs_chunks.data, &query);
+  bson_destroy(&query);
+
+  return ngx_http_mongodb_rest_gridfs_check(ctx, conf, status, "removal of replaced chunks");
+}
+
+/* Give the driver its batch back, and take away the chunks of a file never stored. */
+static void ngx_http_mongodb_rest_gridfs_cleanup(void * data) {
+  ngx_http_mongodb_rest_gridfs_ctx_t * ctx = data;
+  ngx_pool_t * pool;
+  ngx_uint_t i;
+  bson chunks;
+  int status;
+
+  pool = ngx_http_mongodb_rest_alloc_from(NULL);
+
+  for(i = 0; i < ctx->nbatch; i++) {
+    bson_destroy(&ctx->batch[i]);
+  }
+  ctx->nbatch = 0;
+
+  /* The connection is shared; no reply of ours may be left on it. */
+  if(ctx->pending && ctx->conn->connected) {
+    ngx_http_mongodb_rest_gridfs_confirm(ctx);
+  }
+
+  if(ctx->sent && !ctx->stored && ctx->conn->connected) {
+    bson_init(&chunks);
+    bson_append_oid(&chunks, "files_id", &ctx->oid);
+    bson_finish(&chunks);
+
+    status = mongo_remove(ctx->conn, (char *) ctx->conf->gridfs_chunks.data, &chunks);
+    bson_destroy(&chunks);
+    (void) ngx_http_mongodb_rest_gridfs_check(ctx, ctx->conf, status, "removal of partial chunks");
+  }
+
+  ngx_http_mongodb_rest_alloc_from(pool);
+}
+
+static void ngx_http_mongodb_rest_gridfs_read(ngx_http_request_t * r) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongodb_rest_gridfs_ctx_t * ctx;
+  ngx_int_t rc;
+
+  conf = ngx_http_get_module_loc_conf(r, ngx_http_mongodb_rest_module);
+  ctx = ngx_http_get_module_ctx(r, ngx_http_mongodb_rest_module);
+
+  if(ctx->error) {
+    return;
+  }
+
+  if(ngx_http_mongodb_rest_gridfs_consume(r, ctx, conf) != NGX_OK) {
+    ctx->error = 1;
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  if(r->reading_body) {
+    return;
+  }
+
+  if(ngx_http_mongodb_rest_gridfs_finish(r, ctx, conf) != NGX_OK) {
+    ctx->error = 1;
+    ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  r->headers_out.status = NGX_HTTP_CREATED;
+  r->headers_out.content_length_n = 0;
+  r->header_only = 1;
+
+  rc = ngx_http_send_header(r);
+  ngx_http_finalize_request(r, rc);
+}
+
+/* Read event handler once the body is no longer buffered by nginx. */
+static void ngx_http_mongodb_rest_gridfs_read_more(ngx_http_request_t * r) {
+  ngx_int_t rc;
+
+  rc = ngx_http_read_unbuffered_request_body(r);
+
+  if(rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    ngx_http_finalize_request(r, rc);
+    return;
+  }
+
+  ngx_http_mongodb_rest_gridfs_read(r);
+}
+
+static void ngx_http_mongodb_rest_gridfs_body_handler(ngx_http_request_t * r) {
+  r->read_event_handler = ngx_http_mongodb_rest_gridfs_read_more;
+  ngx_http_mongodb_rest_gridfs_read(r);
+}
+
+ngx_int_t ngx_http_mongodb_rest_gridfs_put_handler(ngx_http_request_t* r, mongo * conn, bson_type type, const char * field, const char * value) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongodb_rest_gridfs_ctx_t * ctx;
+  ngx_pool_cleanup_t * cln;
+  ngx_int_t rc;
+
+  conf = ngx_http_get_module_loc_conf(r, ngx_http_mongodb_rest_module);
+
+  if(*value == '\0') {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_mongodb_rest_gridfs_ctx_t));
+  if(ctx == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ctx->conn = conn;
+  ctx->conf = conf;
+  ctx->log = r->connection->log;
+  ctx->type = type;
+  ctx->field = field;
+  ctx->value = ngx_pnalloc(r->pool, ngx_strlen(value) + 1);
+  ctx->chunk = ngx_pnalloc(r->pool, conf->chunk_size);
+  ctx->batch = ngx_pcalloc(r->pool, conf->chunk_batch * sizeof(bson));
+  ctx->batch_ptrs = ngx_pcalloc(r->pool, conf->chunk_batch * sizeof(bson *));
+
+  if(ctx->value == NULL || ctx->chunk == NULL || ctx->batch == NULL || ctx->batch_ptrs == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ngx_cpystrn((u_char *) ctx->value, (u_char *) value, ngx_strlen(value) + 1);
+
+  cln = ngx_pool_cleanup_add(r->pool, 0);
+  if(cln == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  cln->handler = ngx_http_mongodb_rest_gridfs_cleanup;
+  cln->data = ctx;
+
+  /* Any file stored under the key stays until this one is complete. */
+  bson_oid_gen(&ctx->oid);
+  ngx_md5_init(&ctx->md5);
+
+  ngx_http_set_ctx(r, ctx, ngx_http_mongodb_rest_module);
+
+  // ---------- STREAM THE BODY ---------- //
+  r->request_body_no_buffering = 1;
+
+  rc = ngx_http_read_client_request_body(r, ngx_http_mongodb_rest_gridfs_body_handler);
+
+  if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return rc;
+  }
+
+  return NGX_DONE;
+}
@@ -38,78 +38,7 @@
  * TODO range support http://www.w3.org/Protocols/rfc2616/rfc2616-sec14.html#sec14.35
  */
 
-/* Tuning Parameters */
-#define MONGO_MAX_RETRIES_PER_REQUEST 1
-#define MONGO_RECONNECT_WAITTIME 500 //ms
-
-#define TRUE 1
-#define FALSE 0
-
-
-/* Nginx Includes */
-#include <ngx_config.h>
-#include <ngx_core.h>
-#include <ngx_http.h>
-
-/* Standard Includes */
-#include <signal.h>
-#include <stdio.h>
-#include <unistd.h>
-
-/* Mongo Includes - link with -lmongo -lbson */
-#include <mongodb-c/mongo.h>
-#include <mongodb-c/gridfs.h>
-
-#include "jsonbson.h"
-#include "jansson.h"
-
-/**
- * Types
- */
-
-/* Main Configuration */
-typedef struct {
-    ngx_array_t loc_confs; /* ngx_http_mongodb_rest_loc_conf_t */
-} ngx_http_mongodb_rest_main_conf_t;
-
-/* Location Configuration */
-typedef struct {
-    ngx_str_t db;
-    ngx_str_t root_collection;
-    ngx_str_t field;
-    ngx_uint_t type;
-    ngx_str_t user;
-    ngx_str_t pass;
-    ngx_str_t mongo;
-    ngx_array_t* mongods; /* ngx_http_mongod_server_t */
-    ngx_str_t replset; /* Name of the replica set, if connecting. */
-} ngx_http_mongodb_rest_loc_conf_t;
-
-/* Mongo Authentication Credentials */
-typedef struct {
-    ngx_str_t db;
-    ngx_str_t user;
-    ngx_str_t pass;
-} ngx_http_mongo_auth_t;
-
-/* Persistent (to process) MongoDB Connections */
-typedef struct {
-    ngx_str_t name;
-    mongo conn;
-    ngx_array_t *auths; /* ngx_http_mongo_auth_t */
-} ngx_http_mongo_connection_t;
-
-
-// Maybe we should store a list of addresses instead.
-typedef struct {
-    ngx_str_t host;
-    in_port_t port;
-} ngx_http_mongod_server_t;
-
-typedef struct {
-    mongo_cursor ** cursors;
-    ngx_uint_t numchunks;
-} ngx_http_mongodb_rest_cleanup_t;
+#include "ngx_http_mongodb_rest_module.h"
 
 /**
  * Public Interface
@@ -122,6 +51,7 @@ static ngx_command_t ngx_http_mongodb_rest_commands[];
 
 // Forward definitions - functions
 static ngx_int_t ngx_http_mongodb_rest_init_worker(ngx_cycle_t* cycle);
+static void ngx_http_mongodb_rest_exit_worker(ngx_cycle_t* cycle);
 
 ngx_module_t ngx_http_mongodb_rest_module = {
     NGX_MODULE_V1,
@@ -133,20 +63,21 @@ ngx_module_t ngx_http_mongodb_rest_module = {
     ngx_http_mongodb_rest_init_worker,
     NULL,
     NULL,
-    NULL,
+    ngx_http_mongodb_rest_exit_worker,
     NULL,
     NGX_MODULE_V1_PADDING
 };
 
 /* Module context. */
 // Forward declarations - functions
+static ngx_int_t ngx_http_mongodb_rest_init(ngx_conf_t* directive);
 static void* ngx_http_mongodb_rest_create_main_conf(ngx_conf_t* directive);
 static void* ngx_http_mongodb_rest_create_loc_conf(ngx_conf_t* directive);
 static char* ngx_http_mongodb_rest_merge_loc_conf(ngx_conf_t* directive, void* parent, void* child);
 
 static ngx_http_module_t ngx_http_mongodb_rest_module_ctx = {
     NULL, /* preconfiguration */
-    NULL, /* postconfiguration */
+    ngx_http_mongodb_rest_init, /* postconfiguration */
     ngx_http_mongodb_rest_create_main_conf,
     NULL, /* init main configuration */
     NULL, /* create server configuration */
@@ -159,6 +90,10 @@ static ngx_http_module_t ngx_http_mongodb_rest_module_ctx = {
 // Forward declarations - functions
 static char * ngx_http_mongo(ngx_conf_t *cf, ngx_command_t *cmd, void *dummy);
 static char* ngx_http_mongodb_rest(ngx_conf_t* directive, ngx_command_t* command, void* mongodb_rest_conf);
+static char* ngx_http_mongodb_rest_health_check(ngx_conf_t* directive, ngx_command_t* command, void* mongodb_rest_main_conf);
+static char* ngx_http_mongodb_rest_timeout(ngx_conf_t* directive, ngx_command_t* command, void* mongodb_rest_conf);
+static char* ngx_http_mongodb_rest_admission_conf(ngx_conf_t* directive, ngx_command_t* command, void* mongodb_rest_main_conf);
+static char* ngx_http_mongodb_rest_status(ngx_conf_t* directive, ngx_command_t* command, void* mongodb_rest_conf);
 
 static ngx_command_t ngx_http_mongodb_rest_commands[] = {
     {
@@ -177,16 +112,143 @@ static ngx_command_t ngx_http_mongodb_rest_commands[] = {
         0,
         NULL
     },
+    {
+        ngx_string("mongodb-rest-health-check"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_ANY,
+        ngx_http_mongodb_rest_health_check,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("mongodb-rest-timeout"),
+        NGX_HTTP_MAIN_CONF | NGX_HTTP_SRV_CONF | NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_mongodb_rest_timeout,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("mongodb-rest-admission"),
+        NGX_HTTP_MAIN_CONF | NGX_CONF_ANY,
+        ngx_http_mongodb_rest_admission_conf,
+        NGX_HTTP_MAIN_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("mongodb-rest-status"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_NOARGS,
+        ngx_http_mongodb_rest_status,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("mongodb-rest-shards"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_2MORE,
+        ngx_http_mongodb_rest_shards,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("mongodb-rest-aggregate"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_mongodb_rest_aggregate,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("mongodb-rest-gridfs"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_mongodb_rest_gridfs,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("mongodb-rest-write-behind"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_1MORE,
+        ngx_http_mongodb_rest_write_behind,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
+    {
+        ngx_string("mongodb-rest-export"),
+        NGX_HTTP_LOC_CONF | NGX_CONF_TAKE1,
+        ngx_http_mongodb_rest_export,
+        NGX_HTTP_LOC_CONF_OFFSET,
+        0,
+        NULL
+    },
     ngx_null_command
 };
 
 
 static ngx_int_t ngx_http_mongodb_rest_handler(ngx_http_request_t* request);
-//static void ngx_http_mongodb_rest_cleanup(void* data);
+static ngx_int_t ngx_http_mongodb_rest_dispatch(ngx_http_request_t* request);
+static ngx_int_t ngx_http_mongodb_rest_status_handler(ngx_http_request_t* request);
+static void ngx_http_mongodb_rest_cleanup(void* data);
 
 static ngx_array_t ngx_http_mongo_connections;
 
-static ngx_http_mongo_connection_t* ngx_http_get_mongo_connection( ngx_str_t name ) {
+static ngx_rbtree_t ngx_http_mongodb_rest_cursors;
+static ngx_rbtree_node_t ngx_http_mongodb_rest_cursors_sentinel;
+static ngx_queue_t ngx_http_mongodb_rest_cursors_queue;
+static ngx_uint_t ngx_http_mongodb_rest_ncursors;
+static ngx_rbtree_key_t ngx_http_mongodb_rest_cursor_id;
+static ngx_event_t ngx_http_mongodb_rest_reaper;
+
+static ngx_http_mongodb_rest_health_t **ngx_http_mongodb_rest_health;
+#if (NGX_THREADS)
+static ngx_event_t ngx_http_mongodb_rest_pinger;
+static ngx_http_mongodb_rest_probe_t *ngx_http_mongodb_rest_probe;
+#endif
+
+static ngx_http_mongodb_rest_admission_t **ngx_http_mongodb_rest_admission;
+static ngx_queue_t ngx_http_mongodb_rest_waiting[2]; /* Reads, then writes */
+static ngx_event_t ngx_http_mongodb_rest_admitter;
+
+#if (NGX_THREADS)
+/* Each thread running driver calls has its own, and its own connections. */
+static __thread ngx_pool_t *ngx_http_mongodb_rest_alloc_pool;
+static __thread mongo *ngx_http_mongodb_rest_thread_conns; /* One per 'mongo' */
+#else
+static ngx_pool_t *ngx_http_mongodb_rest_alloc_pool; /* NULL for the heap */
+#endif
+
+static void ngx_http_mongodb_rest_cursor_reap(ngx_event_t *ev);
+static void ngx_http_mongodb_rest_cursor_remove(ngx_http_mongodb_rest_cursor_t *c);
+static void ngx_http_mongodb_rest_cursor_free(ngx_http_mongodb_rest_cursor_t *c);
+static ngx_int_t ngx_http_mongodb_rest_batch_init(ngx_cycle_t *cycle, ngx_http_mongodb_rest_loc_conf_t *conf);
+static char *ngx_http_mongodb_rest_bloom_zone(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf, ngx_str_t *value);
+static ngx_int_t ngx_http_mongodb_rest_bloom_start(ngx_cycle_t *cycle, ngx_http_mongodb_rest_bloom_t *bloom);
+static char *ngx_http_mongodb_rest_replica_zone(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf, ngx_str_t *value);
+static ngx_int_t ngx_http_mongodb_rest_replica_start(ngx_cycle_t *cycle, ngx_http_mongodb_rest_replica_t *rp);
+static ngx_int_t ngx_http_mongodb_rest_snapshot_start(ngx_cycle_t *cycle, ngx_http_mongodb_rest_loc_conf_t *conf);
+static void ngx_http_mongodb_rest_replica_insert_key(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static void ngx_http_mongodb_rest_replica_insert_id(ngx_rbtree_node_t *temp, ngx_rbtree_node_t *node, ngx_rbtree_node_t *sentinel);
+static ngx_int_t ngx_http_mongodb_rest_ns(ngx_pool_t *pool, ngx_str_t *db, ngx_str_t *collection, ngx_str_t *ns, const char *suffix);
+static ngx_int_t ngx_http_mongodb_rest_remove_one(ngx_log_t *log, mongo *conn, ngx_http_mongodb_rest_loc_conf_t *conf, bson *query);
+static ngx_int_t ngx_http_mongo_reconnect(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn);
+static void ngx_http_mongo_members_poll(ngx_event_t *ev);
+static void ngx_http_mongodb_rest_index_recheck(ngx_event_t *ev);
+#if (NGX_THREADS)
+static ngx_int_t ngx_http_mongodb_rest_probe_init(ngx_cycle_t *cycle, ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf);
+static void ngx_http_mongodb_rest_probe_run(void *data, ngx_log_t *log);
+static void ngx_http_mongodb_rest_probe_done(ngx_event_t *ev);
+static void ngx_http_mongodb_rest_health_ping(ngx_event_t *ev);
+#endif
+static void ngx_http_mongodb_rest_admission_run(ngx_event_t *ev);
+#if (NGX_THREADS)
+static ngx_http_mongodb_rest_task_t *ngx_http_mongodb_rest_task_create(ngx_http_request_t *request, ngx_http_mongodb_rest_loc_conf_t *conf, ngx_uint_t op);
+static ngx_int_t ngx_http_mongodb_rest_task_post(ngx_http_mongodb_rest_task_t *t);
+#endif
+
+ngx_http_mongo_connection_t* ngx_http_get_mongo_connection( ngx_str_t name ) {
     ngx_http_mongo_connection_t *mongo_conns;
     ngx_uint_t i;
 
@@ -202,12 +264,104 @@ static ngx_http_mongo_connection_t* ngx_http_get_mongo_connection( ngx_str_t nam
     return NULL;
 }
 
-static ngx_int_t ngx_http_mongo_authenticate(ngx_log_t *log, ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf) {
+/*
+ * The driver allocates through these once a worker starts.  While a request
+ * is being handled its BSON, cursors and replies come from the request
+ * pool and go with it; anything that may outlive the request (parked
+ * cursors, connections, background tasks) is allocated from the heap.
+ */
+static void *ngx_http_mongodb_rest_malloc(size_t size) {
+    ngx_http_mongodb_rest_alloc_t *a;
+
+    if (ngx_http_mongodb_rest_alloc_pool) {
+        a = ngx_palloc(ngx_http_mongodb_rest_alloc_pool, sizeof(ngx_http_mongodb_rest_alloc_t) + size);
+    } else {
+        a = malloc(sizeof(ngx_http_mongodb_rest_alloc_t) + size);
+    }
+
+    if (a == NULL) {
+        return NULL;
+    }
+
+    a->pool = ngx_http_mongodb_rest_alloc_pool;
+    a->size = size;
+
+    return a + 1;
+}
+
+static void ngx_http_mongodb_rest_free(void *p) {
+    ngx_http_mongodb_rest_alloc_t *a;
+
+    if (p == NULL) {
+        return;
+    }
+
+    a = (ngx_http_mongodb_rest_alloc_t *) p - 1;
+
+    if (a->pool == NULL) {
+        free(a);
+    } else if (sizeof(ngx_http_mongodb_rest_alloc_t) + a->size > a->pool->max) {
+        /* Only large blocks can be given back before the pool goes. */
+        ngx_pfree(a->pool, a);
+    }
+}
+
+static void *ngx_http_mongodb_rest_realloc(void *p, size_t size) {
+    ngx_http_mongodb_rest_alloc_t *a;
+    ngx_pool_t *pool;
+    void *n;
+
+    if (p == NULL) {
+        return ngx_http_mongodb_rest_malloc(size);
+    }
+
+    a = (ngx_http_mongodb_rest_alloc_t *) p - 1;
+
+    if (a->pool == NULL) {
+        a = realloc(a, sizeof(ngx_http_mongodb_rest_alloc_t) + size);
+        if (a == NULL) {
+            return NULL;
+        }
+        a->size = size;
+        return a + 1;
+    }
+
+    if (size <= a->size) {
+        return p;
+    }
+
+    /* Stay with the pool the block came from, whatever is current. */
+    pool = ngx_http_mongodb_rest_alloc_pool;
+    ngx_http_mongodb_rest_alloc_pool = a->pool;
+    n = ngx_http_mongodb_rest_malloc(size);
+    ngx_http_mongodb_rest_alloc_pool = pool;
+
+    if (n == NULL) {
+        return NULL;
+    }
+
+    ngx_memcpy(n, p, a->size);
+    ngx_http_mongodb_rest_free(p);
+
+    return n;
+}
+
+/* Make pool, or the heap if NULL, the source of driver allocations. */
+ngx_pool_t *ngx_http_mongodb_rest_alloc_from(ngx_pool_t *pool) {
+    ngx_pool_t *previous = ngx_http_mongodb_rest_alloc_pool;
+
+    ngx_http_mongodb_rest_alloc_pool = pool;
+
+    return previous;
+}
+
+static ngx_int_t ngx_http_mongo_authenticate(ngx_cycle_t *cycle, ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf) {
     ngx_http_mongo_connection_t* mongo_conn;
     ngx_http_mongo_auth_t *mongo_auth;
+    ngx_log_t *log = cycle->log;
     mongo_cursor *cursor = NULL;
+    ngx_str_t name = ngx_string("test"), test;
     bson empty;
-    char *test;
     int error;
 
     mongo_conn = ngx_http_get_mongo_connection( mongodb_rest_loc_conf->mongo );
@@ -236,13 +390,12 @@ static ngx_int_t ngx_http_mongo_authenticate(ngx_log_t *log, ngx_http_mongodb_re
     }
 
     // Run a test command to test authentication.
-    test = (char*)malloc( mongodb_rest_loc_conf->db.len + sizeof(".test"));
-    ngx_cpystrn((u_char*)test, (u_char*)mongodb_rest_loc_conf->db.data, mongodb_rest_loc_conf->db.len+1);
-    ngx_cpystrn((u_char*)(test+mongodb_rest_loc_conf->db.len),(u_char*)".test", sizeof(".test"));
+    if (ngx_http_mongodb_rest_ns(cycle->pool, &mongodb_rest_loc_conf->db, &name, &test, "") != NGX_OK) {
+        return NGX_ERROR;
+    }
     bson_empty(&empty);
-    cursor = mongo_find(&mongo_conn->conn, test, &empty, NULL, 0, 0, 0);
+    cursor = mongo_find(&mongo_conn->conn, (char*)test.data, &empty, NULL, 0, 0, 0);
     error =  mongo_cmd_get_last_error(&mongo_conn->conn, (char*)mongodb_rest_loc_conf->db.data, NULL);
-    free(test);
     mongo_cursor_destroy(cursor);
     if (error) {
         ngx_log_error(NGX_LOG_ERR, log, 0, "Authentication Required");
@@ -254,6 +407,7 @@ static ngx_int_t ngx_http_mongo_authenticate(ngx_log_t *log, ngx_http_mongodb_re
 
 static ngx_int_t ngx_http_mongo_add_connection(ngx_cycle_t* cycle, ngx_http_mongodb_rest_loc_conf_t* mongodb_rest_loc_conf) {
     ngx_http_mongo_connection_t* mongo_conn;
+    ngx_http_mongo_member_t *member;
     int status;
     ngx_http_mongod_server_t *mongods;
     volatile ngx_uint_t i;
@@ -270,9 +424,13 @@ static ngx_int_t ngx_http_mongo_add_connection(ngx_cycle_t* cycle, ngx_http_mong
     if (mongo_conn == NULL) {
         return NGX_ERROR;
     }
+    ngx_memzero(mongo_conn, sizeof(ngx_http_mongo_connection_t));
 
     mongo_conn->name = mongodb_rest_loc_conf->mongo;
     mongo_conn->auths = ngx_array_create(cycle->pool, 4, sizeof(ngx_http_mongo_auth_t));
+    mongo_conn->connect_timeout = mongodb_rest_loc_conf->connect_timeout;
+    mongo_conn->send_timeout = mongodb_rest_loc_conf->send_timeout;
+    mongo_conn->read_timeout = mongodb_rest_loc_conf->read_timeout;
 
     if ( mongodb_rest_loc_conf->mongods->nelts == 1 ) {
         ngx_cpystrn( host, mongods[0].host.data, mongods[0].host.len + 1 );
@@ -282,10 +440,22 @@ static ngx_int_t ngx_http_mongo_add_connection(ngx_cycle_t* cycle, ngx_http_mong
         /* Initiate replica set connection. */
         mongo_replset_init( &mongo_conn->conn, (const char *)mongodb_rest_loc_conf->replset.data );
 
-        /* Add replica set seeds. */
+        /* Add replica set seeds, each also a member to hedge reads across. */
+        mongo_conn->members = ngx_array_create(cycle->pool, mongodb_rest_loc_conf->mongods->nelts,
+                                               sizeof(ngx_http_mongo_member_t));
+        if (mongo_conn->members == NULL) {
+            return NGX_ERROR;
+        }
+
         for( i=0; i<mongodb_rest_loc_conf->mongods->nelts; ++i ) {
             ngx_cpystrn( host, mongods[i].host.data, mongods[i].host.len + 1 );
             mongo_replset_add_seed( &mongo_conn->conn, (const char *)host, mongods[i].port );
+
+            member = ngx_array_push(mongo_conn->members);
+            ngx_memzero(member, sizeof(ngx_http_mongo_member_t));
+            ngx_cpystrn( member->host, mongods[i].host.data, mongods[i].host.len + 1 );
+            member->port = mongods[i].port;
+            member->addr = mongods[i].addr;
         }
         status = mongo_replset_connect( &mongo_conn->conn );
     } else {
@@ -296,6 +466,7 @@ static ngx_int_t ngx_http_mongo_add_connection(ngx_cycle_t* cycle, ngx_http_mong
 
     switch (status) {
         case MONGO_CONN_SUCCESS:
+            ngx_http_mongo_set_timeouts(cycle->log, mongo_conn, &mongo_conn->conn);
             break;
         case MONGO_CONN_NO_SOCKET:
             ngx_log_error(NGX_LOG_ERR, cycle->log, 0,
@@ -330,6 +501,208 @@ static ngx_int_t ngx_http_mongo_add_connection(ngx_cycle_t* cycle, ngx_http_mong
     return NGX_OK;
 }
 
+/*
+ * Whether the index spec leads with every field of the key, in any order,
+ * and holds every document; if so, keep its name to hint at.
+ */
+static ngx_int_t ngx_http_mongodb_rest_index_match(ngx_http_mongodb_rest_loc_conf_t *conf, const bson *spec) {
+    ngx_http_mongodb_rest_key_t *keys = conf->keys->elts;
+    bson_iterator it, sub;
+    ngx_uint_t i, n;
+
+    if (bson_find(&it, spec, "key") != BSON_OBJECT) {
+        return NGX_DECLINED;
+    }
+    bson_iterator_subiterator(&it, &sub);
+
+    /* Hinting at an index that leaves documents out would hide them. */
+    if (bson_find(&it, spec, "partialFilterExpression") != BSON_EOO
+        || (bson_find(&it, spec, "sparse") == BSON_BOOL && bson_iterator_bool(&it))) {
+        return NGX_DECLINED;
+    }
+
+    for (n = 0; n < conf->keys->nelts && bson_iterator_next(&sub) != BSON_EOO; n++) {
+        for (i = 0; i < conf->keys->nelts; i++) {
+            if (ngx_strcmp(bson_iterator_key(&sub), keys[i].field.data) == 0) {
+                break;
+            }
+        }
+        if (i == conf->keys->nelts) {
+            return NGX_DECLINED;
+        }
+    }
+
+    if (n < conf->keys->nelts) {
+        return NGX_DECLINED;
+    }
+
+    /* Listings break ties in a key that is not unique by _id. */
+    conf->hint_id = bson_iterator_next(&sub) != BSON_EOO
+                    && ngx_strcmp(bson_iterator_key(&sub), "_id") == 0;
+    conf->hint_unique = bson_find(&it, spec, "unique") == BSON_BOOL
+                        && bson_iterator_bool(&it);
+
+    if (bson_find(&it, spec, "name") != BSON_STRING
+        || bson_iterator_string_len(&it) > sizeof(conf->hint_name)) {
+        return NGX_DECLINED;
+    }
+
+    ngx_memcpy(conf->hint_name, bson_iterator_string(&it), bson_iterator_string_len(&it));
+    conf->hint = conf->hint_name;
+
+    return NGX_OK;
+}
+
+/*
+ * Look for an index that supports the key, to hint at in every query.  Older
+ * servers list indexes in "db.system.indexes", newer ones only through the
+ * listIndexes command.
+ */
+static ngx_int_t ngx_http_mongodb_rest_index_find(ngx_http_mongodb_rest_loc_conf_t *conf, mongo *conn) {
+    mongo_cursor *cursor;
+    bson query, out, sub;
+    bson_iterator it, elems;
+    ngx_int_t rc = NGX_DECLINED;
+
+    bson_init(&query);
+    bson_append_string(&query, "ns", (char *) conf->ns.data);
+    bson_finish(&query);
+
+    cursor = mongo_find(conn, (char *) conf->index_ns.data, &query, NULL, 0, 0, 0);
+    while (cursor && rc == NGX_DECLINED && mongo_cursor_next(cursor) == MONGO_OK) {
+        rc = ngx_http_mongodb_rest_index_match(conf, mongo_cursor_bson(cursor));
+    }
+    if (cursor) {
+        mongo_cursor_destroy(cursor);
+    }
+    bson_destroy(&query);
+
+    if (rc == NGX_DECLINED) {
+        bson_init(&query);
+        bson_append_string(&query, "listIndexes", (char *) conf->collection.data);
+        bson_finish(&query);
+
+        if (mongo_run_command(conn, (char *) conf->db.data, &query, &out) == MONGO_OK) {
+            if (bson_find(&it, &out, "cursor") == BSON_OBJECT) {
+                bson_iterator_subobject(&it, &sub);
+                if (bson_find(&it, &sub, "firstBatch") == BSON_ARRAY) {
+                    bson_iterator_subiterator(&it, &elems);
+                    while (rc == NGX_DECLINED && bson_iterator_next(&elems) == BSON_OBJECT) {
+                        bson_iterator_subobject(&elems, &sub);
+                        rc = ngx_http_mongodb_rest_index_match(conf, &sub);
+                    }
+                }
+            }
+            bson_destroy(&out);
+        }
+        bson_destroy(&query);
+    }
+
+    /* Neither is an error worth carrying into the next request. */
+    mongo_clear_errors(conn);
+
+    return rc;
+}
+
+static ngx_int_t ngx_http_mongodb_rest_index_verify(ngx_cycle_t *cycle, ngx_http_mongodb_rest_loc_conf_t *conf) {
+    ngx_http_mongo_connection_t *mongo_conn;
+    ngx_str_t indexes = ngx_string("system.indexes");
+
+    if (conf->index_check == NGX_HTTP_MONGODB_REST_INDEX_OFF
+        || (conf->keys->nelts == 1 && ngx_strcmp(conf->field.data, "_id") == 0)) {
+        return NGX_OK;
+    }
+
+    mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+    if (mongo_conn == NULL
+        || ngx_http_mongodb_rest_ns(cycle->pool, &conf->db, &indexes, &conf->index_ns, "") != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    conf->index_timer.handler = ngx_http_mongodb_rest_index_recheck;
+    conf->index_timer.data = conf;
+    conf->index_timer.log = cycle->log;
+    conf->index_timer.cancelable = 1;
+
+    if (ngx_http_mongodb_rest_index_find(conf, &mongo_conn->conn) == NGX_OK) {
+        return NGX_OK;
+    }
+
+    if (conf->index_check == NGX_HTTP_MONGODB_REST_INDEX_FAIL) {
+        ngx_log_error(NGX_LOG_EMERG, cycle->log, 0,
+                      "No index on \"%V\" supports Field: %V", &conf->ns, &conf->field);
+        return NGX_ERROR;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, cycle->log, 0,
+                  "No index on \"%V\" supports Field: %V, queries will scan the collection", &conf->ns, &conf->field);
+
+    return NGX_OK;
+}
+
+/*
+ * Once the hinted index is gone, look for another between requests, over the
+ * worker's connection as reconnected if it had dropped, until one is found.
+ */
+static void ngx_http_mongodb_rest_index_recheck(ngx_event_t *ev) {
+    ngx_http_mongodb_rest_loc_conf_t *conf = ev->data;
+    ngx_http_mongo_connection_t *mongo_conn;
+    ngx_pool_t *pool;
+
+    if (ngx_exiting || conf->hint) {
+        return;
+    }
+
+    mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+    pool = ngx_http_mongodb_rest_alloc_from(NULL);
+
+    if (ngx_http_mongo_ensure(ev->log, mongo_conn) == NGX_OK
+        && ngx_http_mongodb_rest_index_find(conf, &mongo_conn->conn) == NGX_OK) {
+        ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                      "Index \"%s\" on \"%V\" supports Field: %V", conf->hint, &conf->ns, &conf->field);
+    } else {
+        ngx_add_timer(ev, MONGO_INDEX_RETRY);
+    }
+
+    ngx_http_mongodb_rest_alloc_from(pool);
+}
+
+/*
+ * Whether mongod refused a query for its hint: older servers say so with a
+ * code of their own, newer ones with the planner's error wrapped in a
+ * generic one.
+ */
+unsigned char ngx_http_mongodb_rest_hint_error(int code, const char *err) {
+    if (code == MONGO_BAD_HINT) {
+        return 1;
+    }
+
+    return (code == MONGO_QUERY_ERROR || code == MONGO_BAD_VALUE)
+           && err != NULL && ngx_strstr(err, "hint") != NULL;
+}
+
+/*
+ * If so, stop hinting at it, so that the caller can retry the query once
+ * without, and look for another index once the request is done.
+ */
+unsigned char ngx_http_mongodb_rest_hint_lost(ngx_log_t *log, ngx_http_mongodb_rest_loc_conf_t *conf, int code, const char *err) {
+    if (conf->hint == NULL || !ngx_http_mongodb_rest_hint_error(code, err)) {
+        return 0;
+    }
+
+    ngx_log_error(NGX_LOG_WARN, log, 0,
+                  "Index \"%s\" on \"%V\" is gone: %s", conf->hint, &conf->ns, err);
+
+    conf->hint = NULL;
+    conf->hint_unique = 0;
+    conf->hint_id = 0;
+    if (!conf->index_timer.timer_set) {
+        ngx_add_timer(&conf->index_timer, MONGO_INDEX_RECHECK);
+    }
+
+    return 1;
+}
+
 static ngx_int_t ngx_http_mongodb_rest_init_worker(ngx_cycle_t* cycle) {
     ngx_http_mongodb_rest_main_conf_t* mongodb_rest_main_conf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_mongodb_rest_module);
     ngx_http_mongodb_rest_loc_conf_t** mongodb_rest_loc_confs;
@@ -337,22 +710,108 @@ static ngx_int_t ngx_http_mongodb_rest_init_worker(ngx_cycle_t* cycle) {
 
     signal(SIGPIPE, SIG_IGN);
 
+    /* Before anything the driver allocates could be freed through them. */
+    bson_malloc_func = ngx_http_mongodb_rest_malloc;
+    bson_realloc_func = ngx_http_mongodb_rest_realloc;
+    bson_free_func = ngx_http_mongodb_rest_free;
+
     mongodb_rest_loc_confs = mongodb_rest_main_conf->loc_confs.elts;
 
     ngx_array_init(&ngx_http_mongo_connections, cycle->pool, 4, sizeof(ngx_http_mongo_connection_t));
 
+    ngx_rbtree_init(&ngx_http_mongodb_rest_cursors, &ngx_http_mongodb_rest_cursors_sentinel,
+                    ngx_rbtree_insert_value);
+    ngx_queue_init(&ngx_http_mongodb_rest_cursors_queue);
+
+    if (mongodb_rest_main_conf->loc_confs.nelts) {
+        ngx_http_mongodb_rest_reaper.handler = ngx_http_mongodb_rest_cursor_reap;
+        ngx_http_mongodb_rest_reaper.log = cycle->log;
+        ngx_http_mongodb_rest_reaper.cancelable = 1;
+        ngx_add_timer(&ngx_http_mongodb_rest_reaper, MONGO_CURSOR_REAP_INTERVAL);
+    }
+
     for (i = 0; i < mongodb_rest_main_conf->loc_confs.nelts; i++) {
         if (ngx_http_mongo_add_connection(cycle, mongodb_rest_loc_confs[i]) == NGX_ERROR) {
             return NGX_ERROR;
         }
-        if (ngx_http_mongo_authenticate(cycle->log, mongodb_rest_loc_confs[i]) == NGX_ERROR) {
+        if (ngx_http_mongo_authenticate(cycle, mongodb_rest_loc_confs[i]) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (ngx_http_mongodb_rest_index_verify(cycle, mongodb_rest_loc_confs[i]) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (mongodb_rest_loc_confs[i]->coalesce > 1
+            && ngx_http_mongodb_rest_batch_init(cycle, mongodb_rest_loc_confs[i]) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (mongodb_rest_loc_confs[i]->write_behind
+            && mongodb_rest_loc_confs[i]->write_behind->conf == mongodb_rest_loc_confs[i]
+            && ngx_http_mongodb_rest_write_behind_init(cycle, mongodb_rest_loc_confs[i]->write_behind) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        /* A single worker fills each filter; they all read it. */
+        if (mongodb_rest_loc_confs[i]->bloom
+            && mongodb_rest_loc_confs[i]->bloom->conf == mongodb_rest_loc_confs[i]
+            && ngx_worker == 0
+            && ngx_http_mongodb_rest_bloom_start(cycle, mongodb_rest_loc_confs[i]->bloom) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (mongodb_rest_loc_confs[i]->replica
+            && mongodb_rest_loc_confs[i]->replica->conf == mongodb_rest_loc_confs[i]
+            && ngx_worker == 0
+            && ngx_http_mongodb_rest_replica_start(cycle, mongodb_rest_loc_confs[i]->replica) == NGX_ERROR) {
+            return NGX_ERROR;
+        }
+        if (mongodb_rest_loc_confs[i]->snapshot.len
+            && ngx_worker == 0
+            && ngx_http_mongodb_rest_snapshot_start(cycle, mongodb_rest_loc_confs[i]) == NGX_ERROR) {
             return NGX_ERROR;
         }
     }
 
+#if (NGX_THREADS)
+    /* A single worker has mongod pinged, on a thread, on behalf of all of them. */
+    if (mongodb_rest_main_conf->health_check && ngx_worker == 0) {
+        if (ngx_http_mongodb_rest_probe_init(cycle, mongodb_rest_main_conf) != NGX_OK) {
+            return NGX_ERROR;
+        }
+        ngx_http_mongodb_rest_pinger.handler = ngx_http_mongodb_rest_health_ping;
+        ngx_http_mongodb_rest_pinger.log = cycle->log;
+        ngx_http_mongodb_rest_pinger.data = mongodb_rest_main_conf;
+        ngx_http_mongodb_rest_pinger.cancelable = 1;
+        ngx_add_timer(&ngx_http_mongodb_rest_pinger, mongodb_rest_main_conf->health_interval);
+    }
+#endif
+
+    /* Armed while requests wait. */
+    if (mongodb_rest_main_conf->admission) {
+        ngx_queue_init(&ngx_http_mongodb_rest_waiting[0]);
+        ngx_queue_init(&ngx_http_mongodb_rest_waiting[1]);
+        ngx_http_mongodb_rest_admitter.handler = ngx_http_mongodb_rest_admission_run;
+        ngx_http_mongodb_rest_admitter.log = cycle->log;
+        ngx_http_mongodb_rest_admitter.cancelable = 1;
+    }
+
     return NGX_OK;
 }
 
+static void ngx_http_mongodb_rest_exit_worker(ngx_cycle_t* cycle) {
+    ngx_queue_t *q;
+    ngx_http_mongodb_rest_cursor_t *c;
+
+    if (ngx_http_mongodb_rest_cursors_queue.next == NULL) {
+        return;
+    }
+
+    /* Let mongod release the open list cursors now. */
+    while (!ngx_queue_empty(&ngx_http_mongodb_rest_cursors_queue)) {
+        q = ngx_queue_head(&ngx_http_mongodb_rest_cursors_queue);
+        c = ngx_queue_data(q, ngx_http_mongodb_rest_cursor_t, queue);
+        ngx_http_mongodb_rest_cursor_remove(c);
+        ngx_http_mongodb_rest_cursor_free(c);
+    }
+}
+
 /* Parse the 'mongo' directive. */
 static char * ngx_http_mongo(ngx_conf_t *cf, ngx_command_t *cmd, void *void_conf) {
     ngx_str_t *value;
@@ -364,6 +823,10 @@ static char * ngx_http_mongo(ngx_conf_t *cf, ngx_command_t *cmd, void *void_conf
 
     mongodb_rest_loc_conf = void_conf;
 
+    if (mongodb_rest_loc_conf->shards != NGX_CONF_UNSET_PTR) {
+        return "cannot be used with mongodb-rest-shards";
+    }
+
     value = cf->args->elts;
     mongodb_rest_loc_conf->mongo = value[1];
     mongodb_rest_loc_conf->mongods = ngx_array_create(cf->pool, 7,
@@ -403,538 +866,6779 @@ static char * ngx_http_mongo(ngx_conf_t *cf, ngx_command_t *cmd, void *void_conf
         mongod_server = ngx_array_push(mongodb_rest_loc_conf->mongods);
         mongod_server->host = u.host;
         mongod_server->port = u.port;
+        if (u.naddrs) {
+            mongod_server->addr = u.addrs[0];
+        } else {
+            ngx_memzero(&mongod_server->addr, sizeof(ngx_addr_t));
+        }
 
     }
 
     return NGX_CONF_OK;
 }
 
-/* Parse the 'mongodb-rest' directive. */
-static char* ngx_http_mongodb_rest(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
-    ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf = void_conf;
-    ngx_http_core_loc_conf_t* core_conf;
-    ngx_str_t *value, type;
-    volatile ngx_uint_t i;
+/* Split "parameter=name:size", skipping "parameter=". */
+ngx_int_t ngx_http_mongodb_rest_zone_param(ngx_str_t *value, size_t skip, ngx_str_t *name, ssize_t *size) {
+    ngx_str_t s;
+    u_char *p;
 
-    core_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
-    core_conf-> handler = ngx_http_mongodb_rest_handler;
+    name->data = value->data + skip;
+    p = (u_char *) ngx_strchr(name->data, ':');
+    if (p == NULL) {
+        return NGX_ERROR;
+    }
+    name->len = p - name->data;
 
-    value = cf->args->elts;
-    mongodb_rest_loc_conf->db = value[1];
+    s.data = p + 1;
+    s.len = value->data + value->len - s.data;
+    *size = ngx_parse_size(&s);
 
-    /* Parse the parameters */
-    for (i = 2; i < cf->args->nelts; i++) {
-        if (ngx_strncmp(value[i].data, "root_collection=", 16) == 0) { 
-            mongodb_rest_loc_conf->root_collection.data = (u_char *) &value[i].data[16];
-            mongodb_rest_loc_conf->root_collection.len = ngx_strlen(&value[i].data[16]);
-            continue;
-        }
+    if (name->len == 0 || *size == NGX_ERROR || *size < (ssize_t) (8 * ngx_pagesize)) {
+        return NGX_ERROR;
+    }
 
-        if (ngx_strncmp(value[i].data, "field=", 6) == 0) {
-            mongodb_rest_loc_conf->field.data = (u_char *) &value[i].data[6];
-            mongodb_rest_loc_conf->field.len = ngx_strlen(&value[i].data[6]);
+    return NGX_OK;
+}
 
-            /* Currently only support for "_id" and "filename" */
-            if (mongodb_rest_loc_conf->field.data != NULL
-                && ngx_strcmp(mongodb_rest_loc_conf->field.data, "filename") != 0
-                && ngx_strcmp(mongodb_rest_loc_conf->field.data, "_id") != 0) {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "Unsupported Field: %s", mongodb_rest_loc_conf->field.data);
-                return NGX_CONF_ERROR;
-            }
+static ngx_int_t ngx_http_mongodb_rest_bloom_init(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_mongodb_rest_bloom_t *obloom = data;
+    ngx_http_mongodb_rest_bloom_t *bloom;
+    ngx_slab_pool_t *shpool;
+    uint32_t signature;
+    size_t size;
 
-            continue;
-        }
+    bloom = shm_zone->data;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-        if (ngx_strncmp(value[i].data, "type=", 5) == 0) { 
-            type = (ngx_str_t) ngx_string(&value[i].data[5]);
-
-            /* Currently only support for "objectid", "string", and "int" */
-            if (type.len == 0) {
-                mongodb_rest_loc_conf->type = NGX_CONF_UNSET_UINT;
-            } else if (ngx_strcasecmp(type.data, (u_char *)"objectid") == 0) {
-                mongodb_rest_loc_conf->type = BSON_OID;
-            } else if (ngx_strcasecmp(type.data, (u_char *)"string") == 0) {
-                mongodb_rest_loc_conf->type = BSON_STRING;
-            } else if (ngx_strcasecmp(type.data, (u_char *)"int") == 0) {
-                mongodb_rest_loc_conf->type = BSON_INT;
-            } else {
-                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                                   "Unsupported Type: %s", (char *)value[i].data);
-                return NGX_CONF_ERROR;
-            }
+    ngx_crc32_init(signature);
+    ngx_crc32_update(&signature, bloom->conf->ns.data, bloom->conf->ns.len);
+    ngx_crc32_update(&signature, bloom->conf->field.data, bloom->conf->field.len);
+    ngx_crc32_final(signature);
 
-            continue;
-        }
+    if (obloom || shm_zone->shm.exists) {
+        bloom->sh = shpool->data;
 
-        if (ngx_strncmp(value[i].data, "user=", 5) == 0) { 
-            mongodb_rest_loc_conf->user.data = (u_char *) &value[i].data[5];
-            mongodb_rest_loc_conf->user.len = ngx_strlen(&value[i].data[5]);
-            continue;
+        /* Reload: keep the filter, unless it holds other keys now. */
+        if (bloom->sh->signature != signature) {
+            bloom->sh->active = NGX_HTTP_MONGODB_REST_BLOOM_NONE;
+            bloom->sh->signature = signature;
         }
+        return NGX_OK;
+    }
 
-        if (ngx_strncmp(value[i].data, "pass=", 5) == 0) {
-            mongodb_rest_loc_conf->pass.data = (u_char *) &value[i].data[5];
-            mongodb_rest_loc_conf->pass.len = ngx_strlen(&value[i].data[5]);
-            continue;
+    bloom->sh = ngx_slab_alloc(shpool, sizeof(ngx_http_mongodb_rest_bloom_shm_t));
+    if (bloom->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    /* Two filters, so that one can be rebuilt while the other is used. */
+    size = (shm_zone->shm.size / 4) & ~(sizeof(ngx_atomic_t) - 1);
+
+    bloom->sh->bits[0] = ngx_slab_alloc(shpool, size);
+    bloom->sh->bits[1] = ngx_slab_alloc(shpool, size);
+    if (bloom->sh->bits[0] == NULL || bloom->sh->bits[1] == NULL) {
+        return NGX_ERROR;
+    }
+
+    bloom->sh->active = NGX_HTTP_MONGODB_REST_BLOOM_NONE;
+    bloom->sh->building = NGX_HTTP_MONGODB_REST_BLOOM_NONE;
+    bloom->sh->signature = signature;
+    bloom->sh->nbits = size * 8;
+    shpool->data = bloom->sh;
+
+    return NGX_OK;
+}
+
+static ngx_int_t ngx_http_mongodb_rest_replica_init(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_mongodb_rest_replica_t *orp = data;
+    ngx_http_mongodb_rest_replica_t *rp;
+    uint32_t signature;
+
+    rp = shm_zone->data;
+    rp->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    ngx_crc32_init(signature);
+    ngx_crc32_update(&signature, rp->conf->ns.data, rp->conf->ns.len);
+    ngx_crc32_update(&signature, rp->conf->field.data, rp->conf->field.len);
+    ngx_crc32_final(signature);
+
+    if (orp || shm_zone->shm.exists) {
+        rp->sh = rp->shpool->data;
+
+        /* Reload: keep the copy, unless it is of something else now. */
+        if (rp->sh->signature != signature) {
+            rp->sh->ready = 0;
+            rp->sh->signature = signature;
         }
+        return NGX_OK;
+    }
+
+    rp->sh = ngx_slab_alloc(rp->shpool, sizeof(ngx_http_mongodb_rest_replica_shm_t));
+    if (rp->sh == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(rp->sh, sizeof(ngx_http_mongodb_rest_replica_shm_t));
+    ngx_rbtree_init(&rp->sh->keys, &rp->sh->keys_sentinel, ngx_http_mongodb_rest_replica_insert_key);
+    ngx_rbtree_init(&rp->sh->ids, &rp->sh->ids_sentinel, ngx_http_mongodb_rest_replica_insert_id);
+    rp->sh->signature = signature;
+    rp->shpool->data = rp->sh;
+
+    return NGX_OK;
+}
+
+/* Parse "replica=name:size". */
+static char *ngx_http_mongodb_rest_replica_zone(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf, ngx_str_t *value) {
+    ngx_http_mongodb_rest_replica_t *rp;
+    ngx_str_t name;
+    ssize_t size;
 
+    if (ngx_http_mongodb_rest_zone_param(value, 8, &name, &size) != NGX_OK) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "invalid parameter \"%V\"", &value[i]);
+                           "Invalid Replica Zone: %V", value);
         return NGX_CONF_ERROR;
     }
 
-    if (mongodb_rest_loc_conf->field.data != NULL
-        && ngx_strcmp(mongodb_rest_loc_conf->field.data, "filename") == 0
-        && mongodb_rest_loc_conf->type != BSON_STRING) {
+    rp = ngx_pcalloc(cf->pool, sizeof(ngx_http_mongodb_rest_replica_t));
+    if (rp == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    rp->zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_mongodb_rest_module);
+    if (rp->zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (rp->zone->data) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "Field: filename, must be of Type: string");
+                           "Replica Zone \"%V\" is already used", &name);
         return NGX_CONF_ERROR;
     }
 
-    if ((mongodb_rest_loc_conf->user.data == NULL || mongodb_rest_loc_conf->user.len == 0)
-        && !(mongodb_rest_loc_conf->pass.data == NULL || mongodb_rest_loc_conf->pass.len == 0)) {
+    rp->zone->init = ngx_http_mongodb_rest_replica_init;
+    rp->zone->data = rp;
+    conf->replica = rp;
+
+    return NGX_CONF_OK;
+}
+
+/* Parse "bloom=name:size". */
+static char *ngx_http_mongodb_rest_bloom_zone(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf, ngx_str_t *value) {
+    ngx_http_mongodb_rest_bloom_t *bloom;
+    ngx_str_t name;
+    ssize_t size;
+
+    if (ngx_http_mongodb_rest_zone_param(value, 6, &name, &size) != NGX_OK) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "Password without username");
+                           "Invalid Bloom Filter Zone: %V", value);
         return NGX_CONF_ERROR;
     }
 
-    if (!(mongodb_rest_loc_conf->user.data == NULL || mongodb_rest_loc_conf->user.len == 0)
-        && (mongodb_rest_loc_conf->pass.data == NULL || mongodb_rest_loc_conf->pass.len == 0)) {
+    bloom = ngx_pcalloc(cf->pool, sizeof(ngx_http_mongodb_rest_bloom_t));
+    if (bloom == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    bloom->zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_mongodb_rest_module);
+    if (bloom->zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (bloom->zone->data) {
         ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
-                           "Username without password");
+                           "Bloom Filter Zone \"%V\" is already used", &name);
         return NGX_CONF_ERROR;
     }
 
+    bloom->zone->init = ngx_http_mongodb_rest_bloom_init;
+    bloom->zone->data = bloom;
+    conf->bloom = bloom;
+
     return NGX_CONF_OK;
 }
 
-static void *ngx_http_mongodb_rest_create_main_conf(ngx_conf_t *cf) {
-    ngx_http_mongodb_rest_main_conf_t  *mongodb_rest_main_conf;
+/*
+ * As the admission counters below, circuits are found by the name of their
+ * 'mongo' and never freed: old workers go on reporting into those they
+ * found after a reload, and the new workers share them.
+ */
+static ngx_int_t ngx_http_mongodb_rest_health_init(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf = shm_zone->data;
+    ngx_http_mongodb_rest_loc_conf_t **upstreams;
+    ngx_http_mongodb_rest_health_t **head, *h;
+    ngx_slab_pool_t *shpool;
+    ngx_str_t *name;
+    ngx_uint_t i;
+    size_t size;
 
-    mongodb_rest_main_conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_mongodb_rest_main_conf_t));
-    if (mongodb_rest_main_conf == NULL) {
-        return NULL;
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    head = shpool->data;
+    if (head == NULL) {
+        head = ngx_slab_alloc(shpool, sizeof(ngx_http_mongodb_rest_health_t *));
+        if (head == NULL) {
+            return NGX_ERROR;
+        }
+        *head = NULL;
+        shpool->data = head;
     }
 
-    if (ngx_array_init(&mongodb_rest_main_conf->loc_confs, cf->pool, 4,
-                       sizeof(ngx_http_mongodb_rest_loc_conf_t *))
-        != NGX_OK) {
-        return NULL;
+    upstreams = mongodb_rest_main_conf->upstreams.elts;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (i = 0; i < mongodb_rest_main_conf->upstreams.nelts; i++) {
+        name = &upstreams[i]->mongo;
+
+        for (h = *head; h; h = h->next) {
+            if (h->len == name->len && ngx_memcmp(h->name, name->data, h->len) == 0) {
+                break;
+            }
+        }
+
+        if (h == NULL) {
+            size = offsetof(ngx_http_mongodb_rest_health_t, name) + name->len;
+
+            h = ngx_slab_alloc_locked(shpool, size);
+            if (h == NULL) {
+                ngx_shmtx_unlock(&shpool->mutex);
+                ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                              "Health zone is full, at: \"%V\"", name);
+                return NGX_ERROR;
+            }
+
+            ngx_memzero(h, size);
+            h->len = name->len;
+            ngx_memcpy(h->name, name->data, h->len);
+            h->next = *head;
+            *head = h;
+        }
+
+        mongodb_rest_main_conf->health_circuits[i] = h;
     }
 
-    return mongodb_rest_main_conf;
+    ngx_shmtx_unlock(&shpool->mutex);
+
+    ngx_http_mongodb_rest_health = mongodb_rest_main_conf->health_circuits;
+
+    return NGX_OK;
 }
 
-static void* ngx_http_mongodb_rest_create_loc_conf(ngx_conf_t* directive) {
-    ngx_http_mongodb_rest_loc_conf_t* mongodb_rest_conf;
+/*
+ * Counters are found by the name of their 'mongo' or location, never by
+ * position: across a reload the old workers go on releasing what they hold
+ * into the counters they found, which the new workers share wherever the
+ * names match.  None is ever freed, since an old worker may still hold it;
+ * those of locations since removed stay idle.
+ */
+static ngx_int_t ngx_http_mongodb_rest_admission_init(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf = shm_zone->data;
+    ngx_http_mongodb_rest_admission_t **head, *a;
+    ngx_slab_pool_t *shpool;
+    ngx_str_t *names;
+    ngx_uint_t i, n;
+    size_t size;
+
+    shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    head = shpool->data;
+    if (head == NULL) {
+        head = ngx_slab_alloc(shpool, sizeof(ngx_http_mongodb_rest_admission_t *));
+        if (head == NULL) {
+            return NGX_ERROR;
+        }
+        *head = NULL;
+        shpool->data = head;
+    }
 
-    mongodb_rest_conf = ngx_pcalloc(directive->pool, sizeof(ngx_http_mongodb_rest_loc_conf_t));
-    if (mongodb_rest_conf == NULL) {
-        ngx_conf_log_error(NGX_LOG_EMERG, directive, 0,
-                           "Failed to allocate memory for GridFS Location Config.");
-        return NGX_CONF_ERROR;
+    n = mongodb_rest_main_conf->upstreams.nelts + mongodb_rest_main_conf->loc_confs.nelts;
+    names = mongodb_rest_main_conf->admission_names;
+
+    ngx_shmtx_lock(&shpool->mutex);
+
+    for (i = 0; i < n; i++) {
+        for (a = *head; a; a = a->next) {
+            if (a->len == names[i].len && ngx_memcmp(a->name, names[i].data, a->len) == 0) {
+                break;
+            }
+        }
+
+        if (a == NULL) {
+            size = offsetof(ngx_http_mongodb_rest_admission_t, name) + names[i].len;
+
+            a = ngx_slab_alloc_locked(shpool, size);
+            if (a == NULL) {
+                ngx_shmtx_unlock(&shpool->mutex);
+                ngx_log_error(NGX_LOG_EMERG, shm_zone->shm.log, 0,
+                              "Admission zone is full, at: \"%V\"", &names[i]);
+                return NGX_ERROR;
+            }
+
+            ngx_memzero(a, size);
+            a->len = names[i].len;
+            ngx_memcpy(a->name, names[i].data, a->len);
+            a->next = *head;
+            *head = a;
+        }
+
+        mongodb_rest_main_conf->admission_counters[i] = a;
     }
 
-    mongodb_rest_conf->db.data = NULL;
-    mongodb_rest_conf->db.len = 0;
-    mongodb_rest_conf->root_collection.data = NULL;
-    mongodb_rest_conf->root_collection.len = 0;
-    mongodb_rest_conf->field.data = NULL;
-    mongodb_rest_conf->field.len = 0;
-    mongodb_rest_conf->type = NGX_CONF_UNSET_UINT;
-    mongodb_rest_conf->user.data = NULL;
-    mongodb_rest_conf->user.len = 0;
-    mongodb_rest_conf->pass.data = NULL;
-    mongodb_rest_conf->pass.len = 0;
-    mongodb_rest_conf->mongo.data = NULL;
-    mongodb_rest_conf->mongo.len = 0;
-    mongodb_rest_conf->mongods = NGX_CONF_UNSET_PTR;
+    ngx_shmtx_unlock(&shpool->mutex);
 
-    return mongodb_rest_conf;
+    ngx_http_mongodb_rest_admission = mongodb_rest_main_conf->admission_counters;
+
+    return NGX_OK;
 }
 
-static char* ngx_http_mongodb_rest_merge_loc_conf(ngx_conf_t* cf, void* void_parent, void* void_child) {
-    ngx_http_mongodb_rest_loc_conf_t *parent = void_parent;
-    ngx_http_mongodb_rest_loc_conf_t *child = void_child;
-    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mongodb_rest_module);
-    ngx_http_mongodb_rest_loc_conf_t **mongodb_rest_loc_conf;
-    ngx_http_mongod_server_t *mongod_server;
+/* Parse the 'mongodb-rest-health-check' directive. */
+static char* ngx_http_mongodb_rest_health_check(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf = void_conf;
+    ngx_str_t *value, s;
+    ngx_int_t n;
+    ngx_uint_t i;
 
-    ngx_conf_merge_str_value(child->db, parent->db, NULL);
-    ngx_conf_merge_str_value(child->root_collection, parent->root_collection, "fs");
-    ngx_conf_merge_str_value(child->field, parent->field, "_id");
-    ngx_conf_merge_uint_value(child->type, parent->type, BSON_OID);
-    ngx_conf_merge_str_value(child->user, parent->user, NULL);
-    ngx_conf_merge_str_value(child->pass, parent->pass, NULL);
-    ngx_conf_merge_str_value(child->mongo, parent->mongo, "127.0.0.1:27017");
+    if (mongodb_rest_main_conf->health_check) {
+        return "is duplicate";
+    }
+    mongodb_rest_main_conf->health_check = 1;
 
-    if (child->mongods == NGX_CONF_UNSET_PTR) {
-        if (parent->mongods != NGX_CONF_UNSET_PTR) {
-            child->mongods = parent->mongods;
-        } else {
-            child->mongods = ngx_array_create(cf->pool, 4,
-                                              sizeof(ngx_http_mongod_server_t));
-            mongod_server = ngx_array_push(child->mongods);
-            mongod_server->host.data = (u_char *)"127.0.0.1";
-            mongod_server->host.len = sizeof("127.0.0.1") - 1;
-            mongod_server->port = 27017;
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.data = &value[i].data[9];
+            s.len = value[i].len - 9;
+            mongodb_rest_main_conf->health_interval = ngx_parse_time(&s, 0);
+
+            if (mongodb_rest_main_conf->health_interval == (ngx_msec_t) NGX_ERROR
+                || mongodb_rest_main_conf->health_interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Health Check Interval: %V", &s);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "fails=", 6) == 0) {
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Health Check Fails: %s", &value[i].data[6]);
+                return NGX_CONF_ERROR;
+            }
+            mongodb_rest_main_conf->health_fails = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "retry=", 6) == 0) {
+            s.data = &value[i].data[6];
+            s.len = value[i].len - 6;
+            mongodb_rest_main_conf->health_retry = ngx_parse_time(&s, 1);
+
+            if (mongodb_rest_main_conf->health_retry == (time_t) NGX_ERROR
+                || mongodb_rest_main_conf->health_retry == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Health Check Retry: %V", &s);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+#if (NGX_THREADS)
+        if (ngx_strncmp(value[i].data, "thread_pool=", 12) == 0) {
+            s.data = &value[i].data[12];
+            s.len = value[i].len - 12;
+            mongodb_rest_main_conf->health_pool = ngx_thread_pool_add(cf, &s);
+            if (mongodb_rest_main_conf->health_pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
         }
+#endif
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
     }
 
-    // Add the local mongodb_rest conf to the main mongodb_rest conf
-    if (child->db.data) {
-        mongodb_rest_loc_conf = ngx_array_push(&mongodb_rest_main_conf->loc_confs);
-        *mongodb_rest_loc_conf = child;
+#if (NGX_THREADS)
+    /* nginx sets up the "default" pool when it is used. */
+    if (mongodb_rest_main_conf->health_pool == NULL) {
+        mongodb_rest_main_conf->health_pool = ngx_thread_pool_add(cf, NULL);
+        if (mongodb_rest_main_conf->health_pool == NULL) {
+            return NGX_CONF_ERROR;
+        }
     }
 
     return NGX_CONF_OK;
+#else
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "Health Check needs nginx built --with-threads, to ping off the event loop");
+    return NGX_CONF_ERROR;
+#endif
 }
 
-static ngx_int_t ngx_http_mongo_reconnect(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn) {
-    volatile int status = MONGO_CONN_FAIL;
+static char* ngx_http_mongodb_rest_admission_conf(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf = void_conf;
+    ngx_str_t *value, s;
+    ngx_int_t n;
+    ngx_uint_t i;
 
-    if (&mongo_conn->conn.connected) { 
-        mongo_disconnect(&mongo_conn->conn);
-        ngx_msleep(MONGO_RECONNECT_WAITTIME);
-        status = mongo_reconnect(&mongo_conn->conn);
-    } else {
-        status = MONGO_CONN_FAIL;
+    if (mongodb_rest_main_conf->admission_conf) {
+        return "is duplicate";
     }
+    mongodb_rest_main_conf->admission_conf = 1;
+    mongodb_rest_main_conf->admission = 1;
 
-    switch (status) {
-        case MONGO_CONN_SUCCESS:
-            break;
-        case MONGO_CONN_NO_SOCKET:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: No Socket");
-            return NGX_ERROR;
-        case MONGO_CONN_FAIL:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: Connection Failure %s:%i;",
-                          mongo_conn->conn.primary->host,
-                          mongo_conn->conn.primary->port);
-            return NGX_ERROR;
-        case MONGO_CONN_ADDR_FAIL:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: getaddrinfo Failure");
-            return NGX_ERROR;
-        case MONGO_CONN_NOT_MASTER:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: Not Master");
-            return NGX_ERROR;
-        default:
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Mongo Exception: Unknown Error");
-            return NGX_ERROR;
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+            n = ngx_atoi(&value[i].data[4], value[i].len - 4);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Admission Max: %s", &value[i].data[4]);
+                return NGX_CONF_ERROR;
+            }
+            mongodb_rest_main_conf->admission_max = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Admission Queue: %s", &value[i].data[6]);
+                return NGX_CONF_ERROR;
+            }
+            mongodb_rest_main_conf->admission_queue = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "queue_timeout=", 14) == 0) {
+            s.data = &value[i].data[14];
+            s.len = value[i].len - 14;
+            mongodb_rest_main_conf->admission_timeout = ngx_parse_time(&s, 0);
+
+            if (mongodb_rest_main_conf->admission_timeout == (ngx_msec_t) NGX_ERROR
+                || mongodb_rest_main_conf->admission_timeout == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Admission Queue Timeout: %V", &s);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
     }
-    
-    return NGX_OK;
+
+    return NGX_CONF_OK;
+}
+
+static char* ngx_http_mongodb_rest_status(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_core_loc_conf_t* core_conf;
+
+    core_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    core_conf->handler = ngx_http_mongodb_rest_status_handler;
+
+    return NGX_CONF_OK;
 }
 
-static ngx_int_t ngx_http_mongo_reauth(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn) {
-    ngx_http_mongo_auth_t *auths;
-    volatile ngx_uint_t i, success = 0;
-    auths = mongo_conn->auths->elts;
+/* Parse the 'mongodb-rest-timeout' directive. */
+static char* ngx_http_mongodb_rest_timeout(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf = void_conf;
+    ngx_msec_t *timeout;
+    ngx_str_t *value, s;
+    ngx_uint_t i;
+    u_char *p;
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "connect=", 8) == 0) {
+            timeout = &mongodb_rest_loc_conf->connect_timeout;
+        } else if (ngx_strncmp(value[i].data, "send=", 5) == 0) {
+            timeout = &mongodb_rest_loc_conf->send_timeout;
+        } else if (ngx_strncmp(value[i].data, "read=", 5) == 0) {
+            timeout = &mongodb_rest_loc_conf->read_timeout;
+        } else {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        p = (u_char *) ngx_strchr(value[i].data, '=') + 1;
+        s.data = p;
+        s.len = value[i].data + value[i].len - p;
+        *timeout = ngx_parse_time(&s, 0);
+
+        if (*timeout == (ngx_msec_t) NGX_ERROR || *timeout == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "Invalid Timeout: %V", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+/*
+ * Build a field selector from a list such as "a,b,-c". mongod refuses
+ * to both include and exclude, unless the exclusion is of _id.
+ */
+static ngx_int_t ngx_http_mongodb_rest_fields_init(bson *fields, u_char *p, size_t len) {
+    u_char *last, *comma;
+    char name[MONGO_MAX_FIELD_NAME + 1];
+    size_t n;
+    int include, mode;
+
+    bson_init(fields);
+    mode = -1;
+
+    for (last = p + len; p < last; p = comma + 1) {
+        comma = ngx_strlchr(p, last, ',');
+        if (comma == NULL) {
+            comma = last;
+        }
+
+        include = 1;
+        if (*p == '-' || *p == '+') {
+            include = (*p == '+');
+            p++;
+        }
+
+        n = comma - p;
+        if (n == 0) {
+            continue;
+        }
+
+        if (n > MONGO_MAX_FIELD_NAME) {
+            bson_destroy(fields);
+            return NGX_ERROR;
+        }
+
+        if (!(n == 3 && ngx_strncmp(p, "_id", 3) == 0)) {
+            if (mode != -1 && mode != include) {
+                bson_destroy(fields);
+                return NGX_ERROR;
+            }
+            mode = include;
+        }
+
+        ngx_memcpy(name, p, n);
+        name[n] = '\0';
+        bson_append_int(fields, name, include);
+    }
+
+    bson_finish(fields);
+
+    return NGX_OK;
+}
+
+/* Map a name given to "type=" to the BSON type of the key. */
+ngx_uint_t ngx_http_mongodb_rest_type(u_char *p, size_t len) {
+    if (len == 8 && ngx_strncasecmp(p, (u_char *) "objectid", 8) == 0) {
+        return BSON_OID;
+    } else if (len == 6 && ngx_strncasecmp(p, (u_char *) "string", 6) == 0) {
+        return BSON_STRING;
+    } else if (len == 3 && ngx_strncasecmp(p, (u_char *) "int", 3) == 0) {
+        return BSON_INT;
+    }
+
+    return BSON_EOO;
+}
+
+/*
+ * Build the key from "field=a,b.c" and "type=int,string", one type per
+ * field, or a single type for all of them.
+ */
+static char *ngx_http_mongodb_rest_keys(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf, ngx_str_t *field, ngx_str_t *type) {
+    ngx_http_mongodb_rest_key_t *key;
+    u_char *p, *last, *comma;
+    ngx_uint_t i, ntypes;
+
+    conf->keys = ngx_array_create(cf->pool, 1, sizeof(ngx_http_mongodb_rest_key_t));
+    if (conf->keys == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (p = field->data, last = p + field->len; p <= last; p = comma + 1) {
+        comma = ngx_strlchr(p, last, ',');
+        if (comma == NULL) {
+            comma = last;
+        }
+
+        if (comma == p
+            || comma - p > MONGO_MAX_FIELD_NAME
+            || conf->keys->nelts == MONGO_MAX_KEY_FIELDS) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "Unsupported Field: %V", field);
+            return NGX_CONF_ERROR;
+        }
+
+        key = ngx_array_push(conf->keys);
+        if (key == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        key->field.len = comma - p;
+        key->field.data = ngx_pnalloc(cf->pool, key->field.len + 1);
+        if (key->field.data == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        ngx_cpystrn(key->field.data, p, key->field.len + 1);
+        key->type = BSON_OID;
+    }
+
+    key = conf->keys->elts;
+    ntypes = 0;
+
+    for (p = type->data, last = p + type->len; type->len && p <= last; p = comma + 1) {
+        comma = ngx_strlchr(p, last, ',');
+        if (comma == NULL) {
+            comma = last;
+        }
+
+        if (ntypes == conf->keys->nelts
+            || (key[ntypes].type = ngx_http_mongodb_rest_type(p, comma - p)) == BSON_EOO) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "Unsupported Type: %V", type);
+            return NGX_CONF_ERROR;
+        }
+        ntypes++;
+    }
+
+    if (ntypes > 1 && ntypes != conf->keys->nelts) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Type: %V, does not match Field: %V", type, field);
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < conf->keys->nelts; i++) {
+        if (ntypes == 1) {
+            key[i].type = key[0].type;
+        }
+
+        /* PUT nests dotted keys in the body as JSON, which has no ObjectId. */
+        if (key[i].type == BSON_OID && ngx_strlchr(key[i].field.data, key[i].field.data + key[i].field.len, '.')) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "Field: %V, must be of Type: string or int", &key[i].field);
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    conf->field = key[0].field;
+    conf->type = key[0].type;
+
+    return NGX_CONF_OK;
+}
+
+/* Parse the 'mongodb-rest' directive. */
+static char* ngx_http_mongodb_rest(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf = void_conf;
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf;
+    ngx_http_core_loc_conf_t* core_conf;
+    ngx_str_t *value, field, type, size;
+    ngx_int_t n;
+    volatile ngx_uint_t i;
+
+    ngx_str_set(&field, "_id");
+    ngx_str_null(&type);
+
+    core_conf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    core_conf-> handler = ngx_http_mongodb_rest_handler;
+    mongodb_rest_loc_conf->location = core_conf->name;
+
+    mongodb_rest_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mongodb_rest_module);
+
+    value = cf->args->elts;
+    mongodb_rest_loc_conf->db = value[1];
+
+    /* Parse the parameters */
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "collection=", 11) == 0) {
+            mongodb_rest_loc_conf->collection.data = (u_char *) &value[i].data[11];
+            mongodb_rest_loc_conf->collection.len = ngx_strlen(&value[i].data[11]);
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "field=", 6) == 0) {
+            field.data = &value[i].data[6];
+            field.len = value[i].len - 6;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "type=", 5) == 0) { 
+            type.data = &value[i].data[5];
+            type.len = value[i].len - 5;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "index_check=", 12) == 0) {
+            if (ngx_strcmp(&value[i].data[12], "warn") == 0) {
+                mongodb_rest_loc_conf->index_check = NGX_HTTP_MONGODB_REST_INDEX_WARN;
+            } else if (ngx_strcmp(&value[i].data[12], "fail") == 0) {
+                mongodb_rest_loc_conf->index_check = NGX_HTTP_MONGODB_REST_INDEX_FAIL;
+            } else if (ngx_strcmp(&value[i].data[12], "off") == 0) {
+                mongodb_rest_loc_conf->index_check = NGX_HTTP_MONGODB_REST_INDEX_OFF;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid value \"%s\", it must be \"warn\", \"fail\" or \"off\"", &value[i].data[12]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "user=", 5) == 0) { 
+            mongodb_rest_loc_conf->user.data = (u_char *) &value[i].data[5];
+            mongodb_rest_loc_conf->user.len = ngx_strlen(&value[i].data[5]);
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "pass=", 5) == 0) {
+            mongodb_rest_loc_conf->pass.data = (u_char *) &value[i].data[5];
+            mongodb_rest_loc_conf->pass.len = ngx_strlen(&value[i].data[5]);
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "projection=", 11) == 0) {
+            mongodb_rest_loc_conf->projection = ngx_palloc(cf->pool, sizeof(bson));
+            if (mongodb_rest_loc_conf->projection == NULL) {
+                return NGX_CONF_ERROR;
+            }
+
+            if (ngx_http_mongodb_rest_fields_init(mongodb_rest_loc_conf->projection,
+                                                  &value[i].data[11], value[i].len - 11) != NGX_OK) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Projection: %s", &value[i].data[11]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "page_size=", 10) == 0) {
+            n = ngx_atoi(&value[i].data[10], value[i].len - 10);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Page Size: %s", &value[i].data[10]);
+                return NGX_CONF_ERROR;
+            }
+            mongodb_rest_loc_conf->page_size = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "cursor_timeout=", 15) == 0) {
+            size.data = &value[i].data[15];
+            size.len = value[i].len - 15;
+            mongodb_rest_loc_conf->cursor_timeout = ngx_parse_time(&size, 0);
+
+            if (mongodb_rest_loc_conf->cursor_timeout == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Cursor Timeout: %V", &size);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "coalesce=", 9) == 0) {
+            n = ngx_atoi(&value[i].data[9], value[i].len - 9);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Coalesce: %s", &value[i].data[9]);
+                return NGX_CONF_ERROR;
+            }
+            mongodb_rest_loc_conf->coalesce = n;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "coalesce_delay=", 15) == 0) {
+            size.data = &value[i].data[15];
+            size.len = value[i].len - 15;
+            mongodb_rest_loc_conf->coalesce_delay = ngx_parse_time(&size, 0);
+
+            if (mongodb_rest_loc_conf->coalesce_delay == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Coalesce Delay: %V", &size);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "bloom=", 6) == 0) {
+            if (ngx_http_mongodb_rest_bloom_zone(cf, mongodb_rest_loc_conf, &value[i]) != NGX_CONF_OK) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "replica=", 8) == 0) {
+            if (ngx_http_mongodb_rest_replica_zone(cf, mongodb_rest_loc_conf, &value[i]) != NGX_CONF_OK) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "bloom_refresh=", 14) == 0) {
+            size.data = &value[i].data[14];
+            size.len = value[i].len - 14;
+            mongodb_rest_loc_conf->bloom_refresh = ngx_parse_time(&size, 0);
+
+            if (mongodb_rest_loc_conf->bloom_refresh == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Bloom Filter Refresh: %V", &size);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "hedge=", 6) == 0) {
+            size.data = &value[i].data[6];
+            size.len = value[i].len - 6;
+            mongodb_rest_loc_conf->hedge = 1;
+
+            if (size.len > 1 && size.data[0] == 'p') {
+                n = ngx_atoi(size.data + 1, size.len - 1);
+                if (n == NGX_ERROR || n == 0 || n > 99) {
+                    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                       "Invalid Hedge: %V", &size);
+                    return NGX_CONF_ERROR;
+                }
+                mongodb_rest_loc_conf->hedge_percentile = n;
+                continue;
+            }
+
+            /* 0 would ask two members for every read. */
+            mongodb_rest_loc_conf->hedge_delay = ngx_parse_time(&size, 0);
+            if (mongodb_rest_loc_conf->hedge_delay == (ngx_msec_t) NGX_ERROR
+                || mongodb_rest_loc_conf->hedge_delay == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Hedge: %V", &size);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "hedge_secondaries=", 18) == 0) {
+            if (ngx_strcmp(&value[i].data[18], "on") == 0) {
+                mongodb_rest_loc_conf->hedge_secondaries = 1;
+            } else if (ngx_strcmp(&value[i].data[18], "off") == 0) {
+                mongodb_rest_loc_conf->hedge_secondaries = 0;
+            } else {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid value \"%s\", it must be \"on\" or \"off\"", &value[i].data[18]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "snapshot=", 9) == 0) {
+            mongodb_rest_loc_conf->snapshot.data = &value[i].data[9];
+            mongodb_rest_loc_conf->snapshot.len = value[i].len - 9;
+
+            while (mongodb_rest_loc_conf->snapshot.len > 1
+                   && mongodb_rest_loc_conf->snapshot.data[mongodb_rest_loc_conf->snapshot.len - 1] == '/') {
+                mongodb_rest_loc_conf->snapshot.len--;
+            }
+
+            if (mongodb_rest_loc_conf->snapshot.len == 0
+                || ngx_conf_full_name(cf->cycle, &mongodb_rest_loc_conf->snapshot, 0) != NGX_OK) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Snapshot: %s", &value[i].data[9]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "snapshot_field=", 15) == 0) {
+            mongodb_rest_loc_conf->snapshot_field.data = &value[i].data[15];
+            mongodb_rest_loc_conf->snapshot_field.len = value[i].len - 15;
+
+            if (mongodb_rest_loc_conf->snapshot_field.len == 0
+                || mongodb_rest_loc_conf->snapshot_field.len > MONGO_MAX_FIELD_NAME) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Snapshot Field: %s", &value[i].data[15]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "snapshot_refresh=", 17) == 0) {
+            size.data = &value[i].data[17];
+            size.len = value[i].len - 17;
+            mongodb_rest_loc_conf->snapshot_refresh = ngx_parse_time(&size, 0);
+
+            if (mongodb_rest_loc_conf->snapshot_refresh == (ngx_msec_t) NGX_ERROR
+                || mongodb_rest_loc_conf->snapshot_refresh == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Snapshot Refresh: %V", &size);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "snapshot_rescan=", 16) == 0) {
+            size.data = &value[i].data[16];
+            size.len = value[i].len - 16;
+            mongodb_rest_loc_conf->snapshot_rescan = ngx_parse_time(&size, 0);
+
+            if (mongodb_rest_loc_conf->snapshot_rescan == (ngx_msec_t) NGX_ERROR
+                || mongodb_rest_loc_conf->snapshot_rescan == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Snapshot Rescan: %V", &size);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "thread_pool=", 12) == 0) {
+#if (NGX_THREADS)
+            size.data = &value[i].data[12];
+            size.len = value[i].len - 12;
+            mongodb_rest_loc_conf->thread_pool = ngx_thread_pool_add(cf, &size);
+            if (mongodb_rest_loc_conf->thread_pool == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+#else
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "Thread Pool: %s, needs nginx built --with-threads", &value[i].data[12]);
+            return NGX_CONF_ERROR;
+#endif
+        }
+
+        if (ngx_strncmp(value[i].data, "max_inflight=", 13) == 0) {
+            n = ngx_atoi(&value[i].data[13], value[i].len - 13);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Max Inflight: %s", &value[i].data[13]);
+                return NGX_CONF_ERROR;
+            }
+            mongodb_rest_loc_conf->max_inflight = n;
+            mongodb_rest_main_conf->admission = 1;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_http_mongodb_rest_keys(cf, mongodb_rest_loc_conf, &field, &type) != NGX_CONF_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* Only the primary could answer either member, so hedging would gain nothing. */
+    if (mongodb_rest_loc_conf->hedge == 1 && mongodb_rest_loc_conf->hedge_secondaries != 1) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Hedge needs hedge_secondaries=on");
+        return NGX_CONF_ERROR;
+    }
+
+    if (ngx_strcmp(mongodb_rest_loc_conf->field.data, "filename") == 0
+        && mongodb_rest_loc_conf->type != BSON_STRING) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Field: filename, must be of Type: string");
+        return NGX_CONF_ERROR;
+    }
+
+    if ((mongodb_rest_loc_conf->user.data == NULL || mongodb_rest_loc_conf->user.len == 0)
+        && !(mongodb_rest_loc_conf->pass.data == NULL || mongodb_rest_loc_conf->pass.len == 0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Password without username");
+        return NGX_CONF_ERROR;
+    }
+
+    if (!(mongodb_rest_loc_conf->user.data == NULL || mongodb_rest_loc_conf->user.len == 0)
+        && (mongodb_rest_loc_conf->pass.data == NULL || mongodb_rest_loc_conf->pass.len == 0)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Username without password");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static void *ngx_http_mongodb_rest_create_main_conf(ngx_conf_t *cf) {
+    ngx_http_mongodb_rest_main_conf_t  *mongodb_rest_main_conf;
+
+    mongodb_rest_main_conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_mongodb_rest_main_conf_t));
+    if (mongodb_rest_main_conf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&mongodb_rest_main_conf->loc_confs, cf->pool, 4,
+                       sizeof(ngx_http_mongodb_rest_loc_conf_t *))
+        != NGX_OK) {
+        return NULL;
+    }
+
+    mongodb_rest_main_conf->health_interval = MONGO_HEALTH_INTERVAL;
+    mongodb_rest_main_conf->health_fails = MONGO_HEALTH_FAILS;
+    mongodb_rest_main_conf->health_retry = MONGO_HEALTH_RETRY;
+    mongodb_rest_main_conf->admission_queue = MONGO_ADMISSION_QUEUE;
+    mongodb_rest_main_conf->admission_timeout = MONGO_ADMISSION_TIMEOUT;
+
+    return mongodb_rest_main_conf;
+}
+
+/* A 'mongo' is one connection per worker, so its locations must agree on its timeouts. */
+static ngx_int_t ngx_http_mongodb_rest_timeouts_check(ngx_conf_t *cf, ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf) {
+    ngx_http_mongodb_rest_loc_conf_t **mongodb_rest_loc_confs, *a, *b;
+    ngx_uint_t i, j;
+
+    mongodb_rest_loc_confs = mongodb_rest_main_conf->loc_confs.elts;
+
+    for (i = 0; i < mongodb_rest_main_conf->loc_confs.nelts; i++) {
+        a = mongodb_rest_loc_confs[i];
+
+        for (j = 0; j < i; j++) {
+            b = mongodb_rest_loc_confs[j];
+
+            if (a->mongo.len != b->mongo.len
+                || ngx_strncmp(a->mongo.data, b->mongo.data, a->mongo.len) != 0) {
+                continue;
+            }
+
+            if (a->connect_timeout != b->connect_timeout
+                || a->send_timeout != b->send_timeout
+                || a->read_timeout != b->read_timeout) {
+                ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                              "Conflicting mongodb-rest-timeout for mongo \"%V\" in locations \"%V\" and \"%V\"",
+                              &a->mongo, &b->location, &a->location);
+                return NGX_ERROR;
+            }
+            break;
+        }
+    }
+
+    return NGX_OK;
+}
+
+/* Give each 'mongo' a circuit in the health zone. */
+static ngx_int_t ngx_http_mongodb_rest_init(ngx_conf_t *cf) {
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mongodb_rest_module);
+    ngx_http_mongodb_rest_loc_conf_t **mongodb_rest_loc_confs, **upstreams, **upstream, *conf;
+    ngx_str_t name = ngx_string("mongodb_rest_health");
+    ngx_str_t admission = ngx_string("mongodb_rest_admission");
+    ngx_str_t *names;
+    ngx_uint_t i, j, n;
+
+    if (ngx_http_mongodb_rest_timeouts_check(cf, mongodb_rest_main_conf) != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    if (mongodb_rest_main_conf->loc_confs.nelts == 0) {
+        mongodb_rest_main_conf->health_check = 0;
+        mongodb_rest_main_conf->admission = 0;
+    }
+
+    if (!mongodb_rest_main_conf->health_check && !mongodb_rest_main_conf->admission) {
+        return NGX_OK;
+    }
+
+    if (ngx_array_init(&mongodb_rest_main_conf->upstreams, cf->pool, 4,
+                       sizeof(ngx_http_mongodb_rest_loc_conf_t *))
+        != NGX_OK) {
+        return NGX_ERROR;
+    }
+
+    mongodb_rest_loc_confs = mongodb_rest_main_conf->loc_confs.elts;
+
+    for (i = 0; i < mongodb_rest_main_conf->loc_confs.nelts; i++) {
+        upstreams = mongodb_rest_main_conf->upstreams.elts;
+
+        for (j = 0; j < mongodb_rest_main_conf->upstreams.nelts; j++) {
+            if (upstreams[j]->mongo.len == mongodb_rest_loc_confs[i]->mongo.len
+                && ngx_strncmp(upstreams[j]->mongo.data, mongodb_rest_loc_confs[i]->mongo.data,
+                               upstreams[j]->mongo.len) == 0) {
+                break;
+            }
+        }
+
+        if (j == mongodb_rest_main_conf->upstreams.nelts) {
+            upstream = ngx_array_push(&mongodb_rest_main_conf->upstreams);
+            if (upstream == NULL) {
+                return NGX_ERROR;
+            }
+            *upstream = mongodb_rest_loc_confs[i];
+        }
+
+        mongodb_rest_loc_confs[i]->upstream = j;
+    }
+
+    /* Each location is counted after every 'mongo'. */
+    for (i = 0; i < mongodb_rest_main_conf->loc_confs.nelts; i++) {
+        mongodb_rest_loc_confs[i]->slot = mongodb_rest_main_conf->upstreams.nelts + i;
+    }
+
+    if (mongodb_rest_main_conf->health_check) {
+        n = mongodb_rest_main_conf->upstreams.nelts;
+        mongodb_rest_main_conf->health_circuits = ngx_pcalloc(cf->pool, n * sizeof(ngx_http_mongodb_rest_health_t *));
+        if (mongodb_rest_main_conf->health_circuits == NULL) {
+            return NGX_ERROR;
+        }
+
+        mongodb_rest_main_conf->health_zone = ngx_shared_memory_add(cf, &name, 8 * ngx_pagesize,
+                                                                    &ngx_http_mongodb_rest_module);
+        if (mongodb_rest_main_conf->health_zone == NULL) {
+            return NGX_ERROR;
+        }
+
+        mongodb_rest_main_conf->health_zone->init = ngx_http_mongodb_rest_health_init;
+        mongodb_rest_main_conf->health_zone->data = mongodb_rest_main_conf;
+    }
+
+    if (mongodb_rest_main_conf->admission) {
+        n = mongodb_rest_main_conf->upstreams.nelts + mongodb_rest_main_conf->loc_confs.nelts;
+        upstreams = mongodb_rest_main_conf->upstreams.elts;
+
+        names = ngx_palloc(cf->pool, n * sizeof(ngx_str_t));
+        mongodb_rest_main_conf->admission_counters = ngx_pcalloc(cf->pool, n * sizeof(ngx_http_mongodb_rest_admission_t *));
+        if (names == NULL || mongodb_rest_main_conf->admission_counters == NULL) {
+            return NGX_ERROR;
+        }
+        mongodb_rest_main_conf->admission_names = names;
+
+        for (i = 0; i < n; i++) {
+            if (i < mongodb_rest_main_conf->upstreams.nelts) {
+                conf = upstreams[i];
+                names[i].len = sizeof("mongo ") - 1 + conf->mongo.len;
+            } else {
+                conf = mongodb_rest_loc_confs[i - mongodb_rest_main_conf->upstreams.nelts];
+                names[i].len = sizeof("location   ") - 1 + conf->location.len + conf->ns.len + conf->mongo.len;
+            }
+
+            names[i].data = ngx_pnalloc(cf->pool, names[i].len);
+            if (names[i].data == NULL) {
+                return NGX_ERROR;
+            }
+
+            if (i < mongodb_rest_main_conf->upstreams.nelts) {
+                ngx_sprintf(names[i].data, "mongo %V", &conf->mongo);
+            } else {
+                ngx_sprintf(names[i].data, "location %V %V %V", &conf->location, &conf->ns, &conf->mongo);
+            }
+        }
+
+        mongodb_rest_main_conf->admission_zone = ngx_shared_memory_add(cf, &admission, 8 * ngx_pagesize,
+                                                                       &ngx_http_mongodb_rest_module);
+        if (mongodb_rest_main_conf->admission_zone == NULL) {
+            return NGX_ERROR;
+        }
+
+        mongodb_rest_main_conf->admission_zone->init = ngx_http_mongodb_rest_admission_init;
+        mongodb_rest_main_conf->admission_zone->data = mongodb_rest_main_conf;
+    }
+
+    return NGX_OK;
+}
+
+static void* ngx_http_mongodb_rest_create_loc_conf(ngx_conf_t* directive) {
+    ngx_http_mongodb_rest_loc_conf_t* mongodb_rest_conf;
+
+    mongodb_rest_conf = ngx_pcalloc(directive->pool, sizeof(ngx_http_mongodb_rest_loc_conf_t));
+    if (mongodb_rest_conf == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, directive, 0,
+                           "Failed to allocate memory for GridFS Location Config.");
+        return NGX_CONF_ERROR;
+    }
+
+    mongodb_rest_conf->db.data = NULL;
+    mongodb_rest_conf->db.len = 0;
+    mongodb_rest_conf->root_collection.data = NULL;
+    mongodb_rest_conf->root_collection.len = 0;
+    mongodb_rest_conf->collection.data = NULL;
+    mongodb_rest_conf->collection.len = 0;
+    mongodb_rest_conf->field.data = NULL;
+    mongodb_rest_conf->field.len = 0;
+    mongodb_rest_conf->type = NGX_CONF_UNSET_UINT;
+    mongodb_rest_conf->keys = NGX_CONF_UNSET_PTR;
+    mongodb_rest_conf->index_check = NGX_CONF_UNSET_UINT;
+    mongodb_rest_conf->user.data = NULL;
+    mongodb_rest_conf->user.len = 0;
+    mongodb_rest_conf->pass.data = NULL;
+    mongodb_rest_conf->pass.len = 0;
+    mongodb_rest_conf->mongo.data = NULL;
+    mongodb_rest_conf->mongo.len = 0;
+    mongodb_rest_conf->mongods = NGX_CONF_UNSET_PTR;
+    mongodb_rest_conf->gridfs = NGX_CONF_UNSET;
+    mongodb_rest_conf->chunk_size = NGX_CONF_UNSET_SIZE;
+    mongodb_rest_conf->chunk_batch = NGX_CONF_UNSET_UINT;
+    mongodb_rest_conf->projection = NGX_CONF_UNSET_PTR;
+    mongodb_rest_conf->page_size = NGX_CONF_UNSET_UINT;
+    mongodb_rest_conf->cursor_timeout = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->coalesce = NGX_CONF_UNSET_UINT;
+    mongodb_rest_conf->coalesce_delay = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->write_behind = NGX_CONF_UNSET_PTR;
+    mongodb_rest_conf->write_behind_interval = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->write_behind_batch = NGX_CONF_UNSET_UINT;
+    mongodb_rest_conf->connect_timeout = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->send_timeout = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->read_timeout = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->bloom = NGX_CONF_UNSET_PTR;
+    mongodb_rest_conf->bloom_refresh = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->replica = NGX_CONF_UNSET_PTR;
+    mongodb_rest_conf->hedge = NGX_CONF_UNSET;
+    mongodb_rest_conf->hedge_delay = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->hedge_percentile = NGX_CONF_UNSET_UINT;
+    mongodb_rest_conf->hedge_secondaries = NGX_CONF_UNSET;
+    mongodb_rest_conf->max_inflight = NGX_CONF_UNSET_UINT;
+#if (NGX_THREADS)
+    mongodb_rest_conf->thread_pool = NGX_CONF_UNSET_PTR;
+#endif
+    mongodb_rest_conf->snapshot_refresh = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->snapshot_rescan = NGX_CONF_UNSET_MSEC;
+    mongodb_rest_conf->export_partitions = NGX_CONF_UNSET_UINT;
+    mongodb_rest_conf->shards = NGX_CONF_UNSET_PTR;
+    mongodb_rest_conf->pipeline = NGX_CONF_UNSET_PTR;
+    mongodb_rest_conf->cache = NGX_CONF_UNSET_PTR;
+    mongodb_rest_conf->cache_ttl = NGX_CONF_UNSET;
+
+    return mongodb_rest_conf;
+}
+
+/* Build a null terminated "db.collection<suffix>" namespace. */
+static ngx_int_t ngx_http_mongodb_rest_ns(ngx_pool_t *pool, ngx_str_t *db, ngx_str_t *collection, ngx_str_t *ns, const char *suffix) {
+    u_char *p;
+    size_t len;
+
+    len = db->len + 1 + collection->len + ngx_strlen(suffix);
+    ns->data = ngx_pnalloc(pool, len + 1);
+    if (ns->data == NULL) {
+        return NGX_ERROR;
+    }
+
+    p = ngx_cpymem(ns->data, db->data, db->len);
+    *p++ = '.';
+    p = ngx_cpymem(p, collection->data, collection->len);
+    p = ngx_cpymem(p, suffix, ngx_strlen(suffix));
+    *p = '\0';
+    ns->len = len;
+
+    return NGX_OK;
+}
+
+static char* ngx_http_mongodb_rest_merge_loc_conf(ngx_conf_t* cf, void* void_parent, void* void_child) {
+    ngx_http_mongodb_rest_loc_conf_t *parent = void_parent;
+    ngx_http_mongodb_rest_loc_conf_t *child = void_child;
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mongodb_rest_module);
+    ngx_http_mongodb_rest_loc_conf_t **mongodb_rest_loc_conf;
+    ngx_http_mongod_server_t *mongod_server;
+    ngx_str_t name;
+
+    ngx_conf_merge_str_value(child->db, parent->db, NULL);
+    ngx_conf_merge_str_value(child->location, parent->location, "");
+    ngx_conf_merge_str_value(child->root_collection, parent->root_collection, "fs");
+    ngx_conf_merge_str_value(child->collection, parent->collection, "test");
+    ngx_conf_merge_str_value(child->field, parent->field, "_id");
+    ngx_conf_merge_uint_value(child->type, parent->type, BSON_OID);
+    ngx_conf_merge_ptr_value(child->keys, parent->keys, NULL);
+    ngx_conf_merge_uint_value(child->index_check, parent->index_check, NGX_HTTP_MONGODB_REST_INDEX_WARN);
+    ngx_conf_merge_str_value(child->user, parent->user, NULL);
+    ngx_conf_merge_str_value(child->pass, parent->pass, NULL);
+    ngx_conf_merge_str_value(child->mongo, parent->mongo, "127.0.0.1:27017");
+    ngx_conf_merge_value(child->gridfs, parent->gridfs, 0);
+    ngx_conf_merge_size_value(child->chunk_size, parent->chunk_size, MONGO_GRIDFS_CHUNK_SIZE);
+    ngx_conf_merge_uint_value(child->chunk_batch, parent->chunk_batch, MONGO_GRIDFS_CHUNK_BATCH);
+    ngx_conf_merge_ptr_value(child->projection, parent->projection, NULL);
+    ngx_conf_merge_uint_value(child->page_size, parent->page_size, MONGO_PAGE_SIZE);
+    ngx_conf_merge_msec_value(child->cursor_timeout, parent->cursor_timeout, MONGO_CURSOR_TIMEOUT);
+    ngx_conf_merge_uint_value(child->coalesce, parent->coalesce, 0);
+    ngx_conf_merge_msec_value(child->coalesce_delay, parent->coalesce_delay, MONGO_COALESCE_DELAY);
+    ngx_conf_merge_ptr_value(child->write_behind, parent->write_behind, NULL);
+    ngx_conf_merge_msec_value(child->write_behind_interval, parent->write_behind_interval, MONGO_WRITE_BEHIND_INTERVAL);
+    ngx_conf_merge_uint_value(child->write_behind_batch, parent->write_behind_batch, MONGO_WRITE_BEHIND_BATCH);
+    ngx_conf_merge_msec_value(child->connect_timeout, parent->connect_timeout, MONGO_CONNECT_TIMEOUT);
+    ngx_conf_merge_msec_value(child->send_timeout, parent->send_timeout, MONGO_SEND_TIMEOUT);
+    ngx_conf_merge_msec_value(child->read_timeout, parent->read_timeout, MONGO_READ_TIMEOUT);
+    ngx_conf_merge_ptr_value(child->bloom, parent->bloom, NULL);
+    ngx_conf_merge_msec_value(child->bloom_refresh, parent->bloom_refresh, MONGO_BLOOM_REFRESH);
+    ngx_conf_merge_ptr_value(child->replica, parent->replica, NULL);
+    ngx_conf_merge_value(child->hedge, parent->hedge, 0);
+    ngx_conf_merge_msec_value(child->hedge_delay, parent->hedge_delay, 0);
+    ngx_conf_merge_uint_value(child->hedge_percentile, parent->hedge_percentile, 0);
+    ngx_conf_merge_value(child->hedge_secondaries, parent->hedge_secondaries, 0);
+    ngx_conf_merge_uint_value(child->max_inflight, parent->max_inflight, 0);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(child->thread_pool, parent->thread_pool, NULL);
+#endif
+    ngx_conf_merge_str_value(child->snapshot, parent->snapshot, "");
+    ngx_conf_merge_str_value(child->snapshot_field, parent->snapshot_field, "_id");
+    ngx_conf_merge_msec_value(child->snapshot_refresh, parent->snapshot_refresh, MONGO_SNAPSHOT_REFRESH);
+    ngx_conf_merge_msec_value(child->snapshot_rescan, parent->snapshot_rescan, MONGO_SNAPSHOT_RESCAN);
+    ngx_conf_merge_uint_value(child->export_partitions, parent->export_partitions, 0);
+    /* A location naming its own mongo is not sharded by its parent. */
+    if (child->shards == NGX_CONF_UNSET_PTR && child->mongods != NGX_CONF_UNSET_PTR) {
+        child->shards = NULL;
+    }
+    ngx_conf_merge_ptr_value(child->shards, parent->shards, NULL);
+    ngx_conf_merge_ptr_value(child->pipeline, parent->pipeline, NULL);
+    if (child->params == NULL) {
+        child->params = parent->params;
+        child->nsegments = parent->nsegments;
+    }
+    ngx_conf_merge_ptr_value(child->cache, parent->cache, NULL);
+    ngx_conf_merge_sec_value(child->cache_ttl, parent->cache_ttl, MONGO_AGGREGATE_TTL);
+
+    if (child->write_behind && child->db.data && child->write_behind->conf == NULL) {
+        child->write_behind->conf = child;
+    }
+
+    if (child->bloom && child->db.data && child->bloom->conf == NULL) {
+        child->bloom->conf = child;
+    }
+
+    if (child->replica && child->db.data && child->replica->conf == NULL) {
+        child->replica->conf = child;
+    }
+
+    if (child->db.data
+        && ngx_http_mongodb_rest_ns(cf->pool, &child->db, &child->collection, &child->ns, "") != NGX_OK) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (child->pipeline && (child->db.data == NULL || child->gridfs || child->shards)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Aggregation needs mongodb-rest, and cannot be used with gridfs or mongodb-rest-shards");
+        return NGX_CONF_ERROR;
+    }
+
+    if ((child->gridfs || child->write_behind || child->export_partitions) && child->db.data == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "mongodb-rest-gridfs, mongodb-rest-write-behind and mongodb-rest-export need mongodb-rest");
+        return NGX_CONF_ERROR;
+    }
+
+    if (child->db.data && child->keys->nelts > 1 && (child->gridfs || child->bloom || child->replica)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Compound Field: %V, cannot be used with gridfs, bloom or replica", &child->field);
+        return NGX_CONF_ERROR;
+    }
+
+    if (child->snapshot.len && child->gridfs) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Snapshot: %V, cannot be used with gridfs", &child->snapshot);
+        return NGX_CONF_ERROR;
+    }
+
+    if (child->export_partitions && child->gridfs) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Export cannot be used with gridfs");
+        return NGX_CONF_ERROR;
+    }
+
+#if (NGX_THREADS)
+    /* These keep their work on the worker's connection. */
+    if (child->thread_pool
+        && (child->gridfs || child->coalesce > 1 || child->write_behind || child->hedge)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Thread Pool cannot be used with gridfs, coalesce, write_behind or hedge");
+        return NGX_CONF_ERROR;
+    }
+#endif
+
+    if (child->db.data) {
+        ngx_str_set(&name, "$cmd");
+        if (ngx_http_mongodb_rest_ns(cf->pool, &child->db, &name, &child->cmd_ns, "") != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (child->gridfs && child->db.data) {
+        if (ngx_http_mongodb_rest_ns(cf->pool, &child->db, &child->root_collection, &child->gridfs_files, ".files") != NGX_OK
+            || ngx_http_mongodb_rest_ns(cf->pool, &child->db, &child->root_collection, &child->gridfs_chunks, ".chunks") != NGX_OK) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    if (child->mongods == NGX_CONF_UNSET_PTR) {
+        if (parent->mongods != NGX_CONF_UNSET_PTR) {
+            child->mongods = parent->mongods;
+        } else {
+            child->mongods = ngx_array_create(cf->pool, 4,
+                                              sizeof(ngx_http_mongod_server_t));
+            mongod_server = ngx_array_push(child->mongods);
+            mongod_server->host.data = (u_char *)"127.0.0.1";
+            mongod_server->host.len = sizeof("127.0.0.1") - 1;
+            mongod_server->port = 27017;
+            ngx_memzero(&mongod_server->addr, sizeof(ngx_addr_t));
+        }
+    }
+
+    // Add the local mongodb_rest conf to the main mongodb_rest conf
+    if (child->db.data && child->shards) {
+        /* Each shard is set up as a location of its own. */
+        if (ngx_http_mongodb_rest_shards_init(cf, child) != NGX_CONF_OK) {
+            return NGX_CONF_ERROR;
+        }
+    } else if (child->db.data) {
+        mongodb_rest_loc_conf = ngx_array_push(&mongodb_rest_main_conf->loc_confs);
+        *mongodb_rest_loc_conf = child;
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t ngx_http_mongo_reconnect(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn) {
+    volatile int status = MONGO_CONN_FAIL;
+
+    /* Straight away: a pause here would hold up the request and the worker. */
+    if (mongo_conn->conn.connected) {
+        mongo_disconnect(&mongo_conn->conn);
+    }
+    status = mongo_reconnect(&mongo_conn->conn);
+
+    switch (status) {
+        case MONGO_CONN_SUCCESS:
+            ngx_http_mongo_set_timeouts(log, mongo_conn, &mongo_conn->conn);
+            break;
+        case MONGO_CONN_NO_SOCKET:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: No Socket");
+            return NGX_ERROR;
+        case MONGO_CONN_FAIL:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Connection Failure %s:%i;",
+                          mongo_conn->conn.primary->host,
+                          mongo_conn->conn.primary->port);
+            return NGX_ERROR;
+        case MONGO_CONN_ADDR_FAIL:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: getaddrinfo Failure");
+            return NGX_ERROR;
+        case MONGO_CONN_NOT_MASTER:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Not Master");
+            return NGX_ERROR;
+        default:
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Mongo Exception: Unknown Error");
+            return NGX_ERROR;
+    }
+    
+    return NGX_OK;
+}
+
+/* The driver blocks, so bound connecting and each send and read on its socket. */
+void ngx_http_mongo_set_timeouts(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn, mongo *conn) {
+    struct timeval tv;
+
+    conn->conn_timeout_ms = mongo_conn->connect_timeout;
+
+    tv.tv_sec = mongo_conn->send_timeout / 1000;
+    tv.tv_usec = (mongo_conn->send_timeout % 1000) * 1000;
+    if (setsockopt(conn->sock, SOL_SOCKET, SO_SNDTIMEO, (const void *) &tv, sizeof(tv)) == -1) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_socket_errno,
+                      "setsockopt(SO_SNDTIMEO) failed for mongo: \"%V\"", &mongo_conn->name);
+    }
+
+    tv.tv_sec = mongo_conn->read_timeout / 1000;
+    tv.tv_usec = (mongo_conn->read_timeout % 1000) * 1000;
+    if (setsockopt(conn->sock, SOL_SOCKET, SO_RCVTIMEO, (const void *) &tv, sizeof(tv)) == -1) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_socket_errno,
+                      "setsockopt(SO_RCVTIMEO) failed for mongo: \"%V\"", &mongo_conn->name);
+    }
+}
+
+ngx_int_t ngx_http_mongo_reauth(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn, mongo *conn) {
+    ngx_http_mongo_auth_t *auths;
+    volatile ngx_uint_t i, success = 0;
+    auths = mongo_conn->auths->elts;
+
+    for (i = 0; i < mongo_conn->auths->nelts; i++) {
+        success = mongo_cmd_authenticate( conn, 
+                                          (const char*)auths[i].db.data, 
+                                          (const char*)auths[i].user.data, 
+                                          (const char*)auths[i].pass.data );
+        if (!success) {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "Invalid mongo user/pass: %s/%s, during reauth", 
+                          auths[i].user.data, 
+                          auths[i].pass.data);   
+            return NGX_ERROR;
+        }
+    }
+    
+    return NGX_OK;
+}
+
+/* Reconnect a worker's connection that has dropped, from outside a request's allocations. */
+ngx_int_t ngx_http_mongo_ensure(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn) {
+    ngx_pool_t *pool;
+    ngx_int_t rc = NGX_OK;
+
+    /* A send or read that timed out leaves the connection out of step. */
+    if (mongo_conn->conn.connected && mongo_conn->conn.err == MONGO_IO_ERROR) {
+        mongo_disconnect(&mongo_conn->conn);
+    }
+
+    if (mongo_conn->conn.connected) {
+        mongo_clear_errors(&mongo_conn->conn);
+        return NGX_OK;
+    }
+
+    /* The connection outlives the request. */
+    pool = ngx_http_mongodb_rest_alloc_from(NULL);
+
+    if (ngx_http_mongo_reconnect(log, mongo_conn) == NGX_ERROR
+        || ngx_http_mongo_reauth(log, mongo_conn, &mongo_conn->conn) == NGX_ERROR) {
+        if (mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
+        rc = NGX_ERROR;
+    } else {
+        mongo_clear_errors(&mongo_conn->conn);
+    }
+
+    ngx_http_mongodb_rest_alloc_from(pool);
+
+    return rc;
+}
+
+/* Poll members that are connecting or owe a reply, until none is. */
+static void ngx_http_mongo_members_arm(ngx_http_mongo_connection_t *mongo_conn) {
+    if (mongo_conn->members_timer.timer_set) {
+        return;
+    }
+
+    mongo_conn->members_timer.handler = ngx_http_mongo_members_poll;
+    mongo_conn->members_timer.data = mongo_conn;
+    mongo_conn->members_timer.log = ngx_cycle->log;
+    mongo_conn->members_timer.cancelable = 1;
+    ngx_add_timer(&mongo_conn->members_timer, MONGO_HEDGE_POLL);
+}
+
+/*
+ * Start connecting to a member on its own, without waiting; member_poll
+ * sees it through.  Its address was resolved with the configuration.
+ */
+static void ngx_http_mongo_member_start(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn, ngx_http_mongo_member_t *member) {
+    ngx_socket_t s;
+
+    if (member->retry > ngx_time() || member->addr.sockaddr == NULL) {
+        return;
+    }
+
+    s = ngx_socket(member->addr.sockaddr->sa_family, SOCK_STREAM, 0);
+    if (s == (ngx_socket_t) -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_socket_errno, ngx_socket_n " failed");
+        return;
+    }
+
+    if (ngx_nonblocking(s) == -1
+        || (connect(s, member->addr.sockaddr, member->addr.socklen) == -1
+            && ngx_socket_errno != NGX_EINPROGRESS)) {
+        ngx_log_error(NGX_LOG_WARN, log, ngx_socket_errno,
+                      "Could not connect to mongo member: %s:%d", member->host, member->port);
+        ngx_close_socket(s);
+        member->retry = ngx_time() + MONGO_HEDGE_RETRY;
+        return;
+    }
+
+    member->fd = s;
+    member->connecting = 1;
+    member->since = ngx_current_msec;
+    ngx_http_mongo_members_arm(mongo_conn);
+}
+
+/* Hand a connected socket to the driver, as if it had connected itself. */
+static ngx_int_t ngx_http_mongo_member_connected(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn, ngx_http_mongo_member_t *member) {
+    ngx_pool_t *pool;
+    int nodelay = 1;
+
+    /* The connection outlives the request. */
+    pool = ngx_http_mongodb_rest_alloc_from(NULL);
+    if (member->conn.primary) {
+        mongo_destroy(&member->conn);
+    }
+    mongo_init(&member->conn);
+    ngx_http_mongodb_rest_alloc_from(pool);
+
+    (void) setsockopt(member->fd, IPPROTO_TCP, TCP_NODELAY, (const void *) &nodelay, sizeof(int));
+    member->conn.sock = member->fd;
+    member->conn.connected = 1;
+    member->pending = 0;
+    ngx_http_mongo_set_timeouts(log, mongo_conn, &member->conn);
+
+    /* A round trip, bounded by the send and read timeouts; only with auth. */
+    if (ngx_http_mongo_reauth(log, mongo_conn, &member->conn) != NGX_OK) {
+        mongo_disconnect(&member->conn);
+        member->retry = ngx_time() + MONGO_HEDGE_RETRY;
+        return NGX_DECLINED;
+    }
+
+    return NGX_OK;
+}
+
+/*
+ * Take a member a step further without waiting: see its connect through,
+ * or throw away the reply it owes once all of it is in.  NGX_OK when it can
+ * be asked, NGX_AGAIN while it cannot yet, NGX_DECLINED when it is not
+ * connected.  One that takes longer than the timeouts is given up on.
+ */
+static ngx_int_t ngx_http_mongo_member_poll(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn, ngx_http_mongo_member_t *member) {
+    struct pollfd pfd;
+    mongo_reply *reply;
+    socklen_t len;
+    int32_t size;
+    u_char header[4];
+    int err, avail;
+
+    if (member->connecting) {
+        pfd.fd = member->fd;
+        pfd.events = POLLOUT;
+        pfd.revents = 0;
+
+        if (poll(&pfd, 1, 0) == 1) {
+            err = 0;
+            len = sizeof(int);
+            if (getsockopt(member->fd, SOL_SOCKET, SO_ERROR, (void *) &err, &len) == -1) {
+                err = ngx_socket_errno;
+            }
+        } else if (ngx_current_msec - member->since < mongo_conn->connect_timeout) {
+            return NGX_AGAIN;
+        } else {
+            err = NGX_ETIMEDOUT;
+        }
+        member->connecting = 0;
+
+        if (err || ngx_blocking(member->fd) == -1) {
+            ngx_log_error(NGX_LOG_WARN, log, err,
+                          "Could not connect to mongo member: %s:%d", member->host, member->port);
+            ngx_close_socket(member->fd);
+            member->retry = ngx_time() + MONGO_HEDGE_RETRY;
+            return NGX_DECLINED;
+        }
+
+        return ngx_http_mongo_member_connected(log, mongo_conn, member);
+    }
+
+    if (!member->conn.connected) {
+        return NGX_DECLINED;
+    }
+
+    if (!member->pending) {
+        return NGX_OK;
+    }
+
+    pfd.fd = member->conn.sock;
+    pfd.events = POLLIN;
+    pfd.revents = 0;
+
+    if (poll(&pfd, 1, 0) == 1) {
+        /* Read only once the whole reply is in, as reading blocks until it is. */
+        err = recv(member->conn.sock, header, sizeof(header), MSG_PEEK | MSG_DONTWAIT);
+        if (err == (int) sizeof(header)) {
+            bson_little_endian32(&size, header);
+            if (ioctl(member->conn.sock, FIONREAD, &avail) != -1 && avail >= size) {
+                member->pending = 0;
+                if (mongo_read_response(&member->conn, &reply) == MONGO_OK) {
+                    bson_free(reply);
+                    return NGX_OK;
+                }
+                mongo_disconnect(&member->conn);
+                return NGX_DECLINED;
+            }
+        } else if (err == 0 || (err == -1 && ngx_socket_errno != NGX_EAGAIN)) {
+            member->pending = 0;
+            mongo_disconnect(&member->conn);
+            return NGX_DECLINED;
+        }
+    }
+
+    if (ngx_current_msec - member->since < mongo_conn->read_timeout) {
+        return NGX_AGAIN;
+    }
+
+    /* It will not answer now; a new connection rather than wait. */
+    member->pending = 0;
+    mongo_disconnect(&member->conn);
+    return NGX_DECLINED;
+}
+
+/* A member answered elsewhere still owes its reply; it is thrown away once in. */
+static void ngx_http_mongo_member_owe(ngx_http_mongo_connection_t *mongo_conn, ngx_http_mongo_member_t *member) {
+    member->pending = 1;
+    member->since = ngx_current_msec;
+    ngx_http_mongo_members_arm(mongo_conn);
+}
+
+static void ngx_http_mongo_members_poll(ngx_event_t *ev) {
+    ngx_http_mongo_connection_t *mongo_conn = ev->data;
+    ngx_http_mongo_member_t *members;
+    ngx_uint_t i, busy = 0;
+
+    members = mongo_conn->members->elts;
+
+    for (i = 0; i < mongo_conn->members->nelts; i++) {
+        if (members[i].connecting || members[i].pending) {
+            (void) ngx_http_mongo_member_poll(ev->log, mongo_conn, &members[i]);
+            busy |= members[i].connecting || members[i].pending;
+        }
+    }
+
+    if (busy) {
+        ngx_add_timer(ev, MONGO_HEDGE_POLL);
+    }
+}
+
+/*
+ * The next member, other than skip, that can be asked at once.  Those not
+ * connected are started on for later reads; none is waited for.
+ */
+static ngx_http_mongo_member_t *ngx_http_mongo_member_next(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn, ngx_http_mongo_member_t *skip) {
+    ngx_http_mongo_member_t *members, *member;
+    ngx_uint_t i;
+    ngx_int_t rc;
+
+    members = mongo_conn->members->elts;
+
+    for (i = 0; i < mongo_conn->members->nelts; i++) {
+        member = &members[mongo_conn->next_member++ % mongo_conn->members->nelts];
+        if (member == skip) {
+            continue;
+        }
+
+        rc = ngx_http_mongo_member_poll(log, mongo_conn, member);
+        if (rc == NGX_OK) {
+            return member;
+        }
+        if (rc == NGX_DECLINED) {
+            ngx_http_mongo_member_start(log, mongo_conn, member);
+        }
+    }
+
+    return NULL;
+}
+
+/* Seconds until a request may try the upstream again, or 0 to go ahead. */
+time_t ngx_http_mongodb_rest_health_allow(ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf, ngx_uint_t upstream) {
+    ngx_http_mongodb_rest_health_t *health = ngx_http_mongodb_rest_health[upstream];
+    ngx_atomic_uint_t retry;
+    time_t now;
+
+    switch (health->state) {
+        case NGX_HTTP_MONGODB_REST_CLOSED:
+            return 0;
+        case NGX_HTTP_MONGODB_REST_OPEN:
+            now = ngx_time();
+            if ((time_t) health->retry > now) {
+                return (time_t) health->retry - now;
+            }
+
+            /* Let one request through to see whether mongod is back. */
+            if (ngx_atomic_cmp_set(&health->state, NGX_HTTP_MONGODB_REST_OPEN,
+                                   NGX_HTTP_MONGODB_REST_HALF_OPEN)) {
+                health->retry = now + mongodb_rest_main_conf->health_retry;
+                return 0;
+            }
+            return MONGO_RETRY_AFTER;
+        default:
+            /* A probe that never reported, say one still reading its body, gives way. */
+            now = ngx_time();
+            retry = health->retry;
+            if ((time_t) retry <= now
+                && ngx_atomic_cmp_set(&health->retry, retry, now + mongodb_rest_main_conf->health_retry)) {
+                return 0;
+            }
+            return MONGO_RETRY_AFTER;
+    }
+}
+
+void ngx_http_mongodb_rest_health_report(ngx_log_t *log, ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf,
+                                                ngx_uint_t upstream, ngx_flag_t healthy) {
+    ngx_http_mongodb_rest_health_t *health = ngx_http_mongodb_rest_health[upstream];
+    ngx_http_mongodb_rest_loc_conf_t **upstreams = mongodb_rest_main_conf->upstreams.elts;
+    ngx_atomic_uint_t state, failures;
+
+    state = health->state;
+
+    if (healthy) {
+        if (health->failures) {
+            health->failures = 0;
+        }
+        if (state != NGX_HTTP_MONGODB_REST_CLOSED
+            && ngx_atomic_cmp_set(&health->state, state, NGX_HTTP_MONGODB_REST_CLOSED)) {
+            ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                          "Mongo circuit closed: \"%V\"", &upstreams[upstream]->mongo);
+        }
+        return;
+    }
+
+    failures = ngx_atomic_fetch_add(&health->failures, 1) + 1;
+
+    if (state == NGX_HTTP_MONGODB_REST_HALF_OPEN
+        || (state == NGX_HTTP_MONGODB_REST_CLOSED && failures >= mongodb_rest_main_conf->health_fails)) {
+        health->retry = ngx_time() + mongodb_rest_main_conf->health_retry;
+        if (ngx_atomic_cmp_set(&health->state, state, NGX_HTTP_MONGODB_REST_OPEN)) {
+            ngx_log_error(NGX_LOG_WARN, log, 0,
+                          "Mongo circuit open after %uA failures: \"%V\"",
+                          failures, &upstreams[upstream]->mongo);
+        }
+    }
+}
+
+/* A request's outcome: a timeout or a broken connection counts against the circuit. */
+static void ngx_http_mongodb_rest_health_outcome(ngx_http_request_t *request, ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_conf,
+                                                 mongo *conn, ngx_int_t rc) {
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf;
+
+    mongodb_rest_main_conf = ngx_http_get_module_main_conf(request, ngx_http_mongodb_rest_module);
+    if (!mongodb_rest_main_conf->health_check || rc == NGX_DONE) {
+        return;
+    }
+
+    ngx_http_mongodb_rest_health_report(request->connection->log, mongodb_rest_main_conf, mongodb_rest_conf->upstream,
+                                        rc != NGX_HTTP_GATEWAY_TIME_OUT && conn->err != MONGO_IO_ERROR);
+}
+
+static char h_digit(char hex) {
+    return (hex >= '0' && hex <= '9') ? hex - '0': ngx_tolower(hex)-'a'+10;
+}
+
+static int htoi(char* h) {
+    char ok[] = "0123456789AaBbCcDdEeFf";
+
+    if (ngx_strchr(ok, h[0]) == NULL || ngx_strchr(ok,h[1]) == NULL) { return -1; }
+    return h_digit(h[0])*16 + h_digit(h[1]);
+}
+
+static int url_decode(char * filename) {
+    char * read = filename;
+    char * write = filename;
+    char hex[3];
+    int c;
+
+    hex[2] = '\0';
+    while (*read != '\0'){
+        if (*read == '%') {
+            hex[0] = *(++read);
+            if (hex[0] == '\0') return 0;
+            hex[1] = *(++read);
+            if (hex[1] == '\0') return 0;
+            c = htoi(hex);
+            if (c == -1) return 0;
+            *write = (char)c;
+        }
+        else *write = *read;
+        read++;
+        write++;
+    }
+    *write = '\0';
+    return 1;
+}
+
+/* What follows the location in the URI, decoded. */
+ngx_int_t ngx_http_mongodb_rest_path(ngx_http_request_t * request, char ** value) {
+  ngx_http_core_loc_conf_t * core_conf;
+  size_t len;
+
+  core_conf = ngx_http_get_module_loc_conf(request, ngx_http_core_module);
+
+  if(request->uri.len < core_conf->name.len) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  len = request->uri.len - core_conf->name.len;
+
+  *value = ngx_pnalloc(request->pool, len + 1);
+  if(*value == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  *ngx_cpymem(*value, request->uri.data + core_conf->name.len, len) = '\0';
+
+  return url_decode(*value) ? NGX_OK : NGX_HTTP_BAD_REQUEST;
+}
+
+/* A decimal int32, as keys of type int are written, perhaps negative. */
+ngx_int_t ngx_http_mongodb_rest_atoi32(const u_char * p, size_t len, int32_t * n) {
+  ngx_int_t v;
+  unsigned neg;
+
+  neg = (len > 1 && *p == '-');
+  if(neg) {
+    p++;
+    len--;
+  }
+
+  v = ngx_atoi((u_char *) p, len);
+  if(v == NGX_ERROR || v > (ngx_int_t) NGX_MAX_INT32_VALUE + neg) {
+    return NGX_ERROR;
+  }
+
+  *n = (int32_t) (neg ? -v : v);
+  return NGX_OK;
+}
+
+unsigned char ngx_http_mongodb_rest_append_value_n(bson * b, bson_type type, const char * field, const char * value, size_t len) {
+  bson_oid_t oid;
+  char hex[25];
+  int32_t n;
+
+  switch (type) {
+    case  BSON_OID:
+      if(len != 24) {
+        return 0;
+      }
+      ngx_cpystrn((u_char *) hex, (u_char *) value, sizeof(hex));
+      bson_oid_from_string(&oid, hex);
+      bson_append_oid(b, field, &oid);
+      break;
+    case BSON_INT:
+      if(ngx_http_mongodb_rest_atoi32((u_char *) value, len, &n) != NGX_OK) {
+        return 0;
+      }
+      bson_append_int(b, field, n);
+      break;
+    case BSON_STRING:
+      bson_append_string_n(b, field, value, len);
+      break;
+    default:
+      return 0;
+      break;
+  }
+
+  return 1;
+}
+
+unsigned char ngx_http_mongodb_rest_append_value(bson * b, bson_type type, const char * field, const char * value) {
+  return ngx_http_mongodb_rest_append_value_n(b, type, field, value, ngx_strlen(value));
+}
+
+/*
+ * Split a key from the URI into one segment per field.  Only compound keys
+ * are split, so a single string key may still contain '/'.
+ */
+ngx_uint_t ngx_http_mongodb_rest_key_split(ngx_http_mongodb_rest_loc_conf_t * conf, const char * value, ngx_str_t * segs) {
+  const char * slash;
+  ngx_uint_t n;
+
+  if(conf->keys->nelts == 1) {
+    segs[0].data = (u_char *) value;
+    segs[0].len = ngx_strlen(value);
+    return 1;
+  }
+
+  for(n = 0; n < conf->keys->nelts; n++) {
+    slash = strchr(value, '/');
+    segs[n].data = (u_char *) value;
+    segs[n].len = slash ? (size_t) (slash - value) : ngx_strlen(value);
+    if(slash == NULL) {
+      return n + 1;
+    }
+    value = slash + 1;
+  }
+
+  /* More segments than fields. */
+  return n + 1;
+}
+
+/* Whether value names a document at all, before asking mongod. */
+unsigned char ngx_http_mongodb_rest_key_valid(ngx_http_mongodb_rest_loc_conf_t * conf, const char * value) {
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  ngx_str_t segs[MONGO_MAX_KEY_FIELDS + 1];
+  ngx_uint_t i;
+  int32_t n;
+
+  if(ngx_http_mongodb_rest_key_split(conf, value, segs) != conf->keys->nelts) {
+    return 0;
+  }
+
+  for(i = 0; i < conf->keys->nelts; i++) {
+    if(segs[i].len == 0 || (keys[i].type == BSON_OID && segs[i].len != 24)
+       || (keys[i].type == BSON_INT && ngx_http_mongodb_rest_atoi32(segs[i].data, segs[i].len, &n) != NGX_OK)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/* Append the fields of the key named by value. */
+unsigned char ngx_http_mongodb_rest_append_key(bson * b, ngx_http_mongodb_rest_loc_conf_t * conf, const char * value) {
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  ngx_str_t segs[MONGO_MAX_KEY_FIELDS + 1];
+  ngx_uint_t i;
+
+  if(ngx_http_mongodb_rest_key_split(conf, value, segs) != conf->keys->nelts) {
+    return 0;
+  }
+
+  for(i = 0; i < conf->keys->nelts; i++) {
+    if(!ngx_http_mongodb_rest_append_value_n(b, keys[i].type, (char *) keys[i].field.data,
+                                             (char *) segs[i].data, segs[i].len)) {
+      return 0;
+    }
+  }
+
+  return 1;
+}
+
+/*
+ * Documents after the key named by after, in key order; with an id, also
+ * those with the same key and a greater _id, as listings order ties by _id.
+ */
+static unsigned char ngx_http_mongodb_rest_append_after(bson * b, ngx_http_mongodb_rest_loc_conf_t * conf, const char * after, bson_type id_type, ngx_str_t * id) {
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  ngx_str_t segs[MONGO_MAX_KEY_FIELDS + 1];
+  ngx_uint_t i, j;
+  u_char num[NGX_INT_T_LEN + 1];
+  unsigned char ok = 1;
+
+  if(ngx_http_mongodb_rest_key_split(conf, after, segs) != conf->keys->nelts) {
+    return 0;
+  }
+
+  if(conf->keys->nelts == 1 && id == NULL) {
+    bson_append_start_object(b, (char *) keys[0].field.data);
+    ok = ngx_http_mongodb_rest_append_value_n(b, keys[0].type, "$gt", (char *) segs[0].data, segs[0].len);
+    bson_append_finish_object(b);
+    return ok;
+  }
+
+  /* {$or: [{a: {$gt: 1}}, {a: 1, b: {$gt: 2}}, ..., {a: 1, b: 2, _id: {$gt: 3}}]} */
+  bson_append_start_array(b, "$or");
+  for(i = 0; i < conf->keys->nelts + (id != NULL); i++) {
+    *ngx_sprintf(num, "%ui", i) = '\0';
+    bson_append_start_object(b, (char *) num);
+    for(j = 0; j < i && j < conf->keys->nelts; j++) {
+      ok &= ngx_http_mongodb_rest_append_value_n(b, keys[j].type, (char *) keys[j].field.data,
+                                                 (char *) segs[j].data, segs[j].len);
+    }
+    if(i < conf->keys->nelts) {
+      bson_append_start_object(b, (char *) keys[i].field.data);
+      ok &= ngx_http_mongodb_rest_append_value_n(b, keys[i].type, "$gt", (char *) segs[i].data, segs[i].len);
+    } else {
+      bson_append_start_object(b, "_id");
+      ok &= ngx_http_mongodb_rest_append_value_n(b, id_type, "$gt", (char *) id->data, id->len);
+    }
+    bson_append_finish_object(b);
+    bson_append_finish_object(b);
+  }
+  bson_append_finish_array(b);
+
+  return ok;
+}
+
+unsigned char ngx_http_mongodb_rest_query_init(bson * query, ngx_http_mongodb_rest_loc_conf_t * conf, const char * value) {
+  bson_init(query);
+  if(!ngx_http_mongodb_rest_append_key(query, conf, value)) {
+    bson_destroy(query);
+    return 0;
+  }
+  bson_finish(query);
+
+  /*int ql = json_length(&query);
+  char * qs = (char *) ngx_palloc(request->pool, ql);
+  tojson(&query, qs);
+  ngx_log_error(NGX_LOG_DEBUG, request->connection->log,0, qs);*/
+
+  return 1;
+}
+
+/*
+ * As above, but mongod gives up after max_time, as the request will, and
+ * hints at the index found for the key, if any.
+ */
+static unsigned char ngx_http_mongodb_rest_query_deadline(bson * query, ngx_http_mongodb_rest_loc_conf_t * conf, const char * value, ngx_msec_t max_time) {
+  bson_init(query);
+  bson_append_start_object(query, "$query");
+  if(!ngx_http_mongodb_rest_append_key(query, conf, value)) {
+    bson_destroy(query);
+    return 0;
+  }
+  bson_append_finish_object(query);
+  bson_append_long(query, "$maxTimeMS", (int64_t) max_time);
+  if(conf->hint) {
+    bson_append_string(query, "$hint", conf->hint);
+  }
+  bson_finish(query);
+
+  return 1;
+}
+
+/* A copy of query without its $hint, for when the index is gone. */
+void ngx_http_mongodb_rest_unhint(bson * out, const bson * query) {
+  bson_iterator it;
+
+  bson_init(out);
+  bson_iterator_init(&it, query);
+  while(bson_iterator_next(&it) != BSON_EOO) {
+    if(ngx_strcmp(bson_iterator_key(&it), "$hint") != 0) {
+      bson_append_element(out, NULL, &it);
+    }
+  }
+  bson_finish(out);
+}
+
+/* What is left of the read timeout since the request arrived. */
+ngx_msec_int_t ngx_http_mongodb_rest_remaining(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  ngx_time_t * tp;
+  ngx_msec_int_t elapsed;
+
+  tp = ngx_timeofday();
+  elapsed = (ngx_msec_int_t) ((tp->sec - request->start_sec) * 1000 + (tp->msec - request->start_msec));
+
+  return (ngx_msec_int_t) conf->read_timeout - elapsed;
+}
+
+/* Whether the client has gone away while we were blocked on mongod. */
+unsigned char ngx_http_mongodb_rest_client_gone(ngx_http_request_t * request) {
+  ngx_connection_t * c = request->connection;
+  ssize_t n;
+  u_char buf[1];
+
+#if (NGX_HTTP_V2)
+  if(request->stream) {
+    return 0;
+  }
+#endif
+
+  if(c->error) {
+    return 1;
+  }
+
+  n = recv(c->fd, buf, 1, MSG_PEEK);
+  return n == 0 || (n == -1 && ngx_socket_errno != NGX_EAGAIN);
+}
+
+/* The ?fields= argument overrides the location's projection. */
+ngx_int_t ngx_http_mongodb_rest_projection(ngx_http_request_t* request, bson * fields, bson ** projection) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_str_t arg;
+  u_char * dst, * src;
+
+  conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
+  *projection = conf->projection;
+
+  if(ngx_http_arg(request, (u_char *) "fields", 6, &arg) != NGX_OK) {
+    return NGX_OK;
+  }
+
+  dst = ngx_pnalloc(request->pool, arg.len);
+  if(dst == NULL) {
+    return NGX_ERROR;
+  }
+
+  src = arg.data;
+  arg.data = dst;
+  ngx_unescape_uri(&dst, &src, arg.len, NGX_UNESCAPE_URI);
+  arg.len = dst - arg.data;
+
+  if(ngx_http_mongodb_rest_fields_init(fields, arg.data, arg.len) != NGX_OK) {
+    return NGX_DECLINED;
+  }
+
+  *projection = fields;
+  return NGX_OK;
+}
+
+#define ngx_http_mongodb_rest_media_is(p, len, s)                            \
+  ((len) == sizeof(s) - 1 && ngx_strncasecmp(p, (u_char *) s, sizeof(s) - 1) == 0)
+
+/* The q parameter among a media range's parameters, in thousandths. */
+static ngx_uint_t ngx_http_mongodb_rest_qvalue(u_char * p, u_char * last) {
+  ngx_uint_t q, scale;
+
+  while((p = ngx_strlchr(p, last, ';')) != NULL) {
+    for(p++; p < last && (*p == ' ' || *p == '\t'); p++) { /* void */ }
+
+    if(last - p < 2 || (*p != 'q' && *p != 'Q') || p[1] != '=') {
+      continue;
+    }
+
+    p += 2;
+    if(p == last || *p < '0' || *p > '9') {
+      return 0;
+    }
+
+    q = (*p++ - '0') * 1000;
+    if(p < last && *p == '.') {
+      for(p++, scale = 100; p < last && scale && *p >= '0' && *p <= '9'; p++, scale /= 10) {
+        q += (*p - '0') * scale;
+      }
+    }
+
+    return ngx_min(q, 1000);
+  }
+
+  return 1000;
+}
+
+/*
+ * The format of the media range with the highest q; at equal q a named
+ * type beats a wildcard, then the first one listed wins. q=0 never does.
+ */
+ngx_http_mongodb_rest_format_e ngx_http_mongodb_rest_format(ngx_http_request_t* request) {
+  ngx_http_mongodb_rest_format_e format, best;
+  ngx_list_part_t * part;
+  ngx_table_elt_t * h;
+  ngx_uint_t i, q, bestq, named, best_named;
+  u_char * p, * last, * comma, * end;
+  size_t len;
+
+  best = NGX_HTTP_MONGODB_REST_JSON;
+  bestq = 0;
+  best_named = 0;
+
+  part = &request->headers_in.headers.part;
+  h = part->elts;
+
+  for(i = 0; /* void */; i++) {
+    if(i >= part->nelts) {
+      if(part->next == NULL) {
+        break;
+      }
+      part = part->next;
+      h = part->elts;
+      i = 0;
+    }
+
+    if(h[i].key.len != sizeof("Accept") - 1
+       || ngx_strncasecmp(h[i].key.data, (u_char *) "Accept", sizeof("Accept") - 1) != 0) {
+      continue;
+    }
+
+    last = h[i].value.data + h[i].value.len;
+
+    for(p = h[i].value.data; p < last; p = comma + 1) {
+      comma = ngx_strlchr(p, last, ',');
+      if(comma == NULL) {
+        comma = last;
+      }
+
+      for( ; p < comma && (*p == ' ' || *p == '\t'); p++) { /* void */ }
+
+      end = ngx_strlchr(p, comma, ';');
+      if(end == NULL) {
+        end = comma;
+      }
+      q = ngx_http_mongodb_rest_qvalue(end, comma);
+
+      for( ; end > p && (end[-1] == ' ' || end[-1] == '\t'); end--) { /* void */ }
+      len = end - p;
+
+      named = 1;
+      if(ngx_http_mongodb_rest_media_is(p, len, "application/bson")) {
+        format = NGX_HTTP_MONGODB_REST_BSON;
+      } else if(ngx_http_mongodb_rest_media_is(p, len, "application/msgpack")
+                || ngx_http_mongodb_rest_media_is(p, len, "application/x-msgpack")) {
+        format = NGX_HTTP_MONGODB_REST_MSGPACK;
+      } else if(ngx_http_mongodb_rest_media_is(p, len, "application/json")) {
+        format = NGX_HTTP_MONGODB_REST_JSON;
+      } else if(ngx_http_mongodb_rest_media_is(p, len, "application/*")
+                || ngx_http_mongodb_rest_media_is(p, len, "*/*")) {
+        format = NGX_HTTP_MONGODB_REST_JSON;
+        named = 0;
+      } else {
+        continue;
+      }
+
+      if(q > bestq || (q == bestq && q && named && !best_named)) {
+        best = format;
+        bestq = q;
+        best_named = named;
+      }
+    }
+  }
+
+  return best;
+}
+
+static void ngx_http_mongodb_rest_cleanup(void* data) {
+  ngx_http_mongodb_rest_cleanup_t * cleanup = data;
+  ngx_uint_t i;
+
+  for(i = 0; i < cleanup->numchunks; i++) {
+    mongo_cursor_destroy(cleanup->cursors[i]);
+  }
+}
+
+/* Serialize b into the pool; JSON output is not null terminated. */
+ngx_int_t ngx_http_mongodb_rest_serialize(ngx_pool_t * pool, ngx_http_mongodb_rest_format_e format, const bson * b, ngx_str_t * out) {
+  switch(format) {
+    case NGX_HTTP_MONGODB_REST_BSON:
+      out->len = bson_size(b);
+      out->data = ngx_pnalloc(pool, out->len);
+      if(out->data == NULL) {
+        return NGX_ERROR;
+      }
+      ngx_memcpy(out->data, b->data, out->len);
+      break;
+
+    case NGX_HTTP_MONGODB_REST_MSGPACK:
+      out->len = msgpack_length(b);
+      out->data = ngx_pnalloc(pool, out->len);
+      if(out->data == NULL) {
+        return NGX_ERROR;
+      }
+      tomsgpack(b, (char *) out->data);
+      break;
+
+    default:
+      out->len = json_length(b);
+      out->data = ngx_pnalloc(pool, out->len);
+      if(out->data == NULL) {
+        return NGX_ERROR;
+      }
+      tojson(b, (char *) out->data);
+      out->len--; // Don't write NULL
+      break;
+  }
+
+  return NGX_OK;
+}
+
+static void ngx_http_mongodb_rest_content_type(ngx_http_request_t* request, ngx_http_mongodb_rest_format_e format) {
+  switch(format) {
+    case NGX_HTTP_MONGODB_REST_BSON:
+      ngx_str_set(&request->headers_out.content_type, "application/bson");
+      break;
+    case NGX_HTTP_MONGODB_REST_MSGPACK:
+      ngx_str_set(&request->headers_out.content_type, "application/msgpack");
+      break;
+    default:
+      ngx_str_set(&request->headers_out.content_type, "text/json");
+      break;
+  }
+}
+
+static ngx_int_t ngx_http_mongodb_rest_add_header(ngx_http_request_t* request, char * key, ngx_str_t * value) {
+  ngx_table_elt_t * h;
+
+  h = ngx_list_push(&request->headers_out.headers);
+  if(h == NULL) {
+    return NGX_ERROR;
+  }
+
+  h->hash = 1;
+  h->key.data = (u_char *) key;
+  h->key.len = ngx_strlen(key);
+  h->value = *value;
+
+  return NGX_OK;
+}
+
+/* Ask the client to come back later. */
+ngx_int_t ngx_http_mongodb_rest_retry_after(ngx_http_request_t* request, time_t seconds) {
+  ngx_str_t value;
+
+  value.data = ngx_pnalloc(request->pool, NGX_TIME_T_LEN);
+  if(value.data == NULL) {
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+  }
+  value.len = ngx_sprintf(value.data, "%T", seconds) - value.data;
+
+  ngx_http_mongodb_rest_add_header(request, "Retry-After", &value);
+
+  return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+/* Send the headers, then the chain. */
+ngx_int_t ngx_http_mongodb_rest_send(ngx_http_request_t* request, ngx_http_mongodb_rest_format_e format, off_t length, ngx_chain_t * out) {
+  ngx_str_t accept = ngx_string("Accept");
+  ngx_int_t rc;
+
+  // ---------- SEND THE HEADERS ---------- //
+
+  if(ngx_http_mongodb_rest_add_header(request, "Vary", &accept) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ngx_http_mongodb_rest_content_type(request, format);
+  request->headers_out.status = NGX_HTTP_OK;
+  request->headers_out.content_length_n = length;
+
+  rc = ngx_http_send_header(request);
+  if(rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
+    return rc;
+  }
+
+  // ---------- SEND THE BODY ---------- //
+
+  return ngx_http_output_filter(request, out);
+}
+
+ngx_chain_t * ngx_http_mongodb_rest_chain(ngx_pool_t * pool, u_char * pos, size_t len) {
+  ngx_chain_t * cl;
+  ngx_buf_t * buffer;
+
+  /* Allocate space for the response buffer */
+  buffer = ngx_calloc_buf(pool);
+  cl = ngx_alloc_chain_link(pool);
+  if(buffer == NULL || cl == NULL) {
+    return NULL;
+  }
+
+  /* Set up the buffer chain */
+  buffer->pos = pos;
+  buffer->last = pos + len;
+  buffer->memory = 1;
+  cl->buf = buffer;
+  cl->next = NULL;
+
+  return cl;
+}
+
+/*
+ * Serialize b in the negotiated format and send it.  When the document
+ * belongs to cursor and BSON is wanted, the reply buffer itself is sent and
+ * the cursor is destroyed with the request; otherwise the cursor is
+ * destroyed as soon as b has been copied.
+ */
+static ngx_int_t ngx_http_mongodb_rest_send_document(ngx_http_request_t* request, const bson * b, mongo_cursor * cursor) {
+  ngx_http_mongodb_rest_format_e format;
+  ngx_pool_cleanup_t * cln;
+  ngx_http_mongodb_rest_cleanup_t * cleanup;
+  ngx_chain_t * out;
+  ngx_str_t s;
+
+  format = ngx_http_mongodb_rest_format(request);
+
+  if(format == NGX_HTTP_MONGODB_REST_BSON && cursor) {
+    cln = ngx_pool_cleanup_add(request->pool, sizeof(ngx_http_mongodb_rest_cleanup_t));
+    if(cln == NULL) {
+      mongo_cursor_destroy(cursor);
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    cleanup = cln->data;
+    cleanup->cursors = ngx_palloc(request->pool, sizeof(mongo_cursor *));
+    if(cleanup->cursors == NULL) {
+      mongo_cursor_destroy(cursor);
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    cleanup->cursors[0] = cursor;
+    cleanup->numchunks = 1;
+    cln->handler = ngx_http_mongodb_rest_cleanup;
+
+    s.data = (u_char *) b->data;
+    s.len = bson_size(b);
+  } else {
+    if(ngx_http_mongodb_rest_serialize(request->pool, format, b, &s) != NGX_OK) {
+      if(cursor) { mongo_cursor_destroy(cursor); }
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(cursor) { mongo_cursor_destroy(cursor); }
+  }
+
+  out = ngx_http_mongodb_rest_chain(request->pool, s.data, s.len);
+  if(out == NULL) {
+    ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+		  "Failed to allocate response buffer");
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  out->buf->last_buf = 1;
+
+  return ngx_http_mongodb_rest_send(request, format, s.len, out);
+}
+
+static void ngx_http_mongodb_rest_cursor_free(ngx_http_mongodb_rest_cursor_t * c) {
+  /* Sends killCursors if the server cursor is still open. */
+  mongo_cursor_destroy(&c->cursor);
+  bson_destroy(&c->query);
+  if(c->fields.data) {
+    bson_destroy(&c->fields);
+  }
+  ngx_free(c);
+}
+
+static void ngx_http_mongodb_rest_cursor_remove(ngx_http_mongodb_rest_cursor_t * c) {
+  ngx_rbtree_delete(&ngx_http_mongodb_rest_cursors, &c->node);
+  ngx_queue_remove(&c->queue);
+  ngx_http_mongodb_rest_ncursors--;
+}
+
+static ngx_http_mongodb_rest_cursor_t * ngx_http_mongodb_rest_cursor_lookup(ngx_rbtree_key_t id) {
+  ngx_rbtree_node_t * node, * sentinel;
+
+  node = ngx_http_mongodb_rest_cursors.root;
+  sentinel = ngx_http_mongodb_rest_cursors.sentinel;
+
+  while(node != sentinel) {
+    if(id < node->key) {
+      node = node->left;
+    } else if(id > node->key) {
+      node = node->right;
+    } else {
+      return (ngx_http_mongodb_rest_cursor_t *) node;
+    }
+  }
+
+  return NULL;
+}
+
+/* Keep c open for the next page, evicting the oldest cursor if full. */
+static ngx_rbtree_key_t ngx_http_mongodb_rest_cursor_park(ngx_http_mongodb_rest_cursor_t * c) {
+  ngx_http_mongodb_rest_cursor_t * oldest;
+
+  if(ngx_http_mongodb_rest_ncursors >= MONGO_MAX_CURSORS) {
+    oldest = ngx_queue_data(ngx_queue_head(&ngx_http_mongodb_rest_cursors_queue),
+                            ngx_http_mongodb_rest_cursor_t, queue);
+    ngx_http_mongodb_rest_cursor_remove(oldest);
+    ngx_http_mongodb_rest_cursor_free(oldest);
+  }
+
+  c->node.key = ++ngx_http_mongodb_rest_cursor_id;
+  c->expires = ngx_current_msec + c->conf->cursor_timeout;
+
+  ngx_rbtree_insert(&ngx_http_mongodb_rest_cursors, &c->node);
+  ngx_queue_insert_tail(&ngx_http_mongodb_rest_cursors_queue, &c->queue);
+  ngx_http_mongodb_rest_ncursors++;
+
+  return c->node.key;
+}
+
+static void ngx_http_mongodb_rest_cursor_reap(ngx_event_t * ev) {
+  ngx_queue_t * q, * next;
+  ngx_http_mongodb_rest_cursor_t * c;
+
+  for(q = ngx_queue_head(&ngx_http_mongodb_rest_cursors_queue);
+      q != ngx_queue_sentinel(&ngx_http_mongodb_rest_cursors_queue);
+      q = next) {
+    next = ngx_queue_next(q);
+    c = ngx_queue_data(q, ngx_http_mongodb_rest_cursor_t, queue);
+
+    if((ngx_msec_int_t) (c->expires - ngx_current_msec) <= 0) {
+      ngx_http_mongodb_rest_cursor_remove(c);
+      ngx_http_mongodb_rest_cursor_free(c);
+    }
+  }
+
+  if(!ngx_exiting) {
+    ngx_add_timer(ev, MONGO_CURSOR_REAP_INTERVAL);
+  }
+}
+
+/*
+ * Whether listings order documents with the same key by _id: unless the key
+ * has it, or the index found at startup makes the key unique.
+ */
+static unsigned char ngx_http_mongodb_rest_tiebreak(ngx_http_mongodb_rest_loc_conf_t * conf) {
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  ngx_uint_t i;
+
+  for(i = 0; i < conf->keys->nelts; i++) {
+    if(ngx_strcmp(keys[i].field.data, "_id") == 0) {
+      return 0;
+    }
+  }
+
+  return !conf->hint_unique;
+}
+
+/* Scan the collection in key order, starting after the given key and id. */
+static ngx_http_mongodb_rest_cursor_t * ngx_http_mongodb_rest_cursor_open(ngx_log_t * log, mongo * conn, ngx_http_mongodb_rest_loc_conf_t * conf, bson * projection, const char * after, bson_type id_type, ngx_str_t * id, ngx_msec_t max_time) {
+  ngx_http_mongodb_rest_cursor_t * c;
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  ngx_uint_t i;
+  unsigned char tiebreak;
+
+  c = ngx_alloc(sizeof(ngx_http_mongodb_rest_cursor_t), log);
+  if(c == NULL) {
+    return NULL;
+  }
+  ngx_memzero(c, sizeof(ngx_http_mongodb_rest_cursor_t));
+  c->conf = conf;
+
+  /* The driver only points at the projection; keep it as long as the cursor. */
+  if(projection && bson_copy(&c->fields, projection) != BSON_OK) {
+    ngx_free(c);
+    return NULL;
+  }
+
+  tiebreak = ngx_http_mongodb_rest_tiebreak(conf);
+
+  bson_init(&c->query);
+  bson_append_start_object(&c->query, "$query");
+  if(after && !ngx_http_mongodb_rest_append_after(&c->query, conf, after, id_type, id)) {
+    bson_destroy(&c->query);
+    if(c->fields.data) { bson_destroy(&c->fields); }
+    ngx_free(c);
+    return NULL;
+  }
+  bson_append_finish_object(&c->query);
+  bson_append_start_object(&c->query, "$orderby");
+  for(i = 0; i < conf->keys->nelts; i++) {
+    bson_append_int(&c->query, (char *) keys[i].field.data, 1);
+  }
+  if(tiebreak) {
+    bson_append_int(&c->query, "_id", 1);
+  }
+  bson_append_finish_object(&c->query);
+  /* Counts server time over every page read from this cursor. */
+  bson_append_long(&c->query, "$maxTimeMS", (int64_t) max_time);
+  /* An index on the key alone cannot give the order of ties; leave it to the planner. */
+  if(conf->hint && (!tiebreak || conf->hint_id)) {
+    bson_append_string(&c->query, "$hint", conf->hint);
+  }
+  bson_finish(&c->query);
+
+  mongo_cursor_init(&c->cursor, conn, (char *) conf->ns.data);
+  mongo_cursor_set_query(&c->cursor, &c->query);
+  if(projection) {
+    mongo_cursor_set_fields(&c->cursor, &c->fields);
+  }
+
+  return c;
+}
+
+/* Whether c was opened with the projection; a server cursor cannot change it. */
+static unsigned char ngx_http_mongodb_rest_cursor_fields(ngx_http_mongodb_rest_cursor_t * c, bson * projection) {
+  if(projection == NULL || c->fields.data == NULL) {
+    return projection == NULL && c->fields.data == NULL;
+  }
+
+  return bson_size(projection) == bson_size(&c->fields)
+         && ngx_memcmp(projection->data, c->fields.data, bson_size(projection)) == 0;
+}
+
+/* As bson_find, following a dotted path into subobjects. */
+static bson_type ngx_http_mongodb_rest_find(bson_iterator * it, const bson * b, const char * field) {
+  char name[MONGO_MAX_FIELD_NAME + 1];
+  const char * dot;
+  bson sub;
+
+  dot = strchr(field, '.');
+  if(dot == NULL) {
+    return bson_find(it, b, field);
+  }
+
+  ngx_cpystrn((u_char *) name, (u_char *) field, dot - field + 1);
+  if(bson_find(it, b, name) != BSON_OBJECT) {
+    return BSON_EOO;
+  }
+  bson_iterator_subobject(it, &sub);
+
+  return ngx_http_mongodb_rest_find(it, &sub, dot + 1);
+}
+
+/* Whether a string field of b's compound key holds a '/', which no URI can name. */
+static unsigned char ngx_http_mongodb_rest_key_slash(ngx_http_mongodb_rest_loc_conf_t * conf, const bson * b) {
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  bson_iterator it;
+  ngx_uint_t i;
+
+  if(conf->keys->nelts == 1) {
+    return 0;
+  }
+
+  for(i = 0; i < conf->keys->nelts; i++) {
+    if(keys[i].type == BSON_STRING
+       && ngx_http_mongodb_rest_find(&it, b, (char *) keys[i].field.data) == BSON_STRING
+       && strchr(bson_iterator_string(&it), '/') != NULL) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* The value of one key field of b, as it would appear in a URI. */
+static ngx_int_t ngx_http_mongodb_rest_field_string(ngx_pool_t * pool, const bson * b, bson_type type, const char * field, ngx_str_t * key) {
+  bson_iterator it;
+
+  if(ngx_http_mongodb_rest_find(&it, b, field) != type) {
+    return NGX_DECLINED;
+  }
+
+  switch(type) {
+    case BSON_OID:
+      key->data = ngx_pnalloc(pool, 25);
+      if(key->data == NULL) {
+        return NGX_ERROR;
+      }
+      bson_oid_to_string(bson_iterator_oid(&it), (char *) key->data);
+      key->len = 24;
+      break;
+    case BSON_INT:
+      key->data = ngx_pnalloc(pool, NGX_INT32_LEN);
+      if(key->data == NULL) {
+        return NGX_ERROR;
+      }
+      key->len = ngx_sprintf(key->data, "%D", (int32_t) bson_iterator_int(&it)) - key->data;
+      break;
+    case BSON_STRING:
+      key->len = bson_iterator_string_len(&it) - 1;
+      key->data = ngx_pnalloc(pool, key->len);
+      if(key->data == NULL) {
+        return NGX_ERROR;
+      }
+      ngx_memcpy(key->data, bson_iterator_string(&it), key->len);
+      break;
+    default:
+      return NGX_DECLINED;
+  }
+
+  return NGX_OK;
+}
+
+/* The key of b as it would appear in a URI. */
+static ngx_int_t ngx_http_mongodb_rest_key_string(ngx_pool_t * pool, const bson * b, ngx_http_mongodb_rest_loc_conf_t * conf, ngx_str_t * key) {
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  ngx_str_t parts[MONGO_MAX_KEY_FIELDS];
+  ngx_uint_t i;
+  ngx_int_t rc;
+  u_char * p;
+
+  if(conf->keys->nelts == 1) {
+    return ngx_http_mongodb_rest_field_string(pool, b, keys[0].type, (char *) keys[0].field.data, key);
+  }
+
+  /* Split at the '/' it holds, the key would name another document. */
+  if(ngx_http_mongodb_rest_key_slash(conf, b)) {
+    return NGX_DECLINED;
+  }
+
+  key->len = conf->keys->nelts - 1;
+  for(i = 0; i < conf->keys->nelts; i++) {
+    rc = ngx_http_mongodb_rest_field_string(pool, b, keys[i].type, (char *) keys[i].field.data, &parts[i]);
+    if(rc != NGX_OK) {
+      return rc;
+    }
+    key->len += parts[i].len;
+  }
+
+  key->data = ngx_pnalloc(pool, key->len);
+  if(key->data == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = key->data;
+  for(i = 0; i < conf->keys->nelts; i++) {
+    if(i) { *p++ = '/'; }
+    p = ngx_cpymem(p, parts[i].data, parts[i].len);
+  }
+
+  return NGX_OK;
+}
+
+/* The _id of b for a continuation token: 'o', 'i' or 's' for its type, then its value. */
+static ngx_int_t ngx_http_mongodb_rest_id_string(ngx_pool_t * pool, const bson * b, ngx_str_t * id) {
+  bson_iterator it;
+  bson_type type;
+  ngx_str_t value;
+  ngx_int_t rc;
+  u_char t;
+
+  type = bson_find(&it, b, "_id");
+  switch(type) {
+    case BSON_OID: t = 'o'; break;
+    case BSON_INT: t = 'i'; break;
+    case BSON_STRING: t = 's'; break;
+    default: return NGX_DECLINED;
+  }
+
+  rc = ngx_http_mongodb_rest_field_string(pool, b, type, "_id", &value);
+  if(rc != NGX_OK) {
+    return rc;
+  }
+
+  id->data = ngx_pnalloc(pool, value.len + 1);
+  if(id->data == NULL) {
+    return NGX_ERROR;
+  }
+  id->data[0] = t;
+  ngx_memcpy(id->data + 1, value.data, value.len);
+  id->len = value.len + 1;
+
+  return NGX_OK;
+}
+
+/* Decode one base64url segment of a token, NUL terminated. */
+static ngx_int_t ngx_http_mongodb_rest_token_decode(ngx_pool_t * pool, u_char * start, u_char * end, ngx_str_t * dec) {
+  ngx_str_t enc;
+
+  enc.data = start;
+  enc.len = end - start;
+
+  dec->data = ngx_pnalloc(pool, ngx_base64_decoded_length(enc.len) + 1);
+  if(dec->data == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  if(ngx_decode_base64url(dec, &enc) != NGX_OK) {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+  dec->data[dec->len] = '\0';
+
+  return NGX_OK;
+}
+
+/*
+ * Tokens look like "pid.id.key[.last]": a cursor parked by worker pid, the
+ * base64url key of the last document sent and, when ties in the key are
+ * ordered by _id, its base64url _id as from id_string above, so that any
+ * worker can carry on from there when the cursor is elsewhere or gone.  A
+ * parked cursor is only taken up with the projection it was opened with.
+ */
+static ngx_int_t ngx_http_mongodb_rest_cursor_resume(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf, ngx_str_t * token, bson * projection, ngx_http_mongodb_rest_cursor_t ** cursor, char ** after, bson_type * id_type, ngx_str_t * id) {
+  ngx_http_mongodb_rest_cursor_t * c;
+  u_char * last, * dot1, * dot2, * dot3;
+  ngx_int_t pid, cid, rc;
+  ngx_str_t dec;
+
+  last = token->data + token->len;
+  dot1 = ngx_strlchr(token->data, last, '.');
+  dot2 = dot1 ? ngx_strlchr(dot1 + 1, last, '.') : NULL;
+  if(dot2 == NULL) {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+  dot3 = ngx_strlchr(dot2 + 1, last, '.');
+
+  pid = ngx_atoi(token->data, dot1 - token->data);
+  cid = ngx_atoi(dot1 + 1, dot2 - dot1 - 1);
+  if(pid == NGX_ERROR || cid == NGX_ERROR) {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  if(dot2 + 1 < (dot3 ? dot3 : last)) {
+    rc = ngx_http_mongodb_rest_token_decode(request->pool, dot2 + 1, dot3 ? dot3 : last, &dec);
+    if(rc != NGX_OK) {
+      return rc;
+    }
+    if(!ngx_http_mongodb_rest_key_valid(conf, (char *) dec.data)) {
+      return NGX_HTTP_BAD_REQUEST;
+    }
+    *after = (char *) dec.data;
+  }
+
+  if(dot3) {
+    rc = ngx_http_mongodb_rest_token_decode(request->pool, dot3 + 1, last, &dec);
+    if(rc != NGX_OK) {
+      return rc;
+    }
+    if(dec.len < 2 || *after == NULL) {
+      return NGX_HTTP_BAD_REQUEST;
+    }
+    switch(dec.data[0]) {
+      case 'o': *id_type = BSON_OID; break;
+      case 'i': *id_type = BSON_INT; break;
+      case 's': *id_type = BSON_STRING; break;
+      default: return NGX_HTTP_BAD_REQUEST;
+    }
+    id->data = dec.data + 1;
+    id->len = dec.len - 1;
+  }
+
+  if((ngx_pid_t) pid == ngx_pid) {
+    c = ngx_http_mongodb_rest_cursor_lookup((ngx_rbtree_key_t) cid);
+    if(c && c->conf == conf) {
+      ngx_http_mongodb_rest_cursor_remove(c);
+      if(ngx_http_mongodb_rest_cursor_fields(c, projection)) {
+        *cursor = c;
+        return NGX_OK;
+      }
+      ngx_http_mongodb_rest_cursor_free(c);
+    }
+  }
+
+  /* Neither the cursor nor a key to carry on from. */
+  if(*after == NULL) {
+    return NGX_HTTP_GONE;
+  }
+
+  return NGX_OK;
+}
+
+/* Chain a serialized document at ll, after n others; the next ll, or NULL. */
+ngx_chain_t ** ngx_http_mongodb_rest_append_doc(ngx_http_request_t* request, ngx_http_mongodb_rest_format_e format, const bson * b, ngx_chain_t ** ll, off_t * length, ngx_uint_t n) {
+  static u_char array_sep[] = ",";
+
+  ngx_str_t doc;
+
+  if(ngx_http_mongodb_rest_serialize(request->pool, format, b, &doc) != NGX_OK) {
+    return NULL;
+  }
+
+  if(n && format == NGX_HTTP_MONGODB_REST_JSON) {
+    *ll = ngx_http_mongodb_rest_chain(request->pool, array_sep, 1);
+    if(*ll == NULL) {
+      return NULL;
+    }
+    ll = &(*ll)->next;
+    (*length)++;
+  }
+
+  *ll = ngx_http_mongodb_rest_chain(request->pool, doc.data, doc.len);
+  if(*ll == NULL) {
+    return NULL;
+  }
+  *length += doc.len;
+
+  return &(*ll)->next;
+}
+
+/*
+ * Frame n documents, serialized and chained from out up to ll, as an array
+ * in the format.
+ */
+ngx_int_t ngx_http_mongodb_rest_frame_array(ngx_http_request_t* request, ngx_http_mongodb_rest_format_e format, ngx_uint_t n, off_t * length, ngx_chain_t ** out, ngx_chain_t ** ll) {
+  static u_char array_open[] = "[", array_close[] = "]";
+
+  ngx_chain_t * cl;
+  u_char * p;
+
+  switch(format) {
+    case NGX_HTTP_MONGODB_REST_JSON:
+      cl = ngx_http_mongodb_rest_chain(request->pool, array_open, 1);
+      *ll = ngx_http_mongodb_rest_chain(request->pool, array_close, 1);
+      (*length)++;
+      break;
+    case NGX_HTTP_MONGODB_REST_MSGPACK:
+      p = ngx_pnalloc(request->pool, 5);
+      cl = p ? ngx_http_mongodb_rest_chain(request->pool, p, msgpack_array_header(n, (char *) p)) : NULL;
+      *ll = ngx_http_mongodb_rest_chain(request->pool, NULL, 0);
+      break;
+    default:
+      /* BSON documents are simply concatenated. */
+      cl = NULL;
+      *ll = ngx_http_mongodb_rest_chain(request->pool, NULL, 0);
+      break;
+  }
+
+  if(*ll == NULL || (cl == NULL && format != NGX_HTTP_MONGODB_REST_BSON)) {
+    return NGX_ERROR;
+  }
+
+  if((*ll)->buf->pos == NULL) {
+    (*ll)->buf->memory = 0;
+  }
+  (*ll)->buf->last_buf = 1;
+
+  if(cl) {
+    *length += ngx_buf_size(cl->buf);
+    cl->next = *out;
+    *out = cl;
+  }
+
+  return NGX_OK;
+}
+
+/* As above, and send them. */
+ngx_int_t ngx_http_mongodb_rest_send_array(ngx_http_request_t* request, ngx_http_mongodb_rest_format_e format, ngx_uint_t n, off_t length, ngx_chain_t * out, ngx_chain_t ** ll) {
+  if(ngx_http_mongodb_rest_frame_array(request, format, n, &length, &out, ll) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  return ngx_http_mongodb_rest_send(request, format, length, out);
+}
+
+static ngx_int_t ngx_http_mongodb_rest_list_handler(ngx_http_request_t* request, mongo * conn, char * ns) {
+  static u_char array_sep[] = ",";
+
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongodb_rest_format_e format;
+  ngx_http_mongodb_rest_cursor_t * c = NULL;
+  ngx_chain_t * out = NULL, ** ll = &out;
+  ngx_str_t arg, doc, key, id, last_id, token;
+  ngx_uint_t n, limit;
+  ngx_int_t rc, status;
+  ngx_msec_int_t remaining;
+  off_t length = 0;
+  bson fields;
+  bson * projection;
+  bson_type id_type = BSON_EOO;
+  char * after = NULL;
+  unsigned resumed, tiebreak;
+  u_char * p;
+
+  conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
+  format = ngx_http_mongodb_rest_format(request);
+  tiebreak = ngx_http_mongodb_rest_tiebreak(conf);
+
+  limit = conf->page_size;
+  if(ngx_http_arg(request, (u_char *) "limit", 5, &arg) == NGX_OK) {
+    rc = ngx_atoi(arg.data, arg.len);
+    if(rc == NGX_ERROR || rc == 0) {
+      return NGX_HTTP_BAD_REQUEST;
+    }
+    limit = ngx_min((ngx_uint_t) rc, conf->page_size);
+  }
+
+  rc = ngx_http_mongodb_rest_projection(request, &fields, &projection);
+  if(rc != NGX_OK) {
+    return rc == NGX_DECLINED ? NGX_HTTP_BAD_REQUEST : NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ngx_str_null(&id);
+  if(ngx_http_arg(request, (u_char *) "continue", 8, &arg) == NGX_OK) {
+    rc = ngx_http_mongodb_rest_cursor_resume(request, conf, &arg, projection, &c, &after, &id_type, &id);
+    if(rc != NGX_OK) {
+      if(projection == &fields) { bson_destroy(&fields); }
+      return rc;
+    }
+  }
+  resumed = (c != NULL);
+
+  remaining = ngx_http_mongodb_rest_remaining(request, conf);
+
+  if(c == NULL) {
+    c = ngx_http_mongodb_rest_cursor_open(request->connection->log, conn, conf, projection,
+                                          after, id_type, id.data ? &id : NULL, remaining);
+  }
+
+  // ---------- RETRIEVE PAGE ---------- //
+  n = 0;
+  ngx_str_null(&key);
+  ngx_str_null(&last_id);
+  status = NGX_OK;
+
+  while(c && n < limit) {
+    if(mongo_cursor_next(&c->cursor) != MONGO_OK) {
+      if(c->cursor.err == MONGO_CURSOR_EXHAUSTED) {
+        break;
+      }
+      /*
+       * The server cursor is gone (timeout, reconnect), or the index hinted
+       * at was dropped; carry on from the key.
+       */
+      if(n == 0 && ((resumed && after)
+                    || (!resumed && ngx_http_mongodb_rest_hint_lost(request->connection->log, conf, conn->lasterrcode, conn->lasterrstr)))) {
+        ngx_http_mongodb_rest_cursor_free(c);
+        c = ngx_http_mongodb_rest_cursor_open(request->connection->log, conn, conf, projection,
+                                              after, id_type, id.data ? &id : NULL, remaining);
+        tiebreak = ngx_http_mongodb_rest_tiebreak(conf);
+        resumed = 0;
+        continue;
+      }
+      if(conn->err == MONGO_IO_ERROR || conn->lasterrcode == MONGO_EXCEEDED_TIME_LIMIT) {
+        status = NGX_HTTP_GATEWAY_TIME_OUT;
+      } else {
+        /* A short page would read as the end of the collection. */
+        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                      "Mongo Exception: listing \"%s\" failed (%d)", ns, c->cursor.err);
+        status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+      }
+      break;
+    }
+
+    /* Stop reading, and let mongod drop the cursor, once nobody is waiting. */
+    ngx_time_update();
+    if(ngx_http_mongodb_rest_remaining(request, conf) <= 0) {
+      status = NGX_HTTP_GATEWAY_TIME_OUT;
+      break;
+    }
+    if(ngx_http_mongodb_rest_client_gone(request)) {
+      status = NGX_HTTP_CLIENT_CLOSED_REQUEST;
+      break;
+    }
+
+    if(ngx_http_mongodb_rest_serialize(request->pool, format, mongo_cursor_bson(&c->cursor), &doc) != NGX_OK) {
+      status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+      break;
+    }
+
+    rc = ngx_http_mongodb_rest_key_string(request->pool, mongo_cursor_bson(&c->cursor), conf, &key);
+    if(rc == NGX_OK && tiebreak) {
+      rc = ngx_http_mongodb_rest_id_string(request->pool, mongo_cursor_bson(&c->cursor), &last_id);
+    }
+    if(rc == NGX_ERROR) {
+      status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+      break;
+    } else if(rc == NGX_DECLINED) {
+      /* Projected away; only the parked cursor can carry on. */
+      ngx_str_null(&key);
+      ngx_str_null(&last_id);
+    }
+
+    if(n && format == NGX_HTTP_MONGODB_REST_JSON) {
+      *ll = ngx_http_mongodb_rest_chain(request->pool, array_sep, 1);
+      if(*ll == NULL) {
+        status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        break;
+      }
+      ll = &(*ll)->next;
+      length++;
+    }
+
+    *ll = ngx_http_mongodb_rest_chain(request->pool, doc.data, doc.len);
+    if(*ll == NULL) {
+      status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+      break;
+    }
+    ll = &(*ll)->next;
+    length += doc.len;
+    n++;
+  }
+
+  if(projection == &fields) {
+    bson_destroy(&fields);
+  }
+
+  if(c == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if(status != NGX_OK) {
+    ngx_http_mongodb_rest_cursor_free(c);
+    return status;
+  }
+
+  // ---------- HAND OUT A CONTINUATION ---------- //
+  if(n == limit) {
+    token.data = ngx_pnalloc(request->pool, 2 * NGX_INT64_LEN + 3 + ngx_base64_encoded_length(key.len)
+                                            + ngx_base64_encoded_length(last_id.len));
+    if(token.data == NULL) {
+      ngx_http_mongodb_rest_cursor_free(c);
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    p = ngx_sprintf(token.data, "%P.%ui.", ngx_pid, (ngx_uint_t) ngx_http_mongodb_rest_cursor_park(c));
+    arg.data = p;
+    ngx_encode_base64url(&arg, &key);
+    p += arg.len;
+    if(last_id.len) {
+      *p++ = '.';
+      arg.data = p;
+      ngx_encode_base64url(&arg, &last_id);
+      p += arg.len;
+    }
+    token.len = p - token.data;
+
+    if(ngx_http_mongodb_rest_add_header(request, "X-Continuation-Token", &token) != NGX_OK) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+  } else {
+    ngx_http_mongodb_rest_cursor_free(c);
+  }
+
+  return ngx_http_mongodb_rest_send_array(request, format, n, length, out, ll);
+}
+
+/* The bytes that identify a key in a URI: the raw ObjectId, int or string. */
+ngx_int_t ngx_http_mongodb_rest_raw_key(bson_type type, const char * value, u_char * buf, ngx_str_t * key) {
+  bson_oid_t oid;
+  int32_t n;
+
+  switch(type) {
+    case BSON_OID:
+      bson_oid_from_string(&oid, value);
+      key->len = ngx_cpymem(buf, oid.bytes, sizeof(oid.bytes)) - buf;
+      key->data = buf;
+      return NGX_OK;
+    case BSON_INT:
+      if(ngx_http_mongodb_rest_atoi32((u_char *) value, ngx_strlen(value), &n) != NGX_OK) {
+        return NGX_DECLINED;
+      }
+      key->len = ngx_cpymem(buf, &n, sizeof(int32_t)) - buf;
+      key->data = buf;
+      return NGX_OK;
+    case BSON_STRING:
+      key->data = (u_char *) value;
+      key->len = ngx_strlen(value);
+      return NGX_OK;
+    default:
+      return NGX_DECLINED;
+  }
+}
+
+/* As above, for the key of a document. */
+static ngx_int_t ngx_http_mongodb_rest_doc_raw_key(const bson * b, bson_type type, const char * field, u_char * buf, ngx_str_t * key) {
+  bson_iterator it;
+  int32_t n;
+
+  if(ngx_http_mongodb_rest_find(&it, b, field) != type) {
+    return NGX_DECLINED;
+  }
+
+  switch(type) {
+    case BSON_OID:
+      key->len = ngx_cpymem(buf, bson_iterator_oid(&it)->bytes, 12) - buf;
+      key->data = buf;
+      return NGX_OK;
+    case BSON_INT:
+      n = bson_iterator_int(&it);
+      key->len = ngx_cpymem(buf, &n, sizeof(int32_t)) - buf;
+      key->data = buf;
+      return NGX_OK;
+    case BSON_STRING:
+      key->data = (u_char *) bson_iterator_string(&it);
+      key->len = ngx_strlen(key->data);
+      return NGX_OK;
+    default:
+      return NGX_DECLINED;
+  }
+}
+
+/* Double hashing: the i'th bit of key is h1 + i * h2. */
+static void ngx_http_mongodb_rest_bloom_set(ngx_http_mongodb_rest_bloom_shm_t * sh, ngx_atomic_t * bits, ngx_str_t * key) {
+  ngx_atomic_uint_t old, mask;
+  ngx_atomic_t * word;
+  uint64_t h1, h2, bit;
+  ngx_uint_t i;
+
+  h1 = ngx_murmur_hash2(key->data, key->len);
+  h2 = ngx_crc32_long(key->data, key->len) | 1;
+
+  for(i = 0; i < MONGO_BLOOM_HASHES; i++) {
+    bit = (h1 + i * h2) % sh->nbits;
+    word = &bits[bit / (8 * sizeof(ngx_atomic_t))];
+    mask = (ngx_atomic_uint_t) 1 << (bit % (8 * sizeof(ngx_atomic_t)));
+
+    /* Other workers set bits in the same word. */
+    do {
+      old = *word;
+    } while(!(old & mask) && !ngx_atomic_cmp_set(word, old, old | mask));
+  }
+}
+
+/* NGX_DECLINED if the key is certainly not in the collection. */
+ngx_int_t ngx_http_mongodb_rest_bloom_test(ngx_http_mongodb_rest_bloom_t * bloom, bson_type type, const char * value) {
+  ngx_http_mongodb_rest_bloom_shm_t * sh = bloom->sh;
+  ngx_atomic_uint_t active;
+  ngx_atomic_t * bits;
+  uint64_t h1, h2, bit;
+  ngx_uint_t i;
+  ngx_str_t key;
+  u_char buf[12];
+
+  active = sh->active;
+  if(active == NGX_HTTP_MONGODB_REST_BLOOM_NONE
+     || ngx_http_mongodb_rest_raw_key(type, value, buf, &key) != NGX_OK) {
+    return NGX_OK;
+  }
+
+  bits = sh->bits[active];
+  h1 = ngx_murmur_hash2(key.data, key.len);
+  h2 = ngx_crc32_long(key.data, key.len) | 1;
+
+  for(i = 0; i < MONGO_BLOOM_HASHES; i++) {
+    bit = (h1 + i * h2) % sh->nbits;
+    if(!(bits[bit / (8 * sizeof(ngx_atomic_t))] & ((ngx_atomic_uint_t) 1 << (bit % (8 * sizeof(ngx_atomic_t)))))) {
+      return NGX_DECLINED;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* Called before a document is written, so a GET racing the write is never turned away. */
+static void ngx_http_mongodb_rest_bloom_add_key(ngx_http_mongodb_rest_bloom_t * bloom, ngx_str_t * key) {
+  ngx_http_mongodb_rest_bloom_shm_t * sh = bloom->sh;
+  ngx_atomic_uint_t active, building;
+
+  /* building before active: a rebuild swaps them in the other order. */
+  building = sh->building;
+  ngx_memory_barrier();
+  active = sh->active;
+
+  if(active != NGX_HTTP_MONGODB_REST_BLOOM_NONE) {
+    ngx_http_mongodb_rest_bloom_set(sh, sh->bits[active], key);
+  }
+  if(building != NGX_HTTP_MONGODB_REST_BLOOM_NONE && building != active) {
+    ngx_http_mongodb_rest_bloom_set(sh, sh->bits[building], key);
+  }
+}
+
+void ngx_http_mongodb_rest_bloom_add(ngx_http_mongodb_rest_bloom_t * bloom, const bson * doc) {
+  ngx_str_t key;
+  u_char buf[12];
+
+  if(ngx_http_mongodb_rest_doc_raw_key(doc, bloom->conf->type, (char *) bloom->conf->field.data, buf, &key) == NGX_OK) {
+    ngx_http_mongodb_rest_bloom_add_key(bloom, &key);
+  }
+}
+
+/* Fill the spare filter from a scan of the collection, a batch at a time, then swap it in. */
+static void ngx_http_mongodb_rest_bloom_build(ngx_event_t * ev) {
+  ngx_http_mongodb_rest_bloom_t * bloom = ev->data;
+  ngx_http_mongodb_rest_bloom_shm_t * sh = bloom->sh;
+  ngx_http_mongodb_rest_loc_conf_t * conf = bloom->conf;
+  ngx_http_mongo_connection_t * mongo_conn;
+  ngx_atomic_uint_t next;
+  ngx_uint_t n;
+  ngx_str_t key;
+  u_char buf[12];
+
+  if(bloom->cursor == NULL && !bloom->settling) {
+    /* From now on writes set bits in both; give those already past that a moment to land. */
+    next = (sh->active == 0) ? 1 : 0;
+    ngx_memzero(sh->bits[next], sh->nbits / 8);
+    ngx_memory_barrier();
+    sh->building = next;
+
+    bloom->nkeys = 0;
+    bloom->settling = 1;
+    ngx_add_timer(ev, MONGO_BLOOM_SETTLE);
+    return;
+  }
+
+  if(bloom->settling) {
+    bloom->settling = 0;
+
+    mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+    if(mongo_conn == NULL || !mongo_conn->conn.connected) {
+      goto failed;
+    }
+
+    bloom->cursor = ngx_alloc(sizeof(mongo_cursor), ev->log);
+    if(bloom->cursor == NULL) {
+      goto failed;
+    }
+
+    mongo_cursor_init(bloom->cursor, &mongo_conn->conn, (char *) conf->ns.data);
+    mongo_cursor_set_fields(bloom->cursor, &bloom->fields);
+  }
+
+  for(n = 0; n < MONGO_BLOOM_BATCH; n++) {
+    if(mongo_cursor_next(bloom->cursor) != MONGO_OK) {
+      break;
+    }
+
+    if(ngx_http_mongodb_rest_doc_raw_key(mongo_cursor_bson(bloom->cursor), conf->type,
+                                           (char *) conf->field.data, buf, &key) == NGX_OK) {
+      ngx_http_mongodb_rest_bloom_set(sh, sh->bits[sh->building], &key);
+      bloom->nkeys++;
+    }
+  }
+
+  /* Let requests in before the next batch. */
+  if(n == MONGO_BLOOM_BATCH) {
+    ngx_add_timer(ev, 1);
+    return;
+  }
+
+  if(bloom->cursor->err != MONGO_CURSOR_EXHAUSTED) {
+    goto failed;
+  }
+
+  mongo_cursor_destroy(bloom->cursor);
+  ngx_free(bloom->cursor);
+  bloom->cursor = NULL;
+
+  sh->active = sh->building;
+  ngx_memory_barrier();
+  sh->building = NGX_HTTP_MONGODB_REST_BLOOM_NONE;
+
+  ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+		"Bloom filter \"%V\" built with %ui keys", &bloom->zone->shm.name, bloom->nkeys);
+
+  if(conf->bloom_refresh && !ngx_exiting) {
+    ngx_add_timer(ev, conf->bloom_refresh);
+  }
+  return;
+
+failed:
+  ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+		"Failed to build Bloom filter \"%V\", retrying", &bloom->zone->shm.name);
+
+  if(bloom->cursor) {
+    mongo_cursor_destroy(bloom->cursor);
+    ngx_free(bloom->cursor);
+    bloom->cursor = NULL;
+  }
+  sh->building = NGX_HTTP_MONGODB_REST_BLOOM_NONE;
+
+  if(!ngx_exiting) {
+    ngx_add_timer(ev, MONGO_BLOOM_RETRY);
+  }
+}
+
+static ngx_int_t ngx_http_mongodb_rest_bloom_start(ngx_cycle_t * cycle, ngx_http_mongodb_rest_bloom_t * bloom) {
+  bson_init(&bloom->fields);
+  bson_append_int(&bloom->fields, (char *) bloom->conf->field.data, 1);
+  bson_finish(&bloom->fields);
+
+  /* A build cut short by the previous worker is started afresh. */
+  bloom->sh->building = NGX_HTTP_MONGODB_REST_BLOOM_NONE;
+
+  bloom->timer.handler = ngx_http_mongodb_rest_bloom_build;
+  bloom->timer.data = bloom;
+  bloom->timer.log = cycle->log;
+  bloom->timer.cancelable = 1;
+
+  if(bloom->sh->active == NGX_HTTP_MONGODB_REST_BLOOM_NONE) {
+    ngx_add_timer(&bloom->timer, 1);
+  } else if(bloom->conf->bloom_refresh) {
+    ngx_add_timer(&bloom->timer, bloom->conf->bloom_refresh);
+  }
+
+  return NGX_OK;
+}
+
+static ngx_http_mongodb_rest_replica_doc_t * ngx_http_mongodb_rest_replica_doc(ngx_rbtree_node_t * node, ngx_uint_t by_id) {
+  if(by_id) {
+    return (ngx_http_mongodb_rest_replica_doc_t *) ((u_char *) node - offsetof(ngx_http_mongodb_rest_replica_doc_t, id_node));
+  }
+  return (ngx_http_mongodb_rest_replica_doc_t *) node;
+}
+
+/* Documents with the same hash are ordered by their key, or by their {_id: ...}. */
+static ngx_int_t ngx_http_mongodb_rest_replica_cmp(ngx_http_mongodb_rest_replica_doc_t * d, ngx_uint_t by_id, u_char * p, size_t len) {
+  u_char * q = by_id ? d->data + d->key_len : d->data;
+  size_t n = by_id ? d->id_len : d->key_len;
+
+  if(len != n) {
+    return len < n ? -1 : 1;
+  }
+  return ngx_memcmp(p, q, len);
+}
+
+static void ngx_http_mongodb_rest_replica_insert(ngx_rbtree_node_t * temp, ngx_rbtree_node_t * node, ngx_rbtree_node_t * sentinel, ngx_uint_t by_id) {
+  ngx_http_mongodb_rest_replica_doc_t * d;
+  ngx_rbtree_node_t ** p;
+  u_char * data;
+  size_t len;
+
+  d = ngx_http_mongodb_rest_replica_doc(node, by_id);
+  data = by_id ? d->data + d->key_len : d->data;
+  len = by_id ? d->id_len : d->key_len;
+
+  for(;;) {
+    if(node->key != temp->key) {
+      p = (node->key < temp->key) ? &temp->left : &temp->right;
+    } else {
+      p = (ngx_http_mongodb_rest_replica_cmp(ngx_http_mongodb_rest_replica_doc(temp, by_id), by_id, data, len) < 0)
+          ? &temp->left : &temp->right;
+    }
+
+    if(*p == sentinel) {
+      break;
+    }
+    temp = *p;
+  }
+
+  *p = node;
+  node->parent = temp;
+  node->left = sentinel;
+  node->right = sentinel;
+  ngx_rbt_red(node);
+}
+
+static void ngx_http_mongodb_rest_replica_insert_key(ngx_rbtree_node_t * temp, ngx_rbtree_node_t * node, ngx_rbtree_node_t * sentinel) {
+  ngx_http_mongodb_rest_replica_insert(temp, node, sentinel, 0);
+}
+
+static void ngx_http_mongodb_rest_replica_insert_id(ngx_rbtree_node_t * temp, ngx_rbtree_node_t * node, ngx_rbtree_node_t * sentinel) {
+  ngx_http_mongodb_rest_replica_insert(temp, node, sentinel, 1);
+}
+
+static ngx_http_mongodb_rest_replica_doc_t * ngx_http_mongodb_rest_replica_lookup(ngx_http_mongodb_rest_replica_shm_t * sh, ngx_uint_t by_id, u_char * p, size_t len) {
+  ngx_rbtree_t * tree = by_id ? &sh->ids : &sh->keys;
+  ngx_rbtree_node_t * node, * sentinel;
+  ngx_rbtree_key_t hash;
+  ngx_int_t rc;
+
+  hash = ngx_murmur_hash2(p, len);
+  node = tree->root;
+  sentinel = tree->sentinel;
+
+  while(node != sentinel) {
+    if(hash != node->key) {
+      node = (hash < node->key) ? node->left : node->right;
+      continue;
+    }
+
+    rc = ngx_http_mongodb_rest_replica_cmp(ngx_http_mongodb_rest_replica_doc(node, by_id), by_id, p, len);
+    if(rc == 0) {
+      return ngx_http_mongodb_rest_replica_doc(node, by_id);
+    }
+    node = (rc < 0) ? node->left : node->right;
+  }
+
+  return NULL;
+}
+
+/* {_id: ...} of a document, as oplog entries name it. */
+static ngx_int_t ngx_http_mongodb_rest_replica_id(const bson * doc, bson * id) {
+  bson_iterator it;
+
+  if(bson_find(&it, doc, "_id") == BSON_EOO) {
+    return NGX_DECLINED;
+  }
+
+  bson_init(id);
+  bson_append_element(id, "_id", &it);
+  bson_finish(id);
+
+  return NGX_OK;
+}
+
+/* The functions below expect the pool mutex to be held. */
+static void ngx_http_mongodb_rest_replica_remove(ngx_http_mongodb_rest_replica_t * rp, ngx_http_mongodb_rest_replica_doc_t * d) {
+  ngx_rbtree_delete(&rp->sh->keys, &d->node);
+  ngx_rbtree_delete(&rp->sh->ids, &d->id_node);
+  ngx_slab_free_locked(rp->shpool, d);
+  rp->sh->ndocs--;
+}
+
+static void ngx_http_mongodb_rest_replica_delete(ngx_http_mongodb_rest_replica_t * rp, const bson * doc) {
+  ngx_http_mongodb_rest_replica_doc_t * d;
+  bson id;
+
+  if(ngx_http_mongodb_rest_replica_id(doc, &id) != NGX_OK) {
+    return;
+  }
+
+  d = ngx_http_mongodb_rest_replica_lookup(rp->sh, 1, (u_char *) id.data, bson_size(&id));
+  if(d) {
+    ngx_http_mongodb_rest_replica_remove(rp, d);
+  }
+
+  bson_destroy(&id);
+}
+
+static void ngx_http_mongodb_rest_replica_clear(ngx_http_mongodb_rest_replica_t * rp) {
+  ngx_http_mongodb_rest_replica_shm_t * sh = rp->sh;
+
+  while(sh->ids.root != sh->ids.sentinel) {
+    ngx_http_mongodb_rest_replica_remove(rp, ngx_http_mongodb_rest_replica_doc(ngx_rbtree_min(sh->ids.root, sh->ids.sentinel), 1));
+  }
+}
+
+/* Store doc in place of the document with its _id; NGX_ERROR if the zone is full. */
+static ngx_int_t ngx_http_mongodb_rest_replica_put(ngx_http_mongodb_rest_replica_t * rp, ngx_log_t * log, const bson * doc) {
+  ngx_http_mongodb_rest_loc_conf_t * conf = rp->conf;
+  ngx_http_mongodb_rest_replica_doc_t * d;
+  ngx_str_t key;
+  size_t id_len, doc_len;
+  u_char buf[12], * p;
+  bson id;
+
+  if(ngx_http_mongodb_rest_replica_id(doc, &id) != NGX_OK) {
+    return NGX_OK;
+  }
+
+  ngx_http_mongodb_rest_replica_delete(rp, &id);
+
+  /* Without the field it cannot be fetched through the location anyway. */
+  if(ngx_http_mongodb_rest_doc_raw_key(doc, conf->type, (char *) conf->field.data, buf, &key) != NGX_OK) {
+    bson_destroy(&id);
+    return NGX_OK;
+  }
+
+  id_len = bson_size(&id);
+  doc_len = bson_size(doc);
+
+  d = ngx_slab_alloc_locked(rp->shpool, offsetof(ngx_http_mongodb_rest_replica_doc_t, data) + key.len + id_len + doc_len);
+  if(d == NULL) {
+    bson_destroy(&id);
+    /* The old version is gone already; no GET may trust the copy now. */
+    rp->sh->ready = 0;
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+		  "Replica zone \"%V\" is full", &rp->zone->shm.name);
+    return NGX_ERROR;
+  }
+
+  d->key_len = key.len;
+  d->id_len = id_len;
+  d->doc_len = doc_len;
+  p = ngx_cpymem(d->data, key.data, key.len);
+  p = ngx_cpymem(p, id.data, id_len);
+  ngx_memcpy(p, doc->data, doc_len);
+  bson_destroy(&id);
+
+  d->node.key = ngx_murmur_hash2(d->data, d->key_len);
+  d->id_node.key = ngx_murmur_hash2(d->data + d->key_len, d->id_len);
+  ngx_rbtree_insert(&rp->sh->keys, &d->node);
+  ngx_rbtree_insert(&rp->sh->ids, &d->id_node);
+  rp->sh->ndocs++;
+
+  return NGX_OK;
+}
+
+/*
+ * Apply an oplog entry to the copy: NGX_ERROR if the zone is full, NGX_AGAIN
+ * if the collection was replaced and must be scanned again.  Updates made
+ * with operators are left to ngx_http_mongodb_rest_replica_refetch, their
+ * _id appended to the array being built in refetch.
+ */
+static ngx_int_t ngx_http_mongodb_rest_replica_apply(ngx_http_mongodb_rest_replica_t * rp, ngx_log_t * log, const bson * entry, bson * refetch, ngx_uint_t * nrefetch) {
+  ngx_http_mongodb_rest_loc_conf_t * conf = rp->conf;
+  bson_iterator it;
+  const char * op, * ns;
+  bson o, o2;
+  u_char num[NGX_INT_T_LEN + 1];
+  ngx_int_t rc = NGX_OK;
+
+  if(bson_find(&it, entry, "op") != BSON_STRING) {
+    return NGX_OK;
+  }
+  op = bson_iterator_string(&it);
+
+  if(bson_find(&it, entry, "ns") != BSON_STRING) {
+    return NGX_OK;
+  }
+  ns = bson_iterator_string(&it);
+
+  if(bson_find(&it, entry, "o") != BSON_OBJECT) {
+    return NGX_OK;
+  }
+  bson_iterator_subobject(&it, &o);
+
+  if(op[0] == 'c') {
+    /* Renamed onto: the copy is of another collection now. */
+    if(bson_find(&it, &o, "to") == BSON_STRING && ngx_strcmp(bson_iterator_string(&it), conf->ns.data) == 0) {
+      return NGX_AGAIN;
+    }
+
+    /* The collection, or its database, was dropped or renamed away. */
+    if((ngx_strcmp(ns, conf->cmd_ns.data) == 0
+        && ((bson_find(&it, &o, "drop") == BSON_STRING
+             && ngx_strcmp(bson_iterator_string(&it), conf->collection.data) == 0)
+            || bson_find(&it, &o, "dropDatabase") != BSON_EOO))
+       || (bson_find(&it, &o, "renameCollection") == BSON_STRING
+           && ngx_strcmp(bson_iterator_string(&it), conf->ns.data) == 0)) {
+      ngx_shmtx_lock(&rp->shpool->mutex);
+      ngx_http_mongodb_rest_replica_clear(rp);
+      ngx_shmtx_unlock(&rp->shpool->mutex);
+    }
+    return NGX_OK;
+  }
+
+  if(ngx_strcmp(ns, conf->ns.data) != 0) {
+    return NGX_OK;
+  }
+
+  switch(op[0]) {
+    case 'i':
+      ngx_shmtx_lock(&rp->shpool->mutex);
+      rc = ngx_http_mongodb_rest_replica_put(rp, log, &o);
+      ngx_shmtx_unlock(&rp->shpool->mutex);
+      break;
+
+    case 'u':
+      if(bson_find(&it, entry, "o2") != BSON_OBJECT) {
+        break;
+      }
+      bson_iterator_subobject(&it, &o2);
+
+      bson_iterator_init(&it, &o);
+      if(bson_iterator_next(&it) != BSON_EOO && *bson_iterator_key(&it) != '$'
+         && bson_find(&it, &o, "_id") != BSON_EOO) {
+        ngx_shmtx_lock(&rp->shpool->mutex);
+        rc = ngx_http_mongodb_rest_replica_put(rp, log, &o);
+        ngx_shmtx_unlock(&rp->shpool->mutex);
+        break;
+      }
+
+      /* Update operators, rather than the whole document: read it back later. */
+      if(bson_find(&it, &o2, "_id") != BSON_EOO) {
+        *ngx_sprintf(num, "%ui", (*nrefetch)++) = '\0';
+        bson_append_element(refetch, (char *) num, &it);
+      }
+      break;
+
+    case 'd':
+      ngx_shmtx_lock(&rp->shpool->mutex);
+      ngx_http_mongodb_rest_replica_delete(rp, &o);
+      ngx_shmtx_unlock(&rp->shpool->mutex);
+      break;
+  }
+
+  return rc;
+}
+
+/*
+ * Read back the documents updated with operators in a batch of the oplog,
+ * named in refetch as {ids: [...]}, with one query, and swap them into the
+ * copy together: NGX_ERROR if the zone is full, NGX_DECLINED if the query
+ * failed.  What they read is at least as new as the batch; later entries
+ * apply over it cleanly.
+ */
+static ngx_int_t ngx_http_mongodb_rest_replica_refetch(ngx_http_mongodb_rest_replica_t * rp, mongo * conn, ngx_log_t * log, bson * refetch) {
+  ngx_http_mongodb_rest_loc_conf_t * conf = rp->conf;
+  ngx_array_t docs;
+  ngx_pool_t * pool;
+  mongo_cursor cursor;
+  bson_iterator it, sub;
+  bson query, id, * b;
+  ngx_uint_t i;
+  ngx_int_t rc = NGX_OK;
+  u_char * data;
+
+  if(bson_find(&it, refetch, "ids") != BSON_ARRAY) {
+    return NGX_OK;
+  }
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log);
+  if(pool == NULL || ngx_array_init(&docs, pool, 16, sizeof(bson)) != NGX_OK) {
+    if(pool) { ngx_destroy_pool(pool); }
+    return NGX_DECLINED;
+  }
+
+  bson_init(&query);
+  bson_append_start_object(&query, "$query");
+  bson_append_start_object(&query, "_id");
+  bson_append_element(&query, "$in", &it);
+  bson_append_finish_object(&query);
+  bson_append_finish_object(&query);
+  bson_append_long(&query, "$maxTimeMS", (int64_t) conf->read_timeout);
+  bson_finish(&query);
+
+  mongo_cursor_init(&cursor, conn, (char *) conf->ns.data);
+  mongo_cursor_set_query(&cursor, &query);
+
+  while(mongo_cursor_next(&cursor) == MONGO_OK) {
+    b = ngx_array_push(&docs);
+    data = ngx_pnalloc(pool, bson_size(mongo_cursor_bson(&cursor)));
+    if(b == NULL || data == NULL) {
+      rc = NGX_DECLINED;
+      break;
+    }
+    ngx_memcpy(data, mongo_cursor_bson(&cursor)->data, bson_size(mongo_cursor_bson(&cursor)));
+    ngx_http_mongodb_rest_bson_wrap(b, data);
+  }
+
+  if(rc == NGX_OK && cursor.err != MONGO_CURSOR_EXHAUSTED) {
+    rc = NGX_DECLINED;
+  }
+
+  mongo_cursor_destroy(&cursor);
+  bson_destroy(&query);
+
+  if(rc != NGX_OK) {
+    ngx_destroy_pool(pool);
+    return rc;
+  }
+
+  /* Under one lock, so no GET sees a document between its versions. */
+  ngx_shmtx_lock(&rp->shpool->mutex);
+
+  bson_iterator_subiterator(&it, &sub);
+  while(bson_iterator_next(&sub) != BSON_EOO) {
+    bson_init(&id);
+    bson_append_element(&id, "_id", &sub);
+    bson_finish(&id);
+    ngx_http_mongodb_rest_replica_delete(rp, &id);
+    bson_destroy(&id);
+  }
+
+  b = docs.elts;
+  for(i = 0; i < docs.nelts && rc == NGX_OK; i++) {
+    rc = ngx_http_mongodb_rest_replica_put(rp, log, &b[i]);
+  }
+
+  ngx_shmtx_unlock(&rp->shpool->mutex);
+
+  ngx_destroy_pool(pool);
+  return rc;
+}
+
+/* The timestamp of the newest (order -1) or oldest (order 1) oplog entry. */
+static ngx_int_t ngx_http_mongodb_rest_oplog_ts(mongo * conn, int order, bson_timestamp_t * ts) {
+  bson query, fields, out;
+  bson_iterator it;
+  ngx_int_t rc = NGX_ERROR;
+
+  bson_init(&query);
+  bson_append_start_object(&query, "$query");
+  bson_append_finish_object(&query);
+  bson_append_start_object(&query, "$orderby");
+  bson_append_int(&query, "$natural", order);
+  bson_append_finish_object(&query);
+  bson_finish(&query);
+
+  bson_init(&fields);
+  bson_append_int(&fields, "ts", 1);
+  bson_finish(&fields);
+
+  if(mongo_find_one(conn, MONGO_OPLOG, &query, &fields, &out) == MONGO_OK) {
+    if(bson_find(&it, &out, "ts") == BSON_TIMESTAMP) {
+      *ts = bson_iterator_timestamp(&it);
+      rc = NGX_OK;
+    }
+    bson_destroy(&out);
+  }
+
+  bson_destroy(&query);
+  bson_destroy(&fields);
+
+  return rc;
+}
+
+static ngx_int_t ngx_http_mongodb_rest_ts_cmp(bson_timestamp_t * a, bson_timestamp_t * b) {
+  if(a->t != b->t) {
+    return (uint32_t) a->t < (uint32_t) b->t ? -1 : 1;
+  }
+  if(a->i != b->i) {
+    return (uint32_t) a->i < (uint32_t) b->i ? -1 : 1;
+  }
+  return 0;
+}
+
+static void ngx_http_mongodb_rest_replica_close(ngx_http_mongodb_rest_replica_t * rp) {
+  if(rp->cursor == NULL) {
+    return;
+  }
+
+  mongo_cursor_destroy(rp->cursor);
+  ngx_free(rp->cursor);
+  rp->cursor = NULL;
+
+  if(!rp->scanning) {
+    bson_destroy(&rp->query);
+  }
+  rp->scanning = 0;
+}
+
+static ngx_int_t ngx_http_mongodb_rest_replica_open(ngx_http_mongodb_rest_replica_t * rp, mongo * conn, ngx_log_t * log, const char * ns) {
+  rp->cursor = ngx_alloc(sizeof(mongo_cursor), log);
+  if(rp->cursor == NULL) {
+    return NGX_ERROR;
+  }
+
+  mongo_cursor_init(rp->cursor, conn, ns);
+  return NGX_OK;
+}
+
+/* Scan the collection once, then keep applying the oplog, a batch at a time. */
+static void ngx_http_mongodb_rest_replica_sync(ngx_event_t * ev) {
+  ngx_http_mongodb_rest_replica_t * rp = ev->data;
+  ngx_http_mongodb_rest_replica_shm_t * sh = rp->sh;
+  ngx_http_mongodb_rest_loc_conf_t * conf = rp->conf;
+  ngx_http_mongo_connection_t * mongo_conn;
+  bson_timestamp_t ts;
+  bson_iterator it;
+  const bson * entry;
+  bson refetch;
+  ngx_uint_t n, nrefetch;
+  ngx_int_t rc;
+
+  if(ngx_exiting) {
+    return;
+  }
+
+  mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+  if(mongo_conn == NULL || !mongo_conn->conn.connected) {
+    goto failed;
+  }
+
+  // ---------- INITIAL SCAN ---------- //
+  if(!sh->ready && !rp->scanning) {
+    ngx_http_mongodb_rest_replica_close(rp);
+
+    /* Entries after this are replayed over the scan; they apply cleanly twice. */
+    if(ngx_http_mongodb_rest_oplog_ts(&mongo_conn->conn, -1, &ts) != NGX_OK) {
+      ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+		    "Replica \"%V\" needs a replica set member to read " MONGO_OPLOG " from", &rp->zone->shm.name);
+      goto failed;
+    }
+
+    ngx_shmtx_lock(&rp->shpool->mutex);
+    ngx_http_mongodb_rest_replica_clear(rp);
+    sh->ts = ts;
+    ngx_shmtx_unlock(&rp->shpool->mutex);
+
+    if(ngx_http_mongodb_rest_replica_open(rp, &mongo_conn->conn, ev->log, (char *) conf->ns.data) != NGX_OK) {
+      goto failed;
+    }
+    rp->scanning = 1;
+  }
+
+  if(rp->scanning) {
+    for(n = 0; n < MONGO_REPLICA_BATCH; n++) {
+      if(mongo_cursor_next(rp->cursor) != MONGO_OK) {
+        break;
+      }
+
+      ngx_shmtx_lock(&rp->shpool->mutex);
+      rc = ngx_http_mongodb_rest_replica_put(rp, ev->log, mongo_cursor_bson(rp->cursor));
+      ngx_shmtx_unlock(&rp->shpool->mutex);
+
+      if(rc != NGX_OK) {
+        goto full;
+      }
+    }
+
+    /* Let requests in before the next batch. */
+    if(n == MONGO_REPLICA_BATCH) {
+      ngx_add_timer(ev, 1);
+      return;
+    }
+
+    if(rp->cursor->err != MONGO_CURSOR_EXHAUSTED) {
+      goto failed;
+    }
+
+    ngx_http_mongodb_rest_replica_close(rp);
+    sh->ready = 1;
+    rp->backoff = 0;
+
+    ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+		  "Replica \"%V\" holds %ui documents", &rp->zone->shm.name, sh->ndocs);
+  }
+
+  // ---------- TAIL THE OPLOG ---------- //
+  if(rp->cursor == NULL) {
+    /* Everything since sh->ts must still be in the oplog, or the copy has gaps. */
+    if(ngx_http_mongodb_rest_oplog_ts(&mongo_conn->conn, 1, &ts) != NGX_OK) {
+      goto failed;
+    }
+
+    if(ngx_http_mongodb_rest_ts_cmp(&ts, &sh->ts) > 0) {
+      ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+		    "Replica \"%V\" fell behind the oplog, scanning again", &rp->zone->shm.name);
+      goto rescan;
+    }
+
+    if(ngx_http_mongodb_rest_replica_open(rp, &mongo_conn->conn, ev->log, MONGO_OPLOG) != NGX_OK) {
+      goto failed;
+    }
+
+    bson_init(&rp->query);
+    bson_append_start_object(&rp->query, "ts");
+    bson_append_timestamp(&rp->query, "$gt", &sh->ts);
+    bson_append_finish_object(&rp->query);
+    bson_append_start_object(&rp->query, "ns");
+    bson_append_start_array(&rp->query, "$in");
+    bson_append_string(&rp->query, "0", (char *) conf->ns.data);
+    bson_append_string(&rp->query, "1", (char *) conf->cmd_ns.data);
+    /* Where older servers log renameCollection. */
+    bson_append_string(&rp->query, "2", "admin.$cmd");
+    bson_append_finish_array(&rp->query);
+    bson_append_finish_object(&rp->query);
+    bson_finish(&rp->query);
+
+    /* Not MONGO_AWAIT_DATA: the worker must not block waiting for writes. */
+    mongo_cursor_set_query(rp->cursor, &rp->query);
+    mongo_cursor_set_options(rp->cursor, MONGO_TAILABLE | MONGO_OPLOG_REPLAY);
+  }
+
+  bson_init(&refetch);
+  bson_append_start_array(&refetch, "ids");
+  nrefetch = 0;
+  ts = sh->ts;
+  rc = NGX_OK;
+
+  for(n = 0; n < MONGO_REPLICA_BATCH; n++) {
+    if(mongo_cursor_next(rp->cursor) != MONGO_OK) {
+      break;
+    }
+
+    entry = mongo_cursor_bson(rp->cursor);
+    rc = ngx_http_mongodb_rest_replica_apply(rp, ev->log, entry, &refetch, &nrefetch);
+    if(rc != NGX_OK) {
+      break;
+    }
+
+    if(bson_find(&it, entry, "ts") == BSON_TIMESTAMP) {
+      ts = bson_iterator_timestamp(&it);
+    }
+  }
+
+  bson_append_finish_array(&refetch);
+  bson_finish(&refetch);
+
+  /*
+   * The position only moves once the batch is whole, so that the updates
+   * read back are replayed if reading them fails.
+   */
+  if(rc == NGX_OK && nrefetch) {
+    rc = ngx_http_mongodb_rest_replica_refetch(rp, &mongo_conn->conn, ev->log, &refetch);
+  }
+  bson_destroy(&refetch);
+
+  if(rc == NGX_ERROR) {
+    goto full;
+  } else if(rc == NGX_AGAIN) {
+    ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+		  "Replica \"%V\" had its collection renamed over, scanning again", &rp->zone->shm.name);
+    goto rescan;
+  } else if(rc == NGX_DECLINED) {
+    /* Read the batch again from sh->ts next time. */
+    ngx_http_mongodb_rest_replica_close(rp);
+    ngx_add_timer(ev, MONGO_REPLICA_RETRY);
+    return;
+  }
+
+  if(n) {
+    sh->ts = ts;
+  }
+
+  if(n == MONGO_REPLICA_BATCH) {
+    ngx_add_timer(ev, 1);
+    return;
+  }
+
+  /* Otherwise the cursor is dead, e.g. nothing matched yet; open another next time. */
+  if(rp->cursor->err != MONGO_CURSOR_PENDING) {
+    ngx_http_mongodb_rest_replica_close(rp);
+  }
+
+  ngx_add_timer(ev, MONGO_REPLICA_INTERVAL);
+  return;
+
+rescan:
+  /* Under the lock, so no GET that saw the copy whole sees it cleared. */
+  ngx_http_mongodb_rest_replica_close(rp);
+  ngx_shmtx_lock(&rp->shpool->mutex);
+  sh->ready = 0;
+  ngx_shmtx_unlock(&rp->shpool->mutex);
+  ngx_add_timer(ev, 1);
+  return;
+
+full:
+  /* Scanning again straight away would only fill the zone again. */
+  rp->backoff = rp->backoff ? ngx_min(rp->backoff * 2, MONGO_REPLICA_BACKOFF_MAX) : MONGO_REPLICA_RETRY;
+  ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+		"Replica \"%V\" does not fit its zone, scanning again in %M ms", &rp->zone->shm.name, rp->backoff);
+  ngx_http_mongodb_rest_replica_close(rp);
+  ngx_shmtx_lock(&rp->shpool->mutex);
+  sh->ready = 0;
+  ngx_http_mongodb_rest_replica_clear(rp);
+  ngx_shmtx_unlock(&rp->shpool->mutex);
+  ngx_add_timer(ev, rp->backoff);
+  return;
+
+failed:
+  /* GETs go to mongod until the copy is whole again. */
+  ngx_http_mongodb_rest_replica_close(rp);
+  sh->ready = 0;
+  ngx_add_timer(ev, MONGO_REPLICA_RETRY);
+}
+
+static ngx_int_t ngx_http_mongodb_rest_replica_start(ngx_cycle_t * cycle, ngx_http_mongodb_rest_replica_t * rp) {
+  rp->timer.handler = ngx_http_mongodb_rest_replica_sync;
+  rp->timer.data = rp;
+  rp->timer.log = cycle->log;
+  rp->timer.cancelable = 1;
+  ngx_add_timer(&rp->timer, 1);
+
+  return NGX_OK;
+}
+
+/* NGX_DECLINED if the copy cannot answer for the key. */
+static ngx_int_t ngx_http_mongodb_rest_replica_get(ngx_http_request_t * request, ngx_http_mongodb_rest_replica_t * rp, bson_type type, const char * value, bson * b) {
+  ngx_http_mongodb_rest_replica_doc_t * d;
+  ngx_str_t key;
+  u_char buf[12], * data = NULL;
+
+  if(!rp->sh->ready || ngx_http_mongodb_rest_raw_key(type, value, buf, &key) != NGX_OK) {
+    return NGX_DECLINED;
+  }
+
+  ngx_shmtx_lock(&rp->shpool->mutex);
+
+  /* Again under the lock: the copy may have been cleared for a rescan since. */
+  if(!rp->sh->ready) {
+    ngx_shmtx_unlock(&rp->shpool->mutex);
+    return NGX_DECLINED;
+  }
+
+  d = ngx_http_mongodb_rest_replica_lookup(rp->sh, 0, key.data, key.len);
+  if(d) {
+    data = ngx_pnalloc(request->pool, d->doc_len);
+    if(data) {
+      ngx_memcpy(data, d->data + d->key_len + d->id_len, d->doc_len);
+    }
+  }
+
+  ngx_shmtx_unlock(&rp->shpool->mutex);
+
+  if(d == NULL) {
+    return NGX_HTTP_NOT_FOUND;
+  }
+  if(data == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  ngx_http_mongodb_rest_bson_wrap(b, data);
+  return NGX_OK;
+}
+
+/*
+ * "snapshot/xx/key.json" for a key as it appears in the URI, null
+ * terminated.  The key is escaped so that it names a single file, and
+ * the files are spread over 256 directories by a hash of it.
+ */
+static ngx_int_t ngx_http_mongodb_rest_snapshot_path(ngx_pool_t * pool, ngx_http_mongodb_rest_loc_conf_t * conf, u_char * key, size_t len, ngx_str_t * path) {
+  u_char * p;
+  uintptr_t n;
+
+  if(conf->keys->nelts == 1 && conf->type == BSON_OID) {
+    p = ngx_pnalloc(pool, len);
+    if(p == NULL) {
+      return NGX_ERROR;
+    }
+    ngx_strlow(p, key, len);
+    key = p;
+  }
+
+  n = ngx_escape_uri(NULL, key, len, NGX_ESCAPE_URI_COMPONENT);
+
+  path->len = conf->snapshot.len + sizeof("/xx/.json") - 1 + len + 2 * n;
+  path->data = ngx_pnalloc(pool, path->len + 1);
+  if(path->data == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = ngx_sprintf(path->data, "%V/%02xD/", &conf->snapshot, ngx_crc32_short(key, len) & 0xff);
+  p = (u_char *) ngx_escape_uri(p, key, len, NGX_ESCAPE_URI_COMPONENT);
+  p = ngx_cpymem(p, ".json", sizeof(".json") - 1);
+  *p = '\0';
+
+  return NGX_OK;
+}
+
+/*
+ * Written to a temporary file first, so readers never see half of it.  A
+ * PUT or DELETE since the cursor was opened, in any worker, leaves a
+ * ".forget" file: the document may have been read before it, so the file
+ * is taken back.  Checked after the rename, as snapshot_forget removes the
+ * file after leaving its mark, one of the two always catches the other.
+ */
+static ngx_int_t ngx_http_mongodb_rest_snapshot_write(ngx_pool_t * pool, ngx_log_t * log, ngx_http_mongodb_rest_loc_conf_t * conf, const bson * doc, time_t started) {
+  ngx_str_t key, path, json;
+  ngx_file_info_t fi;
+  ngx_fd_t fd;
+  ssize_t n;
+  u_char * tmp;
+
+  if(ngx_http_mongodb_rest_key_string(pool, doc, conf, &key) != NGX_OK) {
+    /* Without the key it cannot be fetched through the location anyway. */
+    return NGX_OK;
+  }
+
+  if(ngx_http_mongodb_rest_snapshot_path(pool, conf, key.data, key.len, &path) != NGX_OK
+     || ngx_http_mongodb_rest_serialize(pool, NGX_HTTP_MONGODB_REST_JSON, doc, &json) != NGX_OK) {
+    return NGX_ERROR;
+  }
+
+  tmp = ngx_pnalloc(pool, path.len + sizeof(".forget"));
+  if(tmp == NULL) {
+    return NGX_ERROR;
+  }
+  ngx_sprintf(tmp, "%V.tmp%Z", &path);
+
+  fd = ngx_open_file(tmp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+  if(fd == NGX_INVALID_FILE) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_open_file_n " \"%s\" failed", tmp);
+    return NGX_ERROR;
+  }
+
+  n = ngx_write_fd(fd, json.data, json.len);
+  ngx_close_file(fd);
+
+  if(n != (ssize_t) json.len) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_write_fd_n " \"%s\" failed", tmp);
+    ngx_delete_file(tmp);
+    return NGX_ERROR;
+  }
+
+  if(ngx_rename_file(tmp, path.data) == NGX_FILE_ERROR) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_rename_file_n " \"%s\" to \"%V\" failed", tmp, &path);
+    ngx_delete_file(tmp);
+    return NGX_ERROR;
+  }
+
+  ngx_sprintf(tmp, "%V.forget%Z", &path);
+
+  if(ngx_file_info(tmp, &fi) != NGX_FILE_ERROR && ngx_file_mtime(&fi) >= started) {
+    if(ngx_delete_file(path.data) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+      ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_delete_file_n " \"%V\" failed", &path);
+      return NGX_ERROR;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/*
+ * After a full export, remove from one directory the files it did not
+ * write: those of documents deleted or moved to another key since, and
+ * marks older than any cursor still to come.
+ */
+static ngx_int_t ngx_http_mongodb_rest_snapshot_sweep(ngx_http_mongodb_rest_snapshot_t * sn, ngx_log_t * log) {
+  ngx_str_t name;
+  ngx_dir_t dir;
+  u_char path[NGX_MAX_PATH];
+  u_char * p;
+  size_t len;
+  ngx_int_t rc = NGX_OK;
+
+  name.len = sn->conf->snapshot.len + sizeof("/xx") - 1;
+  if(name.len + sizeof("/") > NGX_MAX_PATH) {
+    return NGX_ERROR;
+  }
+  name.data = path;
+  p = ngx_sprintf(path, "%V/%02xi%Z", &sn->conf->snapshot, sn->sweep - 1);
+
+  if(ngx_open_dir(&name, &dir) == NGX_ERROR) {
+    ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_open_dir_n " \"%V\" failed", &name);
+    return NGX_ERROR;
+  }
+
+  p[-1] = '/';
+
+  for( ;; ) {
+    ngx_set_errno(0);
+
+    if(ngx_read_dir(&dir) == NGX_ERROR) {
+      if(ngx_errno != NGX_ENOMOREFILES) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_read_dir_n " \"%V\" failed", &name);
+        rc = NGX_ERROR;
+      }
+      break;
+    }
+
+    len = ngx_de_namelen(&dir);
+    if(ngx_de_name(&dir)[0] == '.' || p + len >= path + NGX_MAX_PATH) {
+      continue;
+    }
+
+    ngx_memcpy(p, ngx_de_name(&dir), len + 1);
+
+    if(ngx_de_info(path, &dir) == NGX_FILE_ERROR || !ngx_de_is_file(&dir)
+       || ngx_de_mtime(&dir) >= sn->started) {
+      continue;
+    }
+
+    if(ngx_delete_file(path) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+      ngx_log_error(NGX_LOG_ERR, log, ngx_errno, ngx_delete_file_n " \"%s\" failed", path);
+    }
+  }
+
+  ngx_close_dir(&dir);
+
+  return rc;
+}
+
+/* Remember where the export got to, so the next refresh starts there. */
+static void ngx_http_mongodb_rest_snapshot_mark(ngx_http_mongodb_rest_snapshot_t * sn, const bson * doc) {
+  bson_iterator it;
+
+  if(ngx_http_mongodb_rest_find(&it, doc, (char *) sn->conf->snapshot_field.data) == BSON_EOO) {
+    return;
+  }
+
+  if(sn->has_last) {
+    bson_destroy(&sn->last);
+  }
+  bson_init(&sn->last);
+  bson_append_element(&sn->last, "", &it);
+  bson_finish(&sn->last);
+  sn->has_last = 1;
+}
+
+/*
+ * Export the documents whose snapshot_field is at least the greatest one
+ * already exported.  Ties at the boundary are simply written again.  The
+ * first time, and every snapshot_rescan after, every document is written
+ * and then the files it did not write are swept away, one directory per
+ * event loop iteration.
+ */
+static void ngx_http_mongodb_rest_snapshot_export(ngx_event_t * ev) {
+  ngx_http_mongodb_rest_snapshot_t * sn = ev->data;
+  ngx_http_mongodb_rest_loc_conf_t * conf = sn->conf;
+  ngx_http_mongo_connection_t * mongo_conn;
+  bson_iterator it;
+  ngx_pool_t * pool;
+  ngx_uint_t n;
+
+  if(sn->sweep) {
+    if(ngx_http_mongodb_rest_snapshot_sweep(sn, ev->log) != NGX_OK) {
+      sn->sweep = 0;
+      goto failed;
+    }
+
+    if(sn->sweep++ < 256) {
+      ngx_add_timer(ev, 1);
+      return;
+    }
+
+    sn->sweep = 0;
+    sn->rescan = sn->started + conf->snapshot_rescan / 1000;
+    goto done;
+  }
+
+  if(sn->cursor == NULL) {
+    mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+    if(mongo_conn == NULL || !mongo_conn->conn.connected) {
+      goto failed;
+    }
+
+    sn->started = ngx_time();
+    sn->full = !sn->has_last || sn->started >= sn->rescan;
+
+    bson_init(&sn->query);
+    bson_append_start_object(&sn->query, "$query");
+    if(!sn->full) {
+      bson_iterator_init(&it, &sn->last);
+      bson_iterator_next(&it);
+      bson_append_start_object(&sn->query, (char *) conf->snapshot_field.data);
+      bson_append_element(&sn->query, "$gte", &it);
+      bson_append_finish_object(&sn->query);
+    }
+    bson_append_finish_object(&sn->query);
+    bson_append_start_object(&sn->query, "$orderby");
+    bson_append_int(&sn->query, (char *) conf->snapshot_field.data, 1);
+    bson_append_finish_object(&sn->query);
+    bson_finish(&sn->query);
+
+    sn->cursor = ngx_alloc(sizeof(mongo_cursor), ev->log);
+    if(sn->cursor == NULL) {
+      bson_destroy(&sn->query);
+      goto failed;
+    }
+
+    mongo_cursor_init(sn->cursor, &mongo_conn->conn, (char *) conf->ns.data);
+    mongo_cursor_set_query(sn->cursor, &sn->query);
+    if(conf->projection) {
+      mongo_cursor_set_fields(sn->cursor, conf->projection);
+    }
+    sn->ndocs = 0;
+  }
+
+  pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ev->log);
+  if(pool == NULL) {
+    goto failed;
+  }
+
+  for(n = 0; n < MONGO_SNAPSHOT_BATCH; n++) {
+    if(mongo_cursor_next(sn->cursor) != MONGO_OK) {
+      break;
+    }
+
+    if(ngx_http_mongodb_rest_snapshot_write(pool, ev->log, conf, mongo_cursor_bson(sn->cursor), sn->started) != NGX_OK) {
+      ngx_destroy_pool(pool);
+      goto failed;
+    }
+
+    ngx_http_mongodb_rest_snapshot_mark(sn, mongo_cursor_bson(sn->cursor));
+    sn->ndocs++;
+  }
+
+  ngx_destroy_pool(pool);
+
+  /* Let requests in before the next batch. */
+  if(n == MONGO_SNAPSHOT_BATCH) {
+    ngx_add_timer(ev, 1);
+    return;
+  }
+
+  if(sn->cursor->err != MONGO_CURSOR_EXHAUSTED) {
+    goto failed;
+  }
+
+  mongo_cursor_destroy(sn->cursor);
+  ngx_free(sn->cursor);
+  sn->cursor = NULL;
+  bson_destroy(&sn->query);
+
+  ngx_log_error(NGX_LOG_INFO, ev->log, 0,
+		"Snapshot \"%V\" refreshed with %ui documents", &conf->snapshot, sn->ndocs);
+
+  if(sn->full) {
+    sn->sweep = 1;
+    ngx_add_timer(ev, 1);
+    return;
+  }
+
+done:
+  if(!ngx_exiting) {
+    ngx_add_timer(ev, conf->snapshot_refresh);
+  }
+  return;
+
+failed:
+  ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+		"Failed to refresh snapshot \"%V\", retrying", &conf->snapshot);
+
+  /* Whatever was written stays; the retry picks up from the last mark, or starts a full export over. */
+  if(sn->cursor) {
+    mongo_cursor_destroy(sn->cursor);
+    ngx_free(sn->cursor);
+    sn->cursor = NULL;
+    bson_destroy(&sn->query);
+  }
+
+  if(!ngx_exiting) {
+    ngx_add_timer(ev, MONGO_SNAPSHOT_RETRY);
+  }
+}
+
+static ngx_int_t ngx_http_mongodb_rest_snapshot_start(ngx_cycle_t * cycle, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  ngx_http_mongodb_rest_snapshot_t * sn;
+  u_char * dir;
+  ngx_uint_t i;
+
+  dir = ngx_pnalloc(cycle->pool, conf->snapshot.len + sizeof("/xx"));
+  if(dir == NULL) {
+    return NGX_ERROR;
+  }
+
+  for(i = 0; i <= 256; i++) {
+    if(i == 0) {
+      ngx_sprintf(dir, "%V%Z", &conf->snapshot);
+    } else {
+      ngx_sprintf(dir, "%V/%02xi%Z", &conf->snapshot, i - 1);
+    }
+
+    if(ngx_create_dir(dir, 0755) == NGX_FILE_ERROR && ngx_errno != NGX_EEXIST) {
+      ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno, ngx_create_dir_n " \"%s\" failed", dir);
+      return NGX_ERROR;
+    }
+  }
+
+  sn = ngx_pcalloc(cycle->pool, sizeof(ngx_http_mongodb_rest_snapshot_t));
+  if(sn == NULL) {
+    return NGX_ERROR;
+  }
+  sn->conf = conf;
+  conf->snapshot_export = sn;
+
+  /* Files left by the previous workers are rewritten from the start. */
+  sn->timer.handler = ngx_http_mongodb_rest_snapshot_export;
+  sn->timer.data = sn;
+  sn->timer.log = cycle->log;
+  sn->timer.cancelable = 1;
+  ngx_add_timer(&sn->timer, 1);
+
+  return NGX_OK;
+}
+
+/* Serve the exported file, or decline when there is none yet. */
+static ngx_int_t ngx_http_mongodb_rest_snapshot_get(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf, const char * value) {
+  ngx_http_core_loc_conf_t * clcf;
+  ngx_open_file_info_t of;
+  ngx_chain_t * out;
+  ngx_buf_t * b;
+  ngx_str_t path;
+
+  if(ngx_http_mongodb_rest_snapshot_path(request->pool, conf, (u_char *) value, ngx_strlen(value), &path) != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  clcf = ngx_http_get_module_loc_conf(request, ngx_http_core_module);
+
+  ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+  of.read_ahead = clcf->read_ahead;
+  of.directio = clcf->directio;
+  of.valid = clcf->open_file_cache_valid;
+  of.min_uses = clcf->open_file_cache_min_uses;
+  of.errors = clcf->open_file_cache_errors;
+  of.events = clcf->open_file_cache_events;
+
+  if(ngx_open_cached_file(clcf->open_file_cache, &path, &of, request->pool) != NGX_OK
+     || !of.is_file || of.size == 0) {
+    return NGX_DECLINED;
+  }
+
+  b = ngx_calloc_buf(request->pool);
+  out = ngx_alloc_chain_link(request->pool);
+  if(b == NULL || out == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  b->file = ngx_pcalloc(request->pool, sizeof(ngx_file_t));
+  if(b->file == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  b->file_pos = 0;
+  b->file_last = of.size;
+  b->in_file = 1;
+  b->last_buf = 1;
+  b->last_in_chain = 1;
+  b->file->fd = of.fd;
+  b->file->name = path;
+  b->file->log = request->connection->log;
+  b->file->directio = of.is_directio;
+
+  out->buf = b;
+  out->next = NULL;
+
+  request->headers_out.last_modified_time = of.mtime;
+
+  return ngx_http_mongodb_rest_send(request, NGX_HTTP_MONGODB_REST_JSON, of.size, out);
+}
+
+/*
+ * A document written or deleted here is fetched from mongod until an export
+ * opened after this writes it again.  The mark keeps one already under way
+ * from putting back what it read before.
+ */
+static void ngx_http_mongodb_rest_snapshot_forget(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf, const char * value) {
+  ngx_str_t path;
+  ngx_fd_t fd;
+  u_char * mark;
+
+  if(ngx_http_mongodb_rest_snapshot_path(request->pool, conf, (u_char *) value, ngx_strlen(value), &path) != NGX_OK) {
+    return;
+  }
+
+  mark = ngx_pnalloc(request->pool, path.len + sizeof(".forget"));
+  if(mark == NULL) {
+    return;
+  }
+  ngx_sprintf(mark, "%V.forget%Z", &path);
+
+  fd = ngx_open_file(mark, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE, NGX_FILE_DEFAULT_ACCESS);
+  if(fd == NGX_INVALID_FILE) {
+    ngx_log_error(NGX_LOG_ERR, request->connection->log, ngx_errno,
+		  ngx_open_file_n " \"%s\" failed", mark);
+  } else {
+    ngx_close_file(fd);
+  }
+
+  if(ngx_delete_file(path.data) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+    ngx_log_error(NGX_LOG_ERR, request->connection->log, ngx_errno,
+		  ngx_delete_file_n " \"%V\" failed", &path);
+  }
+}
+
+static ngx_int_t ngx_http_mongodb_rest_msec_cmp(const void * a, const void * b) {
+  ngx_msec_t x = *(ngx_msec_t *) a, y = *(ngx_msec_t *) b;
+
+  return x < y ? -1 : (x > y);
+}
+
+/* Note how long a hedged read took; every full window is sorted once. */
+static void ngx_http_mongodb_rest_hedge_sample(ngx_http_mongo_connection_t * mongo_conn, ngx_msec_t latency) {
+  mongo_conn->latency[mongo_conn->nlatency++] = latency;
+
+  if(mongo_conn->nlatency == MONGO_HEDGE_SAMPLES) {
+    ngx_memcpy(mongo_conn->sorted, mongo_conn->latency, sizeof(mongo_conn->sorted));
+    ngx_sort(mongo_conn->sorted, MONGO_HEDGE_SAMPLES, sizeof(ngx_msec_t), ngx_http_mongodb_rest_msec_cmp);
+    mongo_conn->nlatency = 0;
+    mongo_conn->window = 1;
+  }
+}
+
+/* How long the first member has before another is asked as well. */
+static ngx_msec_t ngx_http_mongodb_rest_hedge_delay(ngx_http_mongodb_rest_loc_conf_t * conf, ngx_http_mongo_connection_t * mongo_conn) {
+  if(conf->hedge_percentile == 0) {
+    return conf->hedge_delay;
+  }
+
+  /* Not until there is a window to take the percentile of. */
+  if(!mongo_conn->window) {
+    return conf->read_timeout;
+  }
+
+  return mongo_conn->sorted[(MONGO_HEDGE_SAMPLES - 1) * conf->hedge_percentile / 100];
+}
+
+/*
+ * One document, and no cursor left open.  Only with hedge_secondaries may
+ * a member that is not the primary answer, and then perhaps a stale one.
+ */
+static ngx_int_t ngx_http_mongodb_rest_hedge_send(ngx_http_mongodb_rest_loc_conf_t * conf, mongo * conn, char * ns, bson * query, bson * fields) {
+  return ngx_http_mongodb_rest_op_query(conn, ns, conf->hedge_secondaries ? MONGO_SLAVE_OK : 0, -1, query, fields);
+}
+
+/*
+ * Take a member's answer into the cursor: NGX_OK, 404, or 504 when the
+ * query ran out of time.  NGX_DECLINED when the member failed or refused
+ * the query, e.g. while it is recovering, so that another may answer.
+ */
+static ngx_int_t ngx_http_mongodb_rest_hedge_read(ngx_http_mongo_member_t * member, char * ns, mongo_cursor * cursor) {
+  mongo_reply * reply;
+  bson_iterator it;
+  ngx_int_t rc;
+  bson err;
+
+  if(mongo_read_response(&member->conn, &reply) != MONGO_OK) {
+    mongo_disconnect(&member->conn);
+    return NGX_DECLINED;
+  }
+
+  if(reply->fields.flag & MONGO_REPLY_QUERY_FAILURE) {
+    rc = NGX_DECLINED;
+    if(reply->fields.num) {
+      ngx_http_mongodb_rest_bson_wrap(&err, (u_char *) &reply->objs);
+      if(bson_find(&it, &err, "code") == BSON_INT && bson_iterator_int(&it) == MONGO_EXCEEDED_TIME_LIMIT) {
+        rc = NGX_HTTP_GATEWAY_TIME_OUT;
+      }
+    }
+    bson_free(reply);
+    return rc;
+  }
+
+  /* As if the cursor had sent the query itself. */
+  mongo_cursor_init(cursor, &member->conn, ns);
+  cursor->reply = reply;
+  cursor->flags |= MONGO_CURSOR_QUERY_SENT;
+
+  if(mongo_cursor_next(cursor) != MONGO_OK) {
+    mongo_cursor_destroy(cursor);
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  return NGX_OK;
+}
+
+/* The next batch of a cursor opened by ngx_http_mongodb_rest_op_query. */
+ngx_int_t ngx_http_mongodb_rest_op_get_more(mongo * conn, char * ns, int64_t cursor_id) {
+  mongo_message * mm;
+  size_t nslen;
+  int32_t n = 0;
+  u_char * p;
+
+  nslen = ngx_strlen(ns) + 1;
+  mm = mongo_message_create(16 + 4 + nslen + 4 + 8, 0, 0, MONGO_OP_GET_MORE);
+  if(mm == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = (u_char *) &mm->data;
+  bson_little_endian32(p, &n);
+  p = ngx_cpymem(p + 4, ns, nslen);
+  /* As many as fit in a reply. */
+  bson_little_endian32(p, &n);
+  bson_little_endian64(p + 4, &cursor_id);
+
+  return mongo_message_send(conn, mm) == MONGO_OK ? NGX_OK : NGX_ERROR;
+}
+
+void ngx_http_mongodb_rest_op_kill_cursors(mongo * conn, int64_t cursor_id) {
+  mongo_message * mm;
+  int32_t n;
+  u_char * p;
+
+  mm = mongo_message_create(16 + 4 + 4 + 8, 0, 0, MONGO_OP_KILL_CURSORS);
+  if(mm == NULL) {
+    return;
+  }
+
+  p = (u_char *) &mm->data;
+  n = 0;
+  bson_little_endian32(p, &n);
+  n = 1;
+  bson_little_endian32(p + 4, &n);
+  bson_little_endian64(p + 8, &cursor_id);
+
+  mongo_message_send(conn, mm);
+}
+
+/*
+ * Ask one member for the document and, if it has not answered within the
+ * hedge delay, another as well; whichever answers first fills the cursor.
+ * A member that fails or refuses leaves it to the other, asked at once if
+ * it was not yet.  One still owing its reply has it thrown away before it
+ * is next used.  NGX_DECLINED when no member could answer, so that the
+ * main connection is asked instead.
+ */
+static ngx_int_t ngx_http_mongodb_rest_hedged_find(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf, char * ns, bson * query, bson * fields, mongo_cursor * cursor) {
+  ngx_http_mongo_connection_t * mongo_conn;
+  ngx_http_mongo_member_t * members[2], * member;
+  ngx_msec_int_t remaining, timeout;
+  ngx_msec_t start, delay;
+  ngx_uint_t i, j, n, live, more;
+  struct pollfd pfd[2];
+  ngx_int_t rc;
+
+  mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+  if(mongo_conn == NULL || mongo_conn->members == NULL) {
+    return NGX_DECLINED;
+  }
+
+  ngx_time_update();
+  start = ngx_current_msec;
+  delay = ngx_http_mongodb_rest_hedge_delay(conf, mongo_conn);
+
+  n = 0;
+  live = 0;
+  more = 1;
+
+  for( ;; ) {
+    remaining = ngx_http_mongodb_rest_remaining(request, conf);
+    if(remaining <= 0) {
+      rc = NGX_HTTP_GATEWAY_TIME_OUT;
+      break;
+    }
+
+    // ---------- HEDGE ---------- //
+    /* Another member, at once when none is left to answer, else once the first has had its delay. */
+    if(more && n < 2 && (live == 0 || ngx_current_msec - start >= delay)) {
+      member = ngx_http_mongo_member_next(request->connection->log, mongo_conn, n ? members[0] : NULL);
+
+      if(member && ngx_http_mongodb_rest_hedge_send(conf, &member->conn, ns, query, fields) == NGX_OK) {
+        members[n] = member;
+        pfd[n].fd = member->conn.sock;
+        pfd[n].events = POLLIN;
+        pfd[n].revents = 0;
+        n++;
+        live++;
+      } else {
+        if(member) {
+          mongo_disconnect(&member->conn);
+        }
+        more = 0;
+      }
+    }
+
+    if(live == 0) {
+      return NGX_DECLINED;
+    }
+
+    timeout = remaining;
+    if(more && n < 2) {
+      timeout = ngx_min(timeout, (ngx_msec_int_t) (start + delay - ngx_current_msec));
+      timeout = ngx_max(timeout, 0);
+    }
+
+    rc = poll(pfd, n, (int) timeout);
+    ngx_time_update();
+
+    if(rc == -1 && ngx_errno != NGX_EINTR) {
+      rc = NGX_HTTP_GATEWAY_TIME_OUT;
+      break;
+    }
+
+    for(i = 0; rc > 0 && i < n; i++) {
+      if(pfd[i].fd == -1 || pfd[i].revents == 0) {
+        continue;
+      }
+      /* poll() passes over negative descriptors. */
+      pfd[i].fd = -1;
+      live--;
+
+      rc = ngx_http_mongodb_rest_hedge_read(members[i], ns, cursor);
+      if(rc == NGX_DECLINED) {
+        rc = 1;
+        continue;
+      }
+
+      for(j = 0; j < n; j++) {
+        if(pfd[j].fd != -1) {
+          ngx_http_mongo_member_owe(mongo_conn, members[j]);
+        }
+      }
+
+      if(rc != NGX_HTTP_GATEWAY_TIME_OUT) {
+        ngx_http_mongodb_rest_hedge_sample(mongo_conn, ngx_current_msec - start);
+      }
+      return rc;
+    }
+  }
+
+  for(i = 0; i < n; i++) {
+    if(pfd[i].fd != -1) {
+      ngx_http_mongo_member_owe(mongo_conn, members[i]);
+    }
+  }
+
+  return rc;
+}
+
+static ngx_int_t ngx_http_mongodb_rest_get_handler(ngx_http_request_t* request, mongo * conn, bson_type type, char * ns, const char * value) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  bson query;
+  bson fields;
+  bson doc;
+  bson * projection;
+  mongo_cursor * cursor;
+  ngx_pool_t * pool;
+#if (NGX_THREADS)
+  ngx_http_mongodb_rest_task_t * t;
+#endif
+
+  ngx_str_t arg;
+  ngx_int_t rc;
+
+  if(*value == '\0' && ngx_http_arg(request, (u_char *) "keys", 4, &arg) == NGX_OK) {
+    return ngx_http_mongodb_rest_bulk_handler(request, conn, &arg);
+  }
+
+  if(*value == '\0' && ngx_http_arg(request, (u_char *) "export", 6, &arg) == NGX_OK) {
+    return ngx_http_mongodb_rest_export_handler(request, conn, &arg);
+  }
+
+  if(*value == '\0') {
+    /* Parked cursors outlive the request. */
+    pool = ngx_http_mongodb_rest_alloc_from(NULL);
+    rc = ngx_http_mongodb_rest_list_handler(request, conn, ns);
+    ngx_http_mongodb_rest_alloc_from(pool);
+    return rc;
+  }
+
+  conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
+
+  if(conf->bloom && ngx_http_mongodb_rest_bloom_test(conf->bloom, type, value) == NGX_DECLINED) {
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  rc = ngx_http_mongodb_rest_projection(request, &fields, &projection);
+  if(rc == NGX_DECLINED) {
+    return NGX_HTTP_BAD_REQUEST;
+  } else if(rc != NGX_OK) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  // ---------- FROM THE SNAPSHOT ---------- //
+  /* Files hold the default projection, as JSON. */
+  if(conf->snapshot.len && projection != &fields
+     && ngx_http_mongodb_rest_format(request) == NGX_HTTP_MONGODB_REST_JSON) {
+    rc = ngx_http_mongodb_rest_snapshot_get(request, conf, value);
+    if(rc != NGX_DECLINED) {
+      return rc;
+    }
+  }
+
+  // ---------- FROM THE REPLICA ---------- //
+  /* Projections are left to mongod. */
+  if(conf->replica && projection == NULL) {
+    rc = ngx_http_mongodb_rest_replica_get(request, conf->replica, type, value, &doc);
+    if(rc == NGX_OK) {
+      return ngx_http_mongodb_rest_send_document(request, &doc, NULL);
+    } else if(rc != NGX_DECLINED) {
+      return rc;
+    }
+  }
+
+#if (NGX_THREADS)
+  // ---------- IN A THREAD ---------- //
+  if(conf->thread_pool) {
+    t = ngx_http_mongodb_rest_task_create(request, conf, NGX_HTTP_MONGODB_REST_TASK_GET);
+    if(t == NULL
+       || !ngx_http_mongodb_rest_query_deadline(&t->query, conf, value, ngx_http_mongodb_rest_remaining(request, conf))) {
+      if(projection == &fields) { bson_destroy(&fields); }
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    t->format = ngx_http_mongodb_rest_format(request);
+    if(projection == &fields) {
+      t->fields = fields;
+      t->projection = &t->fields;
+    } else {
+      t->projection = projection;
+    }
+
+    rc = ngx_http_mongodb_rest_task_post(t);
+    if(rc == NGX_DONE) {
+      request->main->count++;
+    }
+    return rc;
+  }
+#endif
+
+  /* The cursor may own the response body, so it lives in the pool. */
+  cursor = ngx_palloc(request->pool, sizeof(mongo_cursor));
+  if(cursor == NULL
+     || !ngx_http_mongodb_rest_query_deadline(&query, conf, value, ngx_http_mongodb_rest_remaining(request, conf))) {
+    if(projection == &fields) { bson_destroy(&fields); }
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  // ---------- FROM THE FIRST MEMBER TO ANSWER ---------- //
+  if(conf->hedge) {
+    rc = ngx_http_mongodb_rest_hedged_find(request, conf, ns, &query, projection, cursor);
+    if(rc != NGX_DECLINED) {
+      if(projection == &fields) { bson_destroy(&fields); }
+      bson_destroy(&query);
+      if(rc != NGX_OK) {
+        return rc;
+      }
+      return ngx_http_mongodb_rest_send_document(request, mongo_cursor_bson(cursor), cursor);
+    }
+  }
+
+  // ---------- RETRIEVE OBJECT ---------- //
+  mongo_cursor_init(cursor, conn, ns);
+  mongo_cursor_set_query(cursor, &query);
+  if(projection) {
+    mongo_cursor_set_fields(cursor, projection);
+  }
+
+  rc = mongo_cursor_next(cursor);
+
+  /* Once more without the dropped index. */
+  if(rc != MONGO_OK && ngx_http_mongodb_rest_hint_lost(request->connection->log, conf, conn->lasterrcode, conn->lasterrstr)) {
+    mongo_cursor_destroy(cursor);
+    bson_destroy(&query);
+    if(!ngx_http_mongodb_rest_query_deadline(&query, conf, value, ngx_http_mongodb_rest_remaining(request, conf))) {
+      if(projection == &fields) { bson_destroy(&fields); }
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    mongo_cursor_init(cursor, conn, ns);
+    mongo_cursor_set_query(cursor, &query);
+    if(projection) {
+      mongo_cursor_set_fields(cursor, projection);
+    }
+    rc = mongo_cursor_next(cursor);
+  }
+
+  if(projection == &fields) {
+    bson_destroy(&fields);
+  }
+  bson_destroy(&query);
+
+  if(rc != MONGO_OK) {
+    mongo_cursor_destroy(cursor);
+    if(conn->err == MONGO_IO_ERROR || conn->lasterrcode == MONGO_EXCEEDED_TIME_LIMIT) {
+      return NGX_HTTP_GATEWAY_TIME_OUT;
+    }
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  return ngx_http_mongodb_rest_send_document(request, mongo_cursor_bson(cursor), cursor);
+}
+
+static ngx_int_t ngx_http_mongodb_rest_delete_handler(ngx_http_request_t* request, mongo * conn, bson_type type, char * ns, const char * value) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  bson query, lookup;
+  mongo_cursor cursor;
+  int rc;
+#if (NGX_THREADS)
+  ngx_http_mongodb_rest_task_t * t;
+#endif
+
+  conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
+
+  if(conf->bloom && ngx_http_mongodb_rest_bloom_test(conf->bloom, type, value) == NGX_DECLINED) {
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  if(conf->snapshot.len) {
+    ngx_http_mongodb_rest_snapshot_forget(request, conf, value);
+  }
+
+#if (NGX_THREADS)
+  // ---------- IN A THREAD ---------- //
+  if(conf->thread_pool) {
+    t = ngx_http_mongodb_rest_task_create(request, conf, NGX_HTTP_MONGODB_REST_TASK_DELETE);
+    if(t == NULL || !ngx_http_mongodb_rest_query_init(&t->remove, conf, value)) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if(!ngx_http_mongodb_rest_query_deadline(&t->query, conf, value, ngx_http_mongodb_rest_remaining(request, conf))) {
+      bson_destroy(&t->remove);
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_mongodb_rest_task_post(t);
+    if(rc == NGX_DONE) {
+      request->main->count++;
+    }
+    return rc;
+  }
+#endif
+
+  if(!ngx_http_mongodb_rest_query_init(&query, conf, value)) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  if(!ngx_http_mongodb_rest_query_deadline(&lookup, conf, value, ngx_http_mongodb_rest_remaining(request, conf))) {
+    bson_destroy(&query);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  // ---------- RETRIEVE OBJECT ---------- //
+  mongo_cursor_init(&cursor, conn, ns);
+  mongo_cursor_set_query(&cursor, &lookup);
+
+  rc = mongo_cursor_next(&cursor);
+  mongo_cursor_destroy(&cursor);
+  bson_destroy(&lookup);
+
+  if(rc != MONGO_OK && ngx_http_mongodb_rest_hint_lost(request->connection->log, conf, conn->lasterrcode, conn->lasterrstr)) {
+    if(!ngx_http_mongodb_rest_query_deadline(&lookup, conf, value, ngx_http_mongodb_rest_remaining(request, conf))) {
+      bson_destroy(&query);
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    mongo_cursor_init(&cursor, conn, ns);
+    mongo_cursor_set_query(&cursor, &lookup);
+    rc = mongo_cursor_next(&cursor);
+    mongo_cursor_destroy(&cursor);
+    bson_destroy(&lookup);
+  }
+
+  if(rc != MONGO_OK) {
+    bson_destroy(&query);
+    if(conn->err == MONGO_IO_ERROR || conn->lasterrcode == MONGO_EXCEEDED_TIME_LIMIT) {
+      return NGX_HTTP_GATEWAY_TIME_OUT;
+    }
+    return NGX_HTTP_NOT_FOUND;
+  }
+  
+  rc = ngx_http_mongodb_rest_remove_one(request->connection->log, conn, conf, &query);
+  bson_destroy(&query);
+
+  if(rc != NGX_HTTP_NO_CONTENT) {
+    return rc;
+  } else {
+    request->headers_out.status = NGX_HTTP_NO_CONTENT;
+    ngx_http_send_header(request);
+
+    return NGX_OK;
+  }
+}
+
+/* A finished document the driver may read but must not free. */
+void ngx_http_mongodb_rest_bson_wrap(bson * b, u_char * data) {
+  ngx_memzero(b, sizeof(bson));
+  b->data = (char *) data;
+  b->finished = 1;
+}
+
+/* An OP_QUERY sent by us rather than a cursor; the reply is read by hand. */
+ngx_int_t ngx_http_mongodb_rest_op_query(mongo * conn, char * ns, int32_t flags, int32_t nreturn, bson * query, bson * fields) {
+  mongo_message * mm;
+  size_t nslen;
+  int32_t n;
+  u_char * p;
+
+  nslen = ngx_strlen(ns) + 1;
+  mm = mongo_message_create(16 + 4 + nslen + 4 + 4 + bson_size(query) + (fields ? bson_size(fields) : 0),
+                            0, 0, MONGO_OP_QUERY);
+  if(mm == NULL) {
+    return NGX_ERROR;
+  }
+
+  p = (u_char *) &mm->data;
+  bson_little_endian32(p, &flags);
+  p = ngx_cpymem(p + 4, ns, nslen);
+  n = 0;
+  bson_little_endian32(p, &n);
+  bson_little_endian32(p + 4, &nreturn);
+  p = ngx_cpymem(p + 8, query->data, bson_size(query));
+  if(fields) {
+    ngx_memcpy(p, fields->data, bson_size(fields));
+  }
+
+  return mongo_message_send(conn, mm) == MONGO_OK ? NGX_OK : NGX_ERROR;
+}
+
+/*
+ * Ask for the outcome of the write just sent on conn.  Replies come back in
+ * order, so each of several writes can be followed by one of these and all
+ * the replies read afterwards, in a single round trip.
+ */
+ngx_int_t ngx_http_mongodb_rest_gle_send(mongo * conn, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  ngx_int_t rc;
+  bson cmd;
+
+  bson_init(&cmd);
+  bson_append_int(&cmd, "getlasterror", 1);
+  bson_finish(&cmd);
+
+  rc = ngx_http_mongodb_rest_op_query(conn, (char *) conf->cmd_ns.data, 0, -1, &cmd, NULL);
+  bson_destroy(&cmd);
+
+  return rc;
+}
+
+/*
+ * Read the reply to ngx_http_mongodb_rest_gle_send: *code is 0 if the write
+ * went through, else mongod's code for it with its message in err; then
+ * out, if given, is a copy of the reply.  NGX_ERROR if there is no reply,
+ * and the outcome is unknown.
+ */
+ngx_int_t ngx_http_mongodb_rest_gle_read(mongo * conn, int * code, u_char * err, size_t len, bson * out) {
+  mongo_reply * reply;
+  bson_iterator it;
+  bson res;
+
+  if(mongo_read_response(conn, &reply) != MONGO_OK) {
+    return NGX_ERROR;
+  }
+
+  if(reply->fields.num != 1) {
+    bson_free(reply);
+    return NGX_ERROR;
+  }
+  ngx_http_mongodb_rest_bson_wrap(&res, (u_char *) &reply->objs);
+
+  *code = 0;
+  *err = '\0';
+
+  if(bson_find(&it, &res, "err") == BSON_STRING) {
+    ngx_cpystrn(err, (u_char *) bson_iterator_string(&it), len);
+    *code = bson_find(&it, &res, "code") != BSON_EOO ? bson_iterator_int(&it) : -1;
+  } else if(bson_find(&it, &res, "ok") != BSON_EOO && !bson_iterator_bool(&it)) {
+    /* getLastError itself failed, so nothing is known of the write. */
+    if(bson_find(&it, &res, "errmsg") == BSON_STRING) {
+      ngx_cpystrn(err, (u_char *) bson_iterator_string(&it), len);
+    }
+    *code = -1;
+  }
+
+  if(*code == 0 && *err != '\0') {
+    *code = -1;
+  }
+
+  if(out && *code == 0 && bson_copy(out, &res) != BSON_OK) {
+    *code = -1;
+    ngx_cpystrn(err, (u_char *) "out of memory", len);
+  }
+
+  bson_free(reply);
+  return NGX_OK;
+}
+
+/*
+ * 204 if the document was patched, 201 if created by an upsert, 404 if
+ * neither.  mongod reports "upserted" only for an _id it generated itself.
+ */
+static ngx_int_t ngx_http_mongodb_rest_patch_result(ngx_log_t * log, int code, u_char * err, bson * res) {
+  bson_iterator it;
+  int n;
+
+  if(code == MONGO_DUPLICATE_KEY) {
+    return NGX_HTTP_CONFLICT;
+  }
+
+  if(code) {
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+		  "Failed to patch document: %s", err);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  n = bson_find(&it, res, "n") != BSON_EOO ? bson_iterator_int(&it) : 0;
+  if(n <= 0) {
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  if(bson_find(&it, res, "upserted") != BSON_EOO
+     || (bson_find(&it, res, "updatedExisting") == BSON_BOOL && !bson_iterator_bool(&it))) {
+    return NGX_HTTP_CREATED;
+  }
+
+  return NGX_HTTP_NO_CONTENT;
+}
+
+/* Map the outcome of a write, as getLastError reported it, to a status; res only for a PATCH. */
+static ngx_int_t ngx_http_mongodb_rest_write_result(ngx_log_t * log, ngx_http_mongodb_rest_write_t * w, int code, u_char * err, bson * res) {
+  ngx_int_t rc;
+
+  if(w->patch) {
+    rc = ngx_http_mongodb_rest_patch_result(log, code, err, res);
+    if(code == 0) {
+      bson_destroy(res);
+    }
+    return rc;
+  }
+
+  if(code == 0) {
+    return w->keyed ? NGX_HTTP_NO_CONTENT : NGX_HTTP_CREATED;
+  }
+
+  if(code == MONGO_DUPLICATE_KEY) {
+    /* Our own _id already there: an earlier attempt went through. */
+    if(w->generated) {
+      return NGX_HTTP_CREATED;
+    }
+    return NGX_HTTP_CONFLICT;
+  }
+
+  ngx_log_error(NGX_LOG_ERR, log, 0,
+		"Failed to write document: %s", err);
+  return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+/* Send a single write on conn. */
+static int ngx_http_mongodb_rest_write_send(mongo * conn, ngx_http_mongodb_rest_loc_conf_t * conf, ngx_http_mongodb_rest_write_t * w) {
+  if(w->patch) {
+    return mongo_update(conn, (char *) conf->ns.data, &w->query, &w->doc, w->upsert ? MONGO_UPDATE_UPSERT : 0);
+  }
+
+  if(w->keyed) {
+    return mongo_update(conn, (char *) conf->ns.data, &w->query, &w->doc, MONGO_UPDATE_UPSERT);
+  }
+
+  return mongo_insert(conn, (char *) conf->ns.data, &w->doc);
+}
+
+/* log is the caller's: from a thread, not the request's. */
+static ngx_int_t ngx_http_mongodb_rest_write_one(ngx_log_t * log, mongo * conn, ngx_http_mongodb_rest_loc_conf_t * conf, ngx_http_mongodb_rest_write_t * w) {
+  u_char err[NGX_MAX_ERROR_STR];
+  bson res;
+  int code;
+
+  if(ngx_http_mongodb_rest_write_send(conn, conf, w) != MONGO_OK
+     || ngx_http_mongodb_rest_gle_send(conn, conf) != NGX_OK) {
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  if(ngx_http_mongodb_rest_gle_read(conn, &code, err, sizeof(err), w->patch ? &res : NULL) != NGX_OK) {
+    return NGX_HTTP_GATEWAY_TIME_OUT;
+  }
+
+  return ngx_http_mongodb_rest_write_result(log, w, code, err, &res);
+}
+
+/* Remove what query matches, and wait for getLastError to say it is gone. */
+static ngx_int_t ngx_http_mongodb_rest_remove_one(ngx_log_t * log, mongo * conn, ngx_http_mongodb_rest_loc_conf_t * conf, bson * query) {
+  u_char err[NGX_MAX_ERROR_STR];
+  int code;
+
+  if(mongo_remove(conn, (char *) conf->ns.data, query) != MONGO_OK
+     || ngx_http_mongodb_rest_gle_send(conn, conf) != NGX_OK) {
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  if(ngx_http_mongodb_rest_gle_read(conn, &code, err, sizeof(err), NULL) != NGX_OK) {
+    return NGX_HTTP_GATEWAY_TIME_OUT;
+  }
+
+  if(code) {
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+		  "Failed to delete document: %s", err);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  return NGX_HTTP_NO_CONTENT;
+}
+
+/* Respond to a PUT or PATCH and release its documents. */
+static void ngx_http_mongodb_rest_write_done(ngx_http_mongodb_rest_write_t * w, ngx_int_t status) {
+  ngx_http_request_t * r = w->request;
+  ngx_table_elt_t * location;
+  ngx_int_t rc;
+
+  if(w->keyed) {
+    bson_destroy(&w->query);
+  }
+  bson_destroy(&w->doc);
+
+  if(status >= NGX_HTTP_SPECIAL_RESPONSE) {
+    ngx_http_finalize_request(r, status);
+    return;
+  }
+
+  if((status == NGX_HTTP_CREATED || status == NGX_HTTP_ACCEPTED) && w->location.len) {
+    location = ngx_list_push(&r->headers_out.headers);
+    if(location == NULL) {
+      ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      return;
+    }
+    location->hash = 1;
+    ngx_str_set(&location->key, "Location");
+    location->value = w->location;
+    r->headers_out.location = location;
+  }
+
+  r->headers_out.status = status;
+  r->headers_out.content_length_n = 0;
+  r->header_only = 1;
+
+  rc = ngx_http_send_header(r);
+  ngx_http_finalize_request(r, rc);
+}
+
+/*
+ * Send every queued write, each followed by its own getLastError, before
+ * reading any reply: the batch costs one round trip, and every request gets
+ * the outcome of its own write.
+ */
+static void ngx_http_mongodb_rest_batch_flush(ngx_http_mongodb_rest_batch_t * batch) {
+  ngx_http_mongodb_rest_loc_conf_t * conf = batch->conf;
+  ngx_http_mongo_connection_t * mongo_conn;
+  ngx_http_mongodb_rest_write_t * w;
+  ngx_connection_t * c;
+  ngx_queue_t writes, * q;
+  ngx_uint_t i, sent = 0;
+  ngx_int_t status;
+  u_char err[NGX_MAX_ERROR_STR];
+  int code, replies = 1;
+  bson res;
+
+  if(batch->timer.timer_set) {
+    ngx_del_timer(&batch->timer);
+  }
+
+  if(ngx_queue_empty(&batch->writes)) {
+    return;
+  }
+
+  /* Take the batch, so that requests arriving meanwhile start a new one. */
+  writes = batch->writes;
+  writes.next->prev = &writes;
+  writes.prev->next = &writes;
+  ngx_queue_init(&batch->writes);
+  batch->nwrites = 0;
+
+  for(q = ngx_queue_head(&writes); q != ngx_queue_sentinel(&writes); q = ngx_queue_next(q)) {
+    w = ngx_queue_data(q, ngx_http_mongodb_rest_write_t, queue);
+    w->batch = NULL;
+  }
+
+  mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+
+  if(mongo_conn && ngx_http_mongo_ensure(batch->timer.log, mongo_conn) == NGX_OK) {
+    for(q = ngx_queue_head(&writes); q != ngx_queue_sentinel(&writes); q = ngx_queue_next(q)) {
+      w = ngx_queue_data(q, ngx_http_mongodb_rest_write_t, queue);
+
+      if(ngx_http_mongodb_rest_write_send(&mongo_conn->conn, conf, w) != MONGO_OK
+         || ngx_http_mongodb_rest_gle_send(&mongo_conn->conn, conf) != NGX_OK) {
+        break;
+      }
+      sent++;
+    }
+  }
+
+  for(i = 0; !ngx_queue_empty(&writes); i++) {
+    q = ngx_queue_head(&writes);
+    ngx_queue_remove(q);
+    w = ngx_queue_data(q, ngx_http_mongodb_rest_write_t, queue);
+
+    if(i >= sent) {
+      status = NGX_HTTP_SERVICE_UNAVAILABLE;
+    } else if(replies && ngx_http_mongodb_rest_gle_read(&mongo_conn->conn, &code, err, sizeof(err),
+                                                        w->patch ? &res : NULL) == NGX_OK) {
+      status = ngx_http_mongodb_rest_write_result(w->request->connection->log, w, code, err, &res);
+    } else {
+      /* Sent, but whether it was written is unknown. */
+      replies = 0;
+      status = NGX_HTTP_GATEWAY_TIME_OUT;
+    }
+
+    c = w->request->connection;
+    ngx_http_mongodb_rest_write_done(w, status);
+    ngx_http_run_posted_requests(c);
+  }
+
+  /* Replies still owed would be taken for those of the next writes. */
+  if(!replies || (mongo_conn && sent < i && mongo_conn->conn.connected)) {
+    mongo_disconnect(&mongo_conn->conn);
+  }
+}
+
+/* A request that goes before its batch is sent must leave it. */
+static void ngx_http_mongodb_rest_write_cleanup(void * data) {
+  ngx_http_mongodb_rest_write_t * w = data;
+
+  if(w->batch == NULL) {
+    return;
+  }
+
+  ngx_queue_remove(&w->queue);
+  w->batch->nwrites--;
+  w->batch = NULL;
+
+  if(w->keyed) {
+    bson_destroy(&w->query);
+  }
+  bson_destroy(&w->doc);
+}
+
+/* Queue a write behind those already waiting, sending them all once there are enough. */
+static ngx_int_t ngx_http_mongodb_rest_batch_add(ngx_http_mongodb_rest_batch_t * batch, ngx_http_mongodb_rest_write_t * w) {
+  ngx_pool_cleanup_t * cln;
+
+  cln = ngx_pool_cleanup_add(w->request->pool, 0);
+  if(cln == NULL) {
+    return NGX_ERROR;
+  }
+  cln->handler = ngx_http_mongodb_rest_write_cleanup;
+  cln->data = w;
+
+  w->batch = batch;
+  ngx_queue_insert_tail(&batch->writes, &w->queue);
+  batch->nwrites++;
+
+  if(batch->nwrites >= batch->conf->coalesce) {
+    ngx_http_mongodb_rest_batch_flush(batch);
+  } else if(!batch->timer.timer_set) {
+    ngx_add_timer(&batch->timer, batch->conf->coalesce_delay);
+  }
+
+  return NGX_OK;
+}
+
+static void ngx_http_mongodb_rest_batch_timer(ngx_event_t * ev) {
+  ngx_http_mongodb_rest_batch_flush(ev->data);
+}
+
+static ngx_int_t ngx_http_mongodb_rest_batch_init(ngx_cycle_t * cycle, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  ngx_http_mongodb_rest_batch_t * batch;
+
+  batch = ngx_pcalloc(cycle->pool, sizeof(ngx_http_mongodb_rest_batch_t));
+  if(batch == NULL) {
+    return NGX_ERROR;
+  }
+
+  batch->conf = conf;
+  ngx_queue_init(&batch->writes);
+  batch->timer.handler = ngx_http_mongodb_rest_batch_timer;
+  batch->timer.data = batch;
+  batch->timer.log = cycle->log;
+
+  conf->batch = batch;
+
+  return NGX_OK;
+}
+
+/* Collect the request body into one buffer. */
+static ngx_int_t ngx_http_mongodb_rest_read_body(ngx_http_request_t * r, ngx_str_t * body) {
+  ngx_chain_t * cl;
+  ngx_buf_t * buf;
+  u_char * p;
+  size_t len;
+  ssize_t n;
+
+  if(r->request_body == NULL || r->request_body->bufs == NULL) {
+    return NGX_ERROR;
+  }
+
+  if(r->request_body->temp_file) {
+    len = r->request_body->temp_file->file.offset;
+    p = ngx_pnalloc(r->pool, len);
+    if(p == NULL) {
+      return NGX_ERROR;
+    }
+
+    n = ngx_read_file(&r->request_body->temp_file->file, p, len, 0);
+    if(n != (ssize_t) len) {
+      return NGX_ERROR;
+    }
+
+    body->data = p;
+    body->len = len;
+    return NGX_OK;
+  }
+
+  cl = r->request_body->bufs;
+  buf = cl->buf;
+
+  if(cl->next == NULL) {
+    body->data = buf->pos;
+    body->len = buf->last - buf->pos;
+    return NGX_OK;
+  }
+
+  /* POST request did not fit into a single buffer. */
+  len = 0;
+  for(cl = r->request_body->bufs; cl; cl = cl->next) {
+    len += cl->buf->last - cl->buf->pos;
+  }
+
+  p = ngx_pnalloc(r->pool, len);
+  if(p == NULL) {
+    return NGX_ERROR;
+  }
+
+  body->data = p;
+  body->len = len;
+
+  for(cl = r->request_body->bufs; cl; cl = cl->next) {
+    p = ngx_cpymem(p, cl->buf->pos, cl->buf->last - cl->buf->pos);
+  }
+
+  return NGX_OK;
+}
+
+/* Set path, dotted into subobjects, in root. */
+static ngx_int_t ngx_http_mongodb_rest_json_set(json_t * root, const char * path, json_t * value) {
+  char name[MONGO_MAX_FIELD_NAME + 1];
+  const char * dot;
+  json_t * sub;
+
+  for(dot = strchr(path, '.'); dot; dot = strchr(path, '.')) {
+    ngx_cpystrn((u_char *) name, (u_char *) path, dot - path + 1);
+
+    sub = json_object_get(root, name);
+    if(sub == NULL) {
+      sub = json_object();
+      if(sub == NULL || json_object_set_new(root, name, sub) != 0) {
+        json_decref(value);
+        return NGX_ERROR;
+      }
+    } else if(!json_is_object(sub)) {
+      json_decref(value);
+      return NGX_DECLINED;
+    }
+
+    root = sub;
+    path = dot + 1;
+  }
+
+  return json_object_set_new(root, path, value) == 0 ? NGX_OK : NGX_ERROR;
+}
+
+/*
+ * Put the key from the URI into the document, in place of any in the body.
+ * Top level fields keep their BSON type; dotted ones are nested in root.
+ */
+static ngx_int_t ngx_http_mongodb_rest_key_doc(ngx_http_request_t * r, ngx_http_mongodb_rest_loc_conf_t * conf, bson * doc, json_t * root, const char * value) {
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  ngx_str_t segs[MONGO_MAX_KEY_FIELDS + 1];
+  ngx_uint_t i;
+  ngx_int_t rc;
+  int32_t n;
+  json_t * v;
+  char * str;
+
+  if(!json_is_object(root)) {
+    return NGX_DECLINED;
+  }
+
+  if(ngx_http_mongodb_rest_key_split(conf, value, segs) != conf->keys->nelts) {
+    return NGX_ERROR;
+  }
+
+  for(i = 0; i < conf->keys->nelts; i++) {
+    if(strchr((char *) keys[i].field.data, '.') == NULL) {
+      json_object_del(root, (char *) keys[i].field.data);
+      if(!ngx_http_mongodb_rest_append_value_n(doc, keys[i].type, (char *) keys[i].field.data,
+                                               (char *) segs[i].data, segs[i].len)) {
+        return NGX_ERROR;
+      }
+      continue;
+    }
+
+    if(keys[i].type == BSON_INT) {
+      if(ngx_http_mongodb_rest_atoi32(segs[i].data, segs[i].len, &n) != NGX_OK) {
+        return NGX_ERROR;
+      }
+      v = json_integer(n);
+    } else {
+      str = ngx_pnalloc(r->pool, segs[i].len + 1);
+      if(str == NULL) {
+        return NGX_ERROR;
+      }
+      ngx_cpystrn((u_char *) str, segs[i].data, segs[i].len + 1);
+      v = json_string(str);
+    }
+
+    if(v == NULL) {
+      return NGX_ERROR;
+    }
+
+    rc = ngx_http_mongodb_rest_json_set(root, (char *) keys[i].field.data, v);
+    if(rc != NGX_OK) {
+      return rc;
+    }
+  }
+
+  return NGX_OK;
+}
+
+/* Convert the JSON body, keyed by the URI if it named a document. */
+static ngx_int_t ngx_http_mongodb_rest_write_init(ngx_http_request_t * r, ngx_http_mongodb_rest_loc_conf_t * conf, ngx_http_mongodb_rest_write_t * w, json_t * root, const char * value) {
+  bson_oid_t oid;
+  ngx_int_t rc;
+
+  w->request = r;
+  bson_init(&w->doc);
+
+  if(*value != '\0') {
+    w->keyed = 1;
+
+    if(!ngx_http_mongodb_rest_query_init(&w->query, conf, value)) {
+      bson_destroy(&w->doc);
+      return NGX_ERROR;
+    }
+
+    rc = ngx_http_mongodb_rest_key_doc(r, conf, &w->doc, root, value);
+
+    if(rc != NGX_OK || !json_to_bson(root, &w->doc, NULL)) {
+      bson_destroy(&w->query);
+      bson_destroy(&w->doc);
+      return rc == NGX_ERROR ? NGX_ERROR : NGX_DECLINED;
+    }
+  } else {
+    /* Generate the _id, so that the new document can be located. */
+    if(json_object_get(root, "_id") == NULL) {
+      bson_oid_gen(&oid);
+      bson_append_oid(&w->doc, "_id", &oid);
+      w->generated = 1;
+
+      if(conf->keys->nelts == 1 && ngx_strcmp(conf->field.data, "_id") == 0) {
+        w->location.len = r->uri.len + 24;
+        w->location.data = ngx_pnalloc(r->pool, w->location.len + 1);
+        if(w->location.data == NULL) {
+          bson_destroy(&w->doc);
+          return NGX_ERROR;
+        }
+        bson_oid_to_string(&oid, (char *) ngx_cpymem(w->location.data, r->uri.data, r->uri.len));
+      }
+    }
+
+    if(!json_to_bson(root, &w->doc, NULL)) {
+      bson_destroy(&w->doc);
+      return NGX_DECLINED;
+    }
+  }
+
+  bson_finish(&w->doc);
+
+  /* Its key could not be named in a URI to read it back. */
+  if(!w->keyed && ngx_http_mongodb_rest_key_slash(conf, &w->doc)) {
+    bson_destroy(&w->doc);
+    return NGX_DECLINED;
+  }
+
+  return NGX_OK;
+}
+
+static void ngx_http_mongodb_rest_put_read(ngx_http_request_t* r) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongo_connection_t * mongo_conn;
+  ngx_http_mongodb_rest_write_t * w;
+  ngx_str_t body;
+  ngx_int_t rc;
+#if (NGX_THREADS)
+  ngx_http_mongodb_rest_task_t * t;
+#endif
+
+  json_t * root;
+  json_error_t error;
+
+  conf = ngx_http_get_module_loc_conf(r, ngx_http_mongodb_rest_module);
+  w = ngx_http_get_module_ctx(r, ngx_http_mongodb_rest_module);
+
+  if(ngx_http_mongodb_rest_read_body(r, &body) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+    return;
+  }
+
+  root = json_loadb((char *) body.data, body.len, 0, &error);
+  if(root == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+		  "Failed to parse JSON. (%d) %s", error.line, error.text);
+    ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+    return;
+  }
+
+  rc = ngx_http_mongodb_rest_write_init(r, conf, w, root, w->key);
+  json_decref(root);
+
+  if(rc != NGX_OK) {
+    ngx_http_finalize_request(r, rc == NGX_DECLINED ? NGX_HTTP_BAD_REQUEST : NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  if(conf->bloom) {
+    ngx_http_mongodb_rest_bloom_add(conf->bloom, &w->doc);
+  }
+
+  if(conf->snapshot.len && *w->key != '\0') {
+    ngx_http_mongodb_rest_snapshot_forget(r, conf, w->key);
+  }
+
+  // ---------- ACKNOWLEDGE FROM THE RING ---------- //
+  if(conf->write_behind) {
+    rc = ngx_http_mongodb_rest_ring_push(conf->write_behind, r->connection->log, w);
+
+    if(rc == NGX_DECLINED) {
+      if(w->keyed) { bson_destroy(&w->query); }
+      bson_destroy(&w->doc);
+      ngx_http_finalize_request(r, ngx_http_mongodb_rest_retry_after(r, MONGO_RETRY_AFTER));
+      return;
+    }
+
+    /* However long it waited, it would never fit. */
+    if(rc == NGX_ABORT) {
+      ngx_http_mongodb_rest_write_done(w, NGX_HTTP_REQUEST_ENTITY_TOO_LARGE);
+      return;
+    }
+
+    ngx_http_mongodb_rest_write_done(w, rc == NGX_OK ? NGX_HTTP_ACCEPTED : NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  // ---------- COALESCE WITH CONCURRENT WRITES ---------- //
+  if(conf->batch) {
+    if(ngx_http_mongodb_rest_batch_add(conf->batch, w) != NGX_OK) {
+      ngx_http_mongodb_rest_write_done(w, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    }
+    return;
+  }
+
+#if (NGX_THREADS)
+  // ---------- IN A THREAD ---------- //
+  /* Reading the body already holds the request open. */
+  if(conf->thread_pool) {
+    t = ngx_http_mongodb_rest_task_create(r, conf, NGX_HTTP_MONGODB_REST_TASK_PUT);
+    if(t == NULL) {
+      ngx_http_mongodb_rest_write_done(w, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      return;
+    }
+    t->w = w;
+
+    rc = ngx_http_mongodb_rest_task_post(t);
+    if(rc != NGX_DONE) {
+      ngx_http_mongodb_rest_write_done(w, rc);
+    }
+    return;
+  }
+#endif
+
+  mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+  if(mongo_conn == NULL) {
+    ngx_http_mongodb_rest_write_done(w, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  ngx_http_mongodb_rest_write_done(w, ngx_http_mongodb_rest_write_one(w->request->connection->log, &mongo_conn->conn, conf, w));
+}
+
+static ngx_int_t ngx_http_mongodb_rest_put_handler(ngx_http_request_t* r, mongo * conn, bson_type type, const char * field, char * ns, const char * value) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongodb_rest_write_t * w;
+  ngx_int_t rc;
+
+  conf = ngx_http_get_module_loc_conf(r, ngx_http_mongodb_rest_module);
+
+  if(conf->gridfs) {
+    return ngx_http_mongodb_rest_gridfs_put_handler(r, conn, type, field, value);
+  }
+
+  w = ngx_pcalloc(r->pool, sizeof(ngx_http_mongodb_rest_write_t));
+  if(w == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  /* Lives in the pool, until the body has been read. */
+  w->key = (char *) value;
+
+  ngx_http_set_ctx(r, w, ngx_http_mongodb_rest_module);
+
+  rc = ngx_http_read_client_request_body(r, ngx_http_mongodb_rest_put_read);
+
+  if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return rc;
+  }
+
+  return NGX_DONE;
+}
+
+/* Whether path is, contains or lies within _id or a field of the key. */
+static unsigned char ngx_http_mongodb_rest_patch_key(ngx_http_mongodb_rest_loc_conf_t * conf, u_char * path, size_t len) {
+  static ngx_str_t id = ngx_string("_id");
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  ngx_str_t * f;
+  ngx_uint_t i;
+
+  for(i = 0; i <= conf->keys->nelts; i++) {
+    f = (i < conf->keys->nelts) ? &keys[i].field : &id;
+
+    if(ngx_strncmp(f->data, path, ngx_min(f->len, len)) != 0) {
+      continue;
+    }
+    if(f->len == len
+       || (f->len > len && f->data[len] == '.')
+       || (f->len < len && path[f->len] == '.')) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/*
+ * Append the members of a JSON merge patch (RFC 7386) as dotted paths:
+ * those set to null when nulls is set, the others when not.  Objects are
+ * merged into member by member.  b may be NULL, to count them.  Returns
+ * the count, or NGX_DECLINED for a patch that names the key or a field
+ * mongod would not take.
+ */
+static ngx_int_t ngx_http_mongodb_rest_patch_paths(ngx_http_mongodb_rest_loc_conf_t * conf, json_t * patch, u_char * path, size_t len, bson * b, ngx_uint_t nulls) {
+  const char * name;
+  void * iter;
+  json_t * v;
+  ngx_int_t rc, count = 0;
+  size_t n;
+  u_char * p;
+
+  for(iter = json_object_iter(patch); iter; iter = json_object_iter_next(patch, iter)) {
+    name = json_object_iter_key(iter);
+    v = json_object_iter_value(iter);
+    n = ngx_strlen(name);
+
+    if(n == 0 || name[0] == '$' || strchr(name, '.') || len + 1 + n > MONGO_MAX_FIELD_NAME) {
+      return NGX_DECLINED;
+    }
+
+    p = path + len;
+    if(len) {
+      *p++ = '.';
+    }
+    p = ngx_cpymem(p, name, n);
+    *p = '\0';
+
+    if(json_is_object(v)) {
+      rc = ngx_http_mongodb_rest_patch_paths(conf, v, path, p - path, b, nulls);
+      if(rc < 0) {
+        return rc;
+      }
+      count += rc;
+      continue;
+    }
+
+    if((ngx_uint_t) json_is_null(v) != nulls) {
+      continue;
+    }
+
+    if(ngx_http_mongodb_rest_patch_key(conf, path, p - path)) {
+      return NGX_DECLINED;
+    }
+
+    if(b) {
+      if(nulls) {
+        bson_append_string(b, (char *) path, "");
+      } else if(!json_append_bson(b, (char *) path, v)) {
+        return NGX_ERROR;
+      }
+    }
+    count++;
+  }
+
+  return count;
+}
+
+/* { $set: ..., $unset: ... } from the patch; NGX_DONE when it changes nothing. */
+static ngx_int_t ngx_http_mongodb_rest_patch_init(ngx_http_mongodb_rest_loc_conf_t * conf, json_t * patch, bson * update) {
+  u_char path[MONGO_MAX_FIELD_NAME + 1];
+  static char * ops[] = { "$set", "$unset" };
+  ngx_int_t counts[2];
+  ngx_uint_t i;
+
+  if(!json_is_object(patch)) {
+    return NGX_DECLINED;
+  }
+
+  for(i = 0; i < 2; i++) {
+    counts[i] = ngx_http_mongodb_rest_patch_paths(conf, patch, path, 0, NULL, i);
+    if(counts[i] < 0) {
+      return counts[i];
+    }
+  }
+
+  if(counts[0] == 0 && counts[1] == 0) {
+    return NGX_DONE;
+  }
+
+  bson_init(update);
+  for(i = 0; i < 2; i++) {
+    if(counts[i] == 0) {
+      continue;
+    }
+    bson_append_start_object(update, ops[i]);
+    if(ngx_http_mongodb_rest_patch_paths(conf, patch, path, 0, update, i) < 0) {
+      bson_destroy(update);
+      return NGX_ERROR;
+    }
+    bson_append_finish_object(update);
+  }
+  bson_finish(update);
+
+  return NGX_OK;
+}
+
+/*
+ * A patch that changes nothing still answers for the document: 204 if it is
+ * there, else 404, or 201 once ?upsert=true has created it from the key
+ * alone.  Writes queued before it go first.
+ */
+static ngx_int_t ngx_http_mongodb_rest_patch_empty(ngx_http_mongodb_rest_loc_conf_t * conf, ngx_http_mongo_connection_t * mongo_conn, ngx_http_mongodb_rest_write_t * w) {
+  ngx_log_t * log = w->request->connection->log;
+  mongo * conn = &mongo_conn->conn;
+  u_char err[NGX_MAX_ERROR_STR];
+  mongo_cursor cursor;
+  bson fields;
+  int code, found;
+
+  if(conf->batch) {
+    ngx_http_mongodb_rest_batch_flush(conf->batch);
+  }
+
+  if(ngx_http_mongo_ensure(log, mongo_conn) != NGX_OK) {
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  bson_init(&fields);
+  bson_append_int(&fields, "_id", 1);
+  bson_finish(&fields);
+
+  mongo_cursor_init(&cursor, conn, (char *) conf->ns.data);
+  mongo_cursor_set_query(&cursor, &w->query);
+  mongo_cursor_set_fields(&cursor, &fields);
+
+  found = (mongo_cursor_next(&cursor) == MONGO_OK);
+
+  mongo_cursor_destroy(&cursor);
+  bson_destroy(&fields);
+
+  if(found) {
+    return NGX_HTTP_NO_CONTENT;
+  }
+
+  if(conn->err == MONGO_IO_ERROR) {
+    return NGX_HTTP_GATEWAY_TIME_OUT;
+  }
+
+  if(!w->upsert) {
+    return NGX_HTTP_NOT_FOUND;
+  }
+
+  if(mongo_insert(conn, (char *) conf->ns.data, &w->doc) != MONGO_OK
+     || ngx_http_mongodb_rest_gle_send(conn, conf) != NGX_OK) {
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+  }
+
+  if(ngx_http_mongodb_rest_gle_read(conn, &code, err, sizeof(err), NULL) != NGX_OK) {
+    return NGX_HTTP_GATEWAY_TIME_OUT;
+  }
+
+  /* Created by another meanwhile. */
+  if(code == MONGO_DUPLICATE_KEY) {
+    return NGX_HTTP_NO_CONTENT;
+  }
+
+  if(code) {
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+		  "Failed to patch document: %s", err);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  return NGX_HTTP_CREATED;
+}
+
+static void ngx_http_mongodb_rest_patch_read(ngx_http_request_t* r) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongo_connection_t * mongo_conn;
+  ngx_http_mongodb_rest_write_t * w;
+  ngx_str_t body, arg, key;
+  ngx_int_t rc;
+  u_char buf[12];
+  unsigned empty;
+
+  json_t * root;
+  json_error_t error;
+
+  conf = ngx_http_get_module_loc_conf(r, ngx_http_mongodb_rest_module);
+  w = ngx_http_get_module_ctx(r, ngx_http_mongodb_rest_module);
+
+  if(ngx_http_mongodb_rest_read_body(r, &body) != NGX_OK) {
+    ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+    return;
+  }
+
+  root = json_loadb((char *) body.data, body.len, 0, &error);
+  if(root == NULL) {
+    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+		  "Failed to parse JSON. (%d) %s", error.line, error.text);
+    ngx_http_finalize_request(r, NGX_HTTP_BAD_REQUEST);
+    return;
+  }
+
+  w->upsert = ngx_http_arg(r, (u_char *) "upsert", 6, &arg) == NGX_OK
+              && arg.len == 4 && ngx_strncmp(arg.data, "true", 4) == 0;
+
+  rc = ngx_http_mongodb_rest_patch_init(conf, root, &w->doc);
+  json_decref(root);
+
+  /* Nothing to change: the document is made of the key alone, to look up or create. */
+  empty = (rc == NGX_DONE);
+  if(empty) {
+    root = json_object();
+    rc = root ? ngx_http_mongodb_rest_write_init(r, conf, w, root, w->key) : NGX_ERROR;
+    if(root) {
+      json_decref(root);
+    }
+  }
+
+  if(rc != NGX_OK) {
+    ngx_http_finalize_request(r, rc == NGX_DECLINED ? NGX_HTTP_BAD_REQUEST : NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  if(!empty) {
+    w->keyed = 1;
+    w->patch = 1;
+    if(!ngx_http_mongodb_rest_query_init(&w->query, conf, w->key)) {
+      bson_destroy(&w->doc);
+      ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
+      return;
+    }
+  }
+
+  /* Only an upsert can add a key. */
+  if(w->upsert && conf->bloom
+     && ngx_http_mongodb_rest_raw_key(conf->type, w->key, buf, &key) == NGX_OK) {
+    ngx_http_mongodb_rest_bloom_add_key(conf->bloom, &key);
+  }
+
+  if(conf->snapshot.len && !empty) {
+    ngx_http_mongodb_rest_snapshot_forget(r, conf, w->key);
+  }
+
+  mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+  if(mongo_conn == NULL) {
+    ngx_http_mongodb_rest_write_done(w, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    return;
+  }
+
+  if(empty) {
+    ngx_http_mongodb_rest_write_done(w, ngx_http_mongodb_rest_patch_empty(conf, mongo_conn, w));
+    return;
+  }
+
+  // ---------- COALESCE WITH CONCURRENT WRITES ---------- //
+  /* In turn with the PUTs queued before it. */
+  if(conf->batch) {
+    if(ngx_http_mongodb_rest_batch_add(conf->batch, w) != NGX_OK) {
+      ngx_http_mongodb_rest_write_done(w, NGX_HTTP_INTERNAL_SERVER_ERROR);
+    }
+    return;
+  }
+
+  ngx_http_mongodb_rest_write_done(w, ngx_http_mongodb_rest_write_one(w->request->connection->log, &mongo_conn->conn, conf, w));
+}
+
+/*
+ * Apply a JSON merge patch to the document named by the URI, as a single
+ * update, in turn with any PUTs coalesced before it.  Refused where PUTs
+ * are written behind: it could be neither ordered with them nor answered.
+ */
+static ngx_int_t ngx_http_mongodb_rest_patch_handler(ngx_http_request_t* r, const char * value) {
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongodb_rest_write_t * w;
+  ngx_int_t rc;
+
+  conf = ngx_http_get_module_loc_conf(r, ngx_http_mongodb_rest_module);
+
+  if(conf->gridfs || conf->write_behind || *value == '\0') {
+    return NGX_HTTP_NOT_ALLOWED;
+  }
+
+  w = ngx_pcalloc(r->pool, sizeof(ngx_http_mongodb_rest_write_t));
+  if(w == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+  w->request = r;
+  w->key = (char *) value;
+
+  ngx_http_set_ctx(r, w, ngx_http_mongodb_rest_module);
+
+  rc = ngx_http_read_client_request_body(r, ngx_http_mongodb_rest_patch_read);
+
+  if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+    return rc;
+  }
+
+  return NGX_DONE;
+}
+
+#if (NGX_THREADS)
+
+// ---------- THREAD POOL ---------- //
+
+/*
+ * This thread's connection to conf's 'mongo', made on first use.  Connecting
+ * is bounded by the connect timeout, as a worker's reconnect is: the driver's
+ * own connect calls reset it, so the connection is set up here and then
+ * reconnected.
+ */
+static mongo * ngx_http_mongodb_rest_thread_conn(ngx_http_mongodb_rest_loc_conf_t * conf, ngx_http_mongo_connection_t * mongo_conn, ngx_log_t * log) {
+  ngx_http_mongod_server_t * mongods = conf->mongods->elts;
+  ngx_pool_t * pool;
+  ngx_uint_t i;
+  mongo * conn;
+  u_char host[255];
+  int rc;
+
+  if(ngx_http_mongodb_rest_thread_conns == NULL) {
+    ngx_http_mongodb_rest_thread_conns = ngx_calloc(ngx_http_mongo_connections.nelts * sizeof(mongo), log);
+    if(ngx_http_mongodb_rest_thread_conns == NULL) {
+      return NULL;
+    }
+  }
+
+  conn = &ngx_http_mongodb_rest_thread_conns[mongo_conn - (ngx_http_mongo_connection_t *) ngx_http_mongo_connections.elts];
+
+  /* A send or read that timed out leaves the connection out of step. */
+  if(conn->connected && conn->err == MONGO_IO_ERROR) {
+    mongo_disconnect(conn);
+  }
+
+  if(conn->connected) {
+    mongo_clear_errors(conn);
+    return conn;
+  }
+
+  /* The connection outlives the task. */
+  pool = ngx_http_mongodb_rest_alloc_from(NULL);
+  if(conn->primary == NULL) {
+    if(conf->mongods->nelts == 1) {
+      mongo_init(conn);
+      conn->primary = bson_malloc(sizeof(mongo_host_port));
+      ngx_cpystrn((u_char *) conn->primary->host, mongods[0].host.data, mongods[0].host.len + 1);
+      conn->primary->port = mongods[0].port;
+      conn->primary->next = NULL;
+    } else {
+      mongo_replset_init(conn, (const char *) conf->replset.data);
+      for(i = 0; i < conf->mongods->nelts; i++) {
+        ngx_cpystrn(host, mongods[i].host.data, mongods[i].host.len + 1);
+        mongo_replset_add_seed(conn, (const char *) host, mongods[i].port);
+      }
+    }
+  }
+  conn->conn_timeout_ms = mongo_conn->connect_timeout;
+  rc = mongo_reconnect(conn);
+  ngx_http_mongodb_rest_alloc_from(pool);
+
+  if(rc != MONGO_OK || !conn->connected) {
+    ngx_log_error(NGX_LOG_ERR, log, 0,
+		  "Could not connect to mongo from thread: \"%V\"", &conf->mongo);
+    return NULL;
+  }
+
+  ngx_http_mongo_set_timeouts(log, mongo_conn, conn);
+
+  if(ngx_http_mongo_reauth(log, mongo_conn, conn) != NGX_OK) {
+    mongo_disconnect(conn);
+    return NULL;
+  }
+
+  return conn;
+}
+
+/* In the thread: everything it allocates comes from the task's pool. */
+static void ngx_http_mongodb_rest_task_run(void * data, ngx_log_t * log) {
+  ngx_http_mongodb_rest_task_t * t = data;
+  char * ns = (char *) t->conf->ns.data;
+  mongo_cursor cursor;
+  bson unhinted;
+  ngx_pool_t * pool;
+  mongo * conn;
+  int rc;
+
+  pool = ngx_http_mongodb_rest_alloc_from(t->pool);
+
+  conn = ngx_http_mongodb_rest_thread_conn(t->conf, t->mongo_conn, log);
+  if(conn == NULL) {
+    t->status = NGX_HTTP_SERVICE_UNAVAILABLE;
+    ngx_http_mongodb_rest_alloc_from(pool);
+    return;
+  }
+  t->connected = 1;
+
+  if(t->op == NGX_HTTP_MONGODB_REST_TASK_PUT) {
+    t->status = ngx_http_mongodb_rest_write_one(log, conn, t->conf, t->w);
+    ngx_http_mongodb_rest_alloc_from(pool);
+    return;
+  }
+
+  // ---------- RETRIEVE OBJECT ---------- //
+  mongo_cursor_init(&cursor, conn, ns);
+  mongo_cursor_set_query(&cursor, &t->query);
+  if(t->projection) {
+    mongo_cursor_set_fields(&cursor, t->projection);
+  }
+
+  rc = mongo_cursor_next(&cursor);
+
+  /* The hinted index is gone; the hint is the worker's to change. */
+  if(rc != MONGO_OK && ngx_http_mongodb_rest_hint_error(conn->lasterrcode, conn->lasterrstr)
+     && (t->hint_err = ngx_pnalloc(t->pool, ngx_strlen(conn->lasterrstr) + 1)) != NULL) {
+    ngx_cpystrn(t->hint_err, (u_char *) conn->lasterrstr, ngx_strlen(conn->lasterrstr) + 1);
+    t->hint_code = conn->lasterrcode;
+    mongo_cursor_destroy(&cursor);
+    ngx_http_mongodb_rest_unhint(&unhinted, &t->query);
+    mongo_cursor_init(&cursor, conn, ns);
+    mongo_cursor_set_query(&cursor, &unhinted);
+    if(t->projection) {
+      mongo_cursor_set_fields(&cursor, t->projection);
+    }
+    rc = mongo_cursor_next(&cursor);
+  }
+
+  if(rc != MONGO_OK) {
+    if(conn->err == MONGO_IO_ERROR || conn->lasterrcode == MONGO_EXCEEDED_TIME_LIMIT) {
+      t->status = NGX_HTTP_GATEWAY_TIME_OUT;
+    } else {
+      t->status = NGX_HTTP_NOT_FOUND;
+    }
+  } else if(t->op == NGX_HTTP_MONGODB_REST_TASK_DELETE) {
+    t->status = NGX_HTTP_NO_CONTENT;
+  } else if(ngx_http_mongodb_rest_serialize(t->pool, t->format, mongo_cursor_bson(&cursor), &t->out) != NGX_OK) {
+    t->status = NGX_HTTP_INTERNAL_SERVER_ERROR;
+  } else {
+    t->status = NGX_HTTP_OK;
+  }
+
+  mongo_cursor_destroy(&cursor);
+  if(t->hint_err) {
+    bson_destroy(&unhinted);
+  }
+
+  if(t->op == NGX_HTTP_MONGODB_REST_TASK_DELETE && t->status == NGX_HTTP_NO_CONTENT) {
+    t->status = ngx_http_mongodb_rest_remove_one(log, conn, t->conf, &t->remove);
+  }
+
+  ngx_http_mongodb_rest_alloc_from(pool);
+}
+
+/* The request's queries; a PUT's documents go with ngx_http_mongodb_rest_write_done. */
+static void ngx_http_mongodb_rest_task_release(ngx_http_mongodb_rest_task_t * t) {
+  if(t->op == NGX_HTTP_MONGODB_REST_TASK_PUT) {
+    return;
+  }
+
+  bson_destroy(&t->query);
+  if(t->op == NGX_HTTP_MONGODB_REST_TASK_DELETE) {
+    bson_destroy(&t->remove);
+  }
+  if(t->projection == &t->fields) {
+    bson_destroy(&t->fields);
+  }
+}
+
+/* Back in the worker, respond with what the thread found. */
+static void ngx_http_mongodb_rest_task_done(ngx_event_t * ev) {
+  ngx_http_mongodb_rest_task_t * t = ev->data;
+  ngx_http_mongodb_rest_main_conf_t * main_conf;
+  ngx_http_request_t * r = t->request;
+  ngx_connection_t * c = r->connection;
+  ngx_chain_t * out;
+  ngx_int_t rc;
+
+  r->main->blocked--;
+  r->aio = 0;
+
+  main_conf = ngx_http_get_module_main_conf(r, ngx_http_mongodb_rest_module);
+  if(main_conf->health_check) {
+    /* Connecting was not enough: the thread's timeouts count as well. */
+    ngx_http_mongodb_rest_health_report(c->log, main_conf, t->conf->upstream,
+                                        t->connected && t->status != NGX_HTTP_GATEWAY_TIME_OUT
+                                        && t->status != NGX_HTTP_SERVICE_UNAVAILABLE);
+  }
+
+  if(t->hint_err) {
+    (void) ngx_http_mongodb_rest_hint_lost(c->log, t->conf, t->hint_code, (char *) t->hint_err);
+  }
+
+  ngx_http_mongodb_rest_task_release(t);
+
+  switch(t->op) {
+    case NGX_HTTP_MONGODB_REST_TASK_PUT:
+      ngx_http_mongodb_rest_write_done(t->w, t->status);
+      ngx_http_run_posted_requests(c);
+      return;
+
+    case NGX_HTTP_MONGODB_REST_TASK_DELETE:
+      if(t->status != NGX_HTTP_NO_CONTENT) {
+        rc = t->status;
+        break;
+      }
+      r->headers_out.status = NGX_HTTP_NO_CONTENT;
+      rc = ngx_http_send_header(r);
+      break;
+
+    default:
+      if(t->status != NGX_HTTP_OK) {
+        rc = t->status;
+        break;
+      }
+
+      /* The body stays in the task's pool, which goes with the request. */
+      out = ngx_http_mongodb_rest_chain(r->pool, t->out.data, t->out.len);
+      if(out == NULL) {
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        break;
+      }
+      out->buf->last_buf = 1;
+
+      rc = ngx_http_mongodb_rest_send(r, t->format, t->out.len, out);
+  }
+
+  ngx_http_finalize_request(r, rc);
+  ngx_http_run_posted_requests(c);
+}
+
+static void ngx_http_mongodb_rest_task_cleanup(void * data) {
+  ngx_destroy_pool(data);
+}
+
+static ngx_http_mongodb_rest_task_t * ngx_http_mongodb_rest_task_create(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf, ngx_uint_t op) {
+  ngx_http_mongodb_rest_task_t * t;
+  ngx_thread_task_t * task;
+  ngx_pool_cleanup_t * cln;
+
+  task = ngx_thread_task_alloc(request->pool, sizeof(ngx_http_mongodb_rest_task_t));
+  if(task == NULL) {
+    return NULL;
+  }
+
+  t = task->ctx;
+  t->task = task;
+  t->request = request;
+  t->conf = conf;
+  t->op = op;
+
+  t->mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+  if(t->mongo_conn == NULL) {
+    return NULL;
+  }
+
+  cln = ngx_pool_cleanup_add(request->pool, 0);
+  if(cln == NULL) {
+    return NULL;
+  }
+
+  /* Destroyed with the request, which cannot end while the thread runs. */
+  t->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, request->connection->log);
+  if(t->pool == NULL) {
+    return NULL;
+  }
+  cln->handler = ngx_http_mongodb_rest_task_cleanup;
+  cln->data = t->pool;
+
+  task->handler = ngx_http_mongodb_rest_task_run;
+  task->event.handler = ngx_http_mongodb_rest_task_done;
+  task->event.data = t;
+
+  return t;
+}
+
+/*
+ * Hand the task to its thread pool.  The request is blocked until it is
+ * done; the caller holds the reference that ngx_http_mongodb_rest_task_done
+ * finalizes.  A full queue is shed like a full admission queue.
+ */
+static ngx_int_t ngx_http_mongodb_rest_task_post(ngx_http_mongodb_rest_task_t * t) {
+  ngx_http_request_t * r = t->request;
+
+  if(ngx_thread_task_post(t->conf->thread_pool, t->task) != NGX_OK) {
+    ngx_http_mongodb_rest_task_release(t);
+    return ngx_http_mongodb_rest_retry_after(r, MONGO_RETRY_AFTER);
+  }
+
+  r->main->blocked++;
+  r->aio = 1;
+
+  return NGX_DONE;
+}
+
+// ---------- HEALTH CHECK ---------- //
+
+/* The pinging worker's round of pings, set up once. */
+static ngx_int_t ngx_http_mongodb_rest_probe_init(ngx_cycle_t * cycle, ngx_http_mongodb_rest_main_conf_t * main_conf) {
+  ngx_http_mongodb_rest_probe_t * probe;
+  ngx_uint_t n = main_conf->upstreams.nelts;
+
+  probe = ngx_pcalloc(cycle->pool, sizeof(ngx_http_mongodb_rest_probe_t));
+  if(probe == NULL) {
+    return NGX_ERROR;
+  }
+
+  probe->task = ngx_thread_task_alloc(cycle->pool, 0);
+  probe->mongo_conns = ngx_pcalloc(cycle->pool, n * sizeof(ngx_http_mongo_connection_t *));
+  probe->healthy = ngx_pcalloc(cycle->pool, n * sizeof(ngx_flag_t));
+  if(probe->task == NULL || probe->mongo_conns == NULL || probe->healthy == NULL) {
+    return NGX_ERROR;
+  }
+
+  probe->main_conf = main_conf;
+  probe->task->handler = ngx_http_mongodb_rest_probe_run;
+  probe->task->ctx = probe;
+  probe->task->event.handler = ngx_http_mongodb_rest_probe_done;
+  probe->task->event.data = probe;
+  probe->task->event.log = cycle->log;
+
+  ngx_http_mongodb_rest_probe = probe;
+
+  return NGX_OK;
+}
+
+/*
+ * Connect, within the connect timeout, and ask isMaster; on the thread's own
+ * connections, so that no request waits on a ping, nor a ping on a request.
+ */
+static void ngx_http_mongodb_rest_probe_run(void * data, ngx_log_t * log) {
+  ngx_http_mongodb_rest_probe_t * probe = data;
+  ngx_http_mongodb_rest_loc_conf_t ** upstreams = probe->main_conf->upstreams.elts;
+  mongo * conn;
+  ngx_uint_t i;
+
+  for(i = 0; i < probe->main_conf->upstreams.nelts; i++) {
+    if(probe->mongo_conns[i] == NULL) {
+      continue;
+    }
+
+    conn = ngx_http_mongodb_rest_thread_conn(upstreams[i], probe->mongo_conns[i], log);
 
-    for (i = 0; i < mongo_conn->auths->nelts; i++) {
-        success = mongo_cmd_authenticate( &mongo_conn->conn, 
-                                          (const char*)auths[i].db.data, 
-                                          (const char*)auths[i].user.data, 
-                                          (const char*)auths[i].pass.data );
-        if (!success) {
-            ngx_log_error(NGX_LOG_ERR, log, 0,
-                          "Invalid mongo user/pass: %s/%s, during reauth", 
-                          auths[i].user.data, 
-                          auths[i].pass.data);   
-            return NGX_ERROR;
-        }
+    probe->healthy[i] = conn != NULL
+                        && mongo_simple_int_command(conn, "admin", "isMaster", 1, NULL) == MONGO_OK;
+    if(conn && !probe->healthy[i]) {
+      mongo_disconnect(conn);
     }
-    
-    return NGX_OK;
+  }
 }
 
-static char h_digit(char hex) {
-    return (hex >= '0' && hex <= '9') ? hex - '0': ngx_tolower(hex)-'a'+10;
-}
+/* Back in the worker, count every ping: one that failed counts as any failure. */
+static void ngx_http_mongodb_rest_probe_done(ngx_event_t * ev) {
+  ngx_http_mongodb_rest_probe_t * probe = ev->data;
+  ngx_uint_t i;
 
-static int htoi(char* h) {
-    char ok[] = "0123456789AaBbCcDdEeFf";
+  for(i = 0; i < probe->main_conf->upstreams.nelts; i++) {
+    if(probe->mongo_conns[i]) {
+      ngx_http_mongodb_rest_health_report(ev->log, probe->main_conf, i, probe->healthy[i]);
+    }
+  }
 
-    if (ngx_strchr(ok, h[0]) == NULL || ngx_strchr(ok,h[1]) == NULL) { return -1; }
-    return h_digit(h[0])*16 + h_digit(h[1]);
+  probe->running = 0;
 }
 
-static int url_decode(char * filename) {
-    char * read = filename;
-    char * write = filename;
-    char hex[3];
-    int c;
+/*
+ * Each interval, have every 'mongo' whose circuit is closed or half open
+ * pinged.  An open circuit waits out its retry; then a request, and these
+ * pings, probe it.  A round still running is not doubled up.
+ */
+static void ngx_http_mongodb_rest_health_ping(ngx_event_t * ev) {
+  ngx_http_mongodb_rest_main_conf_t * main_conf = ev->data;
+  ngx_http_mongodb_rest_probe_t * probe = ngx_http_mongodb_rest_probe;
+  ngx_http_mongodb_rest_loc_conf_t ** upstreams;
+  ngx_uint_t i, n;
+
+  upstreams = main_conf->upstreams.elts;
+
+  if(!probe->running) {
+    for(i = 0, n = 0; i < main_conf->upstreams.nelts; i++) {
+      probe->mongo_conns[i] = NULL;
+      if(ngx_http_mongodb_rest_health[i]->state == NGX_HTTP_MONGODB_REST_OPEN) {
+        continue;
+      }
+      probe->mongo_conns[i] = ngx_http_get_mongo_connection(upstreams[i]->mongo);
+      if(probe->mongo_conns[i]) {
+        n++;
+      }
+    }
 
-    hex[2] = '\0';
-    while (*read != '\0'){
-        if (*read == '%') {
-            hex[0] = *(++read);
-            if (hex[0] == '\0') return 0;
-            hex[1] = *(++read);
-            if (hex[1] == '\0') return 0;
-            c = htoi(hex);
-            if (c == -1) return 0;
-            *write = (char)c;
-        }
-        else *write = *read;
-        read++;
-        write++;
+    if(n) {
+      if(ngx_thread_task_post(main_conf->health_pool, probe->task) == NGX_OK) {
+        probe->running = 1;
+      } else {
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+		      "Mongo health check skipped: its thread pool queue is full");
+      }
     }
-    *write = '\0';
-    return 1;
+  }
+
+  if(!ngx_exiting) {
+    ngx_add_timer(ev, main_conf->health_interval);
+  }
 }
 
-static unsigned char ngx_http_mongodb_rest_query_init(bson * query, bson_type type, const char * field, const char * value) {
-  bson_oid_t oid;
+#endif
 
-  bson_init(query);
-  switch (type) {
-    case  BSON_OID:
-      bson_oid_from_string(&oid, value);
-      bson_append_oid(query, field, &oid);
-      break;
-    case BSON_INT:
-      bson_append_int(query, field, ngx_atoi((u_char*)value, strlen(value)));
-      break;
-    case BSON_STRING:
-      bson_append_string(query, field, value);
-      break;
-    default:
-      return 0;
-      break;
-  }
-  bson_finish(query);
+// ---------- ADMISSION CONTROL ---------- //
 
-  /*int ql = json_length(&query);
-  char * qs = (char *) ngx_palloc(request->pool, ql);
-  tojson(&query, qs);
-  ngx_log_error(NGX_LOG_DEBUG, request->connection->log,0, qs);*/
+/* Take a place for an operation, unless 'mongo' or the location is full. */
+static ngx_int_t ngx_http_mongodb_rest_admission_acquire(ngx_http_mongodb_rest_slot_t *slot) {
+    ngx_http_mongodb_rest_admission_t *upstream, *location;
+    ngx_atomic_uint_t n;
 
-  return 1;
-}
+    upstream = ngx_http_mongodb_rest_admission[slot->conf->upstream];
+    location = ngx_http_mongodb_rest_admission[slot->conf->slot];
 
-static ngx_int_t ngx_http_mongodb_rest_get_handler(ngx_http_request_t* request, mongo * conn, bson_type type, const char * field, char * collection, const char * value) {
-  ngx_buf_t* buffer;
-  ngx_chain_t out;
+    n = ngx_atomic_fetch_add(&upstream->inflight, 1);
+    if (slot->main_conf->admission_max && n >= slot->main_conf->admission_max) {
+        (void) ngx_atomic_fetch_add(&upstream->inflight, -1);
+        return NGX_AGAIN;
+    }
 
-  bson query;
-  mongo_cursor cursor;
+    n = ngx_atomic_fetch_add(&location->inflight, 1);
+    if (slot->conf->max_inflight && n >= slot->conf->max_inflight) {
+        (void) ngx_atomic_fetch_add(&location->inflight, -1);
+        (void) ngx_atomic_fetch_add(&upstream->inflight, -1);
+        return NGX_AGAIN;
+    }
 
-  const bson * b;
-  int l;
-  char * s;
+    slot->held = 1;
+    return NGX_OK;
+}
 
-  ngx_int_t rc;
+static void ngx_http_mongodb_rest_admission_release(ngx_http_mongodb_rest_slot_t *slot) {
+    if (!slot->held) {
+        return;
+    }
+    slot->held = 0;
 
-  if(!ngx_http_mongodb_rest_query_init(&query, type, field, value)) {
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-  }
+    (void) ngx_atomic_fetch_add(&ngx_http_mongodb_rest_admission[slot->conf->slot]->inflight, -1);
+    (void) ngx_atomic_fetch_add(&ngx_http_mongodb_rest_admission[slot->conf->upstream]->inflight, -1);
 
-  // ---------- RETRIEVE OBJECT ---------- //
-  mongo_cursor_init(&cursor, conn, "test.test");
-  mongo_cursor_set_query(&cursor, &query);
+    /* Requests waiting here need not wait for the next poll. */
+    if (!ngx_queue_empty(&ngx_http_mongodb_rest_waiting[0])
+        || !ngx_queue_empty(&ngx_http_mongodb_rest_waiting[1])) {
+        ngx_post_event(&ngx_http_mongodb_rest_admitter, &ngx_posted_events);
+    }
+}
 
-  if(mongo_cursor_next(&cursor) != MONGO_OK) {
-    return NGX_HTTP_NOT_FOUND;
-  }
+static void ngx_http_mongodb_rest_admission_dequeue(ngx_http_mongodb_rest_slot_t *slot) {
+    ngx_queue_remove(&slot->queue);
+    slot->waiting = 0;
+    slot->request->read_event_handler = ngx_http_block_reading;
 
-  b = mongo_cursor_bson(&cursor);
-  l = json_length(b);
-  s = (char *) ngx_palloc(request->pool, l);
-  
-  if(s == NULL)
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-  
-  tojson(b, s);
+    (void) ngx_atomic_fetch_add(&ngx_http_mongodb_rest_admission[slot->conf->slot]->queued, -1);
+    (void) ngx_atomic_fetch_add(&ngx_http_mongodb_rest_admission[slot->conf->upstream]->queued, -1);
+}
 
-  ngx_log_error(NGX_LOG_DEBUG, request->connection->log,0, "JSON: %s (%d/%d)", s, strlen(s), l-1);
+static void ngx_http_mongodb_rest_admission_cleanup(void *data) {
+    ngx_http_mongodb_rest_slot_t *slot = data;
 
-  mongo_cursor_destroy(&cursor);
-  bson_destroy(&query);
+    if (slot->waiting) {
+        ngx_http_mongodb_rest_admission_dequeue(slot);
+    }
+    ngx_http_mongodb_rest_admission_release(slot);
+}
 
-  // ---------- SEND THE HEADERS ---------- //
+/*
+ * Queue a request that found no place, or shed it when as many requests as
+ * allowed already wait on its 'mongo'.  Reads wait ahead of writes, which
+ * may each carry a batch of documents.  A client closing its connection
+ * terminates the request, whose cleanup takes it off the queue.
+ */
+static ngx_int_t ngx_http_mongodb_rest_admission_wait(ngx_http_request_t *request, ngx_http_mongodb_rest_slot_t *slot) {
+    ngx_http_mongodb_rest_admission_t *upstream;
 
-  request->headers_out.status = NGX_HTTP_OK;
-  request->headers_out.content_length_n = l -1;
-  ngx_str_set(&request->headers_out.content_type, "text/json");
+    upstream = ngx_http_mongodb_rest_admission[slot->conf->upstream];
 
-  ngx_http_send_header(request);
+    if (ngx_atomic_fetch_add(&upstream->queued, 1) >= slot->main_conf->admission_queue) {
+        (void) ngx_atomic_fetch_add(&upstream->queued, -1);
+        ngx_log_error(NGX_LOG_WARN, request->connection->log, 0,
+                      "Mongo queue full, shedding request: \"%V\"", &slot->conf->mongo);
+        return ngx_http_mongodb_rest_retry_after(request, MONGO_RETRY_AFTER);
+    }
+    (void) ngx_atomic_fetch_add(&ngx_http_mongodb_rest_admission[slot->conf->slot]->queued, 1);
 
-  // ---------- SEND THE BODY ---------- //
+    request->read_event_handler = ngx_http_test_reading;
+    if (ngx_handle_read_event(request->connection->read, 0) != NGX_OK) {
+        (void) ngx_atomic_fetch_add(&ngx_http_mongodb_rest_admission[slot->conf->slot]->queued, -1);
+        (void) ngx_atomic_fetch_add(&upstream->queued, -1);
+        request->read_event_handler = ngx_http_block_reading;
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
 
-  /* Allocate space for the response buffer */
-  buffer = ngx_pcalloc(request->pool, sizeof(ngx_buf_t));
-  if (buffer == NULL) {
-    ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-		  "Failed to allocate response buffer");
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-  }
+    slot->waiting = 1;
+    slot->deadline = ngx_current_msec + slot->main_conf->admission_timeout;
 
-  /* Set up the buffer chain */
-  buffer->pos = (u_char*)s;
-  buffer->last = (u_char*)s + l - 1; // Don't write NULL
-  buffer->memory = 1;
-  buffer->last_buf = 1;
-  out.buf = buffer;
-  out.next = NULL;
+    if (request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)) {
+        ngx_queue_insert_tail(&ngx_http_mongodb_rest_waiting[0], &slot->queue);
+    } else {
+        ngx_queue_insert_tail(&ngx_http_mongodb_rest_waiting[1], &slot->queue);
+    }
 
-  /* Serve the Chunk */
-  rc = ngx_http_output_filter(request, &out);
+    if (!ngx_http_mongodb_rest_admitter.timer_set) {
+        ngx_add_timer(&ngx_http_mongodb_rest_admitter, MONGO_ADMISSION_POLL);
+    }
 
-  /* TODO: Do we need to do anything on error? */
-  return rc;
+    request->main->count++;
+    return NGX_DONE;
 }
 
-static ngx_int_t ngx_http_mongodb_rest_delete_handler(ngx_http_request_t* request, mongo * conn, bson_type type, const char * field, char * collection, const char * value) {
-  bson query;
-  mongo_cursor cursor;
+/* Let waiting requests in as places free up, or shed those waiting too long. */
+static void ngx_http_mongodb_rest_admission_run(ngx_event_t *ev) {
+    ngx_http_mongodb_rest_slot_t *slot;
+    ngx_http_request_t *request;
+    ngx_connection_t *c;
+    ngx_queue_t *q, *next;
+    ngx_uint_t i;
+    ngx_int_t rc;
+
+    for (i = 0; i < 2; i++) {
+        for (q = ngx_queue_head(&ngx_http_mongodb_rest_waiting[i]);
+             q != ngx_queue_sentinel(&ngx_http_mongodb_rest_waiting[i]);
+             q = next) {
+            next = ngx_queue_next(q);
+            slot = ngx_queue_data(q, ngx_http_mongodb_rest_slot_t, queue);
+
+            if ((ngx_msec_int_t) (slot->deadline - ngx_current_msec) > 0
+                && ngx_http_mongodb_rest_admission_acquire(slot) != NGX_OK) {
+                continue;
+            }
 
-  if(!ngx_http_mongodb_rest_query_init(&query, type, field, value)) {
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-  }
+            ngx_http_mongodb_rest_admission_dequeue(slot);
 
-  // ---------- RETRIEVE OBJECT ---------- //
-  mongo_cursor_init(&cursor, conn, "test.test");
-  mongo_cursor_set_query(&cursor, &query);
+            request = slot->request;
+            c = request->connection;
 
-  if(mongo_cursor_next(&cursor) != MONGO_OK) {
-    return NGX_HTTP_NOT_FOUND;
-  }
+            if (slot->held) {
+                rc = ngx_http_mongodb_rest_dispatch(request);
+                if (rc != NGX_DONE) {
+                    ngx_http_mongodb_rest_admission_release(slot);
+                }
+            } else {
+                ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                              "Mongo queue timed out, shedding request: \"%V\"", &slot->conf->mongo);
+                rc = ngx_http_mongodb_rest_retry_after(request, MONGO_RETRY_AFTER);
+            }
 
-  mongo_cursor_destroy(&cursor);
-  
-  if(mongo_remove(conn, "test.test", &query) != MONGO_OK) {
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-  } else {
-    request->headers_out.status = NGX_HTTP_NO_CONTENT;
-    ngx_http_send_header(request);
+            ngx_http_finalize_request(request, rc);
+            ngx_http_run_posted_requests(c);
+        }
+    }
 
-    return NGX_OK;
-  }
+    if (!ngx_queue_empty(&ngx_http_mongodb_rest_waiting[0])
+        || !ngx_queue_empty(&ngx_http_mongodb_rest_waiting[1])) {
+        ngx_add_timer(ev, MONGO_ADMISSION_POLL);
+    }
 }
 
-static void ngx_http_mongodb_rest_put_read(ngx_http_request_t* r) {
-  u_char * p;
-  size_t len;
+/* Operations in flight and waiting, for each 'mongo' and location. */
+static ngx_int_t ngx_http_mongodb_rest_status_handler(ngx_http_request_t* request) {
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf;
+    ngx_http_mongodb_rest_loc_conf_t **upstreams, **mongodb_rest_loc_confs;
+    ngx_http_mongodb_rest_admission_t *a;
+    ngx_chain_t *out;
+    u_char *p, *last;
+    size_t len;
+    ngx_uint_t i;
+    ngx_int_t rc;
 
-  ngx_buf_t *buf, *next;
-  ngx_chain_t *cl;
+    if (!(request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+        return NGX_HTTP_NOT_ALLOWED;
+    }
 
-  ngx_buf_t *buffer;
-  ngx_chain_t out;
+    rc = ngx_http_discard_request_body(request);
+    if (rc != NGX_OK) {
+        return rc;
+    }
 
-  bson b;
+    mongodb_rest_main_conf = ngx_http_get_module_main_conf(request, ngx_http_mongodb_rest_module);
 
-  if(r->request_body == NULL
-    || r->request_body->bufs == NULL
-    || r->request_body->temp_file) {
-    return;
-  }
+    if (!mongodb_rest_main_conf->admission) {
+        return NGX_HTTP_NOT_FOUND;
+    }
 
-  cl = r->request_body->bufs;
-  buf = cl->buf;
+    upstreams = mongodb_rest_main_conf->upstreams.elts;
+    mongodb_rest_loc_confs = mongodb_rest_main_conf->loc_confs.elts;
 
-  if(cl->next == NULL) {
-    p = buf->pos;
-    len = buf->last - buf->pos;
-  } else {
-    /* POST request did not fit into a single buffer, there must be 2. */
-    u_char * q;
+    len = 0;
+    for (i = 0; i < mongodb_rest_main_conf->upstreams.nelts; i++) {
+        len += sizeof("upstream  inflight  queued \n") - 1 + upstreams[i]->mongo.len + 2 * NGX_ATOMIC_T_LEN;
+    }
+    for (i = 0; i < mongodb_rest_main_conf->loc_confs.nelts; i++) {
+        len += sizeof("location  inflight  queued \n") - 1 + mongodb_rest_loc_confs[i]->ns.len + 2 * NGX_ATOMIC_T_LEN;
+    }
 
-    next = cl->next->buf;
-    len = (buf->last - buf->pos) + (next->last - next->pos);
+    p = ngx_pnalloc(request->pool, len);
+    if (p == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    last = p;
 
-    p = ngx_pnalloc(r->pool, len);
-    if(p == NULL) {
-      ngx_http_finalize_request(r, NGX_HTTP_INTERNAL_SERVER_ERROR);
-      return;
+    for (i = 0; i < mongodb_rest_main_conf->upstreams.nelts; i++) {
+        a = ngx_http_mongodb_rest_admission[i];
+        last = ngx_sprintf(last, "upstream %V inflight %uA queued %uA\n",
+                           &upstreams[i]->mongo, a->inflight, a->queued);
+    }
+    for (i = 0; i < mongodb_rest_main_conf->loc_confs.nelts; i++) {
+        a = ngx_http_mongodb_rest_admission[mongodb_rest_loc_confs[i]->slot];
+        last = ngx_sprintf(last, "location %V inflight %uA queued %uA\n",
+                           &mongodb_rest_loc_confs[i]->ns, a->inflight, a->queued);
     }
 
-    q = ngx_cpymem(p, buf->pos, buf->last - buf->pos);
-    ngx_memcpy(q, next->pos, next->last - next->pos);
-  }
+    out = ngx_http_mongodb_rest_chain(request->pool, p, last - p);
+    if (out == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    out->buf->last_buf = 1;
 
-  ngx_log_error(NGX_LOG_DEBUG, r->connection->log, 0, "%*s", len, p);
+    request->headers_out.status = NGX_HTTP_OK;
+    request->headers_out.content_length_n = last - p;
+    ngx_str_set(&request->headers_out.content_type, "text/plain");
 
-  json_t * root;
-  json_error_t error;
+    rc = ngx_http_send_header(request);
+    if (rc == NGX_ERROR || rc > NGX_OK || request->header_only) {
+        return rc;
+    }
 
-  root = json_loadb((char *) p, len, 0, &error);
-  if(root == NULL) {
-    ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
-		  "Failed to parse JSON. (%d) %s", error.line, error.text);
-    return;
-  }
+    return ngx_http_output_filter(request, out);
+}
 
+/* The body of a PUT or PATCH is in: now it may wait for a place. */
+static void ngx_http_mongodb_rest_admission_body(ngx_http_request_t* request) {
+    ngx_http_finalize_request(request, ngx_http_mongodb_rest_handler(request));
+}
 
+static ngx_int_t ngx_http_mongodb_rest_handler(ngx_http_request_t* request) {
+    ngx_http_mongodb_rest_main_conf_t* mongodb_rest_main_conf;
+    ngx_http_mongodb_rest_loc_conf_t* mongodb_rest_conf;
+    ngx_http_mongodb_rest_slot_t *slot;
+    ngx_pool_cleanup_t *cln;
+    time_t retry;
+    ngx_int_t rc;
 
-  json_decref(json);
+    mongodb_rest_main_conf = ngx_http_get_module_main_conf(request, ngx_http_mongodb_rest_module);
+    mongodb_rest_conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
 
-  //bson_init(&b, json_to_bson(p, len), 1);
+    // ---------- PICK THE SHARD ---------- //
 
-  /*if(b.data == 0) {
-    ngx_log_error(NGX_LOG_ERROR, r->connection->log, 0, "Failed to process: \"%*.s\"", len, p);
-  }*/
+    if (mongodb_rest_conf->shards) {
+        rc = ngx_http_mongodb_rest_shard_pick(request, mongodb_rest_conf);
+        if (rc == NGX_DECLINED) {
+            /* Each shard's circuit is checked as the keys go out. */
+            return ngx_http_mongodb_rest_dispatch(request);
+        }
+        if (rc != NGX_OK) {
+            return rc;
+        }
+        mongodb_rest_conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
+    }
 
-  // TODO: Do something with the BSON object
+    // ---------- FILL THE PIPELINE ---------- //
 
-  //bson_destroy(&b);
+    /* A cached report needs neither mongod nor a place in flight. */
+    if (mongodb_rest_conf->pipeline) {
+        rc = ngx_http_mongodb_rest_aggregate_prepare(request, mongodb_rest_conf);
+        if (rc != NGX_OK) {
+            return rc;
+        }
+    }
 
-  r->headers_out.status = NGX_HTTP_NO_CONTENT;
-  ngx_http_send_header(r);
+    // ---------- CHECK CIRCUIT ---------- //
 
-  ngx_http_finalize_request(r, NGX_HTTP_NO_CONTENT);
-}
+    if (mongodb_rest_main_conf->health_check) {
+        retry = ngx_http_mongodb_rest_health_allow(mongodb_rest_main_conf, mongodb_rest_conf->upstream);
+        if (retry) {
+            return ngx_http_mongodb_rest_retry_after(request, retry);
+        }
+    }
 
-static ngx_int_t ngx_http_mongodb_rest_put_handler(ngx_http_request_t* r, mongo * conn, bson_type type, const char * field, char * collection, const char * value) {
-  ngx_int_t rc;
+    if (!mongodb_rest_main_conf->admission) {
+        return ngx_http_mongodb_rest_dispatch(request);
+    }
 
-  rc = ngx_http_read_client_request_body(r, ngx_http_mongodb_rest_put_read);
+    // ---------- ADMIT ---------- //
 
-  if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
-    return rc;
-  }
+    /* A write takes its place once its body is in, not while it trickles in. */
+    if ((request->method & (NGX_HTTP_PUT | NGX_HTTP_PATCH))
+        && !mongodb_rest_conf->gridfs && request->request_body == NULL) {
+        rc = ngx_http_read_client_request_body(request, ngx_http_mongodb_rest_admission_body);
+        if (rc == NGX_ERROR || rc >= NGX_HTTP_SPECIAL_RESPONSE) {
+            return rc;
+        }
+        return NGX_DONE;
+    }
 
-  return NGX_DONE;
+    cln = ngx_pool_cleanup_add(request->pool, sizeof(ngx_http_mongodb_rest_slot_t));
+    if (cln == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    slot = cln->data;
+    ngx_memzero(slot, sizeof(ngx_http_mongodb_rest_slot_t));
+    slot->request = request;
+    slot->main_conf = mongodb_rest_main_conf;
+    slot->conf = mongodb_rest_conf;
+    cln->handler = ngx_http_mongodb_rest_admission_cleanup;
+
+    if (ngx_http_mongodb_rest_admission_acquire(slot) != NGX_OK) {
+        return ngx_http_mongodb_rest_admission_wait(request, slot);
+    }
+
+    rc = ngx_http_mongodb_rest_dispatch(request);
+    if (rc != NGX_DONE) {
+        ngx_http_mongodb_rest_admission_release(slot);
+    }
+
+    return rc;
 }
 
-static ngx_int_t ngx_http_mongodb_rest_handler(ngx_http_request_t* request) {
+static ngx_int_t ngx_http_mongodb_rest_dispatch(ngx_http_request_t* request) {
+    ngx_http_mongodb_rest_main_conf_t* mongodb_rest_main_conf;
     ngx_http_mongodb_rest_loc_conf_t* mongodb_rest_conf;
     ngx_http_core_loc_conf_t* core_conf;
     ngx_str_t location_name;
     ngx_str_t full_uri;
     char* value;
     ngx_http_mongo_connection_t *mongo_conn;
+    ngx_pool_t *pool;
+    ngx_flag_t offload, bulk;
 
     ngx_int_t rc = NGX_OK;
 
+    mongodb_rest_main_conf = ngx_http_get_module_main_conf(request, ngx_http_mongodb_rest_module);
     mongodb_rest_conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
     core_conf = ngx_http_get_module_loc_conf(request, ngx_http_core_module);
 
-    // ---------- ENSURE MONGO CONNECTION ---------- //
-
-    mongo_conn = ngx_http_get_mongo_connection( mongodb_rest_conf->mongo );
-    if (mongo_conn == NULL) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                      "Mongo Connection not found: \"%V\"", &mongodb_rest_conf->mongo);
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
-    }
-    
-    if ( !(&mongo_conn->conn.connected)
-         && (ngx_http_mongo_reconnect(request->connection->log, mongo_conn) == NGX_ERROR
-             || ngx_http_mongo_reauth(request->connection->log, mongo_conn) == NGX_ERROR)) {
-        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
-                      "Could not connect to mongo: \"%V\"", &mongodb_rest_conf->mongo);
-        if(&mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
-        return NGX_HTTP_SERVICE_UNAVAILABLE;
-    }
-
     // ---------- RETRIEVE KEY ---------- //
 
     location_name = core_conf->name;
@@ -946,7 +7650,7 @@ static ngx_int_t ngx_http_mongodb_rest_handler(ngx_http_request_t* request) {
         return NGX_HTTP_INTERNAL_SERVER_ERROR;
     }
 
-    value = (char*)malloc(sizeof(char) * (full_uri.len - location_name.len + 1));
+    value = ngx_pnalloc(request->pool, full_uri.len - location_name.len + 1);
     if (value == NULL) {
         ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
                       "Failed to allocate memory for value buffer.");
@@ -958,10 +7662,73 @@ static ngx_int_t ngx_http_mongodb_rest_handler(ngx_http_request_t* request) {
     if (!url_decode(value)) {
         ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
                       "Malformed request.");
-        free(value);
         return NGX_HTTP_BAD_REQUEST;
     }
 
+    /* A key with the wrong number of segments, or a malformed ObjectId. */
+    if (*value != '\0' && !mongodb_rest_conf->pipeline && !ngx_http_mongodb_rest_key_valid(mongodb_rest_conf, value)) {
+        return NGX_HTTP_NOT_FOUND;
+    }
+
+    /* A thread connects for itself; listings park cursors on the worker's connection. */
+#if (NGX_THREADS)
+    offload = mongodb_rest_conf->thread_pool
+              && !(*value == '\0' && (request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD)))
+              && !(request->method & NGX_HTTP_PATCH)
+              && !mongodb_rest_conf->pipeline;
+#else
+    offload = 0;
+#endif
+
+    /* Only a bulk GET reaches here across shards; it makes sure of each one's connection. */
+    bulk = mongodb_rest_conf->shards != NULL;
+
+    // ---------- ENSURE MONGO CONNECTION ---------- //
+
+    mongo_conn = ngx_http_get_mongo_connection( mongodb_rest_conf->mongo );
+    if (mongo_conn == NULL) {
+        ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                      "Mongo Connection not found: \"%V\"", &mongodb_rest_conf->mongo);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    /* A send or read that timed out leaves the connection out of step. */
+    if ( !offload && !bulk && mongo_conn->conn.connected && mongo_conn->conn.err == MONGO_IO_ERROR ) {
+        mongo_disconnect(&mongo_conn->conn);
+    }
+    
+    if ( !offload && !bulk && !mongo_conn->conn.connected ) {
+        if (ngx_http_mongo_reconnect(request->connection->log, mongo_conn) == NGX_ERROR
+            || ngx_http_mongo_reauth(request->connection->log, mongo_conn, &mongo_conn->conn) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                          "Could not connect to mongo: \"%V\"", &mongodb_rest_conf->mongo);
+            if(mongo_conn->conn.connected) { mongo_disconnect(&mongo_conn->conn); }
+            if (mongodb_rest_main_conf->health_check) {
+                ngx_http_mongodb_rest_health_report(request->connection->log, mongodb_rest_main_conf,
+                                                    mongodb_rest_conf->upstream, 0);
+            }
+            return NGX_HTTP_SERVICE_UNAVAILABLE;
+        }
+    }
+
+    if ( !offload && !bulk ) {
+        mongo_clear_errors(&mongo_conn->conn);
+    }
+
+    if (ngx_http_mongodb_rest_remaining(request, mongodb_rest_conf) <= 0) {
+        return NGX_HTTP_GATEWAY_TIME_OUT;
+    }
+
+    pool = ngx_http_mongodb_rest_alloc_from(request->pool);
+
+    /* The method was checked, and the pipeline filled, before admission. */
+    if (mongodb_rest_conf->pipeline) {
+        rc = ngx_http_mongodb_rest_aggregate_handler(request, &mongo_conn->conn);
+        ngx_http_mongodb_rest_health_outcome(request, mongodb_rest_conf, &mongo_conn->conn, rc);
+        ngx_http_mongodb_rest_alloc_from(pool);
+        return rc;
+    }
+
     unsigned char* m = request->method_name.data;
     size_t ml = request->method_name.len;
 
@@ -970,11 +7737,11 @@ static ngx_int_t ngx_http_mongodb_rest_handler(ngx_http_request_t* request) {
         if(m[0] == 'G'
 	  && m[1] == 'E'
 	  && m[2] == 'T') {
-          rc = ngx_http_mongodb_rest_get_handler(request, &mongo_conn->conn, mongodb_rest_conf->type, (char*) mongodb_rest_conf->field.data, "test", value);
+          rc = ngx_http_mongodb_rest_get_handler(request, &mongo_conn->conn, mongodb_rest_conf->type, (char*) mongodb_rest_conf->ns.data, value);
 	} else if(m[0] == 'P'
 	  && m[1] == 'U'
 	  && m[2] == 'T') {
-	  rc = ngx_http_mongodb_rest_put_handler(request, &mongo_conn->conn, mongodb_rest_conf->type, (char*) mongodb_rest_conf->field.data, "test", value);
+	  rc = ngx_http_mongodb_rest_put_handler(request, &mongo_conn->conn, mongodb_rest_conf->type, (char*) mongodb_rest_conf->field.data, (char*) mongodb_rest_conf->ns.data, value);
 	} else {
 	  rc = NGX_HTTP_NOT_ALLOWED;
 	}
@@ -989,6 +7756,17 @@ static ngx_int_t ngx_http_mongodb_rest_handler(ngx_http_request_t* request) {
 	  rc = NGX_HTTP_NOT_ALLOWED;
 	}
 	break;
+      case 5:
+	if(m[0] == 'P'
+	  && m[1] == 'A'
+	  && m[2] == 'T'
+	  && m[3] == 'C'
+	  && m[4] == 'H') {
+	  rc = ngx_http_mongodb_rest_patch_handler(request, value);
+	} else {
+	  rc = NGX_HTTP_NOT_ALLOWED;
+	}
+	break;
       case 6:
 	if(m[0] == 'D'
 	  && m[1] == 'E'
@@ -996,7 +7774,7 @@ static ngx_int_t ngx_http_mongodb_rest_handler(ngx_http_request_t* request) {
 	  && m[3] == 'E'
 	  && m[4] == 'T'
 	  && m[5] == 'E') {
-	  rc = ngx_http_mongodb_rest_delete_handler(request, &mongo_conn->conn, mongodb_rest_conf->type, (char*) mongodb_rest_conf->field.data, "test", value);
+	  rc = ngx_http_mongodb_rest_delete_handler(request, &mongo_conn->conn, mongodb_rest_conf->type, (char*) mongodb_rest_conf->ns.data, value);
 	} else {
 	  rc = NGX_HTTP_NOT_ALLOWED;
 	}
@@ -1005,6 +7783,11 @@ static ngx_int_t ngx_http_mongodb_rest_handler(ngx_http_request_t* request) {
         rc = NGX_HTTP_NOT_ALLOWED;
     }
 
-    free(value);
+    /* A thread, or each shard of a bulk GET, answers for itself. */
+    if (!offload && !bulk) {
+        ngx_http_mongodb_rest_health_outcome(request, mongodb_rest_conf, &mongo_conn->conn, rc);
+    }
+
+    ngx_http_mongodb_rest_alloc_from(pool);
     return rc;
 }
@@ -0,0 +1,642 @@
+#ifndef NGX_HTTP_MONGODB_REST_MODULE_H
+#define NGX_HTTP_MONGODB_REST_MODULE_H
+
+/* Tuning Parameters */
+#define MONGO_MAX_RETRIES_PER_REQUEST 1
+#define MONGO_GRIDFS_CHUNK_SIZE 261120 //bytes, as used by the drivers
+#define MONGO_GRIDFS_MAX_CHUNK_SIZE (15 * 1024 * 1024) //bytes, below the BSON limit
+#define MONGO_GRIDFS_CHUNK_BATCH 4
+#define MONGO_MAX_FIELD_NAME 255
+#define MONGO_MAX_KEY_FIELDS 8
+#define MONGO_PAGE_SIZE 100
+#define MONGO_CURSOR_TIMEOUT 60000 //ms
+#define MONGO_CURSOR_REAP_INTERVAL 1000 //ms
+#define MONGO_MAX_CURSORS 1024 //per worker
+#define MONGO_COALESCE_DELAY 1 //ms
+#define MONGO_DUPLICATE_KEY 11000
+#define MONGO_WRITE_BEHIND_INTERVAL 100 //ms
+#define MONGO_WRITE_BEHIND_BATCH 100
+#define MONGO_WRITE_BEHIND_STALE 60 //s, before another worker takes over draining
+#define MONGO_RETRY_AFTER 1 //s
+#define MONGO_HEALTH_INTERVAL 5000 //ms
+#define MONGO_HEALTH_FAILS 3
+#define MONGO_HEALTH_RETRY 10 //s, before a request may probe an open circuit
+#define MONGO_CONNECT_TIMEOUT 60000 //ms
+#define MONGO_SEND_TIMEOUT 60000 //ms
+#define MONGO_READ_TIMEOUT 60000 //ms
+#define MONGO_EXCEEDED_TIME_LIMIT 50
+#define MONGO_BAD_HINT 10113 //before 2.6
+#define MONGO_QUERY_ERROR 17007 //2.6, around the planner's "bad hint"
+#define MONGO_BAD_VALUE 2 //3.0 on, likewise
+#define MONGO_MAX_INDEX_NAME 127 //bytes, as servers before 4.2 allow
+#define MONGO_INDEX_RECHECK 1000 //ms, after the hinted index is gone
+#define MONGO_INDEX_RETRY 60000 //ms, while no index supports the key
+#define MONGO_BLOOM_HASHES 7
+#define MONGO_BLOOM_BATCH 1000 //keys read per event loop iteration while building
+#define MONGO_BLOOM_SETTLE 1000 //ms, for writes in flight before a build starts
+#define MONGO_BLOOM_RETRY 5000 //ms
+#define MONGO_BLOOM_REFRESH 300000 //ms, to pick up keys written by others
+#define MONGO_REPLICA_INTERVAL 100 //ms, between polls of the oplog
+#define MONGO_REPLICA_BATCH 1000 //documents or oplog entries per event loop iteration
+#define MONGO_REPLICA_RETRY 5000 //ms
+#define MONGO_REPLICA_BACKOFF_MAX 3600000 //ms, between scans that fill the zone
+#define MONGO_OPLOG "local.oplog.rs"
+#define MONGO_OPLOG_REPLAY (1 << 3) //query flag, not in the driver's mongo_cursor_opts
+#define MONGO_REPLY_CURSOR_NOT_FOUND (1 << 0) //reply flag, not in the driver
+#define MONGO_REPLY_QUERY_FAILURE (1 << 1) //reply flag, not in the driver
+#define MONGO_HEDGE_SAMPLES 128 //reads per window of observed latency
+#define MONGO_HEDGE_RETRY 5 //s, before connecting to a member that failed again
+#define MONGO_HEDGE_POLL 10 //ms, while a member connects or owes a reply
+#define MONGO_SNAPSHOT_REFRESH 60000 //ms
+#define MONGO_SNAPSHOT_BATCH 100 //documents written per event loop iteration
+#define MONGO_SNAPSHOT_RETRY 5000 //ms
+#define MONGO_SNAPSHOT_RESCAN 3600000 //ms
+#define MONGO_ADMISSION_QUEUE 64 //requests waiting per 'mongo', across workers
+#define MONGO_ADMISSION_TIMEOUT 1000 //ms
+#define MONGO_ADMISSION_POLL 10 //ms, for places freed by other workers
+#define MONGO_EXPORT_MAX_PARTITIONS 16
+#define MONGO_EXPORT_MAX_PARTS (MONGO_EXPORT_MAX_PARTITIONS + 2) //with those for other types either side
+#define MONGO_EXPORT_BATCH 16 //replies sent per event loop iteration
+#define MONGO_EXPORT_POLL 1 //ms, while no partition has a reply
+#define MONGO_SHARD_POINTS 160 //per shard on the hash ring
+#define MONGO_MAX_SHARDS 64
+#define MONGO_AGGREGATE_TTL 60 //s, results are cached for
+#define MONGO_AGGREGATE_MAX_SEGMENTS 8
+
+#define TRUE 1
+#define FALSE 0
+
+
+/* Nginx Includes */
+#include <ngx_config.h>
+#include <ngx_core.h>
+#include <ngx_http.h>
+#include <ngx_md5.h>
+
+/* Standard Includes */
+#include <signal.h>
+#include <stdio.h>
+#include <unistd.h>
+
+/* Mongo Includes - link with -lmongo -lbson */
+#include <mongodb-c/mongo.h>
+#include <mongodb-c/gridfs.h>
+
+#include "jsonbson.h"
+#include "bsonmsgpack.h"
+#include "jansson.h"
+
+/**
+ * Types
+ */
+
+/* Precedes every block the driver allocates. */
+typedef struct {
+    ngx_pool_t *pool; /* NULL when from the heap */
+    size_t size;
+} ngx_http_mongodb_rest_alloc_t;
+
+/* Main Configuration */
+typedef struct {
+    ngx_array_t loc_confs; /* ngx_http_mongodb_rest_loc_conf_t */
+    ngx_flag_t health_check;
+    ngx_msec_t health_interval;
+    ngx_uint_t health_fails;
+    time_t health_retry;
+    ngx_array_t upstreams; /* ngx_http_mongodb_rest_loc_conf_t *, first to use each 'mongo' */
+    ngx_shm_zone_t *health_zone;
+#if (NGX_THREADS)
+    ngx_thread_pool_t *health_pool; /* Runs the pings, so that no worker waits on mongod */
+#endif
+    struct ngx_http_mongodb_rest_health_s **health_circuits; /* Of each 'mongo', found by its name */
+    ngx_flag_t admission; /* Set by 'mongodb-rest-admission' or max_inflight */
+    ngx_flag_t admission_conf;
+    ngx_uint_t admission_max; /* Operations in flight per 'mongo', 0 for no limit */
+    ngx_uint_t admission_queue;
+    ngx_msec_t admission_timeout;
+    ngx_shm_zone_t *admission_zone;
+    ngx_str_t *admission_names; /* Of each 'mongo', then of each location */
+    struct ngx_http_mongodb_rest_admission_s **admission_counters; /* Found by those names */
+} ngx_http_mongodb_rest_main_conf_t;
+
+/* One field of the key, taken from a segment of the URI. */
+typedef struct {
+    ngx_str_t field; /* Null terminated, may be a dotted path */
+    ngx_uint_t type;
+} ngx_http_mongodb_rest_key_t;
+
+#define NGX_HTTP_MONGODB_REST_INDEX_OFF 0
+#define NGX_HTTP_MONGODB_REST_INDEX_WARN 1
+#define NGX_HTTP_MONGODB_REST_INDEX_FAIL 2
+
+#define NGX_HTTP_MONGODB_REST_SHARD_HASH 0
+#define NGX_HTTP_MONGODB_REST_SHARD_RANGE 1
+
+/* Location Configuration */
+typedef struct {
+    ngx_str_t db;
+    ngx_str_t root_collection;
+    ngx_str_t collection;
+    ngx_str_t ns; /* "db.collection" */
+    ngx_str_t cmd_ns; /* "db.$cmd", as commands appear in the oplog */
+    ngx_str_t field; /* The first of keys */
+    ngx_uint_t type;
+    ngx_array_t* keys; /* ngx_http_mongodb_rest_key_t, '/' separated in the URI */
+    ngx_uint_t index_check;
+    char *hint; /* Name of the index found, per worker; NULL while there is none */
+    char hint_name[MONGO_MAX_INDEX_NAME + 1]; /* Where hint points */
+    ngx_flag_t hint_unique; /* The hinted index is unique */
+    ngx_flag_t hint_id; /* The hinted index orders by _id after the key */
+    ngx_str_t index_ns; /* "db.system.indexes", where older servers list them */
+    ngx_event_t index_timer; /* Per worker, to look again once the hinted index is gone */
+    ngx_str_t user;
+    ngx_str_t pass;
+    ngx_str_t mongo;
+    ngx_array_t* mongods; /* ngx_http_mongod_server_t */
+    ngx_str_t replset; /* Name of the replica set, if connecting. */
+    ngx_flag_t gridfs; /* PUT streams the body into GridFS. */
+    size_t chunk_size;
+    ngx_uint_t chunk_batch; /* Chunks per pipelined insert. */
+    ngx_str_t gridfs_files; /* "db.root_collection.files" */
+    ngx_str_t gridfs_chunks; /* "db.root_collection.chunks" */
+    bson *projection; /* Default field selector, or NULL. */
+    ngx_uint_t page_size;
+    ngx_msec_t cursor_timeout;
+    ngx_uint_t coalesce; /* Documents per batched write, 0 to disable. */
+    ngx_msec_t coalesce_delay;
+    struct ngx_http_mongodb_rest_batch_s *batch; /* Per worker */
+    struct ngx_http_mongodb_rest_write_behind_s *write_behind;
+    ngx_msec_t write_behind_interval;
+    ngx_uint_t write_behind_batch;
+    ngx_uint_t upstream; /* Index of 'mongo' in the health zone */
+    ngx_msec_t connect_timeout;
+    ngx_msec_t send_timeout;
+    ngx_msec_t read_timeout; /* Also the most a request waits on mongod */
+    ngx_str_t location; /* Its name, which with ns and mongo keys it there */
+    struct ngx_http_mongodb_rest_bloom_s *bloom;
+    ngx_msec_t bloom_refresh; /* 0 to build once */
+    struct ngx_http_mongodb_rest_replica_s *replica;
+    ngx_flag_t hedge;
+    ngx_msec_t hedge_delay;
+    ngx_uint_t hedge_percentile; /* 0 for a fixed delay */
+    ngx_flag_t hedge_secondaries; /* Hedged reads may be answered by secondaries */
+    ngx_uint_t max_inflight; /* 0 for no limit */
+    ngx_uint_t slot; /* Index of the location in the admission zone */
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool; /* Runs the driver calls of GET, PUT and DELETE. */
+#endif
+    ngx_str_t snapshot; /* Directory of exported documents, if any */
+    ngx_str_t snapshot_field; /* Null terminated, orders the refreshes */
+    ngx_msec_t snapshot_refresh;
+    ngx_msec_t snapshot_rescan; /* Between full exports, which drop stale files */
+    struct ngx_http_mongodb_rest_snapshot_s *snapshot_export; /* Worker 0 only */
+    ngx_uint_t export_partitions; /* Most scans behind ?export, 0 if not served */
+    ngx_array_t *shards; /* ngx_http_mongodb_rest_shard_t, NULL if not sharded */
+    ngx_uint_t shard_by;
+    struct ngx_http_mongodb_rest_point_s *points; /* The hash ring, sorted */
+    ngx_uint_t npoints;
+    bson *pipeline; /* {pipeline: [...]}, if the location runs an aggregation */
+    ngx_array_t *params; /* ngx_http_mongodb_rest_param_t, the slots in it */
+    ngx_uint_t nsegments; /* Of the path, as the params number them */
+    struct ngx_http_mongodb_rest_cache_s *cache;
+    time_t cache_ttl;
+} ngx_http_mongodb_rest_loc_conf_t;
+
+/* Mongo Authentication Credentials */
+typedef struct {
+    ngx_str_t db;
+    ngx_str_t user;
+    ngx_str_t pass;
+} ngx_http_mongo_auth_t;
+
+/* A replica set member reached on its own, to hedge reads across. */
+typedef struct {
+    mongo conn;
+    u_char host[255];
+    int port;
+    ngx_addr_t addr;
+    ngx_socket_t fd; /* While connecting */
+    ngx_flag_t connecting;
+    ngx_flag_t pending; /* Still owes the reply to a read answered elsewhere. */
+    ngx_msec_t since; /* When it started connecting, or came to owe a reply */
+    time_t retry; /* Not before, after failing to connect */
+} ngx_http_mongo_member_t;
+
+/* Persistent (to process) MongoDB Connections */
+typedef struct {
+    ngx_str_t name;
+    mongo conn;
+    ngx_array_t *auths; /* ngx_http_mongo_auth_t */
+    ngx_msec_t connect_timeout;
+    ngx_msec_t send_timeout;
+    ngx_msec_t read_timeout;
+    ngx_array_t *members; /* ngx_http_mongo_member_t, the replica set seeds */
+    ngx_uint_t next_member;
+    ngx_event_t members_timer; /* While a member connects or owes a reply */
+    ngx_msec_t latency[MONGO_HEDGE_SAMPLES]; /* Of hedged reads, as they come */
+    ngx_msec_t sorted[MONGO_HEDGE_SAMPLES]; /* The last full window, sorted */
+    ngx_uint_t nlatency;
+    ngx_flag_t window; /* A full window has been seen. */
+} ngx_http_mongo_connection_t;
+
+
+// Maybe we should store a list of addresses instead.
+typedef struct {
+    ngx_str_t host;
+    in_port_t port;
+    ngx_addr_t addr; /* Resolved with the configuration, if it was given */
+} ngx_http_mongod_server_t;
+
+/* A standalone mongod holding part of a location's keys */
+typedef struct {
+    ngx_str_t mongo; /* "host:port", names its connection */
+    ngx_http_mongod_server_t server;
+    ngx_str_t bound; /* By range, the least key it holds, null terminated; empty for the first */
+    ngx_str_t raw_bound; /* As compared with keys */
+    u_char buf[12];
+    ngx_http_mongodb_rest_loc_conf_t *conf; /* The location, as it is for this shard */
+} ngx_http_mongodb_rest_shard_t;
+
+typedef struct ngx_http_mongodb_rest_point_s {
+    uint32_t hash;
+    ngx_uint_t shard;
+} ngx_http_mongodb_rest_point_t;
+
+typedef struct {
+    mongo_cursor ** cursors;
+    ngx_uint_t numchunks;
+} ngx_http_mongodb_rest_cleanup_t;
+
+/* List cursors kept open between pages, per worker */
+typedef struct {
+    ngx_rbtree_node_t node; /* Key is the id handed out in the token. */
+    ngx_queue_t queue; /* Oldest first */
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    mongo_cursor cursor;
+    bson query;
+    bson fields; /* The projection it was opened with, if any */
+    ngx_msec_t expires;
+} ngx_http_mongodb_rest_cursor_t;
+
+/* A single document PUT, or PATCH */
+typedef struct {
+    ngx_queue_t queue;
+    ngx_http_request_t *request;
+    char *key; /* Decoded key from the URI, empty to insert */
+    bson query; /* Only when keyed */
+    bson doc;
+    ngx_str_t location; /* Key of an inserted document, if known */
+    struct ngx_http_mongodb_rest_batch_s *batch; /* While queued in it */
+    unsigned keyed:1;
+    unsigned generated:1; /* _id was generated by the module */
+    unsigned patch:1; /* doc holds the $set and $unset of a PATCH */
+    unsigned upsert:1; /* ?upsert=true on a PATCH */
+} ngx_http_mongodb_rest_write_t;
+
+/* Writes waiting to be sent together, per location and worker */
+typedef struct ngx_http_mongodb_rest_batch_s {
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    ngx_queue_t writes; /* ngx_http_mongodb_rest_write_t */
+    ngx_uint_t nwrites;
+    ngx_event_t timer;
+} ngx_http_mongodb_rest_batch_t;
+
+/* Write-behind ring, in shared memory */
+typedef struct {
+    uint32_t len; /* Whole entry, aligned; qlen is NGX_MAX_UINT32_VALUE to wrap. */
+    uint32_t qlen; /* Query, 0 to insert; the document follows it. */
+} ngx_http_mongodb_rest_entry_t;
+
+typedef struct {
+    size_t size;
+    size_t head; /* Oldest entry */
+    size_t tail; /* First free byte */
+    size_t used;
+    ngx_uint_t entries;
+    time_t draining; /* When the current drain started, or 0 */
+    off_t replay; /* Journal offset replayed so far */
+    off_t replay_end; /* Journal size at startup */
+    off_t journal_end; /* Where the next entry is journaled */
+    ngx_uint_t journaling; /* Entries being journaled outside the mutex */
+    u_char data[1];
+} ngx_http_mongodb_rest_ring_t;
+
+typedef struct ngx_http_mongodb_rest_write_behind_s {
+    ngx_shm_zone_t *zone;
+    ngx_slab_pool_t *shpool;
+    ngx_http_mongodb_rest_ring_t *ring;
+    ngx_str_t journal; /* Optional append-only copy of the ring */
+    ngx_fd_t fd; /* Per worker */
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    ngx_event_t timer; /* Per worker */
+} ngx_http_mongodb_rest_write_behind_t;
+
+/* Negative lookup filter, in shared memory */
+#define NGX_HTTP_MONGODB_REST_BLOOM_NONE 2
+
+typedef struct {
+    ngx_atomic_t active; /* Filter GET consults, or NONE until one is built */
+    ngx_atomic_t building; /* Filter being rebuilt, or NONE */
+    uint32_t signature; /* Of the namespace and field the filter holds */
+    size_t nbits;
+    ngx_atomic_t *bits[2];
+} ngx_http_mongodb_rest_bloom_shm_t;
+
+typedef struct ngx_http_mongodb_rest_bloom_s {
+    ngx_shm_zone_t *zone;
+    ngx_http_mongodb_rest_bloom_shm_t *sh;
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    mongo_cursor *cursor; /* Per worker, while building */
+    bson fields;
+    ngx_uint_t nkeys;
+    unsigned settling:1;
+    ngx_event_t timer; /* Per worker */
+} ngx_http_mongodb_rest_bloom_t;
+
+/* Copy of a collection kept from the oplog, in shared memory */
+typedef struct {
+    ngx_rbtree_node_t node; /* By key, hashed */
+    ngx_rbtree_node_t id_node; /* By _id, hashed, as the oplog names documents */
+    size_t key_len;
+    size_t id_len; /* {_id: ...} */
+    size_t doc_len;
+    u_char data[1]; /* Key, then id, then document */
+} ngx_http_mongodb_rest_replica_doc_t;
+
+typedef struct {
+    ngx_rbtree_t keys;
+    ngx_rbtree_node_t keys_sentinel;
+    ngx_rbtree_t ids;
+    ngx_rbtree_node_t ids_sentinel;
+    ngx_atomic_t ready; /* Holds the whole collection */
+    uint32_t signature; /* Of the namespace and field the copy holds */
+    bson_timestamp_t ts; /* Last oplog entry applied */
+    ngx_uint_t ndocs;
+} ngx_http_mongodb_rest_replica_shm_t;
+
+typedef struct ngx_http_mongodb_rest_replica_s {
+    ngx_shm_zone_t *zone;
+    ngx_slab_pool_t *shpool;
+    ngx_http_mongodb_rest_replica_shm_t *sh;
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    mongo_cursor *cursor; /* Per worker: the scan, then the oplog */
+    bson query;
+    ngx_msec_t backoff; /* Per worker: before scanning a zone that filled up again */
+    unsigned scanning:1;
+    ngx_event_t timer; /* Per worker */
+} ngx_http_mongodb_rest_replica_t;
+
+/* Writes documents out as JSON files, in order of snapshot_field. */
+typedef struct ngx_http_mongodb_rest_snapshot_s {
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    mongo_cursor *cursor; /* While exporting */
+    bson query;
+    bson last; /* { "": the greatest snapshot_field written }, once there is one */
+    unsigned has_last:1;
+    unsigned full:1; /* The export in progress is of every document */
+    time_t started; /* When the cursor was opened */
+    time_t rescan; /* When the next full export is due */
+    ngx_uint_t sweep; /* Next directory to clear of files the full export left, from 1 */
+    ngx_uint_t ndocs;
+    ngx_event_t timer;
+} ngx_http_mongodb_rest_snapshot_t;
+
+/* One range of an export, scanned over its own connection. */
+typedef struct {
+    mongo conn;
+    bson query; /* To send again without a hint that mongod refuses */
+    int64_t cursor_id; /* Once the first reply is in */
+    ngx_flag_t done;
+} ngx_http_mongodb_rest_partition_t;
+
+/* The keys of a bulk GET held by one shard, asked for in one query. */
+typedef struct {
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    mongo *conn;
+    ngx_uint_t nkeys;
+    ngx_flag_t pending; /* Owes a reply */
+} ngx_http_mongodb_rest_fanout_t;
+
+/* A slot in an aggregation pipeline: "{name[:type][=default]}" */
+typedef struct {
+    ngx_str_t marker; /* The string it stands in for */
+    ngx_str_t name; /* Of the argument, null terminated; empty for a path segment */
+    ngx_uint_t segment; /* From 1, when filled from the path */
+    ngx_uint_t type;
+    ngx_str_t def; /* Null terminated; NULL data if the slot must be filled */
+} ngx_http_mongodb_rest_param_t;
+
+/* Results of an aggregation, in shared memory */
+typedef struct {
+    ngx_rbtree_node_t node; /* By key, hashed */
+    ngx_queue_t queue;
+    time_t expires;
+    size_t key_len;
+    size_t body_len;
+    u_char data[1]; /* Key, then body */
+} ngx_http_mongodb_rest_cache_entry_t;
+
+typedef struct {
+    ngx_rbtree_t tree;
+    ngx_rbtree_node_t sentinel;
+    ngx_queue_t queue; /* Newest first, evicted from the tail */
+} ngx_http_mongodb_rest_cache_shm_t;
+
+typedef struct ngx_http_mongodb_rest_cache_s {
+    ngx_shm_zone_t *zone;
+    ngx_slab_pool_t *shpool;
+    ngx_http_mongodb_rest_cache_shm_t *sh;
+} ngx_http_mongodb_rest_cache_t;
+
+/* An aggregation missed in the cache, between its admission and its run. */
+typedef struct {
+    bson pipeline; /* Filled in */
+    ngx_str_t key; /* Format, namespace, then pipeline */
+} ngx_http_mongodb_rest_aggregate_t;
+
+/* A collection streamed as NDJSON, split by ranges of the key's first field. */
+typedef struct {
+    ngx_http_request_t *request;
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    ngx_http_mongodb_rest_partition_t *parts;
+    ngx_uint_t nparts;
+    ngx_uint_t active; /* Partitions not yet exhausted */
+    ngx_uint_t next; /* In order, the partition being sent; else where to look first */
+    ngx_flag_t unordered;
+    bson fields;
+    bson *projection;
+    ngx_buf_t *buf; /* Reused once the client has taken all of it */
+    ngx_chain_t out;
+    ngx_msec_t progress; /* When a reply last arrived */
+    ngx_event_t timer;
+} ngx_http_mongodb_rest_export_t;
+
+/* Circuit breaker state of each 'mongo', in shared memory */
+#define NGX_HTTP_MONGODB_REST_CLOSED 0
+#define NGX_HTTP_MONGODB_REST_OPEN 1
+#define NGX_HTTP_MONGODB_REST_HALF_OPEN 2 /* One request is probing. */
+
+typedef struct ngx_http_mongodb_rest_health_s {
+    ngx_atomic_t state;
+    ngx_atomic_t failures; /* Consecutive */
+    ngx_atomic_t retry; /* When an open circuit may be probed */
+    struct ngx_http_mongodb_rest_health_s *next;
+    size_t len;
+    u_char name[1]; /* Of the 'mongo' */
+} ngx_http_mongodb_rest_health_t;
+
+/* Operations of a 'mongo' or a location, in shared memory, found by name */
+typedef struct ngx_http_mongodb_rest_admission_s {
+    ngx_atomic_t inflight;
+    ngx_atomic_t queued;
+    struct ngx_http_mongodb_rest_admission_s *next;
+    size_t len;
+    u_char name[1];
+} ngx_http_mongodb_rest_admission_t;
+
+/* A request's place in the admission zone, given up with its pool. */
+typedef struct {
+    ngx_queue_t queue; /* In ngx_http_mongodb_rest_waiting, while waiting */
+    ngx_http_request_t *request;
+    ngx_http_mongodb_rest_main_conf_t *main_conf;
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    ngx_msec_t deadline;
+    unsigned held:1;
+    unsigned waiting:1;
+} ngx_http_mongodb_rest_slot_t;
+
+/* Response Formats, negotiated from Accept */
+typedef enum {
+    NGX_HTTP_MONGODB_REST_JSON = 0,
+    NGX_HTTP_MONGODB_REST_BSON,
+    NGX_HTTP_MONGODB_REST_MSGPACK
+} ngx_http_mongodb_rest_format_e;
+
+/* Streaming GridFS Upload */
+typedef struct {
+    mongo *conn;
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    ngx_log_t *log;
+    bson_type type;
+    const char *field;
+    char *value;
+    bson_oid_t oid; /* files_id of the new chunks, until the swap */
+    ngx_md5_t md5;
+    off_t length;
+    u_char *chunk;
+    size_t chunk_len;
+    ngx_uint_t n; /* Next chunk number */
+    bson *batch;
+    bson **batch_ptrs;
+    ngx_uint_t nbatch;
+    unsigned error:1;
+    unsigned sent:1; /* Some chunks went to mongod */
+    unsigned pending:1; /* A getLastError reply is owed */
+    unsigned stored:1; /* The chunks belong to a file now */
+} ngx_http_mongodb_rest_gridfs_ctx_t;
+
+#if (NGX_THREADS)
+#define NGX_HTTP_MONGODB_REST_TASK_GET 0
+#define NGX_HTTP_MONGODB_REST_TASK_PUT 1
+#define NGX_HTTP_MONGODB_REST_TASK_DELETE 2
+
+/* The driver calls of one request, run on a thread pool. */
+typedef struct {
+    ngx_thread_task_t *task;
+    ngx_http_request_t *request;
+    ngx_http_mongodb_rest_loc_conf_t *conf;
+    ngx_http_mongo_connection_t *mongo_conn; /* The worker's, for its settings */
+    ngx_pool_t *pool; /* The thread's while it runs, then the response's */
+    ngx_uint_t op;
+    ngx_http_mongodb_rest_format_e format;
+    bson query;
+    bson remove; /* DELETE, without $maxTimeMS */
+    bson fields;
+    bson *projection;
+    ngx_http_mongodb_rest_write_t *w; /* PUT */
+    ngx_str_t out; /* GET, serialized */
+    ngx_int_t status;
+    ngx_flag_t connected;
+    u_char *hint_err; /* The hinted index is gone; the worker looks again */
+    int hint_code;
+} ngx_http_mongodb_rest_task_t;
+
+/* One round of pings, run on a thread pool; a round at a time. */
+typedef struct {
+    ngx_thread_task_t *task;
+    ngx_http_mongodb_rest_main_conf_t *main_conf;
+    ngx_http_mongo_connection_t **mongo_conns; /* Of each 'mongo', NULL when not pinged this round */
+    ngx_flag_t *healthy; /* As the thread found each */
+    ngx_flag_t running;
+} ngx_http_mongodb_rest_probe_t;
+#endif
+
+extern ngx_module_t ngx_http_mongodb_rest_module;
+
+/* ngx_http_mongodb_rest_module.c */
+ngx_http_mongo_connection_t *ngx_http_get_mongo_connection(ngx_str_t name);
+ngx_pool_t *ngx_http_mongodb_rest_alloc_from(ngx_pool_t *pool);
+void ngx_http_mongo_set_timeouts(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn, mongo *conn);
+ngx_int_t ngx_http_mongo_ensure(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn);
+unsigned char ngx_http_mongodb_rest_hint_error(int code, const char *err);
+unsigned char ngx_http_mongodb_rest_hint_lost(ngx_log_t *log, ngx_http_mongodb_rest_loc_conf_t *conf, int code, const char *err);
+ngx_int_t ngx_http_mongodb_rest_zone_param(ngx_str_t *value, size_t skip, ngx_str_t *name, ssize_t *size);
+ngx_uint_t ngx_http_mongodb_rest_type(u_char *p, size_t len);
+ngx_int_t ngx_http_mongo_reauth(ngx_log_t *log, ngx_http_mongo_connection_t *mongo_conn, mongo *conn);
+time_t ngx_http_mongodb_rest_health_allow(ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf, ngx_uint_t upstream);
+void ngx_http_mongodb_rest_health_report(ngx_log_t *log, ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf, ngx_uint_t upstream, ngx_flag_t healthy);
+ngx_int_t ngx_http_mongodb_rest_path(ngx_http_request_t *request, char **value);
+ngx_int_t ngx_http_mongodb_rest_atoi32(const u_char *p, size_t len, int32_t *n);
+unsigned char ngx_http_mongodb_rest_append_value_n(bson *b, bson_type type, const char *field, const char *value, size_t len);
+unsigned char ngx_http_mongodb_rest_append_value(bson *b, bson_type type, const char *field, const char *value);
+ngx_uint_t ngx_http_mongodb_rest_key_split(ngx_http_mongodb_rest_loc_conf_t *conf, const char *value, ngx_str_t *segs);
+unsigned char ngx_http_mongodb_rest_key_valid(ngx_http_mongodb_rest_loc_conf_t *conf, const char *value);
+unsigned char ngx_http_mongodb_rest_append_key(bson *b, ngx_http_mongodb_rest_loc_conf_t *conf, const char *value);
+unsigned char ngx_http_mongodb_rest_query_init(bson *query, ngx_http_mongodb_rest_loc_conf_t *conf, const char *value);
+void ngx_http_mongodb_rest_unhint(bson *out, const bson *query);
+ngx_msec_int_t ngx_http_mongodb_rest_remaining(ngx_http_request_t *request, ngx_http_mongodb_rest_loc_conf_t *conf);
+unsigned char ngx_http_mongodb_rest_client_gone(ngx_http_request_t *request);
+ngx_int_t ngx_http_mongodb_rest_projection(ngx_http_request_t *request, bson *fields, bson **projection);
+ngx_http_mongodb_rest_format_e ngx_http_mongodb_rest_format(ngx_http_request_t *request);
+ngx_int_t ngx_http_mongodb_rest_serialize(ngx_pool_t *pool, ngx_http_mongodb_rest_format_e format, const bson *b, ngx_str_t *out);
+ngx_int_t ngx_http_mongodb_rest_retry_after(ngx_http_request_t *request, time_t seconds);
+ngx_int_t ngx_http_mongodb_rest_send(ngx_http_request_t *request, ngx_http_mongodb_rest_format_e format, off_t length, ngx_chain_t *out);
+ngx_chain_t *ngx_http_mongodb_rest_chain(ngx_pool_t *pool, u_char *pos, size_t len);
+ngx_chain_t **ngx_http_mongodb_rest_append_doc(ngx_http_request_t *request, ngx_http_mongodb_rest_format_e format, const bson *b, ngx_chain_t **ll, off_t *length, ngx_uint_t n);
+ngx_int_t ngx_http_mongodb_rest_frame_array(ngx_http_request_t *request, ngx_http_mongodb_rest_format_e format, ngx_uint_t n, off_t *length, ngx_chain_t **out, ngx_chain_t **ll);
+ngx_int_t ngx_http_mongodb_rest_send_array(ngx_http_request_t *request, ngx_http_mongodb_rest_format_e format, ngx_uint_t n, off_t length, ngx_chain_t *out, ngx_chain_t **ll);
+ngx_int_t ngx_http_mongodb_rest_raw_key(bson_type type, const char *value, u_char *buf, ngx_str_t *key);
+ngx_int_t ngx_http_mongodb_rest_bloom_test(ngx_http_mongodb_rest_bloom_t *bloom, bson_type type, const char *value);
+void ngx_http_mongodb_rest_bloom_add(ngx_http_mongodb_rest_bloom_t *bloom, const bson *doc);
+void ngx_http_mongodb_rest_bson_wrap(bson *b, u_char *data);
+ngx_int_t ngx_http_mongodb_rest_op_query(mongo *conn, char *ns, int32_t flags, int32_t nreturn, bson *query, bson *fields);
+ngx_int_t ngx_http_mongodb_rest_op_get_more(mongo *conn, char *ns, int64_t cursor_id);
+void ngx_http_mongodb_rest_op_kill_cursors(mongo *conn, int64_t cursor_id);
+ngx_int_t ngx_http_mongodb_rest_gle_send(mongo *conn, ngx_http_mongodb_rest_loc_conf_t *conf);
+ngx_int_t ngx_http_mongodb_rest_gle_read(mongo *conn, int *code, u_char *err, size_t len, bson *out);
+
+/* ngx_http_mongodb_rest_write_behind.c */
+char *ngx_http_mongodb_rest_write_behind(ngx_conf_t *cf, ngx_command_t *command, void *void_conf);
+ngx_int_t ngx_http_mongodb_rest_ring_push(ngx_http_mongodb_rest_write_behind_t *wb, ngx_log_t *log, ngx_http_mongodb_rest_write_t *w);
+ngx_int_t ngx_http_mongodb_rest_write_behind_init(ngx_cycle_t *cycle, ngx_http_mongodb_rest_write_behind_t *wb);
+
+/* ngx_http_mongodb_rest_shards.c */
+char *ngx_http_mongodb_rest_shards(ngx_conf_t *cf, ngx_command_t *command, void *void_conf);
+char *ngx_http_mongodb_rest_shards_init(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf);
+ngx_int_t ngx_http_mongodb_rest_bulk_handler(ngx_http_request_t *request, mongo *conn, ngx_str_t *arg);
+ngx_int_t ngx_http_mongodb_rest_shard_pick(ngx_http_request_t *request, ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_conf);
+
+/* ngx_http_mongodb_rest_aggregate.c */
+char *ngx_http_mongodb_rest_aggregate(ngx_conf_t *cf, ngx_command_t *command, void *void_conf);
+ngx_int_t ngx_http_mongodb_rest_aggregate_prepare(ngx_http_request_t *request, ngx_http_mongodb_rest_loc_conf_t *conf);
+ngx_int_t ngx_http_mongodb_rest_aggregate_handler(ngx_http_request_t *request, mongo *conn);
+
+/* ngx_http_mongodb_rest_export.c */
+char *ngx_http_mongodb_rest_export(ngx_conf_t *cf, ngx_command_t *command, void *void_conf);
+ngx_int_t ngx_http_mongodb_rest_export_handler(ngx_http_request_t *request, mongo *conn, ngx_str_t *mode);
+
+/* ngx_http_mongodb_rest_gridfs.c */
+char *ngx_http_mongodb_rest_gridfs(ngx_conf_t *cf, ngx_command_t *command, void *void_conf);
+ngx_int_t ngx_http_mongodb_rest_gridfs_put_handler(ngx_http_request_t *r, mongo *conn, bson_type type, const char *field, const char *value);
+
+#endif // NGX_HTTP_MONGODB_REST_MODULE_H
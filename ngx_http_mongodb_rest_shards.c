@@ -0,0 +1,682 @@
+/*
+ * Sharding: a location's keys spread across standalone mongods, by hash or range.
+ */
+
+#include "ngx_http_mongodb_rest_module.h"
+
+/* Parse the 'mongodb-rest-shards' directive. */
+char* ngx_http_mongodb_rest_shards(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf = void_conf;
+    ngx_http_mongodb_rest_shard_t *shard;
+    ngx_http_mongodb_rest_shard_t *shards;
+    ngx_str_t *value, addr;
+    ngx_url_t u;
+    ngx_uint_t i, j;
+    u_char *eq;
+
+    if (mongodb_rest_loc_conf->shards != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    if (mongodb_rest_loc_conf->mongods != NGX_CONF_UNSET_PTR) {
+        return "cannot be used with mongo";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_strcmp(value[1].data, "hash") == 0) {
+        mongodb_rest_loc_conf->shard_by = NGX_HTTP_MONGODB_REST_SHARD_HASH;
+    } else if (ngx_strcmp(value[1].data, "range") == 0) {
+        mongodb_rest_loc_conf->shard_by = NGX_HTTP_MONGODB_REST_SHARD_RANGE;
+    } else {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Invalid Shards: %V, must be hash or range", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (cf->args->nelts - 2 > MONGO_MAX_SHARDS) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Too many Shards, at most %d", MONGO_MAX_SHARDS);
+        return NGX_CONF_ERROR;
+    }
+
+    mongodb_rest_loc_conf->shards = ngx_array_create(cf->pool, cf->args->nelts - 2,
+                                                     sizeof(ngx_http_mongodb_rest_shard_t));
+    if (mongodb_rest_loc_conf->shards == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        shard = ngx_array_push(mongodb_rest_loc_conf->shards);
+        if (shard == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        ngx_memzero(shard, sizeof(ngx_http_mongodb_rest_shard_t));
+
+        addr = value[i];
+
+        /* BOUND=HOST[:PORT] */
+        eq = ngx_strlchr(addr.data, addr.data + addr.len, '=');
+        if (eq) {
+            if (mongodb_rest_loc_conf->shard_by != NGX_HTTP_MONGODB_REST_SHARD_RANGE || eq == addr.data) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Shard: %V", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+
+            shard->bound.len = eq - addr.data;
+            shard->bound.data = ngx_pnalloc(cf->pool, shard->bound.len + 1);
+            if (shard->bound.data == NULL) {
+                return NGX_CONF_ERROR;
+            }
+            ngx_cpystrn(shard->bound.data, addr.data, shard->bound.len + 1);
+
+            addr.len -= eq + 1 - addr.data;
+            addr.data = eq + 1;
+        }
+
+        /* Every shard but the first starts at a bound, in order. */
+        if (mongodb_rest_loc_conf->shard_by == NGX_HTTP_MONGODB_REST_SHARD_RANGE
+            && (i == 2) != (shard->bound.len == 0)) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "Invalid Shard: %V, only the first has no bound", &value[i]);
+            return NGX_CONF_ERROR;
+        }
+
+        ngx_memzero(&u, sizeof(ngx_url_t));
+        u.url = addr;
+        u.default_port = 27017;
+
+        if (ngx_parse_url(cf->pool, &u) != NGX_OK) {
+            if (u.err) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "%s in shard \"%V\"", u.err, &u.url);
+            }
+            return NGX_CONF_ERROR;
+        }
+
+        shard->mongo = addr;
+        shard->server.host = u.host;
+        shard->server.port = u.port;
+        ngx_memzero(&shard->server.addr, sizeof(ngx_addr_t));
+
+        /* Shards are told apart by connection. */
+        shards = mongodb_rest_loc_conf->shards->elts;
+        for (j = 0; j + 1 < mongodb_rest_loc_conf->shards->nelts; j++) {
+            if (shards[j].mongo.len == addr.len
+                && ngx_strncmp(shards[j].mongo.data, addr.data, addr.len) == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Duplicate Shard: %V", &addr);
+                return NGX_CONF_ERROR;
+            }
+        }
+    }
+
+    return NGX_CONF_OK;
+}
+
+static ngx_int_t ngx_http_mongodb_rest_point_cmp(const void *one, const void *two) {
+    const ngx_http_mongodb_rest_point_t *a = one, *b = two;
+
+    return a->hash < b->hash ? -1 : (a->hash > b->hash);
+}
+
+/* Order raw keys as mongod orders the values: ints by number, the rest by bytes. */
+static ngx_int_t ngx_http_mongodb_rest_raw_cmp(ngx_uint_t type, ngx_str_t *a, ngx_str_t *b) {
+    int32_t x, y;
+    ngx_int_t rc;
+
+    if (type == BSON_INT) {
+        ngx_memcpy(&x, a->data, sizeof(int32_t));
+        ngx_memcpy(&y, b->data, sizeof(int32_t));
+        return x < y ? -1 : (x > y);
+    }
+
+    rc = ngx_memcmp(a->data, b->data, ngx_min(a->len, b->len));
+    if (rc != 0) {
+        return rc;
+    }
+
+    return a->len < b->len ? -1 : (a->len > b->len);
+}
+
+/*
+ * Give each shard a copy of the location, connecting only to it, and list
+ * the copies in place of the location; every per-location thing set up in
+ * the worker (connection, index hint, batches, health and admission slots)
+ * then comes per shard.
+ */
+char *ngx_http_mongodb_rest_shards_init(ngx_conf_t *cf, ngx_http_mongodb_rest_loc_conf_t *conf) {
+    ngx_http_mongodb_rest_main_conf_t *mongodb_rest_main_conf = ngx_http_conf_get_module_main_conf(cf, ngx_http_mongodb_rest_module);
+    ngx_http_mongodb_rest_loc_conf_t **mongodb_rest_loc_conf, *copy;
+    ngx_http_mongodb_rest_shard_t *shards, *shard;
+    ngx_http_mongodb_rest_key_t *keys = conf->keys->elts;
+    ngx_http_mongod_server_t *mongod_server;
+    ngx_array_t *inherited;
+    ngx_uint_t i, j;
+    int32_t n32;
+    u_char name[NGX_MAXHOSTNAMELEN + NGX_INT_T_LEN + 8];
+
+    if (conf->gridfs || conf->write_behind || conf->bloom || conf->replica || conf->snapshot.len) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Shards cannot be used with gridfs, write_behind, bloom, replica or snapshot");
+        return NGX_CONF_ERROR;
+    }
+
+    if (keys[0].type != BSON_OID && keys[0].type != BSON_INT && keys[0].type != BSON_STRING) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Shards need a Field: %V, of Type: objectid, int or string", &keys[0].field);
+        return NGX_CONF_ERROR;
+    }
+
+    /* Nested locations inherit the shards, but not the parent's copies. */
+    inherited = conf->shards;
+    conf->shards = ngx_array_create(cf->pool, inherited->nelts, sizeof(ngx_http_mongodb_rest_shard_t));
+    if (conf->shards == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    for (i = 0; i < inherited->nelts; i++) {
+        shard = ngx_array_push(conf->shards);
+        if (shard == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        *shard = ((ngx_http_mongodb_rest_shard_t *) inherited->elts)[i];
+
+        if (shard->bound.len) {
+            if ((keys[0].type == BSON_OID && shard->bound.len != 24)
+                || (keys[0].type == BSON_INT
+                    && ngx_http_mongodb_rest_atoi32(shard->bound.data, shard->bound.len, &n32) != NGX_OK)) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Shard Bound: %V", &shard->bound);
+                return NGX_CONF_ERROR;
+            }
+
+            ngx_http_mongodb_rest_raw_key(keys[0].type, (char *) shard->bound.data, shard->buf, &shard->raw_bound);
+
+            if (i > 1 && ngx_http_mongodb_rest_raw_cmp(keys[0].type, &shard[-1].raw_bound, &shard->raw_bound) >= 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Shard Bound: %V, must be above the last", &shard->bound);
+                return NGX_CONF_ERROR;
+            }
+        }
+
+        copy = ngx_palloc(cf->pool, sizeof(ngx_http_mongodb_rest_loc_conf_t));
+        if (copy == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        *copy = *conf;
+        copy->shards = NULL;
+        copy->points = NULL;
+        copy->npoints = 0;
+        copy->mongo = shard->mongo;
+        ngx_str_null(&copy->replset);
+
+        copy->mongods = ngx_array_create(cf->pool, 1, sizeof(ngx_http_mongod_server_t));
+        if (copy->mongods == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        mongod_server = ngx_array_push(copy->mongods);
+        *mongod_server = shard->server;
+
+        shard->conf = copy;
+
+        mongodb_rest_loc_conf = ngx_array_push(&mongodb_rest_main_conf->loc_confs);
+        if (mongodb_rest_loc_conf == NULL) {
+            return NGX_CONF_ERROR;
+        }
+        *mongodb_rest_loc_conf = copy;
+    }
+
+    shards = conf->shards->elts;
+
+    /* Requests that name no key go to the first shard until told otherwise. */
+    conf->mongo = shards[0].mongo;
+    conf->mongods = shards[0].conf->mongods;
+    ngx_str_null(&conf->replset);
+
+    if (conf->shard_by != NGX_HTTP_MONGODB_REST_SHARD_HASH) {
+        return NGX_CONF_OK;
+    }
+
+    // ---------- BUILD THE RING ---------- //
+
+    conf->npoints = conf->shards->nelts * MONGO_SHARD_POINTS;
+    conf->points = ngx_palloc(cf->pool, conf->npoints * sizeof(ngx_http_mongodb_rest_point_t));
+    if (conf->points == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /* Points follow the shard's address, so adding one moves few keys. */
+    for (i = 0; i < conf->shards->nelts; i++) {
+        for (j = 0; j < MONGO_SHARD_POINTS; j++) {
+            conf->points[i * MONGO_SHARD_POINTS + j].hash =
+                ngx_crc32_short(name, ngx_snprintf(name, sizeof(name), "%V-%ui", &shards[i].mongo, j) - name);
+            conf->points[i * MONGO_SHARD_POINTS + j].shard = i;
+        }
+    }
+
+    ngx_sort(conf->points, conf->npoints, sizeof(ngx_http_mongodb_rest_point_t),
+             ngx_http_mongodb_rest_point_cmp);
+
+    return NGX_CONF_OK;
+}
+
+// ---------- SHARDS ---------- //
+
+/* Index of the shard holding the key named by value, by its first field. */
+static ngx_int_t ngx_http_mongodb_rest_shard_find(ngx_http_mongodb_rest_loc_conf_t * conf, const char * value) {
+  ngx_http_mongodb_rest_key_t * keys = conf->keys->elts;
+  ngx_http_mongodb_rest_shard_t * shards = conf->shards->elts;
+  ngx_str_t segs[MONGO_MAX_KEY_FIELDS + 1], key;
+  ngx_uint_t lo, hi, mid, i;
+  uint32_t hash;
+  u_char buf[12];
+  char first[NGX_INT32_LEN + 25];
+
+  ngx_http_mongodb_rest_key_split(conf, value, segs);
+
+  if(keys[0].type == BSON_STRING) {
+    key = segs[0];
+  } else {
+    if(segs[0].len >= sizeof(first)) {
+      return NGX_ERROR;
+    }
+    ngx_cpystrn((u_char *) first, segs[0].data, segs[0].len + 1);
+    if(ngx_http_mongodb_rest_raw_key(keys[0].type, first, buf, &key) != NGX_OK) {
+      return NGX_ERROR;
+    }
+  }
+
+  if(conf->shard_by == NGX_HTTP_MONGODB_REST_SHARD_RANGE) {
+    for(i = conf->shards->nelts - 1; i > 0; i--) {
+      if(ngx_http_mongodb_rest_raw_cmp(keys[0].type, &shards[i].raw_bound, &key) <= 0) {
+        break;
+      }
+    }
+    return i;
+  }
+
+  /* The first point at or after the key's, round the ring. */
+  hash = ngx_crc32_short(key.data, key.len);
+  lo = 0;
+  hi = conf->npoints;
+  while(lo < hi) {
+    mid = lo + (hi - lo) / 2;
+    if(conf->points[mid].hash < hash) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+
+  return conf->points[lo == conf->npoints ? 0 : lo].shard;
+}
+
+/* The worker's connection for the location, made sure of as dispatch does. */
+static mongo * ngx_http_mongodb_rest_shard_conn(ngx_http_request_t * request, ngx_http_mongodb_rest_loc_conf_t * conf) {
+  ngx_http_mongodb_rest_main_conf_t * main_conf;
+  ngx_http_mongo_connection_t * mongo_conn;
+  ngx_flag_t connected;
+
+  main_conf = ngx_http_get_module_main_conf(request, ngx_http_mongodb_rest_module);
+
+  mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+  if(mongo_conn == NULL) {
+    return NULL;
+  }
+
+  /* Reconnects on the heap, not in the pool of the request that happens to need it. */
+  connected = mongo_conn->conn.connected && mongo_conn->conn.err != MONGO_IO_ERROR;
+
+  if(ngx_http_mongo_ensure(request->connection->log, mongo_conn) != NGX_OK) {
+    ngx_log_error(NGX_LOG_ERR, request->connection->log, 0,
+                  "Could not connect to mongo: \"%V\"", &conf->mongo);
+    if(main_conf->health_check) {
+      ngx_http_mongodb_rest_health_report(request->connection->log, main_conf, conf->upstream, 0);
+    }
+    return NULL;
+  }
+
+  if(!connected && main_conf->health_check) {
+    ngx_http_mongodb_rest_health_report(request->connection->log, main_conf, conf->upstream, 1);
+  }
+
+  return &mongo_conn->conn;
+}
+
+/*
+ * GET ?keys=K1,K2,...: the keys are grouped by shard, each group asked for
+ * in one query, and the queries sent to every shard before any reply is
+ * read.  Documents come back in no particular order; keys that match
+ * nothing are left out.
+ */
+ngx_int_t ngx_http_mongodb_rest_bulk_handler(ngx_http_request_t * request, mongo * conn, ngx_str_t * arg) {
+  static u_char array_sep[] = ",";
+
+  ngx_http_mongodb_rest_main_conf_t * main_conf;
+  ngx_http_mongodb_rest_loc_conf_t * conf;
+  ngx_http_mongodb_rest_shard_t * shards;
+  ngx_http_mongodb_rest_fanout_t * groups, * g;
+  ngx_http_mongodb_rest_format_e format;
+  ngx_chain_t * out = NULL, ** ll = &out;
+  struct pollfd pfd[MONGO_MAX_SHARDS];
+  ngx_uint_t idx[MONGO_MAX_SHARDS];
+  ngx_uint_t i, j, k, n, nkeys, ngroups, npending, ndocs;
+  ngx_int_t * owner, rc;
+  ngx_msec_int_t remaining;
+  ngx_str_t doc;
+  off_t length = 0;
+  mongo_reply * reply;
+  bson_iterator it;
+  bson fields, query, b;
+  bson * projection;
+  time_t retry;
+  int ready, code;
+  char ** keys;
+  u_char * src, * dst, * end, * comma;
+  unsigned hint_lost = 0;
+  u_char num[NGX_INT_T_LEN + 1];
+
+  main_conf = ngx_http_get_module_main_conf(request, ngx_http_mongodb_rest_module);
+  conf = ngx_http_get_module_loc_conf(request, ngx_http_mongodb_rest_module);
+  format = ngx_http_mongodb_rest_format(request);
+
+  // ---------- SPLIT THE KEYS ---------- //
+  n = 1;
+  for(src = arg->data; src < arg->data + arg->len; src++) {
+    n += (*src == ',');
+  }
+  if(n > conf->page_size) {
+    return NGX_HTTP_BAD_REQUEST;
+  }
+
+  keys = ngx_palloc(request->pool, n * sizeof(char *));
+  owner = ngx_palloc(request->pool, n * sizeof(ngx_int_t));
+  if(keys == NULL || owner == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  nkeys = 0;
+  end = arg->data + arg->len;
+  for(src = arg->data; src <= end; src = comma + 1) {
+    comma = ngx_strlchr(src, end, ',');
+    if(comma == NULL) {
+      comma = end;
+    }
+
+    dst = ngx_pnalloc(request->pool, comma - src + 1);
+    if(dst == NULL) {
+      return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    keys[nkeys] = (char *) dst;
+    ngx_unescape_uri(&dst, &src, comma - src, NGX_UNESCAPE_URI);
+    *dst = '\0';
+
+    /* Keys that could name nothing are simply not found. */
+    if(!ngx_http_mongodb_rest_key_valid(conf, keys[nkeys])
+       || (conf->bloom && ngx_http_mongodb_rest_bloom_test(conf->bloom, conf->type, keys[nkeys]) == NGX_DECLINED)) {
+      continue;
+    }
+
+    owner[nkeys] = conf->shards ? ngx_http_mongodb_rest_shard_find(conf, keys[nkeys]) : 0;
+    if(owner[nkeys] != NGX_ERROR) {
+      nkeys++;
+    }
+  }
+
+  ngroups = conf->shards ? conf->shards->nelts : 1;
+  groups = ngx_pcalloc(request->pool, ngroups * sizeof(ngx_http_mongodb_rest_fanout_t));
+  if(groups == NULL) {
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  shards = conf->shards ? conf->shards->elts : NULL;
+  for(i = 0; i < ngroups; i++) {
+    groups[i].conf = shards ? shards[i].conf : conf;
+  }
+  for(k = 0; k < nkeys; k++) {
+    groups[owner[k]].nkeys++;
+  }
+
+  rc = ngx_http_mongodb_rest_projection(request, &fields, &projection);
+  if(rc != NGX_OK) {
+    return rc == NGX_DECLINED ? NGX_HTTP_BAD_REQUEST : NGX_HTTP_INTERNAL_SERVER_ERROR;
+  }
+
+  // ---------- SEND TO EVERY SHARD ---------- //
+  remaining = ngx_http_mongodb_rest_remaining(request, conf);
+  npending = 0;
+  rc = NGX_OK;
+
+  for(i = 0; i < ngroups && rc == NGX_OK; i++) {
+    g = &groups[i];
+    if(g->nkeys == 0) {
+      continue;
+    }
+
+    if(shards) {
+      retry = main_conf->health_check ? ngx_http_mongodb_rest_health_allow(main_conf, g->conf->upstream) : 0;
+      if(retry) {
+        rc = ngx_http_mongodb_rest_retry_after(request, retry);
+        break;
+      }
+      g->conn = ngx_http_mongodb_rest_shard_conn(request, g->conf);
+      if(g->conn == NULL) {
+        rc = NGX_HTTP_SERVICE_UNAVAILABLE;
+        break;
+      }
+    } else {
+      g->conn = conn;
+    }
+
+    /* {$query: {$or: [{key}, ...]}, $maxTimeMS, $hint} */
+    bson_init(&query);
+    bson_append_start_object(&query, "$query");
+    bson_append_start_array(&query, "$or");
+    for(j = 0, k = 0; k < nkeys; k++) {
+      if(owner[k] != (ngx_int_t) i) {
+        continue;
+      }
+      *ngx_sprintf(num, "%ui", j++) = '\0';
+      bson_append_start_object(&query, (char *) num);
+      ngx_http_mongodb_rest_append_key(&query, g->conf, keys[k]);
+      bson_append_finish_object(&query);
+    }
+    bson_append_finish_array(&query);
+    bson_append_finish_object(&query);
+    bson_append_long(&query, "$maxTimeMS", (int64_t) ngx_max(remaining, 1));
+    if(g->conf->hint) {
+      bson_append_string(&query, "$hint", g->conf->hint);
+    }
+    bson_finish(&query);
+
+    if(ngx_http_mongodb_rest_op_query(g->conn, (char *) g->conf->ns.data, 0, (int32_t) g->nkeys, &query, projection) != NGX_OK) {
+      mongo_disconnect(g->conn);
+      rc = NGX_HTTP_GATEWAY_TIME_OUT;
+    } else {
+      g->pending = 1;
+      npending++;
+    }
+    bson_destroy(&query);
+  }
+
+  if(projection == &fields) {
+    bson_destroy(&fields);
+  }
+
+  // ---------- GATHER THE REPLIES ---------- //
+  ndocs = 0;
+
+  while(rc == NGX_OK && npending) {
+    ngx_time_update();
+    remaining = ngx_http_mongodb_rest_remaining(request, conf);
+    if(remaining <= 0) {
+      rc = NGX_HTTP_GATEWAY_TIME_OUT;
+      break;
+    }
+
+    for(n = 0, i = 0; i < ngroups; i++) {
+      if(groups[i].pending) {
+        pfd[n].fd = groups[i].conn->sock;
+        pfd[n].events = POLLIN;
+        pfd[n].revents = 0;
+        idx[n++] = i;
+      }
+    }
+
+    ready = poll(pfd, n, remaining);
+    if(ready == -1 && ngx_socket_errno == NGX_EINTR) {
+      continue;
+    }
+    if(ready <= 0) {
+      rc = NGX_HTTP_GATEWAY_TIME_OUT;
+      break;
+    }
+
+    for(j = 0; j < n && rc == NGX_OK; j++) {
+      if(!pfd[j].revents) {
+        continue;
+      }
+      g = &groups[idx[j]];
+
+      if(mongo_read_response(g->conn, &reply) != MONGO_OK) {
+        rc = NGX_HTTP_GATEWAY_TIME_OUT;
+        break;
+      }
+
+      if(reply->fields.flag & MONGO_REPLY_QUERY_FAILURE) {
+        rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        if(reply->fields.num) {
+          ngx_http_mongodb_rest_bson_wrap(&b, (u_char *) &reply->objs);
+          code = bson_find(&it, &b, "code") == BSON_INT ? bson_iterator_int(&it) : 0;
+          if(code == MONGO_EXCEEDED_TIME_LIMIT) {
+            rc = NGX_HTTP_GATEWAY_TIME_OUT;
+          } else if(bson_find(&it, &b, "$err") == BSON_STRING
+                    && ngx_http_mongodb_rest_hint_lost(request->connection->log, g->conf, code, bson_iterator_string(&it))) {
+            hint_lost = 1;
+          }
+        }
+        g->pending = 0;
+        npending--;
+        bson_free(reply);
+        break;
+      }
+
+      src = (u_char *) &reply->objs;
+      for(k = 0; k < (ngx_uint_t) reply->fields.num; k++) {
+        ngx_http_mongodb_rest_bson_wrap(&b, src);
+        src += bson_size(&b);
+
+        if(ngx_http_mongodb_rest_serialize(request->pool, format, &b, &doc) != NGX_OK) {
+          rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+          break;
+        }
+
+        if(ndocs && format == NGX_HTTP_MONGODB_REST_JSON) {
+          *ll = ngx_http_mongodb_rest_chain(request->pool, array_sep, 1);
+          if(*ll == NULL) { rc = NGX_HTTP_INTERNAL_SERVER_ERROR; break; }
+          ll = &(*ll)->next;
+          length++;
+        }
+
+        *ll = ngx_http_mongodb_rest_chain(request->pool, doc.data, doc.len);
+        if(*ll == NULL) { rc = NGX_HTTP_INTERNAL_SERVER_ERROR; break; }
+        ll = &(*ll)->next;
+        length += doc.len;
+        ndocs++;
+      }
+
+      /* Keys held twice over may outrun the first batch. */
+      if(reply->fields.cursorID == 0) {
+        g->pending = 0;
+        npending--;
+      } else if(rc != NGX_OK
+                || ngx_http_mongodb_rest_op_get_more(g->conn, (char *) g->conf->ns.data, reply->fields.cursorID) != NGX_OK) {
+        ngx_http_mongodb_rest_op_kill_cursors(g->conn, reply->fields.cursorID);
+        g->pending = 0;
+        npending--;
+        if(rc == NGX_OK) {
+          rc = NGX_HTTP_GATEWAY_TIME_OUT;
+        }
+      }
+
+      bson_free(reply);
+    }
+  }
+
+  /* A reply still owed would be read as the answer to the next query. */
+  for(i = 0; i < ngroups; i++) {
+    if(groups[i].pending) {
+      mongo_disconnect(groups[i].conn);
+    }
+  }
+
+  /* Nothing is sent yet; once more without the dropped index. */
+  if(hint_lost) {
+    return ngx_http_mongodb_rest_bulk_handler(request, conn, arg);
+  }
+
+  if(rc != NGX_OK) {
+    return rc;
+  }
+
+  return ngx_http_mongodb_rest_send_array(request, format, ndocs, length, out, ll);
+}
+
+/*
+ * Point the request at the location as it is for the shard holding its key,
+ * or for the one named by ?shard=N when listing or exporting.  Declined for
+ * a bulk GET, which goes to every shard.
+ */
+ngx_int_t ngx_http_mongodb_rest_shard_pick(ngx_http_request_t* request, ngx_http_mongodb_rest_loc_conf_t* mongodb_rest_conf) {
+    ngx_http_mongodb_rest_shard_t *shards = mongodb_rest_conf->shards->elts;
+    ngx_str_t arg;
+    ngx_int_t n;
+    void **loc_conf;
+    char *value;
+
+    n = ngx_http_mongodb_rest_path(request, &value);
+    if (n != NGX_OK) {
+        return n;
+    }
+
+    if (*value == '\0') {
+        if (!(request->method & (NGX_HTTP_GET | NGX_HTTP_HEAD))) {
+            return NGX_HTTP_NOT_ALLOWED;
+        }
+
+        if (ngx_http_arg(request, (u_char *) "keys", 4, &arg) == NGX_OK) {
+            return NGX_DECLINED;
+        }
+
+        if (ngx_http_arg(request, (u_char *) "shard", 5, &arg) != NGX_OK) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+
+        n = ngx_atoi(arg.data, arg.len);
+        if (n == NGX_ERROR || (ngx_uint_t) n >= mongodb_rest_conf->shards->nelts) {
+            return NGX_HTTP_BAD_REQUEST;
+        }
+    } else {
+        if (!ngx_http_mongodb_rest_key_valid(mongodb_rest_conf, value)) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+
+        n = ngx_http_mongodb_rest_shard_find(mongodb_rest_conf, value);
+        if (n == NGX_ERROR) {
+            return NGX_HTTP_NOT_FOUND;
+        }
+    }
+
+    /* Every module's conf stays as it is, bar this one. */
+    loc_conf = ngx_palloc(request->pool, ngx_http_max_module * sizeof(void *));
+    if (loc_conf == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_memcpy(loc_conf, request->loc_conf, ngx_http_max_module * sizeof(void *));
+    loc_conf[ngx_http_mongodb_rest_module.ctx_index] = shards[n].conf;
+    request->loc_conf = loc_conf;
+
+    return NGX_OK;
+}
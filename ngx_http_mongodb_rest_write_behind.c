@@ -0,0 +1,489 @@
+/*
+ * Write-behind: PUTs queued in a shared memory ring, drained to mongod by the workers.
+ */
+
+#include "ngx_http_mongodb_rest_module.h"
+
+static ngx_int_t ngx_http_mongodb_rest_ring_init(ngx_shm_zone_t *shm_zone, void *data) {
+    ngx_http_mongodb_rest_write_behind_t *owb = data;
+    ngx_http_mongodb_rest_write_behind_t *wb;
+    ngx_file_info_t fi;
+    size_t size;
+
+    wb = shm_zone->data;
+
+    if (owb) {
+        /* Reload: keep whatever is still waiting to be written. */
+        wb->shpool = owb->shpool;
+        wb->ring = owb->ring;
+        return NGX_OK;
+    }
+
+    wb->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        wb->ring = wb->shpool->data;
+        return NGX_OK;
+    }
+
+    /*
+     * As many pages as the slab allocator will give in one piece: all of
+     * them but what its bookkeeping and alignment took, found by asking.
+     */
+    wb->shpool->log_nomem = 0;
+
+    for (size = wb->shpool->end - wb->shpool->start; size >= ngx_pagesize; size -= ngx_pagesize) {
+        wb->ring = ngx_slab_alloc(wb->shpool, size);
+        if (wb->ring) {
+            break;
+        }
+    }
+
+    wb->shpool->log_nomem = 1;
+
+    if (wb->ring == NULL) {
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(wb->ring, offsetof(ngx_http_mongodb_rest_ring_t, data));
+    wb->ring->size = (size - offsetof(ngx_http_mongodb_rest_ring_t, data)) & ~((size_t) 7);
+    wb->shpool->data = wb->ring;
+
+    /* Anything left in the journal did not reach mongod before a crash. */
+    if (wb->journal.len && ngx_file_info(wb->journal.data, &fi) != NGX_FILE_ERROR) {
+        wb->ring->replay_end = ngx_file_size(&fi);
+        wb->ring->journal_end = wb->ring->replay_end;
+    }
+
+    return NGX_OK;
+}
+
+/* Parse the 'mongodb-rest-write-behind' directive. */
+char* ngx_http_mongodb_rest_write_behind(ngx_conf_t* cf, ngx_command_t* command, void* void_conf) {
+    ngx_http_mongodb_rest_loc_conf_t *mongodb_rest_loc_conf = void_conf;
+    ngx_http_mongodb_rest_write_behind_t *wb;
+    ngx_str_t *value, name, s;
+    ssize_t size;
+    ngx_int_t n;
+    ngx_uint_t i;
+
+    if (mongodb_rest_loc_conf->write_behind != NGX_CONF_UNSET_PTR) {
+        return "is duplicate";
+    }
+
+    value = cf->args->elts;
+
+    if (ngx_http_mongodb_rest_zone_param(&value[1], 0, &name, &size) != NGX_OK) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Invalid Write Behind Zone: %V", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    wb = ngx_pcalloc(cf->pool, sizeof(ngx_http_mongodb_rest_write_behind_t));
+    if (wb == NULL) {
+        return NGX_CONF_ERROR;
+    }
+    wb->fd = NGX_INVALID_FILE;
+
+    wb->zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_mongodb_rest_module);
+    if (wb->zone == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    if (wb->zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "Write Behind Zone \"%V\" is already used", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    wb->zone->init = ngx_http_mongodb_rest_ring_init;
+    wb->zone->data = wb;
+    mongodb_rest_loc_conf->write_behind = wb;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "journal=", 8) == 0) {
+            wb->journal.data = &value[i].data[8];
+            wb->journal.len = value[i].len - 8;
+            if (ngx_conf_full_name(cf->cycle, &wb->journal, 0) != NGX_OK) {
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "interval=", 9) == 0) {
+            s.data = &value[i].data[9];
+            s.len = value[i].len - 9;
+            mongodb_rest_loc_conf->write_behind_interval = ngx_parse_time(&s, 0);
+
+            if (mongodb_rest_loc_conf->write_behind_interval == (ngx_msec_t) NGX_ERROR
+                || mongodb_rest_loc_conf->write_behind_interval == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Write Behind Interval: %V", &s);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "batch=", 6) == 0) {
+            n = ngx_atoi(&value[i].data[6], value[i].len - 6);
+            if (n == NGX_ERROR || n == 0) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "Invalid Write Behind Batch: %s", &value[i].data[6]);
+                return NGX_CONF_ERROR;
+            }
+            mongodb_rest_loc_conf->write_behind_batch = n;
+            continue;
+        }
+
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+/* Reserve len contiguous bytes at the tail; called with the mutex held. */
+static u_char * ngx_http_mongodb_rest_ring_reserve(ngx_http_mongodb_rest_ring_t * ring, size_t len) {
+  ngx_http_mongodb_rest_entry_t * e;
+  size_t waste;
+  u_char * p;
+
+  if(ring->tail + len > ring->size) {
+    waste = ring->size - ring->tail;
+    if(ring->used + waste + len > ring->size) {
+      return NULL;
+    }
+
+    if(waste) {
+      e = (ngx_http_mongodb_rest_entry_t *) (ring->data + ring->tail);
+      e->len = (uint32_t) waste;
+      e->qlen = NGX_MAX_UINT32_VALUE;
+      ring->used += waste;
+    }
+    ring->tail = 0;
+
+  } else if(ring->used + len > ring->size) {
+    return NULL;
+  }
+
+  p = ring->data + ring->tail;
+  ring->tail += len;
+  if(ring->tail == ring->size) {
+    ring->tail = 0;
+  }
+  ring->used += len;
+  ring->entries++;
+
+  return p;
+}
+
+/*
+ * Queue a write, and journal it: NGX_DECLINED when the ring is full, and
+ * NGX_ABORT when it could never fit.  The journal takes entries in ring
+ * order, each at an offset taken under the mutex but written outside it,
+ * and is synced before the PUT is acknowledged.
+ */
+ngx_int_t ngx_http_mongodb_rest_ring_push(ngx_http_mongodb_rest_write_behind_t * wb, ngx_log_t * log, ngx_http_mongodb_rest_write_t * w) {
+  ngx_http_mongodb_rest_entry_t * e;
+  size_t qlen, dlen, len;
+  off_t offset = 0;
+  u_char * buf, * p;
+
+  qlen = w->keyed ? (size_t) bson_size(&w->query) : 0;
+  dlen = bson_size(&w->doc);
+  len = ngx_align(sizeof(ngx_http_mongodb_rest_entry_t) + qlen + dlen, 8);
+
+  if(len > wb->ring->size) {
+    return NGX_ABORT;
+  }
+
+  /* Built apart, as the ring's copy may be drained and reused before it is journaled. */
+  buf = ngx_pcalloc(w->request->pool, len);
+  if(buf == NULL) {
+    return NGX_ERROR;
+  }
+
+  e = (ngx_http_mongodb_rest_entry_t *) buf;
+  e->len = (uint32_t) len;
+  e->qlen = (uint32_t) qlen;
+  p = buf + sizeof(ngx_http_mongodb_rest_entry_t);
+  if(qlen) {
+    p = ngx_cpymem(p, w->query.data, qlen);
+  }
+  ngx_memcpy(p, w->doc.data, dlen);
+
+  ngx_shmtx_lock(&wb->shpool->mutex);
+
+  p = ngx_http_mongodb_rest_ring_reserve(wb->ring, len);
+  if(p == NULL) {
+    ngx_shmtx_unlock(&wb->shpool->mutex);
+    return NGX_DECLINED;
+  }
+  ngx_memcpy(p, buf, len);
+
+  if(wb->fd != NGX_INVALID_FILE) {
+    offset = wb->ring->journal_end;
+    wb->ring->journal_end += len;
+    wb->ring->journaling++;
+  }
+
+  ngx_shmtx_unlock(&wb->shpool->mutex);
+
+  if(wb->fd == NGX_INVALID_FILE) {
+    return NGX_OK;
+  }
+
+  if(pwrite(wb->fd, buf, len, offset) != (ssize_t) len) {
+    ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+		  "pwrite() \"%V\" failed", &wb->journal);
+  } else if(fdatasync(wb->fd) == -1) {
+    ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+		  "fdatasync() \"%V\" failed", &wb->journal);
+  }
+
+  ngx_shmtx_lock(&wb->shpool->mutex);
+  wb->ring->journaling--;
+  ngx_shmtx_unlock(&wb->shpool->mutex);
+
+  return NGX_OK;
+}
+
+/* Load journal entries left over from before a restart, while they fit. */
+static void ngx_http_mongodb_rest_ring_replay(ngx_http_mongodb_rest_write_behind_t * wb, ngx_log_t * log) {
+  ngx_http_mongodb_rest_ring_t * ring = wb->ring;
+  ngx_http_mongodb_rest_entry_t e;
+  u_char * p;
+
+  while(ring->replay < ring->replay_end) {
+    if(pread(wb->fd, &e, sizeof(e), ring->replay) != (ssize_t) sizeof(e)
+       || e.len < sizeof(e) || (e.len & 7) || e.qlen == NGX_MAX_UINT32_VALUE
+       || ring->replay + e.len > ring->replay_end) {
+      ngx_log_error(NGX_LOG_WARN, log, 0,
+		    "Write behind journal \"%V\" is truncated at %O", &wb->journal, ring->replay);
+      ring->replay = ring->replay_end;
+      break;
+    }
+
+    p = ngx_http_mongodb_rest_ring_reserve(ring, e.len);
+    if(p == NULL) {
+      break;
+    }
+
+    if(pread(wb->fd, p, e.len, ring->replay) != (ssize_t) e.len) {
+      /* Cannot happen short of I/O errors; keep the slot harmless. */
+      ((ngx_http_mongodb_rest_entry_t *) p)->qlen = NGX_MAX_UINT32_VALUE;
+      ring->entries--;
+    }
+
+    ring->replay += e.len;
+  }
+}
+
+/*
+ * Copy up to write_behind_batch entries off the head, write them, and only
+ * then release them from the ring.  Each write is followed by its own
+ * getLastError, all sent before any reply is read; entries are released
+ * up to the first whose outcome is unknown, so a failed drain leaves the
+ * rest for the next attempt.  One mongod rejects is logged and dropped.
+ * One worker drains at a time.
+ */
+static void ngx_http_mongodb_rest_drain(ngx_event_t * ev) {
+  ngx_http_mongodb_rest_write_behind_t * wb = ev->data;
+  ngx_http_mongodb_rest_loc_conf_t * conf = wb->conf;
+  ngx_http_mongodb_rest_ring_t * ring = wb->ring;
+  ngx_http_mongo_connection_t * mongo_conn;
+  ngx_http_mongodb_rest_entry_t * e;
+  size_t head, next, total, taken, * heads, * takens;
+  ngx_uint_t count, sent, done, i;
+  u_char err[NGX_MAX_ERROR_STR];
+  u_char * buf, * p;
+  bson query, doc;
+  int status, code;
+
+  mongo_conn = ngx_http_get_mongo_connection(conf->mongo);
+  buf = NULL;
+  heads = NULL;
+
+  ngx_shmtx_lock(&wb->shpool->mutex);
+
+  if(ring->draining && ngx_time() - ring->draining < MONGO_WRITE_BEHIND_STALE) {
+    ngx_shmtx_unlock(&wb->shpool->mutex);
+    goto done;
+  }
+
+  if(wb->fd != NGX_INVALID_FILE) {
+    ngx_http_mongodb_rest_ring_replay(wb, ev->log);
+  }
+
+  /* Measure the batch at the head. */
+  head = ring->head;
+  total = 0;
+  taken = 0;
+  count = 0;
+
+  while(count < conf->write_behind_batch && taken < ring->used) {
+    e = (ngx_http_mongodb_rest_entry_t *) (ring->data + head);
+    taken += e->len;
+    head = (e->qlen == NGX_MAX_UINT32_VALUE || head + e->len == ring->size) ? 0 : head + e->len;
+
+    if(e->qlen != NGX_MAX_UINT32_VALUE) {
+      total += e->len;
+      count++;
+    }
+  }
+
+  if(taken == 0 || mongo_conn == NULL) {
+    ngx_shmtx_unlock(&wb->shpool->mutex);
+    goto done;
+  }
+
+  ring->draining = ngx_time();
+  ngx_shmtx_unlock(&wb->shpool->mutex);
+
+  /* Writers only append after the tail, so the batch can be read unlocked. */
+  buf = ngx_alloc(total + 1, ev->log);
+  heads = ngx_alloc((count + 1) * 2 * sizeof(size_t), ev->log);
+  if(buf == NULL || heads == NULL) {
+    goto release;
+  }
+  takens = heads + count + 1;
+
+  /* Where the head would be, and how much released, after each entry. */
+  p = buf;
+  i = 0;
+  for(next = ring->head, total = 0; total < taken; ) {
+    e = (ngx_http_mongodb_rest_entry_t *) (ring->data + next);
+    total += e->len;
+    next = (e->qlen == NGX_MAX_UINT32_VALUE || next + e->len == ring->size) ? 0 : next + e->len;
+    if(e->qlen != NGX_MAX_UINT32_VALUE) {
+      p = ngx_cpymem(p, e, e->len);
+      heads[i] = next;
+      takens[i] = total;
+      i++;
+    }
+  }
+
+  // ---------- WRITE THE BATCH ---------- //
+  done = count;
+
+  if(count) {
+    if(ngx_http_mongo_ensure(ev->log, mongo_conn) != NGX_OK) {
+      goto release;
+    }
+
+    for(p = buf, sent = 0; sent < count; p += e->len, sent++) {
+      e = (ngx_http_mongodb_rest_entry_t *) p;
+      ngx_http_mongodb_rest_bson_wrap(&query, p + sizeof(ngx_http_mongodb_rest_entry_t));
+      ngx_http_mongodb_rest_bson_wrap(&doc, p + sizeof(ngx_http_mongodb_rest_entry_t) + e->qlen);
+
+      /* Again, in case a rebuild began since it was queued, or it is replayed. */
+      if(conf->bloom) {
+        ngx_http_mongodb_rest_bloom_add(conf->bloom, &doc);
+      }
+
+      if(e->qlen) {
+        status = mongo_update(&mongo_conn->conn, (char *) conf->ns.data, &query, &doc, MONGO_UPDATE_UPSERT);
+      } else {
+        status = mongo_insert(&mongo_conn->conn, (char *) conf->ns.data, &doc);
+      }
+
+      if(status != MONGO_OK || ngx_http_mongodb_rest_gle_send(&mongo_conn->conn, conf) != NGX_OK) {
+        break;
+      }
+    }
+
+    for(p = buf, done = 0; done < sent; p += e->len, done++) {
+      e = (ngx_http_mongodb_rest_entry_t *) p;
+
+      if(ngx_http_mongodb_rest_gle_read(&mongo_conn->conn, &code, err, sizeof(err), NULL) != NGX_OK) {
+        break;
+      }
+
+      /* A replayed insert of a document that made it the first time. */
+      if(code && !(e->qlen == 0 && code == MONGO_DUPLICATE_KEY)) {
+        ngx_log_error(NGX_LOG_ERR, ev->log, 0,
+		      "Write behind dropped a document: %s", err);
+      }
+    }
+
+    /* Replies still owed would be taken for those of the next writes. */
+    if(done < count && mongo_conn->conn.connected) {
+      mongo_disconnect(&mongo_conn->conn);
+    }
+
+    if(done == 0) {
+      goto release;
+    }
+  }
+
+  // ---------- RELEASE WHAT WAS WRITTEN ---------- //
+  ngx_shmtx_lock(&wb->shpool->mutex);
+
+  if(done < count) {
+    head = heads[done - 1];
+    taken = takens[done - 1];
+  }
+
+  ring->head = head;
+  ring->used -= taken;
+  ring->entries -= done;
+
+  if(ring->used == 0) {
+    ring->head = 0;
+    ring->tail = 0;
+
+    /* Not while an entry, already drained, may still be on its way to the journal. */
+    if(wb->fd != NGX_INVALID_FILE && ring->replay >= ring->replay_end && ring->journaling == 0) {
+      if(ftruncate(wb->fd, 0) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ev->log, ngx_errno,
+		      "ftruncate() \"%V\" failed", &wb->journal);
+      }
+      ring->replay = 0;
+      ring->replay_end = 0;
+      ring->journal_end = 0;
+    }
+  }
+
+  ring->draining = 0;
+  ngx_shmtx_unlock(&wb->shpool->mutex);
+
+  goto done;
+
+release:
+  ngx_shmtx_lock(&wb->shpool->mutex);
+  ring->draining = 0;
+  ngx_shmtx_unlock(&wb->shpool->mutex);
+
+done:
+  if(buf) {
+    ngx_free(buf);
+  }
+  if(heads) {
+    ngx_free(heads);
+  }
+
+  if(!ngx_exiting) {
+    ngx_add_timer(ev, conf->write_behind_interval);
+  }
+}
+
+ngx_int_t ngx_http_mongodb_rest_write_behind_init(ngx_cycle_t * cycle, ngx_http_mongodb_rest_write_behind_t * wb) {
+  if(wb->journal.len) {
+    wb->fd = ngx_open_file(wb->journal.data, NGX_FILE_RDWR,
+                           NGX_FILE_CREATE_OR_OPEN, NGX_FILE_DEFAULT_ACCESS);
+    if(wb->fd == NGX_INVALID_FILE) {
+      ngx_log_error(NGX_LOG_EMERG, cycle->log, ngx_errno,
+		    ngx_open_file_n " \"%V\" failed", &wb->journal);
+      return NGX_ERROR;
+    }
+  }
+
+  wb->timer.handler = ngx_http_mongodb_rest_drain;
+  wb->timer.data = wb;
+  wb->timer.log = cycle->log;
+  wb->timer.cancelable = 1;
+  ngx_add_timer(&wb->timer, wb->conf->write_behind_interval);
+
+  return NGX_OK;
+}
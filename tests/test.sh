@@ -1,3 +1,168 @@
 #!/bin/bash
+#
+# Checks a running nginx configured with tests/nginx.conf.  Stops at the
+# first failure.
 
-curl -v -X PUT -d "{\"test\":\"test\"}" -H "Content-type: text/json" http://localhost/mongo/
+HOST=${HOST:-http://localhost}
+SNAPSHOT=${SNAPSHOT:-/tmp/ngx-mongodb-snapshot}
+STOP_MONGOD=${STOP_MONGOD:-"pkill -f 'mongod.*--port 27018'"}
+TMP=$(mktemp -d)
+trap 'rm -rf "$TMP"' EXIT
+
+fail() {
+    echo "FAIL: $*" >&2
+    exit 1
+}
+
+# expect STATUS CURL_ARGS...: leaves the body in $BODY, the headers in $HEADERS.
+expect() {
+    local want=$1 got
+    shift
+    got=$(curl -s -D "$TMP/headers" -o "$TMP/body" -w '%{http_code}' "$@")
+    BODY=$(tr -d '\000' < "$TMP/body")
+    HEADERS=$(tr -d '\r' < "$TMP/headers")
+    [ "$got" = "$want" ] || fail "$* gave $got, not $want: $BODY"
+}
+
+has() {
+    case "$BODY" in *"$1"*) ;; *) fail "no $1 in $BODY" ;; esac
+}
+
+lacks() {
+    case "$BODY" in *"$1"*) fail "$1 in $BODY" ;; esac
+}
+
+header() {
+    sed -n "s/^$1: //Ip" <<< "$HEADERS" | head -n 1
+}
+
+expect 201 -X PUT -d "{\"test\":\"test\"}" -H "Content-type: text/json" $HOST/mongo/
+
+# [user-026] GridFS: the body is stored in chunks, and replaced whole.
+head -c 10000 /dev/urandom > "$TMP/upload"
+expect 201 -X PUT --data-binary @"$TMP/upload" $HOST/files/upload.bin
+expect 200 $HOST/fs-files/upload.bin
+has '"length":10000'
+has '"chunkSize":4096'
+has "\"md5\":\"$(md5sum < "$TMP/upload" | cut -d ' ' -f 1)\""
+
+head -c 5000 /dev/urandom > "$TMP/upload"
+expect 201 -X PUT --data-binary @"$TMP/upload" $HOST/files/upload.bin
+expect 200 $HOST/fs-files/upload.bin
+has '"length":5000'
+has "\"md5\":\"$(md5sum < "$TMP/upload" | cut -d ' ' -f 1)\""
+
+# [user-028] Accept picks JSON, BSON or MessagePack.
+OID=5f1d7a3b2c4e5f6a7b8c9d0e
+expect 204 -X PUT -d '{"format":"accept"}' $HOST/mongo/$OID
+expect 200 $HOST/mongo/$OID
+has '"format":"accept"'
+[ "$(header Content-Type)" = "text/json" ] || fail "JSON sent as $(header Content-Type)"
+expect 200 -H "Accept: application/bson" $HOST/mongo/$OID
+[ "$(header Content-Type)" = "application/bson" ] || fail "BSON sent as $(header Content-Type)"
+expect 200 -H "Accept: application/msgpack, */*;q=0.5" $HOST/mongo/$OID
+[ "$(header Content-Type)" = "application/msgpack" ] || fail "MessagePack sent as $(header Content-Type)"
+expect 200 -H "Accept: application/bson;q=0" $HOST/mongo/$OID
+[ "$(header Content-Type)" = "text/json" ] || fail "q=0 answered with $(header Content-Type)"
+
+# [user-029] Continuation tokens page through every document once.
+for i in 1 2 3 4 5; do
+    expect 204 -X PUT -d "{\"page\":$i}" $HOST/pages/$(printf '%024x' $i)
+done
+URL="$HOST/pages/"
+SEEN=
+while :; do
+    expect 200 "$URL"
+    SEEN="$SEEN$BODY"
+    TOKEN=$(header X-Continuation-Token)
+    [ -n "$TOKEN" ] || break
+    URL="$HOST/pages/?continue=$TOKEN"
+done
+[ "$(grep -o '"page":' <<< "$SEEN" | wc -l)" = 5 ] || fail "pages held $SEEN"
+
+# A compound key's string segment cannot hold a '/'.
+expect 400 -X PUT -d '{"tenant":"a/b","name":"x"}' $HOST/pairs/
+expect 204 -X PUT -d '{"v":1}' $HOST/pairs/acme/report
+expect 200 $HOST/pairs/acme/report
+has '"v":1'
+
+# [user-032] Once mongod is gone, the circuit opens and requests are shed.
+expect 404 $HOST/breaker/$OID
+eval "$STOP_MONGOD" || fail "could not stop the mongod on 27018"
+sleep 1
+for i in 1 2 3 4; do
+    curl -s -o /dev/null $HOST/breaker/$OID
+done
+expect 503 $HOST/breaker/$OID
+[ -n "$(header Retry-After)" ] || fail "open circuit without Retry-After"
+
+# [user-034] The Bloom filter answers 404 for keys it has not seen.
+KEY1=$(printf '%08x%08x%08x' $(date +%s) $$ 1)
+KEY2=$(printf '%08x%08x%08x' $(date +%s) $$ 2)
+expect 204 -X PUT -d '{"bloom":1}' $HOST/bloom/$KEY1
+expect 200 $HOST/bloom/$KEY1
+expect 204 -X PUT -d '{"bloom":2}' $HOST/bloom-raw/$KEY2
+expect 200 $HOST/bloom-raw/$KEY2
+expect 404 $HOST/bloom/$KEY2
+
+# [user-042] Snapshots: written out by the refresh, served from the file, taken back on DELETE.
+KEY=$(printf '%08x%08x%08x' $(date +%s) $$ 3)
+expect 204 -X PUT -d '{"snap":1}' $HOST/snap/$KEY
+for i in 1 2 3 4 5; do
+    FILE=$(find "$SNAPSHOT" -name "$KEY.json")
+    [ -n "$FILE" ] && break
+    sleep 1
+done
+[ -n "$FILE" ] || fail "no snapshot of $KEY"
+expect 200 $HOST/snap/$KEY
+[ "$BODY" = "$(cat "$FILE")" ] || fail "GET gave $BODY, the file holds $(cat "$FILE")"
+expect 204 -X DELETE $HOST/snap/$KEY
+[ ! -e "$FILE" ] || fail "$FILE outlived its document"
+expect 404 $HOST/snap/$KEY
+
+# [user-043] Export: every document once, as NDJSON, in key order when asked.
+for i in $(seq 1 20); do
+    expect 204 -X PUT -d "{\"n\":$i}" $HOST/export/$(printf '%024x' $i)
+done
+expect 200 "$HOST/export/?export=ordered"
+[ "$(header Content-Type)" = "application/x-ndjson" ] || fail "export sent as $(header Content-Type)"
+[ "$(grep -c . <<< "$BODY")" = 20 ] || fail "ordered export gave $BODY"
+LC_ALL=C sort -c <<< "$BODY" || fail "ordered export out of order: $BODY"
+expect 200 "$HOST/export/?export=unordered&partitions=2"
+[ "$(grep -c . <<< "$BODY")" = 20 ] || fail "unordered export gave $BODY"
+[ "$(sort -u <<< "$BODY" | grep -c .)" = 20 ] || fail "unordered export repeated documents: $BODY"
+
+# [user-044] PATCH merges into the document; null removes a field.
+OID=5f1d7a3b2c4e5f6a7b8c9d0f
+expect 204 -X PUT -d '{"a":1,"b":{"c":2,"d":3},"e":4}' $HOST/mongo/$OID
+expect 204 -X PATCH -d '{"a":5,"b":{"c":null},"e":null}' $HOST/mongo/$OID
+expect 200 $HOST/mongo/$OID
+has '"a":5'
+has '"b":{"d":3}'
+lacks '"e":'
+expect 400 -X PATCH -d '{"_id":"5f1d7a3b2c4e5f6a7b8c9d0e"}' $HOST/mongo/$OID
+expect 400 -X PATCH -d '[1]' $HOST/mongo/$OID
+KEY=$(printf '%08x%08x%08x' $(date +%s) $$ 4)
+expect 404 -X PATCH -d '{"a":1}' $HOST/mongo/$KEY
+expect 201 -X PATCH -d '{"a":1}' "$HOST/mongo/$KEY?upsert=true"
+expect 200 $HOST/mongo/$KEY
+has '"a":1'
+
+# [user-045] Sharding by range: each key lives on, and is listed by, its own shard.
+expect 204 -X PUT -d '{"shard":0}' $HOST/users/alice
+expect 204 -X PUT -d '{"shard":1}' $HOST/users/zed
+expect 200 $HOST/users/zed
+has '"shard":1'
+expect 200 "$HOST/users/?shard=0"
+has '"name":"alice"'
+lacks '"name":"zed"'
+expect 200 "$HOST/users/?shard=1"
+has '"name":"zed"'
+lacks '"name":"alice"'
+expect 200 "$HOST/users/?keys=alice,zed"
+has '"name":"alice"'
+has '"name":"zed"'
+expect 400 $HOST/users/
+expect 405 -X PUT -d '{"name":"bob"}' $HOST/users/
+
+echo OK